@@ -8,13 +8,17 @@
 
 
 /* set to 0 for alloc debugging, e.g. through valgrind */
-#define BENCODE_MIN_BUFFER_PIECE_LEN	512
+#define BENCODE_MIN_BUFFER_PIECE_LEN	4096
+/* number of unused pieces of the minimum size kept around per thread for reuse. set to 0
+ * for alloc debugging */
+#define BENCODE_PIECE_CACHE		64
 
 #define BENCODE_HASH_BUCKETS		31 /* prime numbers work best */
 
 struct __bencode_buffer_piece {
 	char *tail;
 	unsigned int left;
+	unsigned int size;
 	struct __bencode_buffer_piece *next;
 	char buf[0];
 };
@@ -31,6 +35,13 @@ struct __bencode_hash {
 
 
 
+/* pieces are reused across buffers, so that a request/response cycle that fits into the
+ * cached pieces doesn't need to touch malloc at all. buffers may be freed by a different
+ * thread than the one that allocated them, in which case the pieces simply migrate. */
+static __thread struct __bencode_buffer_piece *__bencode_piece_cache;
+static __thread unsigned int __bencode_piece_cache_len;
+
+
 static bencode_item_t __bencode_end_marker = {
 	.type = BENCODE_END_MARKER,
 	.iov[0].iov_base = "e",
@@ -74,19 +85,39 @@ static void __bencode_list_init(bencode_item_t *list) {
 static struct __bencode_buffer_piece *__bencode_piece_new(unsigned int size) {
 	struct __bencode_buffer_piece *ret;
 
-	if (size < BENCODE_MIN_BUFFER_PIECE_LEN)
+	if (size <= BENCODE_MIN_BUFFER_PIECE_LEN) {
 		size = BENCODE_MIN_BUFFER_PIECE_LEN;
+		if (__bencode_piece_cache) {
+			ret = __bencode_piece_cache;
+			__bencode_piece_cache = ret->next;
+			__bencode_piece_cache_len--;
+			goto init;
+		}
+	}
 	ret = BENCODE_MALLOC(sizeof(*ret) + size);
 	if (!ret)
 		return NULL;
+	ret->size = size;
 
+init:
 	ret->tail = ret->buf;
-	ret->left = size;
+	ret->left = ret->size;
 	ret->next = NULL;
 
 	return ret;
 }
 
+static void __bencode_piece_free(struct __bencode_buffer_piece *piece) {
+	if (piece->size == BENCODE_MIN_BUFFER_PIECE_LEN
+			&& __bencode_piece_cache_len < BENCODE_PIECE_CACHE) {
+		piece->next = __bencode_piece_cache;
+		__bencode_piece_cache = piece;
+		__bencode_piece_cache_len++;
+		return;
+	}
+	BENCODE_FREE(piece);
+}
+
 int bencode_buffer_init(bencode_buffer_t *buf) {
 	buf->pieces = __bencode_piece_new(0);
 	if (!buf->pieces)
@@ -136,7 +167,7 @@ void bencode_buffer_free(bencode_buffer_t *buf) {
 
 	for (piece = buf->pieces; piece; piece = next) {
 		next = piece->next;
-		BENCODE_FREE(piece);
+		__bencode_piece_free(piece);
 	}
 }
 
@@ -194,17 +225,30 @@ static void __bencode_container_add(bencode_item_t *parent, bencode_item_t *chil
 	}
 }
 
+/* formats a decimal number backwards, ending at "end". returns the start */
+static char *__bencode_uint_fmt(char *end, unsigned long long u) {
+	do {
+		*--end = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	return end;
+}
+
 static bencode_item_t *__bencode_string_alloc(bencode_buffer_t *buf, const void *base,
 		int str_len, int iov_len, int iov_cnt, bencode_type_t type)
 {
 	bencode_item_t *ret;
 	int len_len;
 
-	assert((str_len <= 99999) && (str_len >= 0));
-	ret = __bencode_item_alloc(buf, 7);
+	assert(str_len >= 0);
+	// room for the digits of INT_MAX plus the colon
+	ret = __bencode_item_alloc(buf, 11);
 	if (!ret)
 		return NULL;
-	len_len = sprintf(ret->__buf, "%d:", str_len);
+	ret->__buf[10] = ':';
+	char *start = __bencode_uint_fmt(&ret->__buf[10], str_len);
+	len_len = &ret->__buf[11] - start;
+	memmove(ret->__buf, start, len_len);
 
 	ret->type = type;
 	ret->iov[0].iov_base = ret->__buf;
@@ -245,18 +289,24 @@ bencode_item_t *bencode_string_iovec(bencode_buffer_t *buf, const struct iovec *
 
 bencode_item_t *bencode_integer(bencode_buffer_t *buf, long long int i) {
 	bencode_item_t *ret;
-	int alen, rlen;
-
-	alen = 8;
-	while (1) {
-		ret = __bencode_item_alloc(buf, alen + 3);
-		if (!ret)
-			return NULL;
-		rlen = snprintf(ret->__buf, alen, "i%llde", i);
-		if (rlen < alen)
-			break;
-		alen <<= 1;
-	}
+	int rlen;
+	char tmp[24]; /* "i" + sign + 20 digits + "e" */
+	char *start, *end = tmp + sizeof(tmp);
+	unsigned long long u = i;
+
+	*--end = 'e';
+	if (i < 0)
+		u = -u;
+	start = __bencode_uint_fmt(end, u);
+	if (i < 0)
+		*--start = '-';
+	*--start = 'i';
+	rlen = tmp + sizeof(tmp) - start;
+
+	ret = __bencode_item_alloc(buf, rlen);
+	if (!ret)
+		return NULL;
+	memcpy(ret->__buf, start, rlen);
 
 	ret->type = BENCODE_INTEGER;
 	ret->iov[0].iov_base = ret->__buf;
@@ -45,6 +45,7 @@
 #include "graphite.h"
 #include "codec.h"
 #include "media_player.h"
+#include "iptables.h"
 
 
 /* also serves as array index for callstream->peers[] */
@@ -443,7 +444,7 @@ destroy:
 }
 
 
-#define DS(x) do {							\
+#define DS(x) ({							\
 		u_int64_t ks_val, d;					\
 		ks_val = atomic64_get(&ps->kernel_stats.x);	\
 		if (ke->stats.x < ks_val)				\
@@ -451,8 +452,9 @@ destroy:
 		else							\
 			d = ke->stats.x - ks_val;			\
 		atomic64_add(&ps->stats.x, d);			\
-		atomic64_add(&rtpe_statsps.x, d);			\
-	} while (0)
+		RTPE_STATS_ADD(x, d);					\
+		d;							\
+	})
 
 static void update_requests_per_second_stats(struct requests_ps *request, u_int64_t new_val) {
 	mutex_lock(&request->lock);
@@ -483,19 +485,21 @@ static void call_timer(void *ptr) {
 	GSList *calls = NULL;
 	struct rtpengine_list_entry *ke;
 	struct packet_stream *ps, *sink;
-	struct stats tmpstats;
+	struct stats counters;
 	int j, update;
 	struct stream_fd *sfd;
 	struct rtp_stats *rs;
 	unsigned int pt;
 	endpoint_t ep;
 	u_int64_t offers, answers, deletes;
+	u_int64_t ds_packets, ds_bytes;
 	struct timeval tv_start;
 	long long run_diff;
 
 	// timers are run in a single thread, so no locking required here
 	static struct timeval last_run;
 	static long long interval = 1000000; // usec
+	static struct stats last_counters;
 
 	gettimeofday(&tv_start, NULL);
 
@@ -526,13 +530,17 @@ static void call_timer(void *ptr) {
 		calls = g_slist_delete_link(calls, calls);
 	}
 
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, bytes);
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, packets);
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, errors);
+	// the per-thread counters only ever go up, so the rate is the difference to last time
+	stats_counters_sum(&counters);
 
-	atomic64_set(&rtpe_stats.bytes, atomic64_get_na(&tmpstats.bytes) / run_diff);
-	atomic64_set(&rtpe_stats.packets, atomic64_get_na(&tmpstats.packets) / run_diff);
-	atomic64_set(&rtpe_stats.errors, atomic64_get_na(&tmpstats.errors) / run_diff);
+	atomic64_set(&rtpe_stats.bytes,
+			(atomic64_get_na(&counters.bytes) - atomic64_get_na(&last_counters.bytes)) / run_diff);
+	atomic64_set(&rtpe_stats.packets,
+			(atomic64_get_na(&counters.packets) - atomic64_get_na(&last_counters.packets)) / run_diff);
+	atomic64_set(&rtpe_stats.errors,
+			(atomic64_get_na(&counters.errors) - atomic64_get_na(&last_counters.errors)) / run_diff);
+
+	last_counters = counters;
 
 	/* update statistics regarding requests per second */
 	offers = atomic64_get_set(&rtpe_statsps.offers, 0);
@@ -561,9 +569,12 @@ static void call_timer(void *ptr) {
 			goto next;
 		}
 
-		DS(packets);
-		DS(bytes);
+		ds_packets = DS(packets);
+		ds_bytes = DS(bytes);
 		DS(errors);
+		RTPE_STATS_ADD(kernel_packets, ds_packets);
+		RTPE_STATS_ADD(kernel_bytes, ds_bytes);
+		thread_stats_intf_add(sfd->local_intf->spec->stats_idx, ds_packets, ds_bytes);
 
 
 		if (ke->stats.packets != atomic64_get(&ps->kernel_stats.packets))
@@ -611,6 +622,14 @@ static void call_timer(void *ptr) {
 				sink->ssrc_out->srtp_index = ke->target.encrypt.last_index;
 				update = 1;
 			}
+			/* SRTCP index as advanced by the kernel, if it's forwarding RTCP */
+			if (ke->target.rtcp_fw && sink->crypto.params.crypto_suite && sink->ssrc_out
+					&& ntohl(ke->target.ssrc) == sink->ssrc_out->parent->h.ssrc
+					&& ke->target.encrypt.rtcp_index > sink->ssrc_out->srtcp_index)
+			{
+				sink->ssrc_out->srtcp_index = ke->target.encrypt.rtcp_index;
+				update = 1;
+			}
 			mutex_unlock(&sink->out_lock);
 		}
 
@@ -2217,6 +2236,8 @@ no_stats_output:
 
 	cdr_update_entry(c);
 
+	kernel_batch_start();
+
 	for (l = c->streams.head; l; l = l->next) {
 		ps = l->data;
 
@@ -2230,11 +2251,19 @@ no_stats_output:
 		ps->rtcp_sink = NULL;
 	}
 
+	// the ports are about to be released and can be reused immediately, so the kernel
+	// rules must be gone before then, even if we're part of a larger batch
+	if (kernel_batch_sync())
+		ilog(LOG_WARNING, "Failed to remove some of the kernel forwarding rules of the call");
+	kernel_batch_end(); // nothing left to flush after the sync
+
+	iptables_batch_start();
 	while (c->stream_fds.head) {
 		sfd = g_queue_pop_head(&c->stream_fds);
 		poller_del_item(rtpe_poller, sfd->socket.fd);
 		obj_put(sfd);
 	}
+	iptables_batch_end();
 
 	recording_finish(c);
 
@@ -2243,8 +2272,8 @@ no_stats_output:
 
 
 /* XXX move these */
-int call_stream_address46(char *o, struct packet_stream *ps, enum stream_address_format format,
-		int *len, const struct local_intf *ifa, int keep_unspec)
+int call_stream_address46(char *o, size_t olen, struct packet_stream *ps,
+		enum stream_address_format format, int *len, const struct local_intf *ifa, int keep_unspec)
 {
 	struct packet_stream *sink;
 	int l = 0;
@@ -2260,15 +2289,25 @@ int call_stream_address46(char *o, struct packet_stream *ps, enum stream_address
 
 	sink = packet_stream_sink(ps);
 
-	if (format == SAF_NG)
-		l += sprintf(o + l, "%s ", ifa_addr->addr.family->rfc_name);
+	// called for every address in every SDP rewrite, so no printf here
+	if (format == SAF_NG) {
+		l = strlen(ifa_addr->addr.family->rfc_name);
+		memcpy(o, ifa_addr->addr.family->rfc_name, l);
+		o[l++] = ' ';
+	}
 
 	if (is_addr_unspecified(&sink->advertised_endpoint.address)
 			&& !is_trickle_ice_address(&sink->advertised_endpoint)
 			&& keep_unspec)
-		l += sprintf(o + l, "%s", ifa_addr->addr.family->unspec_string);
-	else
-		l += sprintf(o + l, "%s", sockaddr_print_buf(&ifa->advertised_address.addr));
+	{
+		int ul = strlen(ifa_addr->addr.family->unspec_string);
+		memcpy(o + l, ifa_addr->addr.family->unspec_string, ul + 1);
+		l += ul;
+	}
+	else {
+		sockaddr_print(&ifa->advertised_address.addr, o + l, olen - l);
+		l += strlen(o + l);
+	}
 
 	*len = l;
 	return ifa_addr->addr.family->af;
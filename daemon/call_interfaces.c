@@ -48,7 +48,7 @@ static int call_stream_address_gstring(GString *o, struct packet_stream *ps, enu
 	int len, ret;
 	char buf[64]; /* 64 bytes ought to be enough for anybody */
 
-	ret = call_stream_address46(buf, ps, format, &len, NULL, 1);
+	ret = call_stream_address46(buf, sizeof(buf), ps, format, &len, NULL, 1);
 	g_string_append_len(o, buf, len);
 	return ret;
 }
@@ -1792,6 +1792,7 @@ const char *call_play_media_ng(bencode_item_t *input, bencode_item_t *output) {
 	else
 		goto out;
 
+	// not known yet if the media is still being retrieved from the database
 	if (monologue->player->duration)
 		bencode_dictionary_add_integer(output, "duration", monologue->player->duration);
 
@@ -25,6 +25,7 @@
 #include "str.h"
 #include "statistics.h"
 #include "main.h"
+#include "media_player.h"
 #include "media_socket.h"
 
 #include "rtpengine_config.h"
@@ -43,6 +44,7 @@ static void cli_incoming_terminate(str *instr, struct streambuf *replybuffer);
 static void cli_incoming_ksadd(str *instr, struct streambuf *replybuffer);
 static void cli_incoming_ksrm(str *instr, struct streambuf *replybuffer);
 static void cli_incoming_kslist(str *instr, struct streambuf *replybuffer);
+static void cli_incoming_flushmediacache(str *instr, struct streambuf *replybuffer);
 
 static void cli_incoming_set_maxopenfiles(str *instr, struct streambuf *replybuffer);
 static void cli_incoming_set_maxsessions(str *instr, struct streambuf *replybuffer);
@@ -96,6 +98,7 @@ static const cli_handler_t cli_top_handlers[] = {
 	{ "ksadd",		cli_incoming_ksadd		},
 	{ "ksrm",		cli_incoming_ksrm		},
 	{ "kslist",		cli_incoming_kslist		},
+	{ "flushmediacache",	cli_incoming_flushmediacache	},
 	{ NULL, },
 };
 static const cli_handler_t cli_set_handlers[] = {
@@ -393,6 +396,28 @@ static void cli_incoming_list_counters(str *instr, struct streambuf *replybuffer
 			atomic64_get(&rtpe_stats.errors));
 }
 
+static void cli_packet_stages(struct streambuf *replybuffer) {
+	struct stats_counters *sc = stats_counters_total();
+	streambuf_printf(replybuffer, "\nPacket processing stages (sampled 1 in %i):\n",
+			rtpe_config.packet_timing_sample);
+	streambuf_printf(replybuffer, "\n %20s | %10s | %10s |", "Stage", "Count", "Avg us");
+	for (int i = 0; i < LATENCY_BUCKETS - 1; i++)
+		streambuf_printf(replybuffer, " <=%6.2fus |", packet_stage_bucket_ns[i] / 1000.0);
+	streambuf_printf(replybuffer, " >%7.2fus\n", packet_stage_bucket_ns[LATENCY_BUCKETS - 2] / 1000.0);
+	for (int i = 0; i < __PACKET_STAGES; i++) {
+		struct latency_histogram *h = &sc->packet_stages[i];
+		uint64_t count = atomic64_get_na(&h->count);
+		if (!count)
+			continue;
+		streambuf_printf(replybuffer, " %20s | %10"PRIu64" | %10.3f |", packet_stage_names[i], count,
+				(double) atomic64_get_na(&h->sum) / count / 1000.0);
+		for (int j = 0; j < LATENCY_BUCKETS; j++)
+			streambuf_printf(replybuffer, " %10"PRIu64"%s", atomic64_get_na(&h->buckets[j]),
+					j == LATENCY_BUCKETS - 1 ? "\n" : " |");
+	}
+	free(sc);
+}
+
 static void cli_incoming_list_totals(str *instr, struct streambuf *replybuffer) {
 	struct timeval avg, calls_dur_iv;
 	u_int64_t num_sessions, min_sess_iv, max_sess_iv;
@@ -461,6 +486,62 @@ static void cli_incoming_list_totals(str *instr, struct streambuf *replybuffer)
 			(unsigned long long)deletes_ps.ps_max,
 			(unsigned long long)deletes_ps.ps_avg);
 
+	struct media_cache_stats mcs;
+	media_player_cache_stats(&mcs);
+	uint64_t mc_lookups = mcs.hits + mcs.misses;
+	streambuf_printf(replybuffer, "\nMedia playback cache:\n");
+	streambuf_printf(replybuffer, " Hits/Misses                                     :"UINT64F"/"UINT64F"\n", mcs.hits, mcs.misses);
+	streambuf_printf(replybuffer, " Hit rate                                        :%.1f%%\n",
+			mc_lookups ? (double) mcs.hits * 100.0 / mc_lookups : 0.0);
+	streambuf_printf(replybuffer, " Evictions                                       :"UINT64F"\n", mcs.evictions);
+	streambuf_printf(replybuffer, " Entries                                         :%u\n", mcs.entries);
+	streambuf_printf(replybuffer, " Memory used/limit                               :"UINT64F"/"UINT64F" bytes\n",
+			mcs.bytes, mcs.max_bytes);
+
+	struct port_pool_stats pps;
+	port_pool_stats(&pps);
+	streambuf_printf(replybuffer, "\nPort allocation:\n");
+	streambuf_printf(replybuffer, " Allocations/Failures                            :"UINT64F"/"UINT64F"\n", pps.allocs, pps.failures);
+	streambuf_printf(replybuffer, " Free ports                                      :%u\n", pps.free_ports);
+	streambuf_printf(replybuffer, " Average words scanned per allocation            :%.2f\n",
+			pps.allocs ? (double) pps.words / pps.allocs : 0.0);
+	streambuf_printf(replybuffer, " Average attempts per allocation                 :%.2f\n",
+			pps.allocs ? (double) pps.attempts / pps.allocs : 0.0);
+
+	struct socket_pool_stats sps;
+	socket_pool_stats(&sps);
+	streambuf_printf(replybuffer, "\nPre-opened port pool:\n");
+	streambuf_printf(replybuffer, " Hits/Misses                                     :"UINT64F"/"UINT64F"\n", sps.hits, sps.misses);
+	streambuf_printf(replybuffer, " Port pairs available                            :%u\n", sps.available);
+	streambuf_printf(replybuffer, " Refills                                         :"UINT64F"\n", sps.refills);
+	streambuf_printf(replybuffer, " Average refill time                             :%.1f us\n",
+			sps.refills ? (double) sps.refill_time_us / sps.refills : 0.0);
+
+	streambuf_printf(replybuffer, "\nLogging:\n");
+	streambuf_printf(replybuffer, " Messages dropped                                :%u\n", log_dropped_messages());
+
+	streambuf_printf(replybuffer, "\nNG command processing:\n");
+	streambuf_printf(replybuffer, " Queued commands                                 :%u\n", control_ng_queue_depth());
+	streambuf_printf(replybuffer, " Commands in progress                            :%u\n", control_ng_in_flight());
+	streambuf_printf(replybuffer, "\n %20s | %10s | %10s |", "Command", "Count", "Avg ms");
+	for (int i = 0; i < NG_LATENCY_BUCKETS - 1; i++)
+		streambuf_printf(replybuffer, " <=%5.1fms |", ng_latency_bucket_us[i] / 1000.0);
+	streambuf_printf(replybuffer, " >%6.1fms\n", ng_latency_bucket_us[NG_LATENCY_BUCKETS - 2] / 1000.0);
+	for (int i = 0; i < __NGC_MAX; i++) {
+		struct ng_command_stats *st = &rtpe_ng_command_stats[i];
+		uint64_t count = atomic64_get(&st->count);
+		if (!count)
+			continue;
+		streambuf_printf(replybuffer, " %20s | %10"PRIu64" | %10.3f |", ng_command_names[i], count,
+				(double) atomic64_get(&st->time_us) / count / 1000.0);
+		for (int j = 0; j < NG_LATENCY_BUCKETS; j++)
+			streambuf_printf(replybuffer, " %9"PRIu64"%s", atomic64_get(&st->latency[j]),
+					j == NG_LATENCY_BUCKETS - 1 ? "\n" : " |");
+	}
+
+	if (rtpe_config.packet_timing_sample)
+		cli_packet_stages(replybuffer);
+
 	streambuf_printf(replybuffer, "\n\n");
 
 	streambuf_printf(replybuffer, "Control statistics:\n\n");
@@ -1128,6 +1209,11 @@ static void cli_incoming_kslist(str *instr, struct streambuf *replybuffer) {
 	streambuf_printf(replybuffer, "\n");
 }
 
+static void cli_incoming_flushmediacache(str *instr, struct streambuf *replybuffer) {
+	unsigned int num = media_player_cache_flush();
+	streambuf_printf(replybuffer, "Removed %u entries from the media cache.\n", num);
+}
+
 static void cli_incoming(struct streambuf_stream *s) {
    ilog(LOG_INFO, "New cli connection from %s", s->addr);
 }
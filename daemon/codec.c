@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <time.h>
 #include "call.h"
 #include "log.h"
 #include "rtplib.h"
@@ -1116,9 +1117,16 @@ static int __packet_decoded(decoder_t *decoder, AVFrame *frame, void *u1, void *
 
 static int packet_decode(struct codec_ssrc_handler *ch, struct transcode_packet *packet, struct media_packet *mp)
 {
+	struct timespec start, end;
+
 	if (!ch->first_ts)
 		ch->first_ts = packet->ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	int ret = decoder_input_data(ch->decoder, packet->payload, packet->ts, __packet_decoded, ch, mp);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	RTPE_STATS_INC(transcode_packets);
+	RTPE_STATS_ADD(transcode_cpu_ns, (end.tv_sec - start.tv_sec) * 1000000000LL
+			+ end.tv_nsec - start.tv_nsec);
 	//mp->iter_in++;
 	mp->ssrc_out->parent->seq_diff--;
 	return ret;
@@ -14,12 +14,68 @@
 #include "call_interfaces.h"
 #include "socket.h"
 #include "log_funcs.h"
+#include "kernel.h"
+#include "iptables.h"
+
+
+// replies made up of more pieces than this are collapsed before sending
+#define NG_REPLY_IOV_MAX 64
+
+// requests queued for a signalling worker thread
+struct ng_request {
+	struct control_ng *c;
+	endpoint_t sin;
+	char addr[64];
+	socket_t *ul;
+	struct timeval received;
+	str buf;
+	char data[0];
+};
+
+struct ng_worker {
+	mutex_t lock;
+	cond_t cond;
+	GQueue requests;
+};
 
 
 mutex_t rtpe_cngs_lock;
 GHashTable *rtpe_cngs_hash;
 struct control_ng *rtpe_control_ng;
 
+struct ng_command_stats rtpe_ng_command_stats[__NGC_MAX];
+
+const char *ng_command_names[__NGC_MAX] = {
+	[NGC_PING] = "ping",
+	[NGC_OFFER] = "offer",
+	[NGC_ANSWER] = "answer",
+	[NGC_DELETE] = "delete",
+	[NGC_QUERY] = "query",
+	[NGC_LIST] = "list",
+	[NGC_START_RECORDING] = "start recording",
+	[NGC_STOP_RECORDING] = "stop recording",
+	[NGC_START_FORWARDING] = "start forwarding",
+	[NGC_STOP_FORWARDING] = "stop forwarding",
+	[NGC_BLOCK_DTMF] = "block DTMF",
+	[NGC_UNBLOCK_DTMF] = "unblock DTMF",
+	[NGC_BLOCK_MEDIA] = "block media",
+	[NGC_UNBLOCK_MEDIA] = "unblock media",
+	[NGC_PLAY_MEDIA] = "play media",
+	[NGC_STOP_MEDIA] = "stop media",
+};
+
+// upper bounds, the last bucket is open ended
+const unsigned int ng_latency_bucket_us[NG_LATENCY_BUCKETS - 1] = {
+	500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000,
+};
+
+static struct ng_worker *ng_workers;
+static unsigned int ng_num_workers;
+static unsigned int ng_max_queued;
+static unsigned int ng_next_worker;
+static volatile gint ng_queued;
+static volatile gint ng_in_flight;
+
 const char magic_load_limit_strings[__LOAD_LIMIT_MAX][64] = {
 	[LOAD_LIMIT_MAX_SESSIONS] = "Parallel session limit reached",
 	[LOAD_LIMIT_CPU] = "CPU usage limit exceeded",
@@ -113,19 +169,39 @@ struct control_ng_stats* get_control_ng_stats(struct control_ng* c, const sockad
 	return cur;
 }
 
-static void control_ng_incoming(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
-		socket_t *ul)
+static void ng_command_stats_update(enum ng_command ngc, const struct timeval *received) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long long us = timeval_diff(&now, received);
+	if (us < 0)
+		us = 0;
+
+	unsigned int bucket;
+	for (bucket = 0; bucket < NG_LATENCY_BUCKETS - 1; bucket++) {
+		if (us <= ng_latency_bucket_us[bucket])
+			break;
+	}
+
+	struct ng_command_stats *st = &rtpe_ng_command_stats[ngc];
+	atomic64_inc(&st->count);
+	atomic64_add(&st->time_us, us);
+	atomic64_inc(&st->latency[bucket]);
+}
+
+static void control_ng_process(struct control_ng *c, str *buf, const endpoint_t *sin, char *addr,
+		socket_t *ul, const struct timeval *received)
 {
-	struct control_ng *c = (void *) obj;
 	bencode_buffer_t bencbuf;
 	bencode_item_t *dict, *resp;
 	str cmd = STR_NULL, cookie, data, reply, *to_send, callid;
 	const char *errstr, *resultstr;
-	struct iovec iov[3];
+	struct iovec iov[3], *riov;
 	unsigned int iovlen;
+	int riovlen;
 	GString *log_str;
 	struct timeval cmd_start, cmd_stop, cmd_process_time;
 	struct control_ng_stats* cur = get_control_ng_stats(c,&sin->address);
+	int ngc = -1;
 
 	str_chr_str(&data, buf, ' ');
 	if (!data.s || data.s == buf->s) {
@@ -187,68 +263,88 @@ static void control_ng_incoming(struct obj *obj, str *buf, const endpoint_t *sin
 
 	int cmdcode = __csh_lookup(&cmd);
 
+	// collect all kernel and firewall rule changes made by this command and push them at once
+	kernel_batch_start();
+	iptables_batch_start();
+
 	switch (cmdcode) {
 		case CSH_LOOKUP("ping"):
+			ngc = NGC_PING;
 			resultstr = "pong";
 			g_atomic_int_inc(&cur->ping);
 			break;
 		case CSH_LOOKUP("offer"):
+			ngc = NGC_OFFER;
 			errstr = call_offer_ng(dict, resp, addr, sin);
 			g_atomic_int_inc(&cur->offer);
 			break;
 		case CSH_LOOKUP("answer"):
+			ngc = NGC_ANSWER;
 			errstr = call_answer_ng(dict, resp);
 			g_atomic_int_inc(&cur->answer);
 			break;
 		case CSH_LOOKUP("delete"):
+			ngc = NGC_DELETE;
 			errstr = call_delete_ng(dict, resp);
 			g_atomic_int_inc(&cur->delete);
 			break;
 		case CSH_LOOKUP("query"):
+			ngc = NGC_QUERY;
 			errstr = call_query_ng(dict, resp);
 			g_atomic_int_inc(&cur->query);
 			break;
 		case CSH_LOOKUP("list"):
+			ngc = NGC_LIST;
 			errstr = call_list_ng(dict, resp);
 			g_atomic_int_inc(&cur->list);
 			break;
 		case CSH_LOOKUP("start recording"):
+			ngc = NGC_START_RECORDING;
 			errstr = call_start_recording_ng(dict, resp);
 			g_atomic_int_inc(&cur->start_recording);
 			break;
 		case CSH_LOOKUP("stop recording"):
+			ngc = NGC_STOP_RECORDING;
 			errstr = call_stop_recording_ng(dict, resp);
 			g_atomic_int_inc(&cur->stop_recording);
 			break;
 		case CSH_LOOKUP("start forwarding"):
+			ngc = NGC_START_FORWARDING;
 			errstr = call_start_forwarding_ng(dict, resp);
 			g_atomic_int_inc(&cur->start_forwarding);
 			break;
 		case CSH_LOOKUP("stop forwarding"):
+			ngc = NGC_STOP_FORWARDING;
 			errstr = call_stop_forwarding_ng(dict, resp);
 			g_atomic_int_inc(&cur->stop_forwarding);
 			break;
 		case CSH_LOOKUP("block DTMF"):
+			ngc = NGC_BLOCK_DTMF;
 			errstr = call_block_dtmf_ng(dict, resp);
 			g_atomic_int_inc(&cur->block_dtmf);
 			break;
 		case CSH_LOOKUP("unblock DTMF"):
+			ngc = NGC_UNBLOCK_DTMF;
 			errstr = call_unblock_dtmf_ng(dict, resp);
 			g_atomic_int_inc(&cur->unblock_dtmf);
 			break;
 		case CSH_LOOKUP("block media"):
+			ngc = NGC_BLOCK_MEDIA;
 			errstr = call_block_media_ng(dict, resp);
 			g_atomic_int_inc(&cur->block_media);
 			break;
 		case CSH_LOOKUP("unblock media"):
+			ngc = NGC_UNBLOCK_MEDIA;
 			errstr = call_unblock_media_ng(dict, resp);
 			g_atomic_int_inc(&cur->unblock_media);
 			break;
 		case CSH_LOOKUP("play media"):
+			ngc = NGC_PLAY_MEDIA;
 			errstr = call_play_media_ng(dict, resp);
 			g_atomic_int_inc(&cur->play_media);
 			break;
 		case CSH_LOOKUP("stop media"):
+			ngc = NGC_STOP_MEDIA;
 			errstr = call_stop_media_ng(dict, resp);
 			g_atomic_int_inc(&cur->stop_media);
 			break;
@@ -256,6 +352,12 @@ static void control_ng_incoming(struct obj *obj, str *buf, const endpoint_t *sin
 			errstr = "Unrecognized command";
 	}
 
+	iptables_batch_end();
+	// affected streams keep being forwarded in userspace
+	if (kernel_batch_end())
+		ilog(LOG_WARNING, "Failed to push some of the kernel forwarding changes of the '"
+				STR_FORMAT "' command", STR_FMT(&cmd));
+
 	// stop command timer
 	gettimeofday(&cmd_stop, NULL);
 	//print command duration
@@ -299,13 +401,28 @@ err_send:
 	}
 
 send_resp:
-	bencode_collapse_str(resp, &reply);
-	to_send = &reply;
+	// send the reply straight out of the bencode buffer, so that the SDP body
+	// isn't copied. the cookie cache then copies it from the same iovec
+	riov = NULL;
+	to_send = NULL;
+	if (resp->iov_cnt <= NG_REPLY_IOV_MAX)
+		riov = bencode_iovec(resp, &riovlen, 2, 0);
+	if (riov) {
+		riov[0].iov_base = cookie.s;
+		riov[0].iov_len = cookie.len;
+		riov[1].iov_base = " ";
+		riov[1].iov_len = 1;
+		socket_sendiov(ul, riov, riovlen + 2, sin);
+	}
+	else
+		to_send = bencode_collapse_str(resp, &reply);
 
 	if (cmd.s) {
 		ilog(LOG_INFO, "Replying to '"STR_FORMAT"' from %s (elapsed time %llu.%06llu sec)", STR_FMT(&cmd), addr, (unsigned long long)cmd_process_time.tv_sec, (unsigned long long)cmd_process_time.tv_usec);
 
 		if (get_log_level() >= LOG_DEBUG) {
+			if (!to_send)
+				to_send = bencode_collapse_str(resp, &reply);
 			dict = bencode_decode_expect_str(&bencbuf, to_send, BENCODE_DICTIONARY);
 			if (dict) {
 				log_str = g_string_sized_new(256);
@@ -318,6 +435,11 @@ send_resp:
 		}
 	}
 
+	if (riov) {
+		cookie_cache_insert_iov(&c->cookie_cache, &cookie, riov + 2, riovlen);
+		goto out;
+	}
+
 send_only:
 	iovlen = 3;
 
@@ -338,11 +460,144 @@ send_only:
 	goto out;
 
 out:
+	if (ngc >= 0)
+		ng_command_stats_update(ngc, received);
 	bencode_buffer_free(&bencbuf);
 	log_info_clear();
 }
 
 
+// returns the length of one bencoded item without decoding it, or -1 if it's invalid
+static int ng_bencode_skip(const char *s, int len, unsigned int depth) {
+	int pos, l;
+	const char *end;
+
+	if (len <= 0 || depth > 32)
+		return -1;
+
+	switch (s[0]) {
+		case 'i':
+			end = memchr(s, 'e', len);
+			return end ? end - s + 1 : -1;
+		case 'l':
+		case 'd':
+			for (pos = 1; pos < len && s[pos] != 'e'; pos += l) {
+				l = ng_bencode_skip(s + pos, len - pos, depth + 1);
+				if (l < 0)
+					return -1;
+			}
+			return pos < len ? pos + 1 : -1;
+	}
+
+	// string with length prefix
+	for (pos = 0, l = 0; pos < len && s[pos] >= '0' && s[pos] <= '9'; pos++) {
+		l = l * 10 + (s[pos] - '0');
+		if (l > len)
+			return -1;
+	}
+	if (!pos || pos >= len || s[pos] != ':')
+		return -1;
+	pos++;
+	if (l > len - pos)
+		return -1;
+	return pos + l;
+}
+
+// finds the call-id in a request by only walking the top-level dictionary, as the worker
+// decodes the request anyway
+static int ng_scan_call_id(const str *data, str *callid) {
+	const char *s = data->s, *colon;
+	int len = data->len, pos, l, is_callid;
+
+	if (len < 2 || s[0] != 'd')
+		return -1;
+
+	for (pos = 1; pos < len && s[pos] != 'e'; pos += l) {
+		l = ng_bencode_skip(s + pos, len - pos, 1);
+		if (l < 0)
+			return -1;
+		is_callid = (l == 9 && !memcmp(s + pos, "7:call-id", 9));
+		pos += l;
+
+		l = ng_bencode_skip(s + pos, len - pos, 1);
+		if (l < 0)
+			return -1;
+		if (!is_callid)
+			continue;
+		if (s[pos] < '0' || s[pos] > '9')
+			return -1;
+		colon = memchr(s + pos, ':', l);
+		str_init_len(callid, (char *) colon + 1, s + pos + l - colon - 1);
+		return 0;
+	}
+
+	return -1;
+}
+
+static void control_ng_reject(str *buf, const endpoint_t *sin, char *addr, socket_t *ul) {
+	static const char reply[] = " d6:result10:load limit7:message25:Too many pending commandse";
+	struct iovec iov[2];
+	str cookie;
+
+	ilog(LOG_WARNING, "Rejecting NG command from %s, too many commands are pending", addr);
+
+	str_chr_str(&cookie, buf, ' ');
+	if (!cookie.s || cookie.s == buf->s)
+		return;
+	iov[0].iov_base = buf->s;
+	iov[0].iov_len = cookie.s - buf->s;
+	iov[1].iov_base = (char *) reply;
+	iov[1].iov_len = sizeof(reply) - 1;
+	socket_sendiov(ul, iov, 2, sin);
+}
+
+// called from the poller thread. requests for the same call always go to the same
+// worker, so that they're processed in the order they were received.
+static void control_ng_incoming(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
+		socket_t *ul)
+{
+	struct control_ng *c = (void *) obj;
+	struct timeval received;
+
+	gettimeofday(&received, NULL);
+
+	if (!ng_num_workers) {
+		control_ng_process(c, buf, sin, addr, ul, &received);
+		return;
+	}
+
+	if (ng_max_queued && g_atomic_int_get(&ng_queued) >= ng_max_queued) {
+		control_ng_reject(buf, sin, addr, ul);
+		return;
+	}
+
+	struct ng_request *req = g_malloc(sizeof(*req) + buf->len + 1);
+	req->c = obj_get(c);
+	req->sin = *sin;
+	g_strlcpy(req->addr, addr, sizeof(req->addr));
+	req->ul = ul;
+	req->received = received;
+	memcpy(req->data, buf->s, buf->len);
+	req->data[buf->len] = '\0';
+	str_init_len(&req->buf, req->data, buf->len);
+
+	unsigned int idx;
+	str data, callid;
+	str_chr_str(&data, buf, ' ');
+	if (data.s && !str_shift(&data, 1) && !ng_scan_call_id(&data, &callid))
+		idx = str_hash(&callid) % ng_num_workers;
+	else
+		idx = g_atomic_int_add(&ng_next_worker, 1) % ng_num_workers;
+
+	struct ng_worker *w = &ng_workers[idx];
+	g_atomic_int_inc(&ng_queued);
+	mutex_lock(&w->lock);
+	g_queue_push_tail(&w->requests, req);
+	cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
+}
+
+
 
 struct control_ng *control_ng_new(struct poller *p, endpoint_t *ep, unsigned char tos) {
 	struct control_ng *c;
@@ -379,3 +634,57 @@ void control_ng_init() {
 	mutex_init(&rtpe_cngs_lock);
 	rtpe_cngs_hash = g_hash_table_new(g_sockaddr_hash, g_sockaddr_eq);
 }
+
+
+// a max_queued of zero means no limit
+void control_ng_workers_init(unsigned int num, unsigned int max_queued) {
+	ng_workers = g_new0(struct ng_worker, num);
+	for (unsigned int i = 0; i < num; i++) {
+		mutex_init(&ng_workers[i].lock);
+		cond_init(&ng_workers[i].cond);
+		g_queue_init(&ng_workers[i].requests);
+	}
+	ng_num_workers = num;
+	ng_max_queued = max_queued;
+}
+
+
+void control_ng_worker_loop(void *p) {
+	struct ng_worker *w = &ng_workers[GPOINTER_TO_UINT(p)];
+
+	mutex_lock(&w->lock);
+
+	while (!rtpe_shutdown) {
+		struct ng_request *req = g_queue_pop_head(&w->requests);
+		if (!req) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&w->cond, &w->lock, &tv);
+			continue;
+		}
+		mutex_unlock(&w->lock);
+
+		g_atomic_int_add(&ng_queued, -1);
+		g_atomic_int_inc(&ng_in_flight);
+		gettimeofday(&rtpe_now, NULL);
+		control_ng_process(req->c, &req->buf, &req->sin, req->addr, req->ul, &req->received);
+		g_atomic_int_add(&ng_in_flight, -1);
+
+		obj_put(req->c);
+		g_free(req);
+
+		mutex_lock(&w->lock);
+	}
+
+	mutex_unlock(&w->lock);
+}
+
+
+unsigned int control_ng_queue_depth(void) {
+	return g_atomic_int_get(&ng_queued);
+}
+
+unsigned int control_ng_in_flight(void) {
+	return g_atomic_int_get(&ng_in_flight);
+}
@@ -8,71 +8,144 @@
 #include "poller.h"
 #include "str.h"
 
-static const char *cookie_in_use = "MAGIC";
+// a command with this cookie is being worked on. duplicates wait on `cond` until
+// the first thread is done, the last one to leave frees it
+struct cookie_wait {
+	cond_t cond;
+	unsigned int waiters;
+	int done;
+};
 
 INLINE void cookie_cache_state_init(struct cookie_cache_state *s) {
-	s->cookies = g_hash_table_new(str_hash, str_equal);
+	s->cookies = g_hash_table_new_full(str_hash, str_equal, NULL, free);
 	s->chunks = g_string_chunk_new(4 * 1024);
 }
 
+INLINE void cookie_cache_state_free(struct cookie_cache_state *s) {
+	if (!s->cookies)
+		return;
+	g_hash_table_destroy(s->cookies);
+	g_string_chunk_free(s->chunks);
+}
+
 void cookie_cache_init(struct cookie_cache *c) {
-	cookie_cache_state_init(&c->current);
-	cookie_cache_state_init(&c->old);
-	c->swap_time = rtpe_now.tv_sec;
-	mutex_init(&c->lock);
-	cond_init(&c->cond);
+	for (int i = 0; i < COOKIE_CACHE_SHARDS; i++) {
+		struct cookie_cache_shard *s = &c->shards[i];
+		cookie_cache_state_init(&s->current);
+		cookie_cache_state_init(&s->old);
+		s->pending = g_hash_table_new(str_hash, str_equal);
+		// stagger the swaps so that not all shards age out on the same request
+		s->swap_time = rtpe_now.tv_sec - i * COOKIE_CACHE_TIMEOUT / COOKIE_CACHE_SHARDS;
+		mutex_init(&s->lock);
+	}
+}
+
+INLINE struct cookie_cache_shard *__cookie_cache_shard(struct cookie_cache *c, const str *s) {
+	return &c->shards[str_hash(s) % COOKIE_CACHE_SHARDS];
+}
+
+/* lock must be held. the expired state is handed back in `dead` to be freed
+ * once the lock is released */
+static void __cookie_cache_check_swap(struct cookie_cache_shard *s, struct cookie_cache_state *dead) {
+	dead->cookies = NULL;
+	if (rtpe_now.tv_sec - s->swap_time < COOKIE_CACHE_TIMEOUT)
+		return;
+	*dead = s->old;
+	s->old = s->current;
+	cookie_cache_state_init(&s->current);
+	s->swap_time = rtpe_now.tv_sec;
 }
 
 /* lock must be held */
-static void __cookie_cache_check_swap(struct cookie_cache *c) {
-	if (rtpe_now.tv_sec - c->swap_time >= 30) {
-		g_hash_table_remove_all(c->old.cookies);
-		g_string_chunk_clear(c->old.chunks);
-		swap_ptrs(&c->old.chunks, &c->current.chunks);
-		swap_ptrs(&c->old.cookies, &c->current.cookies);
-		c->swap_time = rtpe_now.tv_sec;
-	}
+static void __cookie_cache_release(struct cookie_cache_shard *s, const str *cookie) {
+	struct cookie_wait *w = g_hash_table_lookup(s->pending, cookie);
+	if (!w)
+		return;
+	g_hash_table_remove(s->pending, cookie);
+	w->done = 1;
+	if (w->waiters)
+		cond_broadcast(&w->cond);
+	else
+		g_slice_free1(sizeof(*w), w);
 }
 
 str *cookie_cache_lookup(struct cookie_cache *c, const str *s) {
+	struct cookie_cache_shard *shard = __cookie_cache_shard(c, s);
+	struct cookie_cache_state dead;
+	struct cookie_wait *w;
 	str *ret;
 
-	mutex_lock(&c->lock);
+	mutex_lock(&shard->lock);
 
-	__cookie_cache_check_swap(c);
+	__cookie_cache_check_swap(shard, &dead);
 
 restart:
-	ret = g_hash_table_lookup(c->current.cookies, s);
+	w = g_hash_table_lookup(shard->pending, s);
+	if (w) {
+		/* another thread is working on this right now */
+		w->waiters++;
+		while (!w->done)
+			cond_wait(&w->cond, &shard->lock);
+		if (--w->waiters == 0)
+			g_slice_free1(sizeof(*w), w);
+		goto restart;
+	}
+
+	ret = g_hash_table_lookup(shard->current.cookies, s);
 	if (!ret)
-		ret = g_hash_table_lookup(c->old.cookies, s);
-	if (ret) {
-		if (ret == (void *) cookie_in_use) {
-			/* another thread is working on this right now */
-			cond_wait(&c->cond, &c->lock);
-			goto restart;
-		}
+		ret = g_hash_table_lookup(shard->old.cookies, s);
+	if (ret)
 		ret = str_dup(ret);
-		mutex_unlock(&c->lock);
-		return ret;
+	else {
+		w = g_slice_alloc0(sizeof(*w));
+		cond_init(&w->cond);
+		g_hash_table_replace(shard->pending, (void *) s, w);
 	}
-	g_hash_table_replace(c->current.cookies, (void *) s, (void *) cookie_in_use);
-	mutex_unlock(&c->lock);
-	return NULL;
+
+	mutex_unlock(&shard->lock);
+
+	cookie_cache_state_free(&dead);
+
+	return ret;
 }
 
 void cookie_cache_insert(struct cookie_cache *c, const str *s, const str *r) {
-	mutex_lock(&c->lock);
-	g_hash_table_replace(c->current.cookies, str_chunk_insert(c->current.chunks, s),
-		str_chunk_insert(c->current.chunks, r));
-	g_hash_table_remove(c->old.cookies, s);
-	cond_broadcast(&c->cond);
-	mutex_unlock(&c->lock);
+	struct iovec iov = {
+		.iov_base = r->s,
+		.iov_len = r->len,
+	};
+	cookie_cache_insert_iov(c, s, &iov, 1);
+}
+
+// the reply is assembled from `iov` directly, without flattening it first
+void cookie_cache_insert_iov(struct cookie_cache *c, const str *s, const struct iovec *iov,
+		unsigned int iovcnt)
+{
+	struct cookie_cache_shard *shard = __cookie_cache_shard(c, s);
+	size_t len = 0;
+
+	for (unsigned int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	str *r = str_alloc(len);
+	for (unsigned int i = 0; i < iovcnt; i++) {
+		memcpy(r->s + r->len, iov[i].iov_base, iov[i].iov_len);
+		r->len += iov[i].iov_len;
+	}
+	r->s[r->len] = '\0';
+
+	mutex_lock(&shard->lock);
+	g_hash_table_replace(shard->current.cookies, str_chunk_insert(shard->current.chunks, s), r);
+	g_hash_table_remove(shard->old.cookies, s);
+	__cookie_cache_release(shard, s);
+	mutex_unlock(&shard->lock);
 }
 
 void cookie_cache_remove(struct cookie_cache *c, const str *s) {
-	mutex_lock(&c->lock);
-	g_hash_table_remove(c->current.cookies, s);
-	g_hash_table_remove(c->old.cookies, s);
-	cond_broadcast(&c->cond);
-	mutex_unlock(&c->lock);
+	struct cookie_cache_shard *shard = __cookie_cache_shard(c, s);
+
+	mutex_lock(&shard->lock);
+	g_hash_table_remove(shard->current.cookies, s);
+	g_hash_table_remove(shard->old.cookies, s);
+	__cookie_cache_release(shard, s);
+	mutex_unlock(&shard->lock);
 }
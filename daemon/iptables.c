@@ -5,24 +5,110 @@
 int (*iptables_add_rule)(const socket_t *local_sock, const str *comment);
 int (*iptables_del_rule)(const socket_t *local_sock);
 
-#ifdef WITH_IPTABLES_OPTION
+#if defined(WITH_IPTABLES_OPTION) || defined(WITH_NFTABLES_OPTION)
 
-#include <stdio.h>
+#include <glib.h>
 #include <errno.h>
 #include <string.h>
+#include "aux.h"
+#include "log.h"
+#include "socket.h"
+
+// a pending rule change
+struct iptables_op {
+	int del;
+	endpoint_t local;
+	str *comment;
+};
+
+// changes are applied in the order they were made, across all threads. this makes sure
+// that a port's rule is deleted before the same port is opened again.
+static mutex_t iptables_queue_lock = MUTEX_STATIC_INIT;
+static GQueue iptables_queue = G_QUEUE_INIT;
+static mutex_t iptables_commit_lock = MUTEX_STATIC_INIT;
+static __thread unsigned int iptables_batch_depth;
+
+// applies and frees all queued ops
+static void (*iptables_commit)(GQueue *ops);
+
+static void iptables_op_free(void *p) {
+	struct iptables_op *op = p;
+	if (op->comment)
+		free(op->comment);
+	g_slice_free1(sizeof(*op), op);
+}
+
+static void iptables_flush(void) {
+	mutex_lock(&iptables_commit_lock);
+
+	mutex_lock(&iptables_queue_lock);
+	GQueue ops = iptables_queue;
+	g_queue_init(&iptables_queue);
+	mutex_unlock(&iptables_queue_lock);
+
+	if (ops.length)
+		iptables_commit(&ops);
+
+	mutex_unlock(&iptables_commit_lock);
+}
+
+static void iptables_queue_op(int del, const socket_t *local_sock, const str *comment) {
+	struct iptables_op *op = g_slice_alloc0(sizeof(*op));
+	op->del = del;
+	op->local = local_sock->local;
+	if (comment)
+		op->comment = str_dup(comment);
+
+	mutex_lock(&iptables_queue_lock);
+	g_queue_push_tail(&iptables_queue, op);
+	mutex_unlock(&iptables_queue_lock);
+
+	if (!iptables_batch_depth)
+		iptables_flush();
+}
+
+static int __iptables_add_rule(const socket_t *local_sock, const str *comment) {
+	iptables_queue_op(0, local_sock, comment);
+	return 0;
+}
+
+static int __iptables_del_rule(const socket_t *local_sock) {
+	iptables_queue_op(1, local_sock, NULL);
+	return 0;
+}
+
+#endif
+
+
+void iptables_batch_start(void) {
+#if defined(WITH_IPTABLES_OPTION) || defined(WITH_NFTABLES_OPTION)
+	iptables_batch_depth++;
+#endif
+}
+
+void iptables_batch_end(void) {
+#if defined(WITH_IPTABLES_OPTION) || defined(WITH_NFTABLES_OPTION)
+	if (!iptables_batch_depth)
+		return;
+	if (--iptables_batch_depth)
+		return;
+	if (iptables_commit)
+		iptables_flush();
+#endif
+}
+
+
+#ifdef WITH_IPTABLES_OPTION
+
+#include <stdio.h>
 #include <libiptc/libiptc.h>
 #include <libiptc/libip6tc.h>
 #include <libiptc/libxtc.h>
 #include <linux/netfilter/xt_comment.h>
-#include <glib.h>
-#include <errno.h>
 #include <sys/file.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include "aux.h"
-#include "log.h"
-#include "socket.h"
 
 #undef __ALIGN_KERNEL
 #define __ALIGN_KERNEL(x, a)		__ALIGN_KERNEL_MASK(x, (__typeof(x))(a) - 1)
@@ -81,7 +167,7 @@ static void xt_unlock(void) {
 	mutex_unlock(&__xt_lock);
 }
 
-static void ip46tables_fill_matches(struct ipt_matches *matches, const socket_t *local_sock,
+static void ip46tables_fill_matches(struct ipt_matches *matches, const endpoint_t *local,
 		const str *comment)
 {
 	matches->target.target.u.user.target_size = XT_ALIGN(sizeof(struct xt_standard_target));
@@ -89,7 +175,7 @@ static void ip46tables_fill_matches(struct ipt_matches *matches, const socket_t
 
 	strcpy(matches->udp_match.u.user.name, "udp");
 	matches->udp_match.u.match_size = XT_ALIGN(sizeof(struct xt_entry_match)) + XT_ALIGN(sizeof(struct xt_udp));
-	matches->udp.dpts[0] = matches->udp.dpts[1] = local_sock->local.port;
+	matches->udp.dpts[0] = matches->udp.dpts[1] = local->port;
 	matches->udp.spts[0] = 0;
 	matches->udp.spts[1] = 0xffff;
 
@@ -100,212 +186,388 @@ static void ip46tables_fill_matches(struct ipt_matches *matches, const socket_t
 		str_ncpy(matches->comment.comment, sizeof(matches->comment.comment), comment);
 }
 
-static void ip4_fill_entry(struct ipv4_ipt_entry *entry, const socket_t *local_sock, const str *comment) {
+static void ip4_fill_entry(struct ipv4_ipt_entry *entry, const endpoint_t *local, const str *comment) {
 	ZERO(*entry);
 	entry->entry.ip.proto = IPPROTO_UDP;
-	entry->entry.ip.dst = local_sock->local.address.u.ipv4;
+	entry->entry.ip.dst = local->address.u.ipv4;
 	memset(&entry->entry.ip.dmsk, 0xff, sizeof(entry->entry.ip.dmsk));
 	entry->entry.target_offset = G_STRUCT_OFFSET(struct ipv4_ipt_entry, matches.target);
 
-	ip46tables_fill_matches(&entry->matches, local_sock, comment);
+	ip46tables_fill_matches(&entry->matches, local, comment);
 
 	entry->entry.next_offset = entry->entry.target_offset + entry->matches.target.target.u.user.target_size;
 }
-static void ip6_fill_entry(struct ipv6_ipt_entry *entry, const socket_t *local_sock, const str *comment) {
+static void ip6_fill_entry(struct ipv6_ipt_entry *entry, const endpoint_t *local, const str *comment) {
 	ZERO(*entry);
 	entry->entry.ipv6.proto = IPPROTO_UDP;
-	entry->entry.ipv6.dst = local_sock->local.address.u.ipv6;
+	entry->entry.ipv6.dst = local->address.u.ipv6;
 	entry->entry.ipv6.flags |= IP6T_F_PROTO;
 	memset(&entry->entry.ipv6.dmsk, 0xff, sizeof(entry->entry.ipv6.dmsk));
 	entry->entry.target_offset = G_STRUCT_OFFSET(struct ipv6_ipt_entry, matches.target);
 
-	ip46tables_fill_matches(&entry->matches, local_sock, comment);
+	ip46tables_fill_matches(&entry->matches, local, comment);
 
 	entry->entry.next_offset = entry->entry.target_offset + entry->matches.target.target.u.user.target_size;
 }
 
-static const char *ip4tables_add_rule(const socket_t *local_sock, const str *comment) {
-	struct xtc_handle *h;
-	struct ipv4_ipt_entry entry;
-	const char *err;
-
-	xt_lock();
-
-	err = "could not initialize iptables";
-	h = iptc_init("filter");
-	if (!h)
-		goto err2;
-
-	ip4_fill_entry(&entry, local_sock, comment);
-
-	err = "failed to append iptables entry";
-	if (!iptc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
-		goto err;
-	err = "failed to commit iptables changes";
-	if (!iptc_commit(h))
-		goto err;
-
-	err = NULL;
-
-err:
-	iptc_free(h);
-err2:
-	xt_unlock();
-	return err;
+// all rule matches except the comment
+static void ip46tables_fill_mask(struct ipt_matches *mask) {
+	memset(&mask->udp_match, 0xff, sizeof(mask->udp_match));
+	memset(&mask->udp, 0xff, sizeof(mask->udp));
+	memset(&mask->comment_match, 0xff, sizeof(mask->comment_match));
+	memset(&mask->target, 0xff, sizeof(mask->target));
 }
 
-static const char *ip6tables_add_rule(const socket_t *local_sock, const str *comment) {
-	struct xtc_handle *h;
-	struct ipv6_ipt_entry entry;
-	const char *err;
-
-	xt_lock();
-
-	err = "could not initialize ip6tables";
-	h = ip6tc_init("filter");
-	if (!h)
-		goto err2;
+static const char *ip4tables_apply(struct xtc_handle *h, struct iptables_op *op) {
+	struct ipv4_ipt_entry entry, mask;
 
-	ip6_fill_entry(&entry, local_sock, comment);
+	ip4_fill_entry(&entry, &op->local, op->comment);
 
-	err = "failed to append ip6tables entry";
-	if (!ip6tc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
-		goto err;
-	err = "failed to commit ip6tables changes";
-	if (!ip6tc_commit(h))
-		goto err;
+	if (!op->del) {
+		if (!iptc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
+			return "failed to append iptables entry";
+		return NULL;
+	}
 
-	err = NULL;
+	memset(&mask, 0, sizeof(mask));
+	memset(&mask.entry, 0xff, sizeof(mask.entry));
+	ip46tables_fill_mask(&mask.matches);
 
-err:
-	ip6tc_free(h);
-err2:
-	xt_unlock();
-	return err;
+	if (!iptc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
+		return "failed to delete iptables entry";
+	return NULL;
 }
 
-static const char *ip4tables_del_rule(const socket_t *local_sock) {
-	struct xtc_handle *h;
-	struct ipv4_ipt_entry entry, mask;
-	const char *err;
-
-	xt_lock();
+static const char *ip6tables_apply(struct xtc_handle *h, struct iptables_op *op) {
+	struct ipv6_ipt_entry entry, mask;
 
-	err = "could not initialize iptables";
-	h = iptc_init("filter");
-	if (!h)
-		goto err2;
+	ip6_fill_entry(&entry, &op->local, op->comment);
 
-	ip4_fill_entry(&entry, local_sock, NULL);
+	if (!op->del) {
+		if (!ip6tc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
+			return "failed to append ip6tables entry";
+		return NULL;
+	}
 
-	// match everything except the comment
 	memset(&mask, 0, sizeof(mask));
 	memset(&mask.entry, 0xff, sizeof(mask.entry));
-	memset(&mask.matches.udp_match, 0xff, sizeof(mask.matches.udp_match));
-	memset(&mask.matches.udp, 0xff, sizeof(mask.matches.udp));
-	memset(&mask.matches.comment_match, 0xff, sizeof(mask.matches.comment_match));
-	memset(&mask.matches.target, 0xff, sizeof(mask.matches.target));
+	ip46tables_fill_mask(&mask.matches);
 
-	err = "failed to delete iptables entry";
-	if (!iptc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
-		goto err;
-	err = "failed to commit iptables changes";
-	if (!iptc_commit(h))
-		goto err;
-
-	err = NULL;
+	if (!ip6tc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
+		return "failed to delete ip6tables entry";
+	return NULL;
+}
 
-err:
-	iptc_free(h);
-err2:
-	xt_unlock();
-	return err;
+static void iptables_op_error(struct iptables_op *op, const char *err) {
+	if (op->del)
+		ilog(LOG_ERROR, "Error deleting iptables rule: %s (%s)",
+				err, strerror(errno));
+	else
+		ilog(LOG_ERROR, "Error adding iptables rule (for '" STR_FORMAT "'): %s (%s)",
+				STR_FMT0(op->comment), err, strerror(errno));
 }
 
-static const char *ip6tables_del_rule(const socket_t *local_sock) {
-	struct xtc_handle *h;
-	struct ipv6_ipt_entry entry, mask;
+// reads each table once, applies all changes to it and commits it once
+static void ip46tables_commit(GQueue *ops) {
+	struct xtc_handle *h4 = NULL, *h6 = NULL;
+	int h4_failed = 0, h6_failed = 0;
 	const char *err;
+	struct iptables_op *op;
+	unsigned int num = ops->length;
 
 	xt_lock();
 
-	err = "could not initialize ip6tables";
-	h = ip6tc_init("filter");
-	if (!h)
-		goto err2;
+	while ((op = g_queue_pop_head(ops))) {
+		switch (op->local.address.family->af) {
+			case AF_INET:
+				err = "could not initialize iptables";
+				if (!h4 && !h4_failed && !(h4 = iptc_init("filter")))
+					h4_failed = 1;
+				if (h4)
+					err = ip4tables_apply(h4, op);
+				break;
+			case AF_INET6:
+				err = "could not initialize ip6tables";
+				if (!h6 && !h6_failed && !(h6 = ip6tc_init("filter")))
+					h6_failed = 1;
+				if (h6)
+					err = ip6tables_apply(h6, op);
+				break;
+			default:
+				err = "unsupported socket family";
+				break;
+		}
+		if (err)
+			iptables_op_error(op, err);
+		iptables_op_free(op);
+	}
 
-	ip6_fill_entry(&entry, local_sock, NULL);
+	if (h4) {
+		if (!iptc_commit(h4))
+			ilog(LOG_ERROR, "Failed to commit iptables changes: %s", strerror(errno));
+		iptc_free(h4);
+	}
+	if (h6) {
+		if (!ip6tc_commit(h6))
+			ilog(LOG_ERROR, "Failed to commit ip6tables changes: %s", strerror(errno));
+		ip6tc_free(h6);
+	}
 
-	// match everything except the comment
-	memset(&mask, 0, sizeof(mask));
-	memset(&mask.entry, 0xff, sizeof(mask.entry));
-	memset(&mask.matches.udp_match, 0xff, sizeof(mask.matches.udp_match));
-	memset(&mask.matches.udp, 0xff, sizeof(mask.matches.udp));
-	memset(&mask.matches.comment_match, 0xff, sizeof(mask.matches.comment_match));
-	memset(&mask.matches.target, 0xff, sizeof(mask.matches.target));
+	xt_unlock();
 
-	err = "failed to delete ip6tables entry";
-	if (!ip6tc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
-		goto err;
-	err = "failed to commit ip6tables changes";
-	if (!ip6tc_commit(h))
-		goto err;
+	ilog(LOG_DEBUG, "Committed %u iptables changes", num);
+}
 
-	err = NULL;
+#endif // WITH_IPTABLES_OPTION
 
-err:
-	ip6tc_free(h);
-err2:
-	xt_unlock();
-	return err;
-}
 
-static int __iptables_add_rule(const socket_t *local_sock, const str *comment) {
-	const char *err;
+#ifdef WITH_NFTABLES_OPTION
 
-	switch (local_sock->family->af) {
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/set.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+// nftables ops are sent in transactions of this many elements
+#define NFT_BATCH_OPS 256
+
+// only used while holding iptables_commit_lock
+static struct mnl_socket *nft_sock;
+static unsigned int nft_portid;
+static uint32_t nft_seq;
+
+// element key of a `ipv4_addr . inet_service` or `ipv6_addr . inet_service` set. each
+// part of a concatenation is padded to 32 bits.
+static unsigned int nft_fill_key(unsigned char *key, const endpoint_t *local, const char **set) {
+	unsigned int len;
+	uint16_t port = htons(local->port);
+
+	switch (local->address.family->af) {
 		case AF_INET:
-			err = ip4tables_add_rule(local_sock, comment);
+			memcpy(key, &local->address.u.ipv4, 4);
+			len = 4;
+			*set = rtpe_config.nftables_set4;
 			break;
 		case AF_INET6:
-			err = ip6tables_add_rule(local_sock, comment);
+			memcpy(key, &local->address.u.ipv6, 16);
+			len = 16;
+			*set = rtpe_config.nftables_set6;
 			break;
 		default:
-			err = "unsupported socket family";
-			break;
-	};
+			return 0;
+	}
 
-	if (err)
-		ilog(LOG_ERROR, "Error adding iptables rule (for '" STR_FORMAT "'): %s (%s)",
-				STR_FMT(comment), err, strerror(errno));
+	memset(key + len, 0, 4);
+	memcpy(key + len, &port, 2);
+	return len + 4;
+}
+
+// builds one element message at the current position of the batch, without adding it to
+// the batch yet. without a key, this flushes the whole set.
+static int nft_batch_add(struct mnl_nlmsg_batch *b, int msg, const char *set_name,
+		const unsigned char *key, unsigned int key_len)
+{
+	struct nftnl_set *set = nftnl_set_alloc();
+	if (!set)
+		return -1;
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, rtpe_config.nftables_table);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, set_name);
+
+	if (key) {
+		struct nftnl_set_elem *e = nftnl_set_elem_alloc();
+		if (!e) {
+			nftnl_set_free(set);
+			return -1;
+		}
+		nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, key, key_len);
+		nftnl_set_elem_add(set, e);
+	}
 
+	struct nlmsghdr *nlh = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(b), msg, NFPROTO_INET,
+			(msg == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0) | NLM_F_ACK, nft_seq++);
+	nftnl_set_elems_nlmsg_build_payload(nlh, set);
+	nftnl_set_free(set);
 	return 0;
 }
 
+static void nft_drain(void) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	while (recv(mnl_socket_get_fd(nft_sock), buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
 
-static int __iptables_del_rule(const socket_t *local_sock) {
-	const char *err;
+// waits for all the acks of a transaction that was sent. returns 0 or an errno.
+static int nft_batch_recv(uint32_t first_seq, unsigned int num_msgs) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	unsigned int acks = 0;
+
+	while (acks < num_msgs) {
+		ssize_t ret = mnl_socket_recvfrom(nft_sock, buf, sizeof(buf));
+		if (ret < 0)
+			return errno;
+
+		int len = ret;
+		for (struct nlmsghdr *nlh = (void *) buf; mnl_nlmsg_ok(nlh, len);
+				nlh = mnl_nlmsg_next(nlh, &len))
+		{
+			if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_pid != nft_portid)
+				continue;
+			if (nlh->nlmsg_seq < first_seq)
+				continue; // left over from an earlier failed transaction
+			struct nlmsgerr *nle = mnl_nlmsg_get_payload(nlh);
+			if (nle->error) {
+				// the transaction was aborted: no more acks are coming
+				nft_drain();
+				return -nle->error;
+			}
+			acks++;
+		}
+	}
 
-	switch (local_sock->family->af) {
-		case AF_INET:
-			err = ip4tables_del_rule(local_sock);
-			break;
-		case AF_INET6:
-			err = ip6tables_del_rule(local_sock);
-			break;
-		default:
-			err = "unsupported socket family";
+	return 0;
+}
+
+// runs a transaction of the given ops, or of a single set flush if `ops` is NULL. as many
+// ops as fit into one batch are included, and their number is returned in `done`
+static int nft_transaction(struct iptables_op **ops, unsigned int num, const char *flush_set,
+		unsigned int *done)
+{
+	// the limit leaves room for the message that overflows it, and for the batch end
+	char buf[NFT_BATCH_OPS * 128 + MNL_SOCKET_BUFFER_SIZE];
+	struct mnl_nlmsg_batch *b = mnl_nlmsg_batch_start(buf, sizeof(buf) - MNL_SOCKET_BUFFER_SIZE);
+	unsigned int num_msgs = 0, i = 0;
+	struct nlmsghdr *end;
+	int ret = 0;
+
+	nftnl_batch_begin(mnl_nlmsg_batch_current(b), nft_seq++);
+	if (!mnl_nlmsg_batch_next(b))
+		goto nomem;
+
+	uint32_t first_seq = nft_seq;
+
+	if (flush_set) {
+		if (nft_batch_add(b, NFT_MSG_DELSETELEM, flush_set, NULL, 0))
+			goto nomem;
+		if (!mnl_nlmsg_batch_next(b))
+			goto nomem;
+		num_msgs++;
+	}
+
+	for (i = 0; i < num; i++) {
+		unsigned char key[20];
+		const char *set;
+		unsigned int key_len = nft_fill_key(key, &ops[i]->local, &set);
+		if (!key_len)
+			continue;
+		uint32_t seq = nft_seq;
+		if (nft_batch_add(b, ops[i]->del ? NFT_MSG_DELSETELEM : NFT_MSG_NEWSETELEM, set, key, key_len))
+			goto nomem;
+		if (!mnl_nlmsg_batch_next(b)) {
+			// full: this one goes into the next transaction
+			nft_seq = seq;
+			if (!num_msgs)
+				goto nomem;
 			break;
-	};
+		}
+		num_msgs++;
+	}
 
-	if (err)
-		ilog(LOG_ERROR, "Error deleting iptables rule: %s (%s)",
-				err, strerror(errno));
+	// the batch end takes the place of an overflowing message, if there was one. it's not
+	// subject to the limit, so it's added to the size here
+	end = nftnl_batch_end(mnl_nlmsg_batch_current(b), nft_seq++);
 
-	return 0;
+	if (num_msgs) {
+		if (mnl_socket_sendto(nft_sock, mnl_nlmsg_batch_head(b),
+					mnl_nlmsg_batch_size(b) + end->nlmsg_len) < 0)
+			ret = errno;
+		else
+			ret = nft_batch_recv(first_seq, num_msgs);
+	}
+	mnl_nlmsg_batch_stop(b);
+	if (done)
+		*done = i;
+	return ret;
+
+nomem:
+	mnl_nlmsg_batch_stop(b);
+	if (done)
+		*done = num;
+	return ENOMEM;
 }
 
-#endif // WITH_IPTABLES_OPTION
+static void nft_op_error(struct iptables_op *op, int err) {
+	if (op->del)
+		ilog(LOG_ERROR, "Error deleting nftables set element: %s", strerror(err));
+	else
+		ilog(LOG_ERROR, "Error adding nftables set element (for '" STR_FORMAT "'): %s",
+				STR_FMT0(op->comment), strerror(err));
+}
+
+static void nft_commit(GQueue *ops) {
+	struct iptables_op *batch[NFT_BATCH_OPS];
+	unsigned int num_ops = ops->length;
+
+	while (ops->length) {
+		unsigned int num = 0, done;
+		while (num < NFT_BATCH_OPS && ops->length)
+			batch[num++] = g_queue_pop_head(ops);
+
+		// more than one transaction if they don't all fit into one batch
+		for (unsigned int off = 0; off < num; off += done) {
+			int err = nft_transaction(batch + off, num - off, NULL, &done);
+			if (err && done > 1) {
+				// a single failed op (e.g. a deleted element that was already gone) aborts
+				// the whole transaction, so fall back to applying them one by one
+				ilog(LOG_DEBUG, "nftables transaction of %u ops failed (%s), retrying "
+						"individually", done, strerror(err));
+				for (unsigned int i = off; i < off + done; i++) {
+					err = nft_transaction(&batch[i], 1, NULL, NULL);
+					if (err)
+						nft_op_error(batch[i], err);
+				}
+			}
+			else if (err)
+				nft_op_error(batch[off], err);
+		}
+
+		for (unsigned int i = 0; i < num; i++)
+			iptables_op_free(batch[i]);
+	}
+
+	ilog(LOG_DEBUG, "Committed %u nftables changes", num_ops);
+}
+
+static void nft_init(void) {
+	nft_sock = mnl_socket_open(NETLINK_NETFILTER);
+	if (!nft_sock)
+		die("Failed to open netfilter netlink socket: %s", strerror(errno));
+	if (mnl_socket_bind(nft_sock, 0, MNL_SOCKET_AUTOPID) < 0)
+		die("Failed to bind netfilter netlink socket: %s", strerror(errno));
+	nft_portid = mnl_socket_get_portid(nft_sock);
+	nft_seq = time(NULL);
+
+	iptables_commit = nft_commit;
+	iptables_add_rule = __iptables_add_rule;
+	iptables_del_rule = __iptables_del_rule;
+
+	// flush sets
+	int err = nft_transaction(NULL, 0, rtpe_config.nftables_set4, NULL);
+	if (err)
+		ilog(LOG_ERROR, "Failed to flush nftables set '%s' in table '%s': %s",
+				rtpe_config.nftables_set4, rtpe_config.nftables_table, strerror(err));
+	err = nft_transaction(NULL, 0, rtpe_config.nftables_set6, NULL);
+	if (err)
+		ilog(LOG_ERROR, "Failed to flush nftables set '%s' in table '%s': %s",
+				rtpe_config.nftables_set6, rtpe_config.nftables_table, strerror(err));
+}
+
+#endif // WITH_NFTABLES_OPTION
+
 
 static int __iptables_stub(void) {
 	return 0;
@@ -315,16 +577,26 @@ static int __iptables_stub(void) {
 void iptables_init(void) {
 	if (rtpe_config.iptables_chain && !rtpe_config.iptables_chain[0])
 		rtpe_config.iptables_chain = NULL;
+	if (rtpe_config.nftables_table && !rtpe_config.nftables_table[0])
+		rtpe_config.nftables_table = NULL;
+
+	iptables_add_rule = (void *) __iptables_stub;
+	iptables_del_rule = (void *) __iptables_stub;
 
-	if (!rtpe_config.iptables_chain) {
-		iptables_add_rule = (void *) __iptables_stub;
-		iptables_del_rule = (void *) __iptables_stub;
+#ifdef WITH_NFTABLES_OPTION
+	if (rtpe_config.nftables_table) {
+		nft_init();
 		return;
 	}
+#endif
+
+	if (!rtpe_config.iptables_chain)
+		return;
 
 #ifdef WITH_IPTABLES_OPTION
 
 	mutex_init(&__xt_lock);
+	iptables_commit = ip46tables_commit;
 	iptables_add_rule = __iptables_add_rule;
 	iptables_del_rule = __iptables_del_rule;
 
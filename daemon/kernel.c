@@ -24,6 +24,28 @@
 
 struct kernel_interface kernel;
 
+// per-thread accumulation of kernel operations, see kernel_batch_start()
+static __thread unsigned int batch_depth;
+static __thread unsigned int batch_num;
+static __thread struct rtpengine_message *batch_msg;
+
+// targets with an add, update or delete waiting in some thread's batch. the batch itself only
+// holds a placeholder, the operation to execute is kept here (as a copy, coalesced per target),
+// so that another thread which must touch the same target can execute it on the owner's
+// behalf instead of being overtaken by it later. the lock is never held across a syscall
+struct kernel_pending {
+	struct rtpengine_batch_entry e;
+	const void *owner;	// &batch_num of the owning thread
+	int in_flight;		// being executed by the owner, can't be taken over
+};
+static mutex_t kernel_pending_lock = MUTEX_STATIC_INIT;
+static cond_t kernel_pending_cond = COND_STATIC_INIT;
+static GHashTable *kernel_pending; // struct re_address -> struct kernel_pending
+static int kernel_pending_num; // atomic, lets the common case skip the lock
+
+#define BATCH_ENTRIES(m) ((struct rtpengine_batch_entry *) ((m) + 1))
+#define BATCH_OWNER ((const void *) &batch_num)
+
 
 
 
@@ -120,43 +142,352 @@ int kernel_setup_table(unsigned int id) {
 }
 
 
-int kernel_add_stream(struct rtpengine_target_info *mti, int update) {
+static guint re_address_hash(gconstpointer p) {
+	const struct re_address *a = p;
+	guint ret = a->family ^ (a->port << 16);
+	for (int i = 0; i < (a->family == AF_INET6 ? 4 : 1); i++)
+		ret ^= a->u.u32[i];
+	return ret;
+}
+
+static gboolean re_address_eq(gconstpointer p, gconstpointer q) {
+	const struct re_address *a = p, *b = q;
+	if (a->family != b->family || a->port != b->port)
+		return FALSE;
+	if (a->family == AF_INET6)
+		return !memcmp(a->u.ipv6, b->u.ipv6, sizeof(a->u.ipv6));
+	return a->u.ipv4 == b->u.ipv4;
+}
+
+static void kernel_pending_free(void *p) {
+	g_slice_free1(sizeof(struct kernel_pending), p);
+}
+
+static int kernel_is_target_op(unsigned int cmd) {
+	return cmd == REMG_ADD || cmd == REMG_UPDATE || cmd == REMG_DEL;
+}
+
+
+/* returns 0 or a negative errno, like the kernel does for each entry of a batch */
+static int __kernel_batch_single(const struct rtpengine_batch_entry *e) {
 	struct rtpengine_message msg;
 	int ret;
 
-	if (!kernel.is_open)
-		return -1;
-
-	msg.cmd = update ? REMG_UPDATE : REMG_ADD;
-	msg.u.target = *mti;
+	ZERO(msg);
+	msg.cmd = e->cmd;
+	switch (e->cmd) {
+		case REMG_DEL_CALL:
+			msg.u.call = e->u.call;
+			break;
+		case REMG_DEL_STREAM:
+			msg.u.stream = e->u.stream;
+			break;
+		default:
+			msg.u.target = e->u.target;
+			break;
+	}
 
 	// coverity[uninit_use_in_call : FALSE]
 	ret = write(kernel.fd, &msg, sizeof(msg));
 	if (ret > 0)
 		return 0;
+	return -errno;
+}
+
+/* logs a failed operation. returns -1 if it did fail */
+static int kernel_batch_result(struct rtpengine_batch_entry *e, int result) {
+	if (result == -EEXIST && e->cmd == REMG_ADD) {
+		// a leftover from a delete that failed earlier: replace it
+		e->cmd = REMG_UPDATE;
+		result = __kernel_batch_single(e);
+		e->cmd = REMG_ADD;
+	}
+	else if (result == -ENOENT && e->cmd == REMG_DEL) {
+		// the delete was coalesced with an add that hadn't been executed yet
+		result = 0;
+	}
 
-	ilog(LOG_ERROR, "Failed to push relay stream to kernel: %s", strerror(errno));
+	if (!result)
+		return 0;
+	ilog(LOG_ERROR, "Failed to execute kernel operation %u: %s", e->cmd, strerror(-result));
 	return -1;
 }
 
+static int kernel_batch_single(struct rtpengine_batch_entry *e) {
+	return kernel_batch_result(e, __kernel_batch_single(e));
+}
 
-int kernel_del_stream(const struct re_address *a) {
-	struct rtpengine_message msg;
+/* replaces the pending placeholders in our batch with the operations to execute, and drops
+ * the ones that another thread has taken over */
+static void __kernel_batch_claim(void) {
+	unsigned int i, j;
+	struct rtpengine_batch_entry *e, *entries = BATCH_ENTRIES(batch_msg);
+	struct kernel_pending *p;
+
+	mutex_lock(&kernel_pending_lock);
+	for (i = 0, j = 0; i < batch_num; i++) {
+		e = &entries[i];
+		if (kernel_is_target_op(e->cmd)) {
+			p = kernel_pending ? g_hash_table_lookup(kernel_pending, &e->u.target.local) : NULL;
+			// already claimed through an earlier placeholder for the same target?
+			if (!p || p->owner != BATCH_OWNER || p->in_flight)
+				continue;
+			*e = p->e;
+			p->in_flight = 1;
+		}
+		if (i != j)
+			entries[j] = *e;
+		j++;
+	}
+	batch_num = j;
+	mutex_unlock(&kernel_pending_lock);
+}
+
+/* takes our executed operations out of the pending table */
+static void __kernel_batch_release(void) {
+	unsigned int i;
+	struct rtpengine_batch_entry *e;
+	struct kernel_pending *p;
+
+	mutex_lock(&kernel_pending_lock);
+	for (i = 0; i < batch_num; i++) {
+		e = &BATCH_ENTRIES(batch_msg)[i];
+		if (!kernel_is_target_op(e->cmd) || !kernel_pending)
+			continue;
+		p = g_hash_table_lookup(kernel_pending, &e->u.target.local);
+		if (!p || p->owner != BATCH_OWNER)
+			continue;
+		g_hash_table_remove(kernel_pending, &e->u.target.local);
+		g_atomic_int_add(&kernel_pending_num, -1);
+	}
+	cond_broadcast(&kernel_pending_cond);
+	mutex_unlock(&kernel_pending_lock);
+}
+
+/* returns the number of failed operations */
+static unsigned int __kernel_batch_flush(void) {
+	unsigned int i, failed = 0;
+	size_t len;
 	int ret;
+	struct rtpengine_batch_entry *e;
+
+	if (!batch_num)
+		return 0;
+
+	__kernel_batch_claim();
+	if (!batch_num)
+		return 0;
+
+	if (!kernel.is_open) {
+		failed = batch_num;
+		goto out;
+	}
+	if (kernel.no_batch)
+		goto single;
+
+	len = sizeof(*batch_msg) + batch_num * sizeof(*e);
+	ZERO(*batch_msg);
+	batch_msg->cmd = REMG_BATCH;
+	batch_msg->u.batch.num_entries = batch_num;
+
+	// reading from the control file makes the kernel return the results
+	ret = read(kernel.fd, batch_msg, len);
+	if (ret == len) {
+		for (i = 0; i < batch_num; i++) {
+			e = &BATCH_ENTRIES(batch_msg)[i];
+			if (kernel_batch_result(e, e->result))
+				failed++;
+		}
+	}
+	else if (errno == EINVAL) {
+		// older kernel module without batch support: fall back to one write per entry
+		ilog(LOG_WARNING, "Kernel module doesn't support batched operations, falling back to "
+				"individual writes");
+		kernel.no_batch = 1;
+single:
+		for (i = 0; i < batch_num; i++) {
+			if (kernel_batch_single(&BATCH_ENTRIES(batch_msg)[i]))
+				failed++;
+		}
+	}
+	else {
+		ilog(LOG_ERROR, "Failed to push batch of %u operations to kernel: %s", batch_num,
+				strerror(errno));
+		failed = batch_num;
+	}
+
+out:
+	__kernel_batch_release();
+	batch_num = 0;
+	return failed;
+}
+
+/* returns an entry to fill in if batching is active, or NULL otherwise. a full batch is flushed
+ * first, which must not happen with the pending lock held, see kernel_target_op() */
+static struct rtpengine_batch_entry *kernel_batch_entry(unsigned int cmd) {
+	struct rtpengine_batch_entry *e;
+
+	if (!batch_depth || kernel.no_batch)
+		return NULL;
+
+	if (!batch_msg)
+		batch_msg = g_malloc(sizeof(*batch_msg) + RTPENGINE_MAX_BATCH * sizeof(*e));
+	if (batch_num >= RTPENGINE_MAX_BATCH)
+		__kernel_batch_flush();
+
+	e = &BATCH_ENTRIES(batch_msg)[batch_num++];
+	ZERO(*e);
+	e->cmd = cmd;
+	return e;
+}
+
+static int kernel_batch_flush(void) {
+	return __kernel_batch_flush() ? -1 : 0;
+}
+
+// operations that return a result synchronously must see all previous operations applied.
+// returns -1 if any of the queued operations failed
+int kernel_batch_sync(void) {
+	return kernel_batch_flush();
+}
+
+void kernel_batch_start(void) {
+	batch_depth++;
+}
+
+// returns -1 if any of the queued operations failed
+int kernel_batch_end(void) {
+	if (!batch_depth)
+		return 0;
+	if (--batch_depth)
+		return 0;
+	return kernel_batch_flush();
+}
+
+
+/* a later operation on a target replaces an earlier one that is still pending */
+static void kernel_pending_coalesce(struct rtpengine_batch_entry *p, const struct rtpengine_batch_entry *e) {
+	unsigned int cmd = e->cmd;
+
+	// an update of a target that is yet to be (re-)added is still an add
+	if (cmd == REMG_UPDATE && p->cmd != REMG_UPDATE)
+		cmd = REMG_ADD;
+	*p = *e;
+	p->cmd = cmd;
+}
+
+/* adds, updates and deletes are queued if batching is active, otherwise executed right away.
+ * in both cases, an operation for the same target that's still waiting in another thread's
+ * batch is executed first: the caller holds the lock that the other thread held when it
+ * queued it, so it was meant to happen before ours. if "last" is given, the operation (a
+ * delete) is never queued and the final state of the target is returned in it */
+static int kernel_target_op(unsigned int cmd, const struct rtpengine_target_info *ti,
+		struct rtpengine_target_info *last)
+{
+	struct rtpengine_batch_entry e, takeover;
+	struct rtpengine_message msg;
+	struct kernel_pending *p = NULL;
+	int batched;
 
 	if (!kernel.is_open)
 		return -1;
 
-	ZERO(msg);
-	msg.cmd = REMG_DEL;
-	msg.u.target.local = *a;
+	ZERO(e);
+	e.cmd = cmd;
+	e.u.target = *ti;
+	takeover.cmd = REMG_NOOP;
 
-	ret = write(kernel.fd, &msg, sizeof(msg));
-	if (ret > 0)
+	// anything that we have queued ourselves must come first
+	if (last) {
+		ZERO(*last);
+		kernel_batch_sync();
+	}
+
+	batched = !last && batch_depth && !kernel.no_batch;
+	// make sure that kernel_batch_entry() below won't have to flush
+	if (batched && batch_num >= RTPENGINE_MAX_BATCH)
+		__kernel_batch_flush();
+
+	if (!batched && !g_atomic_int_get(&kernel_pending_num))
+		goto execute;
+
+	mutex_lock(&kernel_pending_lock);
+
+	if (kernel_pending)
+		p = g_hash_table_lookup(kernel_pending, &ti->local);
+	// the owner is in the middle of executing it, which completes without taking any locks
+	while (p && p->in_flight && p->owner != BATCH_OWNER) {
+		cond_wait(&kernel_pending_cond, &kernel_pending_lock);
+		p = g_hash_table_lookup(kernel_pending, &ti->local);
+	}
+	if (p && p->owner != BATCH_OWNER) {
+		takeover = p->e;
+		g_hash_table_remove(kernel_pending, &ti->local);
+		g_atomic_int_add(&kernel_pending_num, -1);
+		p = NULL;
+	}
+
+	if (batched) {
+		if (p)
+			kernel_pending_coalesce(&p->e, &e);
+		else {
+			if (!kernel_pending)
+				kernel_pending = g_hash_table_new_full(re_address_hash, re_address_eq,
+						NULL, kernel_pending_free);
+			p = g_slice_alloc0(sizeof(*p));
+			p->e = e;
+			p->owner = BATCH_OWNER;
+			g_hash_table_insert(kernel_pending, &p->e.u.target.local, p);
+			g_atomic_int_inc(&kernel_pending_num);
+			// placeholder, filled in from the pending table when flushing
+			kernel_batch_entry(cmd)->u.target.local = ti->local;
+		}
+	}
+
+	mutex_unlock(&kernel_pending_lock);
+
+	if (takeover.cmd != REMG_NOOP)
+		kernel_batch_single(&takeover);
+	if (batched)
 		return 0;
 
-	ilog(LOG_ERROR, "Failed to delete relay stream from kernel: %s", strerror(errno));
-	return -1;
+execute:
+	if (!last)
+		return kernel_batch_single(&e);
+
+	// reading makes the kernel return the target as it was when it was deleted. an older
+	// kernel module returns it unchanged, i.e. as zeroes
+	ZERO(msg);
+	msg.cmd = cmd;
+	msg.u.target = e.u.target;
+	if (read(kernel.fd, &msg, sizeof(msg)) == sizeof(msg)) {
+		*last = msg.u.target;
+		return 0;
+	}
+	return kernel_batch_result(&e, -errno);
+}
+
+// when batching, failures are only reported by kernel_batch_end() or kernel_batch_sync()
+int kernel_add_stream(struct rtpengine_target_info *mti, int update) {
+	return kernel_target_op(update ? REMG_UPDATE : REMG_ADD, mti, NULL);
+}
+
+
+int kernel_del_stream(const struct re_address *a) {
+	struct rtpengine_target_info ti;
+
+	ZERO(ti);
+	ti.local = *a;
+	return kernel_target_op(REMG_DEL, &ti, NULL);
+}
+
+// never batched. the final state of the deleted target is returned in "last"
+int kernel_del_stream_last(const struct re_address *a, struct rtpengine_target_info *last) {
+	struct rtpengine_target_info ti;
+
+	ZERO(ti);
+	ti.local = *a;
+	return kernel_target_op(REMG_DEL, &ti, last);
 }
 
 GList *kernel_list() {
@@ -169,6 +500,8 @@ GList *kernel_list() {
 	if (!kernel.is_open)
 		return NULL;
 
+	kernel_batch_sync();
+
 	sprintf(str, PREFIX "/%u/blist", kernel.table);
 	fd = open(str, O_RDONLY);
 	if (fd == -1)
@@ -196,6 +529,8 @@ unsigned int kernel_add_call(const char *id) {
 	if (!kernel.is_open)
 		return UNINIT_IDX;
 
+	kernel_batch_sync();
+
 	ZERO(msg);
 	msg.cmd = REMG_ADD_CALL;
 	snprintf(msg.u.call.call_id, sizeof(msg.u.call.call_id), "%s", id);
@@ -208,11 +543,17 @@ unsigned int kernel_add_call(const char *id) {
 
 int kernel_del_call(unsigned int idx) {
 	struct rtpengine_message msg;
+	struct rtpengine_batch_entry *e;
 	int ret;
 
 	if (!kernel.is_open)
 		return -1;
 
+	if ((e = kernel_batch_entry(REMG_DEL_CALL))) {
+		e->u.call.call_idx = idx;
+		return 0;
+	}
+
 	ZERO(msg);
 	msg.cmd = REMG_DEL_CALL;
 	msg.u.call.call_idx = idx;
@@ -230,6 +571,8 @@ unsigned int kernel_add_intercept_stream(unsigned int call_idx, const char *id)
 	if (!kernel.is_open)
 		return UNINIT_IDX;
 
+	kernel_batch_sync();
+
 	ZERO(msg);
 	msg.cmd = REMG_ADD_STREAM;
 	msg.u.stream.call_idx = call_idx;
@@ -28,6 +28,7 @@
 #include "dtls.h"
 #include "call_interfaces.h"
 #include "cli.h"
+#include "metrics.h"
 #include "graphite.h"
 #include "ice.h"
 #include "socket.h"
@@ -69,6 +70,9 @@ struct rtpengine_config rtpe_config = {
 	.rec_method = "pcap",
 	.rec_format = "raw",
 	.media_num_threads = -1,
+	.ng_queue_size = 1000,
+	.nftables_set4 = "rtpengine4",
+	.nftables_set6 = "rtpengine6",
 };
 
 
@@ -291,6 +295,7 @@ static void options(int *argc, char ***argv) {
 	char *listenudps = NULL;
 	char *listenngs = NULL;
 	char *listencli = NULL;
+	char *listenmetrics = NULL;
 	char *graphitep = NULL;
 	char *graphite_prefix_s = NULL;
 	char *redisps = NULL;
@@ -299,6 +304,7 @@ static void options(int *argc, char ***argv) {
 	char *log_facility_rtcp_s = NULL;
 	char *log_facility_dtmf_s = NULL;
 	char *log_format = NULL;
+	char *kernel_rtcp_mark_s = NULL;
 	int sip_source = 0;
 	char *homerp = NULL;
 	char *homerproto = NULL;
@@ -310,12 +316,15 @@ static void options(int *argc, char ***argv) {
 	GOptionEntry e[] = {
 		{ "table",	't', 0, G_OPTION_ARG_INT,	&rtpe_config.kernel_table,		"Kernel table to use",		"INT"		},
 		{ "no-fallback",'F', 0, G_OPTION_ARG_NONE,	&rtpe_config.no_fallback,	"Only start when kernel module is available", NULL },
+		{ "kernel-rtcp-sample",0,0,G_OPTION_ARG_INT,	&rtpe_config.kernel_rtcp_sample,	"Forward RTCP in kernel, passing every Nth packet to the daemon",	"INT"	},
+		{ "kernel-rtcp-sample-mark",0,0,G_OPTION_ARG_STRING,	&kernel_rtcp_mark_s,	"Packet mark bits for sampled RTCP",	"MARK[/MASK]"	},
 		{ "interface",	'i', 0, G_OPTION_ARG_STRING_ARRAY,&if_a,	"Local interface for RTP",	"[NAME/]IP[!IP]"},
 		{ "subscribe-keyspace", 'k', 0, G_OPTION_ARG_STRING_ARRAY,&ks_a,	"Subscription keyspace list",	"INT INT ..."},
 		{ "listen-tcp",	'l', 0, G_OPTION_ARG_STRING,	&listenps,	"TCP port to listen on",	"[IP:]PORT"	},
 		{ "listen-udp",	'u', 0, G_OPTION_ARG_STRING,	&listenudps,	"UDP port to listen on",	"[IP46|HOSTNAME:]PORT"	},
 		{ "listen-ng",	'n', 0, G_OPTION_ARG_STRING,	&listenngs,	"UDP port to listen on, NG protocol", "[IP46|HOSTNAME:]PORT"	},
 		{ "listen-cli", 'c', 0, G_OPTION_ARG_STRING,    &listencli,     "UDP port to listen on, CLI",   "[IP46|HOSTNAME:]PORT"     },
+		{ "listen-metrics",0,0, G_OPTION_ARG_STRING,	&listenmetrics,	"TCP port to serve Prometheus metrics on",	"[IP46|HOSTNAME:]PORT"	},
 		{ "graphite", 'g', 0, G_OPTION_ARG_STRING,    &graphitep,     "Address of the graphite server",   "IP46|HOSTNAME:PORT"     },
 		{ "graphite-interval",  'G', 0, G_OPTION_ARG_INT,    &rtpe_config.graphite_interval,  "Graphite send interval in seconds",    "INT"   },
 		{ "graphite-prefix",0,  0,	G_OPTION_ARG_STRING, &graphite_prefix_s, "Prefix for graphite line", "STRING"},
@@ -327,6 +336,7 @@ static void options(int *argc, char ***argv) {
 		{ "offer-timeout",0,0,	G_OPTION_ARG_INT,	&rtpe_config.offer_timeout,	"Timeout for incomplete one-sided calls",	"SECS"		},
 		{ "port-min",	'm', 0, G_OPTION_ARG_INT,	&rtpe_config.port_min,	"Lowest port to use for RTP",	"INT"		},
 		{ "port-max",	'M', 0, G_OPTION_ARG_INT,	&rtpe_config.port_max,	"Highest port to use for RTP",	"INT"		},
+		{ "port-pool-size",0,0,	G_OPTION_ARG_INT,	&rtpe_config.port_pool_size,"Number of pre-opened RTP/RTCP port pairs to keep ready per interface","INT"	},
 		{ "redis",	'r', 0, G_OPTION_ARG_STRING,	&redisps,	"Connect to Redis database",	"[PW@]IP:PORT/INT"	},
 		{ "redis-write",'w', 0, G_OPTION_ARG_STRING,    &redisps_write, "Connect to Redis write database",      "[PW@]IP:PORT/INT"       },
 		{ "redis-num-threads", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_num_threads, "Number of Redis restore threads",      "INT"       },
@@ -344,6 +354,9 @@ static void options(int *argc, char ***argv) {
 		{ "xmlrpc-format",'x', 0, G_OPTION_ARG_INT,	&rtpe_config.fmt,	"XMLRPC timeout request format to use. 0: SEMS DI, 1: call-id only, 2: Kamailio",	"INT"	},
 		{ "num-threads",  0, 0, G_OPTION_ARG_INT,	&rtpe_config.num_threads,	"Number of worker threads to create",	"INT"	},
 		{ "media-num-threads",  0, 0, G_OPTION_ARG_INT,	&rtpe_config.media_num_threads,	"Number of worker threads for media playback",	"INT"	},
+		{ "ng-num-threads",  0, 0, G_OPTION_ARG_INT,	&rtpe_config.ng_num_threads,	"Number of worker threads for NG commands",	"INT"	},
+		{ "ng-queue-size",  0, 0, G_OPTION_ARG_INT,	&rtpe_config.ng_queue_size,	"Max number of NG commands waiting for a worker thread",	"INT"	},
+		{ "packet-timing-sample",0,0,G_OPTION_ARG_INT,	&rtpe_config.packet_timing_sample,	"Time the processing stages of every Nth media packet",	"INT"	},
 		{ "delete-delay",  'd', 0, G_OPTION_ARG_INT,    &rtpe_config.delete_delay,  "Delay for deleting a session from memory.",    "INT"   },
 		{ "sip-source",  0,  0, G_OPTION_ARG_NONE,	&sip_source,	"Use SIP source address by default",	NULL	},
 		{ "dtls-passive", 0, 0, G_OPTION_ARG_NONE,	&dtls_passive_def,"Always prefer DTLS passive role",	NULL	},
@@ -359,6 +372,11 @@ static void options(int *argc, char ***argv) {
 		{ "recording-format",0, 0, G_OPTION_ARG_STRING,	&rtpe_config.rec_format,	"File format for stored pcap files",	"raw|eth"	},
 #ifdef WITH_IPTABLES_OPTION
 		{ "iptables-chain",0,0,	G_OPTION_ARG_STRING,	&rtpe_config.iptables_chain,"Add explicit firewall rules to this iptables chain","STRING" },
+#endif
+#ifdef WITH_NFTABLES_OPTION
+		{ "nftables-table",0,0,	G_OPTION_ARG_STRING,	&rtpe_config.nftables_table,"Add open ports to sets in this nftables table (inet family)","STRING" },
+		{ "nftables-set4",0,0,	G_OPTION_ARG_STRING,	&rtpe_config.nftables_set4,"Name of nftables set for IPv4 ports","STRING" },
+		{ "nftables-set6",0,0,	G_OPTION_ARG_STRING,	&rtpe_config.nftables_set6,"Name of nftables set for IPv6 ports","STRING" },
 #endif
 		{ "codecs",	0, 0,	G_OPTION_ARG_NONE,	&codecs,		"Print a list of supported codecs and exit",	NULL },
 		{ "scheduling",	0, 0,	G_OPTION_ARG_STRING,	&rtpe_config.scheduling,"Thread scheduling policy",	"default|none|fifo|rr|other|batch|idle" },
@@ -371,6 +389,8 @@ static void options(int *argc, char ***argv) {
 		{ "mysql-user",	0,   0,	G_OPTION_ARG_STRING,	&rtpe_config.mysql_user,"MySQL connection credentials",		"USERNAME"	},
 		{ "mysql-pass",	0,   0,	G_OPTION_ARG_STRING,	&rtpe_config.mysql_pass,"MySQL connection credentials",		"PASSWORD"	},
 		{ "mysql-query",0,   0,	G_OPTION_ARG_STRING,	&rtpe_config.mysql_query,"MySQL select query",			"STRING"	},
+		{ "mysql-threads",0, 0,	G_OPTION_ARG_INT,	&rtpe_config.mysql_threads,"Number of threads for MySQL media retrieval","INT"	},
+		{ "media-cache-size",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_cache_size,"Max memory for cached encoded media playback in MB","INT"	},
 		{ NULL, }
 	};
 
@@ -403,6 +423,17 @@ static void options(int *argc, char ***argv) {
 	if (!rtpe_config.interfaces.length)
 		die("Cannot start without any configured interfaces");
 
+	if (kernel_rtcp_mark_s) {
+		rtpe_config.kernel_rtcp_mark = strtoul(kernel_rtcp_mark_s, &endptr, 0);
+		rtpe_config.kernel_rtcp_mark_mask = 0xffffffff;
+		if (*endptr == '/')
+			rtpe_config.kernel_rtcp_mark_mask = strtoul(endptr + 1, &endptr, 0);
+		// unsampled packets must not match, so some bit must be set
+		if (*endptr || !rtpe_config.kernel_rtcp_mark
+				|| (rtpe_config.kernel_rtcp_mark & ~rtpe_config.kernel_rtcp_mark_mask))
+			die("Invalid packet mark '%s' (--kernel-rtcp-sample-mark)", kernel_rtcp_mark_s);
+	}
+
 	if (ks_a) {
 		for (iter = ks_a; *iter; iter++) {
 			str_keyspace_db.s = *iter;
@@ -437,6 +468,11 @@ static void options(int *argc, char ***argv) {
 	    die("Invalid IP or port '%s' (--listen-cli)", listencli);
 	}
 
+	if (listenmetrics) {
+		if (endpoint_parse_any_getaddrinfo(&rtpe_config.metrics_listen_ep, listenmetrics))
+			die("Invalid IP or port '%s' (--listen-metrics)", listenmetrics);
+	}
+
 	if (graphitep) {if (endpoint_parse_any_getaddrinfo_full(&rtpe_config.graphite_ep, graphitep))
 	    die("Invalid IP or port '%s' (--graphite)", graphitep);
 	}
@@ -539,6 +575,10 @@ static void options(int *argc, char ***argv) {
 			die("Too many '%%' placeholders (%u) present in --mysql-query='%s'",
 					count, rtpe_config.mysql_query);
 	}
+
+	if (rtpe_config.iptables_chain && rtpe_config.iptables_chain[0]
+			&& rtpe_config.nftables_table && rtpe_config.nftables_table[0])
+		die("Cannot use both --iptables-chain and --nftables-table");
 }
 
 void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
@@ -560,6 +600,10 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	}
 
 	ini_rtpe_cfg->kernel_table = rtpe_config.kernel_table;
+	ini_rtpe_cfg->kernel_rtcp_sample = rtpe_config.kernel_rtcp_sample;
+	ini_rtpe_cfg->kernel_rtcp_mark = rtpe_config.kernel_rtcp_mark;
+	ini_rtpe_cfg->kernel_rtcp_mark_mask = rtpe_config.kernel_rtcp_mark_mask;
+	ini_rtpe_cfg->packet_timing_sample = rtpe_config.packet_timing_sample;
 	ini_rtpe_cfg->max_sessions = rtpe_config.max_sessions;
 	ini_rtpe_cfg->cpu_limit = rtpe_config.cpu_limit;
 	ini_rtpe_cfg->load_limit = rtpe_config.load_limit;
@@ -579,11 +623,14 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->no_fallback = rtpe_config.no_fallback;
 	ini_rtpe_cfg->port_min = rtpe_config.port_min;
 	ini_rtpe_cfg->port_max = rtpe_config.port_max;
+	ini_rtpe_cfg->port_pool_size = rtpe_config.port_pool_size;
 	ini_rtpe_cfg->redis_db = rtpe_config.redis_db;
 	ini_rtpe_cfg->redis_write_db = rtpe_config.redis_write_db;
 	ini_rtpe_cfg->no_redis_required = rtpe_config.no_redis_required;
 	ini_rtpe_cfg->num_threads = rtpe_config.num_threads;
 	ini_rtpe_cfg->media_num_threads = rtpe_config.media_num_threads;
+	ini_rtpe_cfg->ng_num_threads = rtpe_config.ng_num_threads;
+	ini_rtpe_cfg->ng_queue_size = rtpe_config.ng_queue_size;
 	ini_rtpe_cfg->fmt = rtpe_config.fmt;
 	ini_rtpe_cfg->log_format = rtpe_config.log_format;
 	ini_rtpe_cfg->redis_allowed_errors = rtpe_config.redis_allowed_errors;
@@ -597,6 +644,7 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->udp_listen_ep = rtpe_config.udp_listen_ep;
 	ini_rtpe_cfg->ng_listen_ep = rtpe_config.ng_listen_ep;
 	ini_rtpe_cfg->cli_listen_ep = rtpe_config.cli_listen_ep;
+	ini_rtpe_cfg->metrics_listen_ep = rtpe_config.metrics_listen_ep;
 	ini_rtpe_cfg->redis_ep = rtpe_config.redis_ep;
 	ini_rtpe_cfg->redis_write_ep = rtpe_config.redis_write_ep;
 	ini_rtpe_cfg->homer_ep = rtpe_config.homer_ep;
@@ -606,6 +654,9 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->redis_write_auth = g_strdup(rtpe_config.redis_write_auth);
 	ini_rtpe_cfg->spooldir = g_strdup(rtpe_config.spooldir);
 	ini_rtpe_cfg->iptables_chain = g_strdup(rtpe_config.iptables_chain);
+	ini_rtpe_cfg->nftables_table = g_strdup(rtpe_config.nftables_table);
+	ini_rtpe_cfg->nftables_set4 = g_strdup(rtpe_config.nftables_set4);
+	ini_rtpe_cfg->nftables_set6 = g_strdup(rtpe_config.nftables_set6);
 	ini_rtpe_cfg->rec_method = g_strdup(rtpe_config.rec_method);
 	ini_rtpe_cfg->rec_format = g_strdup(rtpe_config.rec_format);
 
@@ -650,6 +701,7 @@ static void create_everything(void) {
 	struct control_tcp *ct;
 	struct control_udp *cu;
 	struct cli *cl;
+	struct metrics *ml;
 	struct timeval tmp_tv;
 	struct timeval redis_start, redis_stop;
 	double redis_diff = 0;
@@ -663,6 +715,18 @@ static void create_everything(void) {
 		}
 		goto no_kernel;
 	}
+	// sampled RTCP must be told apart from RTCP that the kernel couldn't handle, which
+	// takes a packet mark. without one, RTCP is still forwarded in kernel, just not sampled
+	if (rtpe_config.kernel_rtcp_sample && rtpe_config.kernel_rtcp_mark_mask
+			&& !socket_rcvmark_supported())
+	{
+		ilog(LOG_WARN, "Packet marks can't be received on this system (SO_RCVMARK), "
+				"not sampling RTCP forwarded in kernel");
+		rtpe_config.kernel_rtcp_mark_mask = 0;
+	}
+	if (rtpe_config.kernel_rtcp_sample && !rtpe_config.kernel_rtcp_mark_mask)
+		ilog(LOG_NOTICE, "RTCP forwarded in kernel is not sampled (no --kernel-rtcp-sample-mark), "
+				"no RTCP statistics for kernelized streams");
 
 no_kernel:
 	rtpe_poller = poller_new();
@@ -678,6 +742,10 @@ no_kernel:
 	if (rtpe_config.max_sessions < -1) {
 		rtpe_config.max_sessions = -1;
 	}
+	if (rtpe_config.kernel_rtcp_sample < 0)
+		rtpe_config.kernel_rtcp_sample = 0;
+	if (rtpe_config.packet_timing_sample < 0)
+		rtpe_config.packet_timing_sample = 0;
 
 	if (rtpe_config.redis_num_threads < 1) {
 #ifdef _SC_NPROCESSORS_ONLN
@@ -719,6 +787,14 @@ no_kernel:
 	        die("Failed to open UDP CLI connection port");
 	}
 
+	ml = NULL;
+	if (rtpe_config.metrics_listen_ep.port) {
+		interfaces_exclude_port(rtpe_config.metrics_listen_ep.port);
+		ml = metrics_new(rtpe_poller, &rtpe_config.metrics_listen_ep);
+		if (!ml)
+			die("Failed to open TCP metrics port");
+	}
+
 	if (!is_addr_unspecified(&rtpe_config.redis_write_ep.address)) {
 		rtpe_redis_write = redis_new(&rtpe_config.redis_write_ep,
 				rtpe_config.redis_write_db, rtpe_config.redis_write_auth,
@@ -777,6 +853,7 @@ int main(int argc, char **argv) {
 	init_everything();
 	create_everything();
 	fill_initial_rtpe_cfg(&initial_rtpe_config);
+	log_async_start();
 
 	ilog(LOG_INFO, "Startup complete, version %s", RTPENGINE_VERSION);
 
@@ -792,6 +869,10 @@ int main(int argc, char **argv) {
 
 	thread_create_detach(ice_thread_run, NULL);
 
+	if (rtpe_config.port_pool_size > 0)
+		thread_create_detach_prio(socket_pool_loop, NULL, rtpe_config.idle_scheduling,
+				rtpe_config.idle_priority);
+
 	if (rtpe_config.num_threads < 1) {
 #ifdef _SC_NPROCESSORS_ONLN
 		rtpe_config.num_threads = sysconf( _SC_NPROCESSORS_ONLN ) + 3;
@@ -802,6 +883,14 @@ int main(int argc, char **argv) {
 
 	service_notify("READY=1\n");
 
+	// must be running before the pollers start handing over NG requests
+	if (rtpe_config.ng_num_threads > 0) {
+		control_ng_workers_init(rtpe_config.ng_num_threads, MAX(rtpe_config.ng_queue_size, 0));
+		for (idx = 0; idx < rtpe_config.ng_num_threads; ++idx)
+			thread_create_detach_prio(control_ng_worker_loop, GUINT_TO_POINTER(idx),
+					rtpe_config.scheduling, rtpe_config.priority);
+	}
+
 	for (idx = 0; idx < rtpe_config.num_threads; ++idx)
 		thread_create_detach_prio(poller_loop, rtpe_poller, rtpe_config.scheduling, rtpe_config.priority);
 
@@ -814,6 +903,15 @@ int main(int argc, char **argv) {
 		thread_create_detach_prio(send_timer_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
 	}
 
+#ifdef WITH_TRANSCODING
+	if (rtpe_config.mysql_host) {
+		if (rtpe_config.mysql_threads <= 0)
+			rtpe_config.mysql_threads = 2;
+		for (idx = 0; idx < rtpe_config.mysql_threads; ++idx)
+			thread_create_detach_prio(media_player_db_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
+	}
+#endif
+
 
 	while (!rtpe_shutdown) {
 		usleep(100000);
@@ -831,5 +929,7 @@ int main(int argc, char **argv) {
 
 	ilog(LOG_INFO, "Version %s shutting down", RTPENGINE_VERSION);
 
+	log_async_stop();
+
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include "media_player.h"
 #include <glib.h>
+#include <sys/stat.h>
 #ifdef WITH_TRANSCODING
 #include <mysql.h>
 #include <mysql/errmsg.h>
@@ -23,13 +24,163 @@
 
 
 #ifdef WITH_TRANSCODING
+// one encoded RTP payload as produced by the packetizer
+struct media_cache_frame {
+	uint32_t ts; // RTP TS offset from the first frame
+	uint32_t offset; // into media_cache_entry->data
+	uint16_t len;
+	uint8_t marker;
+};
+
+// fully encoded media, keyed by source, output codec and ptime. immutable once
+// it has been inserted into the cache
+struct media_cache_entry {
+	struct obj obj;
+	char *key;
+	GList link; // LRU position
+	GArray *frames;
+	GString *data;
+	unsigned int clock_rate;
+	unsigned long duration; // in milliseconds
+	size_t size;
+};
+
+static struct {
+	mutex_t lock;
+	GHashTable *entries;
+	GQueue lru; // most recently used first
+	size_t size;
+	size_t max_size;
+	atomic64 hits;
+	atomic64 misses;
+	atomic64 evictions;
+} media_cache;
+
+// pending media_player_play_db() requests
+struct media_player_db_job {
+	struct media_player *mp;
+	unsigned int gen;
+	long long id;
+};
+
 static struct timerthread media_player_thread;
-static MYSQL __thread *mysql_conn;
+
+static mutex_t db_jobs_lock = MUTEX_STATIC_INIT;
+static cond_t db_jobs_cond = COND_STATIC_INIT;
+static GQueue db_jobs = G_QUEUE_INIT;
+static mutex_t db_pool_lock = MUTEX_STATIC_INIT;
+static GQueue db_pool = G_QUEUE_INIT; // idle connections
 #endif
 static struct timerthread send_timer_thread;
 
 
 
+#ifdef WITH_TRANSCODING
+static void __media_cache_entry_free(void *p) {
+	struct media_cache_entry *e = p;
+	g_free(e->key);
+	g_array_free(e->frames, TRUE);
+	g_string_free(e->data, TRUE);
+}
+
+static struct media_cache_entry *media_cache_entry_new(char *key, const struct rtp_payload_type *pt) {
+	struct media_cache_entry *e = obj_alloc0("media_cache_entry", sizeof(*e), __media_cache_entry_free);
+	e->key = key;
+	e->link.data = e;
+	e->frames = g_array_new(FALSE, FALSE, sizeof(struct media_cache_frame));
+	e->data = g_string_new(NULL);
+	e->clock_rate = pt->clock_rate;
+	return e;
+}
+
+// media_cache.lock must be held
+static void __media_cache_evict(size_t needed) {
+	while (media_cache.lru.tail && media_cache.size + needed > media_cache.max_size) {
+		struct media_cache_entry *e = media_cache.lru.tail->data;
+		ilog(LOG_DEBUG, "Evicting '%s' from media cache", e->key);
+		g_queue_unlink(&media_cache.lru, &e->link);
+		g_hash_table_remove(media_cache.entries, e->key);
+		media_cache.size -= e->size;
+		atomic64_inc(&media_cache.evictions);
+		obj_put(e);
+	}
+}
+
+// consumes the reference
+static void media_cache_insert(struct media_cache_entry *e) {
+	e->size = sizeof(*e) + strlen(e->key) + e->data->len
+		+ e->frames->len * sizeof(struct media_cache_frame);
+	if (!e->frames->len || e->size > media_cache.max_size) {
+		obj_put(e);
+		return;
+	}
+
+	mutex_lock(&media_cache.lock);
+	if (g_hash_table_lookup(media_cache.entries, e->key)) {
+		// another player finished encoding the same media first
+		mutex_unlock(&media_cache.lock);
+		obj_put(e);
+		return;
+	}
+	__media_cache_evict(e->size);
+	g_hash_table_insert(media_cache.entries, e->key, e);
+	g_queue_push_head_link(&media_cache.lru, &e->link);
+	media_cache.size += e->size;
+	mutex_unlock(&media_cache.lock);
+
+	ilog(LOG_DEBUG, "Added '%s' to media cache (%u frames, %zu bytes)", e->key,
+			e->frames->len, e->size);
+}
+
+// returns a new reference
+static struct media_cache_entry *media_cache_get(const char *key) {
+	mutex_lock(&media_cache.lock);
+	struct media_cache_entry *e = g_hash_table_lookup(media_cache.entries, key);
+	if (e) {
+		g_queue_unlink(&media_cache.lru, &e->link);
+		g_queue_push_head_link(&media_cache.lru, &e->link);
+		obj_hold(e);
+	}
+	mutex_unlock(&media_cache.lock);
+	return e;
+}
+#endif
+
+
+void media_player_cache_stats(struct media_cache_stats *s) {
+	ZERO(*s);
+#ifdef WITH_TRANSCODING
+	s->hits = atomic64_get(&media_cache.hits);
+	s->misses = atomic64_get(&media_cache.misses);
+	s->evictions = atomic64_get(&media_cache.evictions);
+	mutex_lock(&media_cache.lock);
+	if (media_cache.entries)
+		s->entries = g_hash_table_size(media_cache.entries);
+	s->bytes = media_cache.size;
+	s->max_bytes = media_cache.max_size;
+	mutex_unlock(&media_cache.lock);
+#endif
+}
+
+// players still using an entry keep their reference to it
+unsigned int media_player_cache_flush(void) {
+	unsigned int num = 0;
+#ifdef WITH_TRANSCODING
+	mutex_lock(&media_cache.lock);
+	struct media_cache_entry *e;
+	while ((e = g_queue_peek_tail(&media_cache.lru))) {
+		g_queue_unlink(&media_cache.lru, &e->link);
+		g_hash_table_remove(media_cache.entries, e->key);
+		media_cache.size -= e->size;
+		obj_put(e);
+		num++;
+	}
+	mutex_unlock(&media_cache.lock);
+#endif
+	return num;
+}
+
+
 #ifdef WITH_TRANSCODING
 // called with call->master lock in W
 static unsigned int send_timer_flush(struct send_timer *st, void *ptr) {
@@ -61,10 +212,14 @@ static void media_player_shutdown(struct media_player *mp) {
 
 	ilog(LOG_DEBUG, "shutting down media_player");
 	timerthread_obj_deschedule(&mp->tt_obj);
+	// invalidates outstanding DB requests
+	mp->db_gen++;
 	avformat_close_input(&mp->fmtctx);
 
 	if (mp->sink) {
-		unsigned int num = send_timer_flush(mp->sink->send_timer, mp->handler);
+		// cached playback has no codec handler and uses the player itself as source
+		unsigned int num = send_timer_flush(mp->sink->send_timer,
+				mp->cache_entry ? (void *) mp : (void *) mp->handler);
 		ilog(LOG_DEBUG, "%u packets removed from send queue", num);
 		// roll back seq numbers already used
 		mp->ssrc_out->parent->seq_diff -= num;
@@ -83,6 +238,14 @@ static void media_player_shutdown(struct media_player *mp) {
 		free(mp->blob);
 	mp->blob = NULL;
 	mp->read_pos = STR_NULL;
+	mp->duration = 0;
+	if (mp->cache_entry)
+		obj_put(mp->cache_entry);
+	mp->cache_entry = NULL;
+	// playback incomplete: don't cache partial output
+	if (mp->cache_rec)
+		obj_put(mp->cache_rec);
+	mp->cache_rec = NULL;
 }
 #endif
 
@@ -227,6 +390,25 @@ void send_timer_push(struct send_timer *st, struct codec_packet *cp) {
 #define CODECPAR codec
 #endif
 
+// find suitable output payload type
+static struct rtp_payload_type *media_player_dst_pt(struct media_player *mp) {
+	for (GList *l = mp->media->codecs_prefs_send.head; l; l = l->next) {
+		struct rtp_payload_type *dst_pt = l->data;
+		if (dst_pt->codec_def && !dst_pt->codec_def->pseudocodec)
+			return dst_pt;
+	}
+	return NULL;
+}
+
+// if we played anything before, scale our sync TS according to the time
+// that has passed
+static void media_player_sync_ts(struct media_player *mp, struct rtp_payload_type *dst_pt) {
+	if (mp->sync_ts_tv.tv_sec) {
+		long long ts_diff_us = timeval_diff(&rtpe_now, &mp->sync_ts_tv);
+		mp->sync_ts += ts_diff_us * dst_pt->clock_rate / 1000000 / dst_pt->codec_def->clockrate_mult;
+	}
+}
+
 static int __ensure_codec_handler(struct media_player *mp, AVStream *avs) {
 	if (mp->handler)
 		return 0;
@@ -244,15 +426,7 @@ static int __ensure_codec_handler(struct media_player *mp, AVStream *avs) {
 	src_pt.clock_rate = avs->CODECPAR->sample_rate;
 	codec_init_payload_type(&src_pt, mp->media);
 
-	// find suitable output payload type
-	struct rtp_payload_type *dst_pt;
-	for (GList *l = mp->media->codecs_prefs_send.head; l; l = l->next) {
-		dst_pt = l->data;
-		if (dst_pt->codec_def && !dst_pt->codec_def->pseudocodec)
-			goto found;
-	}
-	dst_pt = NULL;
-found:
+	struct rtp_payload_type *dst_pt = media_player_dst_pt(mp);
 	if (!dst_pt) {
 		ilog(LOG_ERR, "No supported output codec found in SDP");
 		return -1;
@@ -260,29 +434,169 @@ found:
 	ilog(LOG_DEBUG, "Output codec for media playback is " STR_FORMAT,
 			STR_FMT(&dst_pt->encoding_with_params));
 
-	// if we played anything before, scale our sync TS according to the time
-	// that has passed
-	if (mp->sync_ts_tv.tv_sec) {
-		long long ts_diff_us = timeval_diff(&rtpe_now, &mp->sync_ts_tv);
-		mp->sync_ts += ts_diff_us * dst_pt->clock_rate / 1000000 / dst_pt->codec_def->clockrate_mult;
-	}
+	media_player_sync_ts(mp, dst_pt);
 
 	mp->handler = codec_handler_make_playback(&src_pt, dst_pt, mp->sync_ts);
 	if (!mp->handler)
 		return -1;
 
 	mp->duration = avs->duration * 1000 * avs->time_base.num / avs->time_base.den;
+	if (mp->cache_rec)
+		mp->cache_rec->duration = mp->duration;
 
 	return 0;
 }
 
 
+// appropriate lock must be held
+static void media_player_cache_record(struct media_player *mp, struct media_packet *packet) {
+	struct media_cache_entry *e = mp->cache_rec;
+
+	for (GList *l = packet->packets_out.head; l; l = l->next) {
+		struct codec_packet *p = l->data;
+		if (!p->rtp || p->s.len < sizeof(struct rtp_header))
+			continue;
+		unsigned int len = p->s.len - sizeof(struct rtp_header);
+		uint32_t ts = ntohl(p->rtp->timestamp);
+		if (!e->frames->len)
+			mp->cache_ts = ts;
+
+		struct media_cache_frame f = {
+			.ts = ts - (uint32_t) mp->cache_ts,
+			.offset = e->data->len,
+			.len = len,
+			.marker = (p->rtp->m_pt & 0x80) ? 1 : 0,
+		};
+		if (len > 0xffff || e->data->len + len > media_cache.max_size) {
+			ilog(LOG_DEBUG, "Encoded media too large for media cache");
+			obj_put(e);
+			mp->cache_rec = NULL;
+			return;
+		}
+		g_array_append_val(e->frames, f);
+		g_string_append_len(e->data, (char *) p->rtp + sizeof(struct rtp_header), len);
+	}
+}
+
+
+// appropriate lock must be held
+static void media_player_cached_packet(struct media_player *mp) {
+	struct media_cache_entry *e = mp->cache_entry;
+	if (mp->cache_idx >= e->frames->len) {
+		ilog(LOG_DEBUG, "End of cached media reached");
+		return;
+	}
+
+	struct media_cache_frame *f = &g_array_index(e->frames, struct media_cache_frame, mp->cache_idx);
+	mp->cache_idx++;
+
+	struct ssrc_entry_call *ssrc_out_p = mp->ssrc_out->parent;
+	char *buf = malloc(sizeof(struct rtp_header) + f->len + RTP_BUFFER_TAIL_ROOM);
+	memcpy(buf + sizeof(struct rtp_header), e->data->str + f->offset, f->len);
+
+	// rewrite RTP header for this stream
+	struct rtp_header *rh = (void *) buf;
+	uint32_t ts = mp->cache_ts + f->ts;
+	ZERO(*rh);
+	rh->v_p_x_cc = 0x80;
+	rh->m_pt = mp->cache_pt | (f->marker ? 0x80 : 0);
+	rh->seq_num = htons(mp->seq + (ssrc_out_p->seq_diff += 1));
+	rh->timestamp = htonl(ts);
+	rh->ssrc = htonl(ssrc_out_p->h.ssrc);
+
+	struct codec_packet *p = g_slice_alloc0(sizeof(*p));
+	p->s.s = buf;
+	p->s.len = f->len + sizeof(struct rtp_header);
+	p->free_func = free;
+	p->source = mp;
+	p->rtp = rh;
+	p->to_send = mp->cache_start;
+	timeval_add_usec(&p->to_send, (unsigned long long) f->ts * 1000000 / e->clock_rate);
+
+	payload_tracker_add(&mp->ssrc_out->tracker, mp->cache_pt);
+	atomic64_inc(&mp->ssrc_out->packets);
+	atomic64_add(&mp->ssrc_out->octets, f->len);
+	atomic64_set(&mp->ssrc_out->last_ts, ts);
+
+	mp->sync_ts = ts;
+	mp->sync_ts_tv = p->to_send;
+
+	struct media_packet packet = {
+		.tv = rtpe_now,
+		.call = mp->call,
+		.media = mp->media,
+		.ssrc_out = mp->ssrc_out,
+	};
+	g_queue_push_tail(&packet.packets_out, p);
+
+	media_packet_encrypt(mp->crypt_handler->out->rtp_crypt, mp->sink, &packet);
+
+	mutex_lock(&mp->sink->out_lock);
+	if (media_socket_dequeue(&packet, mp->sink))
+		ilog(LOG_ERR, "Error sending playback media to RTP sink");
+	mutex_unlock(&mp->sink->out_lock);
+
+	if (mp->cache_idx >= e->frames->len)
+		return;
+	f = &g_array_index(e->frames, struct media_cache_frame, mp->cache_idx);
+	mp->next_run = mp->cache_start;
+	timeval_add_usec(&mp->next_run, (unsigned long long) f->ts * 1000000 / e->clock_rate);
+	timerthread_obj_schedule_abs(&mp->tt_obj, &mp->next_run);
+}
+
+
+// call->master_lock held in W
+// returns 0 if playback was started from the cache. on a miss, prepares capturing
+// the encoded output and returns -1
+static int media_player_cache_play(struct media_player *mp, const char *src) {
+	if (!media_cache.max_size || !src)
+		return -1;
+	struct rtp_payload_type *dst_pt = media_player_dst_pt(mp);
+	if (!dst_pt)
+		return -1; // reported later
+
+	char *key = g_strdup_printf("%s|" STR_FORMAT "|" STR_FORMAT "|%i", src,
+			STR_FMT(&dst_pt->encoding_with_params),
+			STR_FMT(&dst_pt->format_parameters),
+			dst_pt->ptime);
+
+	struct media_cache_entry *e = media_cache_get(key);
+	if (!e) {
+		atomic64_inc(&media_cache.misses);
+		mp->cache_rec = media_cache_entry_new(key, dst_pt);
+		return -1;
+	}
+
+	atomic64_inc(&media_cache.hits);
+	ilog(LOG_DEBUG, "Playing media '%s' from cache", key);
+	g_free(key);
+
+	media_player_sync_ts(mp, dst_pt);
+	while (mp->sync_ts == 0)
+		mp->sync_ts = random();
+
+	mp->cache_entry = e;
+	mp->cache_idx = 0;
+	mp->cache_pt = dst_pt->payload_type;
+	mp->cache_ts = mp->sync_ts;
+	mp->cache_start = rtpe_now;
+	mp->duration = e->duration;
+
+	media_player_cached_packet(mp);
+	return 0;
+}
+
+
 // appropriate lock must be held
 static void media_player_read_packet(struct media_player *mp) {
 	int ret = av_read_frame(mp->fmtctx, &mp->pkt);
 	if (ret < 0) {
 		if (ret == AVERROR_EOF) {
 			ilog(LOG_DEBUG, "EOF reading from media stream");
+			if (mp->cache_rec) {
+				media_cache_insert(mp->cache_rec);
+				mp->cache_rec = NULL;
+			}
 			return;
 		}
 		ilog(LOG_ERR, "Error while reading from media stream");
@@ -339,6 +653,9 @@ static void media_player_read_packet(struct media_player *mp) {
 
 	mp->handler->func(mp->handler, &packet);
 
+	if (mp->cache_rec)
+		media_player_cache_record(mp, &packet);
+
 	// as this is timing sensitive and we may have spent some time decoding,
 	// update our global "now" timestamp
 	gettimeofday(&rtpe_now, NULL);
@@ -420,6 +737,16 @@ int media_player_play_file(struct media_player *mp, const str *file) {
 	char file_s[PATH_MAX];
 	snprintf(file_s, sizeof(file_s), STR_FORMAT, STR_FMT(file));
 
+	// include size and mtime in the cache key so that changed files are re-encoded
+	struct stat st;
+	if (!stat(file_s, &st)) {
+		char src[PATH_MAX + 64];
+		snprintf(src, sizeof(src), "file:%s:%lli:%lli", file_s, (long long) st.st_size,
+				(long long) st.st_mtime);
+		if (!media_player_cache_play(mp, src))
+			return 0;
+	}
+
 	int ret = avformat_open_input(&mp->fmtctx, file_s, NULL, NULL);
 	if (ret < 0) {
 		ilog(LOG_ERR, "Failed to open media file for playback: %s", av_error(ret));
@@ -482,15 +809,12 @@ static int64_t __mp_avio_seek(void *opaque, int64_t offset, int whence) {
 
 
 
-// call->master_lock held in W
-int media_player_play_blob(struct media_player *mp, const str *blob) {
 #ifdef WITH_TRANSCODING
+// call->master_lock held in W
+static int media_player_play_blob_start(struct media_player *mp, const str *blob) {
 	const char *err;
 	int av_ret = 0;
 
-	if (media_player_play_init(mp))
-		return -1;
-
 	mp->blob = str_dup(blob);
 	err = "out of memory";
 	if (!mp->blob)
@@ -529,96 +853,185 @@ err:
 	ilog(LOG_ERR, "Failed to start media playback from memory: %s", err);
 	if (av_ret)
 		ilog(LOG_ERR, "Error returned from libav: %s", av_error(av_ret));
-#endif
 	return -1;
 }
+#endif
 
 
+// call->master_lock held in W
+int media_player_play_blob(struct media_player *mp, const str *blob) {
 #ifdef WITH_TRANSCODING
-static int __connect_db(void) {
-	if (mysql_conn) {
-		mysql_close(mysql_conn);
-		mysql_conn = NULL;
-	}
-	mysql_conn = mysql_init(NULL);
-	if (!mysql_conn)
+	if (media_player_play_init(mp))
 		return -1;
-	if (!mysql_real_connect(mysql_conn, rtpe_config.mysql_host, rtpe_config.mysql_user, rtpe_config.mysql_pass, NULL, rtpe_config.mysql_port,
+
+	if (media_cache.max_size) {
+		gchar *sum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (guchar *) blob->s, blob->len);
+		char src[64];
+		snprintf(src, sizeof(src), "blob:%s", sum);
+		g_free(sum);
+		if (!media_player_cache_play(mp, src))
+			return 0;
+	}
+
+	return media_player_play_blob_start(mp, blob);
+#else
+	return -1;
+#endif
+}
+
+
+#ifdef WITH_TRANSCODING
+static MYSQL *db_conn_connect(void) {
+	MYSQL *conn = mysql_init(NULL);
+	if (!conn)
+		return NULL;
+	if (!mysql_real_connect(conn, rtpe_config.mysql_host, rtpe_config.mysql_user, rtpe_config.mysql_pass, NULL, rtpe_config.mysql_port,
 			NULL, CLIENT_IGNORE_SIGPIPE))
 		goto err;
 
-	return 0;
+	return conn;
 
 err:
-	ilog(LOG_ERR, "Couldn't connect to database: %s", mysql_error(mysql_conn));
-	mysql_close(mysql_conn);
-	mysql_conn = NULL;
-	return -1;
+	ilog(LOG_ERR, "Couldn't connect to database: %s", mysql_error(conn));
+	mysql_close(conn);
+	return NULL;
 }
 
+// takes an idle connection from the pool or makes a new one
+static MYSQL *db_conn_get(void) {
+	mutex_lock(&db_pool_lock);
+	MYSQL *conn = g_queue_pop_head(&db_pool);
+	mutex_unlock(&db_pool_lock);
+	if (conn)
+		return conn;
+	return db_conn_connect();
+}
 
-// call->master_lock held in W
-int media_player_play_db(struct media_player *mp, long long id) {
+static void db_conn_put(MYSQL *conn) {
+	mutex_lock(&db_pool_lock);
+	if (db_pool.length < (unsigned int) rtpe_config.mysql_threads) {
+		g_queue_push_head(&db_pool, conn);
+		conn = NULL;
+	}
+	mutex_unlock(&db_pool_lock);
+	if (conn)
+		mysql_close(conn);
+}
+
+
+// runs in a DB worker thread without any locks held
+static void media_player_db_run(struct media_player_db_job *job) {
+	struct media_player *mp = job->mp;
+	struct call *call = mp->call;
 	const char *err;
 	AUTO_CLEANUP_BUF(query);
+	MYSQL *conn = NULL;
+	MYSQL_RES *res = NULL;
 
-	err = "missing configuration";
-	if (!rtpe_config.mysql_host || !rtpe_config.mysql_query)
-		goto err;
+	log_info_call(call);
 
-	int len = asprintf(&query, rtpe_config.mysql_query, (unsigned long long) id);
+	int len = asprintf(&query, rtpe_config.mysql_query, (unsigned long long) job->id);
 	err = "query print error";
 	if (len <= 0)
 		goto err;
 
 	for (int retries = 0; retries < 5; retries++) {
-		if (!mysql_conn || retries != 0) {
+		if (!conn) {
 			err = "failed to connect to database";
-			if (__connect_db())
+			conn = db_conn_get();
+			if (!conn)
 				goto err;
 		}
 
-		int ret = mysql_real_query(mysql_conn, query, len);
+		int ret = mysql_real_query(conn, query, len);
 		if (ret == 0)
 			goto success;
 
-		ret = mysql_errno(mysql_conn);
-		if (ret == CR_SERVER_GONE_ERROR || ret == CR_SERVER_LOST)
-			continue;
+		ret = mysql_errno(conn);
+		if (ret != CR_SERVER_GONE_ERROR && ret != CR_SERVER_LOST)
+			ilog(LOG_ERR, "Failed to query from database: %s", mysql_error(conn));
 
-		ilog(LOG_ERR, "Failed to query from database: %s", mysql_error(mysql_conn));
+		// don't return a possibly broken connection to the pool
+		mysql_close(conn);
+		conn = NULL;
 	}
 	err = "exceeded max number of database retries";
 	goto err;
 
-success:;
-
-	MYSQL_RES *res = mysql_store_result(mysql_conn);
+success:
+	res = mysql_store_result(conn);
 	err = "failed to get result from database";
 	if (!res)
 		goto err;
+	// result is buffered on the client side, connection can be reused
+	db_conn_put(conn);
+	conn = NULL;
+
 	MYSQL_ROW row = mysql_fetch_row(res);
 	unsigned long *lengths = mysql_fetch_lengths(res);
 	err = "empty result from database";
-	if (!row || !lengths || !row[0] || !lengths[0]) {
-		mysql_free_result(res);
+	if (!row || !lengths || !row[0] || !lengths[0])
 		goto err;
-	}
 
 	str blob;
 	str_init_len(&blob, row[0], lengths[0]);
-	int ret = media_player_play_blob(mp, &blob);
 
-	mysql_free_result(res);
+	rwlock_lock_w(&call->master_lock);
+	gettimeofday(&rtpe_now, NULL);
+	if (mp->db_gen != job->gen)
+		ilog(LOG_DEBUG, "Media playback was stopped or replaced while querying the database");
+	else
+		media_player_play_blob_start(mp, &blob);
+	rwlock_unlock_w(&call->master_lock);
 
-	return ret;
+	goto out;
 
 err:
 	if (query)
 		ilog(LOG_ERR, "Failed to start media playback from database (used query '%s'): %s", query, err);
 	else
 		ilog(LOG_ERR, "Failed to start media playback from database: %s", err);
-	return -1;
+out:
+	if (res)
+		mysql_free_result(res);
+	if (conn)
+		mysql_close(conn);
+	obj_put(&mp->tt_obj);
+	g_slice_free1(sizeof(*job), job);
+	log_info_clear();
+}
+
+
+// call->master_lock held in W
+int media_player_play_db(struct media_player *mp, long long id) {
+	if (!rtpe_config.mysql_host || !rtpe_config.mysql_query) {
+		ilog(LOG_ERR, "Failed to start media playback from database: missing configuration");
+		return -1;
+	}
+
+	if (media_player_play_init(mp))
+		return -1;
+
+	// a cache hit saves the database round trip
+	char src[32];
+	snprintf(src, sizeof(src), "db:%llu", (unsigned long long) id);
+	if (!media_player_cache_play(mp, src))
+		return 0;
+
+	// hand over to a DB worker thread, which starts playback once the
+	// media has been retrieved. the duration isn't known until then
+	struct media_player_db_job *job = g_slice_alloc0(sizeof(*job));
+	job->mp = mp;
+	obj_hold(&mp->tt_obj);
+	job->gen = mp->db_gen;
+	job->id = id;
+
+	mutex_lock(&db_jobs_lock);
+	g_queue_push_tail(&db_jobs, job);
+	cond_signal(&db_jobs_cond);
+	mutex_unlock(&db_jobs_lock);
+
+	return 0;
 }
 
 
@@ -633,7 +1046,10 @@ static void media_player_run(void *ptr) {
 	rwlock_lock_r(&call->master_lock);
 	mutex_lock(&mp->lock);
 
-	media_player_read_packet(mp);
+	if (mp->cache_entry)
+		media_player_cached_packet(mp);
+	else
+		media_player_read_packet(mp);
 
 	mutex_unlock(&mp->lock);
 	rwlock_unlock_r(&call->master_lock);
@@ -680,6 +1096,15 @@ static void send_timer_run(void *ptr) {
 
 void media_player_init(void) {
 #ifdef WITH_TRANSCODING
+	mutex_init(&media_cache.lock);
+	media_cache.entries = g_hash_table_new(g_str_hash, g_str_equal);
+	g_queue_init(&media_cache.lru);
+	if (rtpe_config.media_cache_size > 0)
+		media_cache.max_size = (size_t) rtpe_config.media_cache_size * 1024 * 1024;
+
+	// must happen before any DB thread starts
+	mysql_library_init(0, NULL, NULL);
+
 	timerthread_init(&media_player_thread, media_player_run);
 #endif
 	timerthread_init(&send_timer_thread, send_timer_run);
@@ -691,6 +1116,35 @@ void media_player_loop(void *p) {
 	ilog(LOG_DEBUG, "media_player_loop");
 	timerthread_run(&media_player_thread);
 }
+
+void media_player_db_loop(void *p) {
+	ilog(LOG_DEBUG, "media_player_db_loop");
+
+	// connections from the pool are used by all DB threads
+	mysql_thread_init();
+
+	mutex_lock(&db_jobs_lock);
+
+	while (!rtpe_shutdown) {
+		struct media_player_db_job *job = g_queue_pop_head(&db_jobs);
+		if (!job) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&db_jobs_cond, &db_jobs_lock, &tv);
+			continue;
+		}
+		mutex_unlock(&db_jobs_lock);
+
+		media_player_db_run(job);
+
+		mutex_lock(&db_jobs_lock);
+	}
+
+	mutex_unlock(&db_jobs_lock);
+
+	mysql_thread_end();
+}
 #endif
 void send_timer_loop(void *p) {
 	ilog(LOG_DEBUG, "send_timer_loop");
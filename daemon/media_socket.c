@@ -3,6 +3,7 @@
 #include <string.h>
 #include <glib.h>
 #include <errno.h>
+#include <time.h>
 #include <netinet/in.h>
 #include "str.h"
 #include "ice.h"
@@ -55,6 +56,7 @@ struct packet_handler_ctx {
 	struct packet_stream *in_srtp, *out_srtp; // SRTP contexts for decrypt/encrypt (relevant for muxed RTCP)
 	int payload_type; // -1 if unknown or not RTP
 	int rtcp; // true if this is an RTCP packet
+	unsigned int mark; // packet mark set in the kernel
 
 	// verdicts:
 	int update; // true if Redis info needs to be updated
@@ -338,6 +340,11 @@ static GHashTable *__local_intf_addr_type_hash; // addr + type -> GList of struc
 static GQueue __preferred_lists_for_family[__SF_LAST];
 
 GQueue all_local_interfaces = G_QUEUE_INIT;
+static GQueue all_intf_specs = G_QUEUE_INIT;
+
+// wakes up the socket pool refill thread
+static mutex_t socket_pool_lock = MUTEX_STATIC_INIT;
+static cond_t socket_pool_cond = COND_STATIC_INIT;
 
 
 
@@ -623,8 +630,10 @@ static void __interface_append(struct intf_config *ifa, sockfamily_t *fam) {
 		spec->port_pool.min = ifa->port_min;
 		spec->port_pool.max = ifa->port_max;
 		spec->port_pool.free_ports = spec->port_pool.max - spec->port_pool.min + 1;
-		mutex_init(&spec->port_pool.free_list_lock);
+		mutex_init(&spec->socket_pool.lock);
 		g_hash_table_insert(__intf_spec_addr_type_hash, &spec->local_address, spec);
+		spec->stats_idx = all_intf_specs.length;
+		g_queue_push_tail(&all_intf_specs, spec);
 	}
 
 	ifc = uid_slice_alloc(ifc, &lif->list);
@@ -672,6 +681,8 @@ void interfaces_init(GQueue *interfaces) {
 			__interface_append(ifa, fam);
 		}
 	}
+
+	stats_counters_num_intf = all_intf_specs.length;
 }
 
 void interfaces_exclude_port(unsigned int port) {
@@ -733,8 +744,12 @@ static int get_port(socket_t *r, unsigned int port, struct intf_spec *spec, cons
 		return -1;
 	}
 
-	iptables_add_rule(r, label);
+	// pooled sockets get their firewall rule when they're handed out
+	if (label)
+		iptables_add_rule(r, label);
 	socket_timestamping(r);
+	if (rtpe_config.kernel_rtcp_mark_mask)
+		socket_rcvmark(r);
 
 	g_atomic_int_dec_and_test(&pp->free_ports);
 	__C_DBG("%d free ports remaining on interface %s", pp->free_ports,
@@ -755,11 +770,6 @@ static void release_port(socket_t *r, struct intf_spec *spec) {
 		__C_DBG("port %u is released", port);
 		bit_array_clear(pp->ports_used, port);
 		g_atomic_int_inc(&pp->free_ports);
-		if ((port & 1) == 0) {
-			mutex_lock(&pp->free_list_lock);
-			g_queue_push_tail(&pp->free_list, GUINT_TO_POINTER(port));
-			mutex_unlock(&pp->free_list_lock);
-		}
 	} else {
 		__C_DBG("port %u is NOT released", port);
 	}
@@ -771,13 +781,38 @@ static void free_port(socket_t *r, struct intf_spec *spec) {
 
 
 
-/* puts list of socket_t into "out" */
-int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+// opens `num_ports` ports starting at `port`, or none at all
+static int __open_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int port,
 		struct intf_spec *spec, const str *label)
 {
-	int i, cycle = 0;
 	socket_t *sk;
-	int port;
+
+	for (unsigned int i = 0; i < num_ports; i++) {
+		sk = g_slice_alloc0(sizeof(*sk));
+		// fd=0 is a valid file descriptor that may be closed
+		// accidentally by free_port if previously bounded
+		sk->fd = -1;
+
+		if (get_port(sk, port++, spec, label)) {
+			g_slice_free1(sizeof(*sk), sk);
+			goto release;
+		}
+
+		g_queue_push_tail(out, sk);
+	}
+
+	return 0;
+
+release:
+	while ((sk = g_queue_pop_head(out)))
+		free_port(sk, spec);
+	return -1;
+}
+
+static int __alloc_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+		struct intf_spec *spec, const str *label)
+{
+	unsigned int port, words = 0, attempts = 0;
 	struct port_pool *pp;
 
 	if (num_ports == 0)
@@ -787,75 +822,185 @@ int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wa
 
 	__C_DBG("wanted_start_port=%d", wanted_start_port);
 
-	if (wanted_start_port > 0) {
-		port = wanted_start_port;
-		__C_DBG("port=%d", port);
-	} else {
-		port = g_atomic_int_get(&pp->last_used);
-		__C_DBG("before randomization port=%d", port);
+	if (wanted_start_port > 0)
+		return __open_consecutive_ports(out, num_ports, wanted_start_port, spec, label);
+
+	port = g_atomic_int_get(&pp->last_used);
+	__C_DBG("before randomization port=%d", port);
 #if PORT_RANDOM_MIN && PORT_RANDOM_MAX
-		port += PORT_RANDOM_MIN + (ssl_random() % (PORT_RANDOM_MAX - PORT_RANDOM_MIN));
+	port += PORT_RANDOM_MIN + (ssl_random() % (PORT_RANDOM_MAX - PORT_RANDOM_MIN));
 #endif
-		__C_DBG("after  randomization port=%d", port);
-	}
-
-	// debug msg if port is in the given interval
-	if (bit_array_isset(pp->ports_used, port)) {
-		__C_DBG("port %d is USED in port pool", port);
-		mutex_lock(&pp->free_list_lock);
-		unsigned int fport = GPOINTER_TO_UINT(g_queue_pop_head(&pp->free_list));
-		mutex_unlock(&pp->free_list_lock);
-		if (fport) {
-			port = fport;
-			__C_DBG("Picked port %u from free list", port);
-		}
-	} else {
-		__C_DBG("port %d is NOT USED in port pool", port);
-	}
+	__C_DBG("after  randomization port=%d", port);
 
+	// the bit array is only read here. if another thread claims a port between the scan and
+	// get_port(), the latter fails and we continue looking from there.
 	while (1) {
-		__C_DBG("cycle=%d, port=%d", cycle, port);
-		if (!wanted_start_port) {
-			if (port < pp->min)
-				port = pp->min;
-			if ((port & 1))
-				port++;
-		}
-
-		for (i = 0; i < num_ports; i++) {
-			sk = g_slice_alloc0(sizeof(*sk));
-			// fd=0 is a valid file descriptor that may be closed
-			// accidentally by free_port if previously bounded
-			sk->fd = -1;
-			g_queue_push_tail(out, sk);
-
-			if (!wanted_start_port && port > pp->max) {
-				port = 0;
-				cycle++;
-				goto release_restart;
-			}
-
-			if (get_port(sk, port++, spec, label))
-				goto release_restart;
-		}
-		break;
+		int found = bit_array_find_clear_even(pp->ports_used, pp->min, pp->max, port,
+				num_ports > 1, &words);
+		if (found < 0)
+			goto fail;
+		port = found;
+		__C_DBG("found free port %u after looking at %u words", port, words);
 
-release_restart:
-		while ((sk = g_queue_pop_head(out)))
-			free_port(sk, spec);
+		if (port + num_ports - 1 <= pp->max
+				&& !__open_consecutive_ports(out, num_ports, port, spec, label))
+			break;
 
-		if (cycle >= 2 || wanted_start_port > 0)
+		// each candidate is tried at most once
+		if (++attempts > (pp->max - pp->min) / 2 + 1)
 			goto fail;
+		port += 2;
 	}
 
 	/* success */
-	g_atomic_int_set(&pp->last_used, port);
+	g_atomic_int_set(&pp->last_used, port + num_ports);
+	atomic64_inc(&pp->allocs);
+	atomic64_add(&pp->alloc_words, words);
+	atomic64_add(&pp->alloc_attempts, attempts + 1);
 
 	__C_DBG("Opened ports %u.. on interface %s for media relay",
 		((socket_t *) out->head->data)->local.port, sockaddr_print_buf(&spec->local_address.addr));
 	return 0;
 
 fail:
+	atomic64_inc(&pp->alloc_failures);
+	return -1;
+}
+
+void port_pool_stats(struct port_pool_stats *st) {
+	ZERO(*st);
+
+	for (GList *l = all_intf_specs.head; l; l = l->next) {
+		struct intf_spec *spec = l->data;
+		struct port_pool *pp = &spec->port_pool;
+
+		st->allocs += atomic64_get(&pp->allocs);
+		st->failures += atomic64_get(&pp->alloc_failures);
+		st->words += atomic64_get(&pp->alloc_words);
+		st->attempts += atomic64_get(&pp->alloc_attempts);
+		st->free_ports += g_atomic_int_get(&pp->free_ports);
+	}
+}
+
+// pooled sockets aren't polled, so anything sent to the port while it sat in the pool
+// (e.g. late packets for the call that used it last) is still queued. discard all of it
+// so that the new call doesn't learn its peer from those
+static void socket_pool_drain(socket_t *s) {
+	char buf[1];
+	unsigned int num = 0;
+
+	while (recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		num++;
+	if (num)
+		ilog(LOG_DEBUG, "Discarded %u stale packets from pooled port %u", num, s->local.port);
+}
+
+// hands out a pre-opened RTP/RTCP pair from the interface's pool, if there is one
+static int socket_pool_get(GQueue *out, struct intf_spec *spec, const str *label) {
+	struct socket_pool *sp = &spec->socket_pool;
+
+	mutex_lock(&sp->lock);
+	socket_t *rtp = g_queue_pop_head(&sp->sockets);
+	socket_t *rtcp = g_queue_pop_head(&sp->sockets);
+	unsigned int left = sp->sockets.length / 2;
+	mutex_unlock(&sp->lock);
+
+	if (left < (rtpe_config.port_pool_size + 1) / 2)
+		cond_signal(&socket_pool_cond);
+
+	if (!rtp) {
+		atomic64_inc(&sp->misses);
+		return -1;
+	}
+
+	atomic64_inc(&sp->hits);
+	socket_pool_drain(rtp);
+	socket_pool_drain(rtcp);
+	iptables_add_rule(rtp, label);
+	iptables_add_rule(rtcp, label);
+	g_queue_push_tail(out, rtp);
+	g_queue_push_tail(out, rtcp);
+	return 0;
+}
+
+static void socket_pool_refill(struct intf_spec *spec) {
+	struct socket_pool *sp = &spec->socket_pool;
+	struct timeval start, end;
+	GQueue q = G_QUEUE_INIT;
+
+	while (!rtpe_shutdown) {
+		mutex_lock(&sp->lock);
+		unsigned int have = sp->sockets.length / 2;
+		mutex_unlock(&sp->lock);
+		if (have >= rtpe_config.port_pool_size)
+			break;
+
+		gettimeofday(&start, NULL);
+		// no label means no firewall rule yet
+		if (__alloc_consecutive_ports(&q, 2, 0, spec, NULL))
+			break;
+		gettimeofday(&end, NULL);
+
+		atomic64_inc(&sp->refills);
+		atomic64_add(&sp->refill_time_us, timeval_diff(&end, &start));
+
+		mutex_lock(&sp->lock);
+		while (q.length)
+			g_queue_push_tail(&sp->sockets, g_queue_pop_head(&q));
+		mutex_unlock(&sp->lock);
+	}
+}
+
+void socket_pool_loop(void *p) {
+	ilog(LOG_DEBUG, "socket_pool_loop");
+
+	mutex_lock(&socket_pool_lock);
+
+	while (!rtpe_shutdown) {
+		mutex_unlock(&socket_pool_lock);
+
+		for (GList *l = all_intf_specs.head; l; l = l->next)
+			socket_pool_refill(l->data);
+
+		mutex_lock(&socket_pool_lock);
+
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		timeval_add_usec(&tv, 100000);
+		cond_timedwait(&socket_pool_cond, &socket_pool_lock, &tv);
+	}
+
+	mutex_unlock(&socket_pool_lock);
+}
+
+void socket_pool_stats(struct socket_pool_stats *st) {
+	ZERO(*st);
+
+	for (GList *l = all_intf_specs.head; l; l = l->next) {
+		struct intf_spec *spec = l->data;
+		struct socket_pool *sp = &spec->socket_pool;
+
+		st->hits += atomic64_get(&sp->hits);
+		st->misses += atomic64_get(&sp->misses);
+		st->refills += atomic64_get(&sp->refills);
+		st->refill_time_us += atomic64_get(&sp->refill_time_us);
+		mutex_lock(&sp->lock);
+		st->available += sp->sockets.length / 2;
+		mutex_unlock(&sp->lock);
+	}
+}
+
+/* puts list of socket_t into "out" */
+int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+		struct intf_spec *spec, const str *label)
+{
+	if (num_ports == 2 && !wanted_start_port && rtpe_config.port_pool_size > 0
+			&& !socket_pool_get(out, spec, label))
+		return 0;
+
+	if (!__alloc_consecutive_ports(out, num_ports, wanted_start_port, spec, label))
+		return 0;
+
 	ilog(LOG_ERR, "Failed to get %u consecutive ports on interface %s for media relay (last error: %s)",
 			num_ports, sockaddr_print_buf(&spec->local_address.addr), strerror(errno));
 	return -1;
@@ -977,6 +1122,8 @@ static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, st
 		.mki_len	= c->params.mki_len,
 		.last_index	= ssrc_ctx ? ssrc_ctx->srtp_index : 0,
 		.auth_tag_len	= c->params.crypto_suite->srtp_auth_tag,
+		.rtcp_auth_tag_len = c->params.crypto_suite->srtcp_auth_tag,
+		.rtcp_index	= ssrc_ctx ? ssrc_ctx->srtcp_index : 0,
 	};
 	if (c->params.mki_len)
 		memcpy(s->mki, c->params.mki, c->params.mki_len);
@@ -992,6 +1139,55 @@ static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, st
 
 	return 0;
 }
+/* RTCP can be handled by the kernel only if the kernel can do exactly what
+ * the userspace handler would do: a plain passthrough or a straight SRTCP
+ * decrypt/encrypt with the same keys as the RTP, and no filtering */
+static int __k_rtcp_io_ok(const struct streamhandler_io *io, struct crypto_context *c) {
+	if (io->rtcp_filter)
+		return 0;
+	if (!io->rtcp_crypt)
+		return io->kernel == __k_null;
+	if (io->kernel != __k_srtp_decrypt && io->kernel != __k_srtp_encrypt)
+		return 0;
+	if (!c || !c->params.crypto_suite)
+		return 0;
+	if (c->params.session_params.unencrypted_srtcp != c->params.session_params.unencrypted_srtp)
+		return 0;
+	return 1;
+}
+static int __k_rtcp_ok(struct packet_stream *stream, struct packet_stream *sink) {
+	struct crypto_context *in_c = NULL, *out_c = NULL;
+
+	if (!rtpe_config.kernel_rtcp_sample)
+		return 0;
+	if (MEDIA_ISSET(stream->media, TRANSCODE))
+		return 0;
+	if (stream->selected_sfd)
+		in_c = &stream->selected_sfd->crypto;
+	out_c = &sink->crypto;
+	if (!__k_rtcp_io_ok(stream->handler->in, in_c))
+		return 0;
+	if (!__k_rtcp_io_ok(stream->handler->out, out_c))
+		return 0;
+
+	if (PS_ISSET(stream, RTP)) {
+		/* muxed RTCP: must go to the same destination as the RTP, using the
+		 * same crypto parameters as the separate RTCP contexts would */
+		if (!MEDIA_ISSET(stream->media, RTCP_MUX))
+			return 0;
+		if (stream->rtcp_sink != sink)
+			return 0;
+		if (stream->rtcp_sibling && stream->rtcp_sibling->selected_sfd && in_c
+				&& crypto_params_cmp(&stream->rtcp_sibling->selected_sfd->crypto.params,
+					&in_c->params))
+			return 0;
+		if (sink->rtcp_sibling && crypto_params_cmp(&sink->rtcp_sibling->crypto.params,
+					&out_c->params))
+			return 0;
+	}
+
+	return 1;
+}
 static int __k_srtp_encrypt(struct rtpengine_srtp *s, struct packet_stream *stream) {
 	return __k_srtp_crypt(s, &stream->crypto, stream->ssrc_out);
 }
@@ -1030,7 +1226,7 @@ void kernelize(struct packet_stream *stream) {
 	nk_warn_msg = "interface to kernel module not open";
 	if (!kernel.is_open)
 		goto no_kernel_warn;
-	if (!PS_ISSET(stream, RTP))
+	if (!PS_ISSET(stream, RTP) && !(PS_ISSET(stream, RTCP) && rtpe_config.kernel_rtcp_sample))
 		goto no_kernel;
 	if (!stream->selected_sfd)
 		goto no_kernel;
@@ -1057,6 +1253,19 @@ void kernelize(struct packet_stream *stream) {
 
 	ZERO(reti);
 
+	if (__k_rtcp_ok(stream, sink)) {
+		reti.rtcp_fw = 1;
+		if (rtpe_config.kernel_rtcp_mark_mask) {
+			reti.rtcp_sample = rtpe_config.kernel_rtcp_sample;
+			reti.rtcp_sample_mark = rtpe_config.kernel_rtcp_mark;
+			reti.rtcp_sample_mark_mask = rtpe_config.kernel_rtcp_mark_mask;
+		}
+		if (!PS_ISSET(stream, RTP))
+			reti.rtcp = 1;
+	}
+	else if (!PS_ISSET(stream, RTP))
+		goto no_kernel;
+
 	if (PS_ISSET2(stream, STRICT_SOURCE, MEDIA_HANDOVER)) {
 		mutex_lock(&stream->out_lock);
 		__re_address_translate_ep(&reti.expected_src, &stream->endpoint);
@@ -1099,7 +1308,7 @@ void kernelize(struct packet_stream *stream) {
 
 	ZERO(stream->kernel_stats);
 
-	if (stream->media->protocol && stream->media->protocol->rtp) {
+	if (!reti.rtcp && stream->media->protocol && stream->media->protocol->rtp) {
 		GList *values, *l;
 		struct rtp_stats *rs;
 
@@ -1123,8 +1332,13 @@ void kernelize(struct packet_stream *stream) {
 
 	recording_stream_kernel_info(stream, &reti);
 
-	kernel_add_stream(&reti, 0);
+	// leave the stream unkernelized if this fails, so that it's tried again later. if it's
+	// batched, a failure is only logged and the stream stays in userspace
+	if (kernel_add_stream(&reti, 0))
+		return;
 	PS_SET(stream, KERNELIZED);
+	if (reti.rtcp_fw)
+		PS_SET(stream, KERNEL_RTCP);
 
 	return;
 
@@ -1135,6 +1349,29 @@ no_kernel:
 	PS_SET(stream, NO_KERNEL_SUPPORT);
 }
 
+/* the kernel keeps one SRTCP index per target and advances it while forwarding RTCP. we
+ * must carry on from there, or indexes (and with them keystream) would be reused */
+static void __unkernelize_srtcp(struct packet_stream *p, const struct re_address *rea) {
+	struct rtpengine_target_info last;
+	struct packet_stream *sink;
+
+	if (kernel_del_stream_last(rea, &last))
+		return;
+	if (!last.rtcp_fw)
+		return;
+
+	sink = packet_stream_sink(p);
+	if (!sink)
+		return;
+
+	mutex_lock(&sink->out_lock);
+	if (sink->crypto.params.crypto_suite && sink->ssrc_out
+			&& ntohl(last.ssrc) == sink->ssrc_out->parent->h.ssrc
+			&& last.encrypt.rtcp_index > sink->ssrc_out->srtcp_index)
+		sink->ssrc_out->srtcp_index = last.encrypt.rtcp_index;
+	mutex_unlock(&sink->out_lock);
+}
+
 /* must be called with in_lock held or call->master_lock held in W */
 void __unkernelize(struct packet_stream *p) {
 	struct re_address rea;
@@ -1146,10 +1383,14 @@ void __unkernelize(struct packet_stream *p) {
 
 	if (kernel.is_open) {
 		__re_address_translate_ep(&rea, &p->selected_sfd->socket.local);
-		kernel_del_stream(&rea);
+		if (PS_ISSET(p, KERNEL_RTCP))
+			__unkernelize_srtcp(p, &rea);
+		else
+			kernel_del_stream(&rea);
 	}
 
 	PS_CLEAR(p, KERNELIZED);
+	PS_CLEAR(p, KERNEL_RTCP);
 }
 
 
@@ -1411,7 +1652,7 @@ static void media_packet_rtp(struct packet_handler_ctx *phc)
 			ilog(LOG_WARNING | LOG_FLAG_LIMIT,
 					"RTP packet with unknown payload type %u received", phc->payload_type);
 			atomic64_inc(&phc->mp.stream->stats.errors);
-			atomic64_inc(&rtpe_statsps.errors);
+			RTPE_STATS_INC(errors);
 		}
 		else {
 			atomic64_inc(&rtp_s->packets);
@@ -1658,6 +1899,62 @@ int media_socket_dequeue(struct media_packet *mp, struct packet_stream *sink) {
 
 
 /* called lock-free */
+// per-stage timing of every Nth packet, see --packet-timing-sample
+struct packet_timing {
+	int active;
+	unsigned int stages; // bit mask of enum packet_stage
+	struct timespec start, last;
+	u_int64_t ns[__PACKET_STAGES];
+};
+
+static __thread unsigned int packet_timing_countdown;
+
+INLINE u_int64_t packet_timing_diff(const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + a->tv_nsec - b->tv_nsec;
+}
+
+INLINE void packet_timing_start(struct packet_timing *pt) {
+	unsigned int n = rtpe_config.packet_timing_sample;
+
+	pt->active = 0;
+	if (G_LIKELY(!n))
+		return;
+	if (packet_timing_countdown) {
+		packet_timing_countdown--;
+		return;
+	}
+	packet_timing_countdown = n - 1;
+
+	pt->active = 1;
+	pt->stages = 0;
+	ZERO(pt->ns);
+	clock_gettime(CLOCK_MONOTONIC, &pt->start);
+	pt->last = pt->start;
+}
+
+// charges the time since the previous call to `stage`
+INLINE void packet_timing_stage(struct packet_timing *pt, enum packet_stage stage) {
+	struct timespec now;
+
+	if (G_LIKELY(!pt->active))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pt->ns[stage] += packet_timing_diff(&now, &pt->last);
+	pt->stages |= 1 << stage;
+	pt->last = now;
+}
+
+INLINE void packet_timing_done(struct packet_timing *pt) {
+	struct timespec now;
+
+	if (G_LIKELY(!pt->active))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pt->ns[PACKET_STAGE_TOTAL] = packet_timing_diff(&now, &pt->start);
+	pt->stages |= 1 << PACKET_STAGE_TOTAL;
+	thread_stats_packet_stages(pt->ns, pt->stages);
+}
+
 static int stream_packet(struct packet_handler_ctx *phc) {
 /**
  * Incoming packets:
@@ -1679,11 +1976,15 @@ static int stream_packet(struct packet_handler_ctx *phc) {
  */
 /* TODO move the above comments to the data structure definitions, if the above
  * always holds true */
-	int ret = 0, handler_ret = 0;
+	int ret = 0, handler_ret = 0, handled;
+	struct packet_timing pt;
+
+	packet_timing_start(&pt);
 
 	phc->mp.call = phc->mp.sfd->call;
 
 	rwlock_lock_r(&phc->mp.call->master_lock);
+	packet_timing_stage(&pt, PACKET_STAGE_CALL_LOCK);
 
 	phc->mp.stream = phc->mp.sfd->stream;
 	if (G_UNLIKELY(!phc->mp.stream))
@@ -1720,6 +2021,7 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 
 	// this set payload_type, ssrc_in, ssrc_out and mp
 	media_packet_rtp(phc);
+	packet_timing_stage(&pt, PACKET_STAGE_DEMUX);
 
 
 	/* do we have somewhere to forward it to? */
@@ -1729,48 +2031,73 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	{
 		ilog(LOG_WARNING, "RTP packet from %s discarded", endpoint_print_buf(&phc->mp.fsin));
 		atomic64_inc(&phc->mp.stream->stats.errors);
-		atomic64_inc(&rtpe_statsps.errors);
+		RTPE_STATS_INC(errors);
 		goto out;
 	}
 
 
 	handler_ret = media_packet_decrypt(phc);
+	packet_timing_stage(&pt, PACKET_STAGE_DECRYPT);
+
+	// RTCP forwarded by the kernel module: this is only a sampled copy, so
+	// gather the stats from it but don't forward it again. anything else the
+	// kernel passes up is handled as usual
+	if (phc->rtcp && rtpe_config.kernel_rtcp_mark_mask
+			&& (phc->mark & rtpe_config.kernel_rtcp_mark_mask) == rtpe_config.kernel_rtcp_mark)
+	{
+		if (handler_ret >= 0) {
+			GQueue rtcp_list = G_QUEUE_INIT;
+			phc->mp.raw = phc->s;
+			rtcp_parse(&rtcp_list, &phc->mp);
+			rtcp_list_free(&rtcp_list);
+		}
+		goto out;
+	}
 
 	// If recording pcap dumper is set, then we record the call.
-	if (phc->mp.call->recording)
+	if (phc->mp.call->recording) {
 		dump_packet(&phc->mp, &phc->s);
+		packet_timing_stage(&pt, PACKET_STAGE_RECORDING);
+	}
 
 	// ready to process
 
 	phc->mp.raw = phc->s;
 
 	if (phc->rtcp) {
-		if (do_rtcp(phc))
-			goto drop;
+		handled = do_rtcp(phc);
+		packet_timing_stage(&pt, PACKET_STAGE_RTCP);
 	}
 	else {
 		struct codec_handler *transcoder = codec_handler_get(phc->mp.media, phc->payload_type);
 		// this transfers the packet from 's' to 'packets_out'
-		if (transcoder->func(transcoder, &phc->mp))
-			goto drop;
+		handled = transcoder->func(transcoder, &phc->mp);
+		packet_timing_stage(&pt, PACKET_STAGE_CODEC);
 	}
+	if (handled)
+		goto drop;
 
 	if (G_LIKELY(handler_ret >= 0))
 		handler_ret = __media_packet_encrypt(phc);
 
 	if (phc->unkernelize) // for RTCP packet index updates
 		unkernelize(phc->mp.stream);
+	packet_timing_stage(&pt, PACKET_STAGE_ENCRYPT);
 
 
 	int address_check = media_packet_address_check(phc);
+	packet_timing_stage(&pt, PACKET_STAGE_ADDRESS_CHECK);
 	if (address_check)
 		goto drop;
 
-	if (phc->kernelize)
+	if (phc->kernelize) {
 		media_packet_kernel_check(phc);
+		packet_timing_stage(&pt, PACKET_STAGE_KERNEL_CHECK);
+	}
 
 
 	mutex_lock(&phc->sink->out_lock);
+	packet_timing_stage(&pt, PACKET_STAGE_SINK_LOCK);
 
 	if (!phc->sink->advertised_endpoint.port
 			|| (is_addr_unspecified(&phc->sink->advertised_endpoint.address)
@@ -1784,12 +2111,13 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	ret = media_socket_dequeue(&phc->mp, phc->sink);
 
 	mutex_unlock(&phc->sink->out_lock);
+	packet_timing_stage(&pt, PACKET_STAGE_SEND);
 
 	if (ret == -1) {
 		ret = -errno;
                 ilog(LOG_DEBUG,"Error when sending message. Error: %s",strerror(errno));
 		atomic64_inc(&phc->mp.stream->stats.errors);
-		atomic64_inc(&rtpe_statsps.errors);
+		RTPE_STATS_INC(errors);
 		goto out;
 	}
 
@@ -1799,8 +2127,9 @@ drop:
 	atomic64_inc(&phc->mp.stream->stats.packets);
 	atomic64_add(&phc->mp.stream->stats.bytes, phc->s.len);
 	atomic64_set(&phc->mp.stream->last_packet, rtpe_now.tv_sec);
-	atomic64_inc(&rtpe_statsps.packets);
-	atomic64_add(&rtpe_statsps.bytes, phc->s.len);
+	RTPE_STATS_INC(packets);
+	RTPE_STATS_ADD(bytes, phc->s.len);
+	thread_stats_intf_add(phc->mp.sfd->local_intf->spec->stats_idx, 1, phc->s.len);
 
 out:
 	if (phc->unkernelize) {
@@ -1822,6 +2151,8 @@ out:
 		phc->mp.ssrc_out = NULL;
 	}
 
+	packet_timing_done(&pt);
+
 	return ret;
 }
 
@@ -1852,7 +2183,7 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 		phc.mp.sfd = sfd;
 
 		ret = socket_recvfrom_ts(&sfd->socket, buf + RTP_BUFFER_HEAD_ROOM, MAX_RTP_PACKET_SIZE,
-				&phc.mp.fsin, &phc.mp.tv);
+				&phc.mp.fsin, &phc.mp.tv, &phc.mark);
 
 		if (ret < 0) {
 			if (errno == EINTR)
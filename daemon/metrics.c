@@ -0,0 +1,435 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+
+#include "poller.h"
+#include "aux.h"
+#include "log.h"
+#include "call.h"
+#include "control_ng.h"
+#include "media_socket.h"
+#include "streambuf.h"
+#include "tcp_listener.h"
+#include "statistics.h"
+
+
+#define METRICS_MAX_REQUEST 4096
+#define METRICS_VALUE_WIDTH 20
+
+// the text is built once and then kept. on each scrape, the values are collected again
+// in the same order and only those that changed are rewritten in place. values are
+// right-aligned in fixed width fields for that
+struct metrics_slot {
+	size_t			off;
+	int			width;
+	uint64_t		raw;
+};
+
+struct metrics_buf {
+	GString			*s;
+	GArray			*slots;
+	unsigned int		idx;
+	gboolean		update;
+	// the set of samples has changed since the text was built
+	gboolean		stale;
+
+	// series that are left out while they're zero
+	gboolean		ng_present[__NGC_MAX];
+	gboolean		stage_present[__PACKET_STAGES];
+	unsigned int		num_intf;
+};
+
+static mutex_t metrics_lock = MUTEX_STATIC_INIT;
+static struct metrics_buf metrics_text;
+
+
+static void metrics_header(struct metrics_buf *b, const char *name, const char *type, const char *help) {
+	if (b->update)
+		return;
+	g_string_append_printf(b->s, "# HELP rtpengine_%s %s\n# TYPE rtpengine_%s %s\n", name, help, name, type);
+}
+
+// `unit` of zero prints `raw` as an integer, otherwise scaled with `prec` decimals
+static int metrics_format(char *buf, size_t len, uint64_t raw, double unit, int prec) {
+	if (!unit)
+		return snprintf(buf, len, "%" PRIu64, raw);
+	return snprintf(buf, len, "%.*f", prec, raw * unit);
+}
+
+// the value of a sample whose name and labels have just been appended
+static void metrics_slot(struct metrics_buf *b, uint64_t raw, double unit, int prec) {
+	char buf[64];
+	int len;
+
+	if (!b->update) {
+		len = metrics_format(buf, sizeof(buf), raw, unit, prec);
+		struct metrics_slot sl = {
+			.off = b->s->len,
+			.width = MAX(len, METRICS_VALUE_WIDTH),
+			.raw = raw,
+		};
+		g_string_append_printf(b->s, "%*s\n", sl.width, buf);
+		g_array_append_val(b->slots, sl);
+		return;
+	}
+
+	if (b->stale)
+		return;
+	if (b->idx >= b->slots->len) {
+		b->stale = TRUE;
+		return;
+	}
+	struct metrics_slot *sl = &g_array_index(b->slots, struct metrics_slot, b->idx++);
+	if (sl->raw == raw)
+		return;
+	len = metrics_format(buf, sizeof(buf), raw, unit, prec);
+	if (len > sl->width) {
+		b->stale = TRUE;
+		return;
+	}
+	memset(b->s->str + sl->off, ' ', sl->width - len);
+	memcpy(b->s->str + sl->off + sl->width - len, buf, len);
+	sl->raw = raw;
+}
+
+static void metrics_value(struct metrics_buf *b, const char *name, const char *labels, uint64_t val) {
+	if (!b->update)
+		g_string_append_printf(b->s, "rtpengine_%s%s%s%s ", name,
+				labels ? "{" : "", labels ? labels : "", labels ? "}" : "");
+	metrics_slot(b, val, 0, 0);
+}
+
+static void metrics_scalar(struct metrics_buf *b, const char *name, const char *type, const char *help,
+		uint64_t val)
+{
+	metrics_header(b, name, type, help);
+	metrics_value(b, name, NULL, val);
+}
+
+// returns whether an optional series is to be included, and notes if that has changed
+static gboolean metrics_present(struct metrics_buf *b, gboolean *present, gboolean now) {
+	if (!b->update)
+		*present = now;
+	else if (*present != now)
+		b->stale = TRUE;
+	return *present;
+}
+
+static void metrics_label_escape(GString *s, const char *v, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		switch (v[i]) {
+			case '\\':
+				g_string_append(s, "\\\\");
+				break;
+			case '"':
+				g_string_append(s, "\\\"");
+				break;
+			case '\n':
+				g_string_append(s, "\\n");
+				break;
+			default:
+				g_string_append_c(s, v[i]);
+		}
+	}
+}
+
+// `buckets` are not cumulative and have one more entry than `bounds`. `unit` converts
+// the bounds and the sum to seconds
+static void metrics_histogram(struct metrics_buf *b, const char *name, const char *labels,
+		const atomic64 *buckets, unsigned int num, const unsigned int *bounds, double unit,
+		uint64_t count, uint64_t sum)
+{
+	const char *sep = labels ? "," : "";
+	uint64_t cum = 0;
+	GString *s = b->s;
+
+	if (!labels)
+		labels = "";
+
+	for (unsigned int i = 0; i < num; i++) {
+		cum += atomic64_get(&buckets[i]);
+		if (!b->update) {
+			if (i < num - 1)
+				g_string_append_printf(s, "rtpengine_%s_bucket{%s%sle=\"%g\"} ",
+						name, labels, sep, bounds[i] * unit);
+			else
+				g_string_append_printf(s, "rtpengine_%s_bucket{%s%sle=\"+Inf\"} ",
+						name, labels, sep);
+		}
+		metrics_slot(b, cum, 0, 0);
+	}
+	if (!b->update)
+		g_string_append_printf(s, "rtpengine_%s_sum%s%s%s ", name,
+				*labels ? "{" : "", labels, *labels ? "}" : "");
+	metrics_slot(b, sum, unit, 9);
+	if (!b->update)
+		g_string_append_printf(s, "rtpengine_%s_count%s%s%s ", name,
+				*labels ? "{" : "", labels, *labels ? "}" : "");
+	metrics_slot(b, count, 0, 0);
+}
+
+static void metrics_latency_histogram(struct metrics_buf *b, const char *name, const char *help,
+		const struct latency_histogram *h)
+{
+	metrics_header(b, name, "histogram", help);
+	metrics_histogram(b, name, NULL, h->buckets, LATENCY_BUCKETS, latency_bucket_us, 1e-6,
+			atomic64_get(&h->count), atomic64_get(&h->sum));
+}
+
+static void metrics_packet_stages(struct metrics_buf *b, const struct stats_counters *c) {
+	char labels[64] = "";
+
+	metrics_header(b, "packet_stage_duration_seconds", "histogram",
+			"Time spent in each part of userspace packet processing, for sampled packets");
+	for (int i = 0; i < __PACKET_STAGES; i++) {
+		const struct latency_histogram *h = &c->packet_stages[i];
+		uint64_t count = atomic64_get_na(&h->count);
+		if (!metrics_present(b, &b->stage_present[i], count != 0))
+			continue;
+		if (!b->update)
+			snprintf(labels, sizeof(labels), "stage=\"%s\"", packet_stage_names[i]);
+		metrics_histogram(b, "packet_stage_duration_seconds", labels, h->buckets, LATENCY_BUCKETS,
+				packet_stage_bucket_ns, 1e-9, count, atomic64_get_na(&h->sum));
+	}
+}
+
+static void metrics_interfaces(struct metrics_buf *b, const struct stats_counters *c) {
+	if (b->update && b->num_intf != c->num_intf)
+		b->stale = TRUE;
+	b->num_intf = c->num_intf;
+
+	if (!c->num_intf)
+		return;
+
+	// the same address can appear in several logical interfaces, report it once. samples
+	// of one metric must be grouped together, so this goes over the interfaces twice
+	gboolean seen[c->num_intf];
+	GString *labels = g_string_new("");
+
+	for (int bytes = 0; bytes < 2; bytes++) {
+		const char *name = bytes ? "interface_bytes_total" : "interface_packets_total";
+
+		memset(seen, 0, sizeof(seen));
+		metrics_header(b, name, "counter", bytes ? "Bytes relayed per local address"
+				: "Packets relayed per local address");
+
+		for (GList *l = all_local_interfaces.head; l; l = l->next) {
+			struct local_intf *ifc = l->data;
+			unsigned int idx = ifc->spec->stats_idx;
+			if (idx >= c->num_intf || seen[idx])
+				continue;
+			seen[idx] = TRUE;
+
+			if (!b->update) {
+				g_string_assign(labels, "interface=\"");
+				metrics_label_escape(labels, ifc->logical->name.s, ifc->logical->name.len);
+				g_string_append_printf(labels, "\",address=\"%s\"",
+						sockaddr_print_buf(&ifc->spec->local_address.addr));
+			}
+
+			metrics_value(b, name, labels->str, bytes ? atomic64_get_na(&c->intf[idx].bytes)
+					: atomic64_get_na(&c->intf[idx].packets));
+		}
+	}
+
+	g_string_free(labels, TRUE);
+}
+
+static void metrics_ng_commands(struct metrics_buf *b) {
+	char labels[64] = "";
+
+	metrics_header(b, "ng_command_duration_seconds", "histogram",
+			"Time from receiving an NG command until the response was sent");
+	for (int i = 0; i < __NGC_MAX; i++) {
+		struct ng_command_stats *st = &rtpe_ng_command_stats[i];
+		uint64_t count = atomic64_get(&st->count);
+		if (!metrics_present(b, &b->ng_present[i], count != 0))
+			continue;
+		if (!b->update)
+			snprintf(labels, sizeof(labels), "command=\"%s\"", ng_command_names[i]);
+		metrics_histogram(b, "ng_command_duration_seconds", labels, st->latency, NG_LATENCY_BUCKETS,
+				ng_latency_bucket_us, 1e-6, count, atomic64_get(&st->time_us));
+	}
+}
+
+static void metrics_collect(struct metrics_buf *b) {
+	struct stats_counters *c = stats_counters_total();
+	uint64_t u_packets = atomic64_get_na(&c->packets) - atomic64_get_na(&c->kernel_packets);
+	uint64_t u_bytes = atomic64_get_na(&c->bytes) - atomic64_get_na(&c->kernel_bytes);
+
+	metrics_header(b, "packets_total", "counter", "Packets relayed");
+	metrics_value(b, "packets_total", "path=\"userspace\"", u_packets);
+	metrics_value(b, "packets_total", "path=\"kernel\"", atomic64_get_na(&c->kernel_packets));
+	metrics_header(b, "bytes_total", "counter", "Bytes relayed");
+	metrics_value(b, "bytes_total", "path=\"userspace\"", u_bytes);
+	metrics_value(b, "bytes_total", "path=\"kernel\"", atomic64_get_na(&c->kernel_bytes));
+	metrics_scalar(b, "errors_total", "counter", "Packets that could not be relayed",
+			atomic64_get_na(&c->errors));
+
+	metrics_scalar(b, "packets_per_second", "gauge", "Packets relayed during the last second",
+			atomic64_get(&rtpe_stats.packets));
+	metrics_scalar(b, "bytes_per_second", "gauge", "Bytes relayed during the last second",
+			atomic64_get(&rtpe_stats.bytes));
+	metrics_scalar(b, "errors_per_second", "gauge", "Relay errors during the last second",
+			atomic64_get(&rtpe_stats.errors));
+
+	metrics_interfaces(b, c);
+
+	metrics_scalar(b, "transcode_packets_total", "counter", "Packets decoded for transcoding",
+			atomic64_get_na(&c->transcode_packets));
+	metrics_header(b, "transcode_cpu_seconds_total", "counter", "CPU time spent decoding and re-encoding");
+	if (!b->update)
+		g_string_append(b->s, "rtpengine_transcode_cpu_seconds_total ");
+	metrics_slot(b, atomic64_get_na(&c->transcode_cpu_ns), 1e-9, 6);
+
+	metrics_ng_commands(b);
+	metrics_latency_histogram(b, "redis_write_duration_seconds", "Time taken to write a call to Redis",
+			&rtpe_redis_write_latency);
+	metrics_latency_histogram(b, "timer_lag_seconds", "Delay between when a timer was due and when it ran",
+			&c->timer_lag);
+	metrics_packet_stages(b, c);
+
+	rwlock_lock_r(&rtpe_callhash_lock);
+	uint64_t total = g_hash_table_size(rtpe_callhash);
+	rwlock_unlock_r(&rtpe_callhash_lock);
+	uint64_t foreign = atomic64_get(&rtpe_stats.foreign_sessions);
+	metrics_header(b, "sessions", "gauge", "Current sessions");
+	metrics_value(b, "sessions", "type=\"own\"", total - foreign);
+	metrics_value(b, "sessions", "type=\"foreign\"", foreign);
+
+	struct port_pool_stats pps;
+	port_pool_stats(&pps);
+	metrics_scalar(b, "port_allocations_total", "counter", "Local port allocations", pps.allocs);
+	metrics_scalar(b, "port_allocation_failures_total", "counter", "Failed local port allocations",
+			pps.failures);
+	metrics_scalar(b, "free_ports", "gauge", "Local ports available for allocation", pps.free_ports);
+
+	struct socket_pool_stats sps;
+	socket_pool_stats(&sps);
+	metrics_header(b, "socket_pool_requests_total", "counter", "Requests for a pre-opened port pair");
+	metrics_value(b, "socket_pool_requests_total", "result=\"hit\"", sps.hits);
+	metrics_value(b, "socket_pool_requests_total", "result=\"miss\"", sps.misses);
+	metrics_scalar(b, "socket_pool_available", "gauge", "Pre-opened port pairs available", sps.available);
+
+	metrics_scalar(b, "ng_queued_commands", "gauge", "NG commands waiting for a worker",
+			control_ng_queue_depth());
+	metrics_scalar(b, "ng_commands_in_progress", "gauge", "NG commands being processed by a worker",
+			control_ng_in_flight());
+	metrics_scalar(b, "log_dropped_messages_total", "counter", "Log messages dropped because a buffer was full",
+			log_dropped_messages());
+
+	free(c);
+}
+
+// brings the text up to date, rebuilding it only if the set of samples has changed
+static void metrics_update(struct metrics_buf *b) {
+	if (!b->s) {
+		b->s = g_string_sized_new(16384);
+		b->slots = g_array_new(FALSE, FALSE, sizeof(struct metrics_slot));
+	}
+
+	if (b->s->len) {
+		b->update = TRUE;
+		b->stale = FALSE;
+		b->idx = 0;
+		metrics_collect(b);
+		if (!b->stale && b->idx == b->slots->len)
+			return;
+	}
+
+	b->update = FALSE;
+	g_string_truncate(b->s, 0);
+	g_array_set_size(b->slots, 0);
+	metrics_collect(b);
+}
+
+static void metrics_send(struct streambuf_stream *s, const char *status, const char *body, size_t len) {
+	streambuf_printf(s->outbuf, "HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, len);
+	streambuf_write(s->outbuf, body, len);
+}
+
+static void metrics_stream_readable(struct streambuf_stream *s) {
+	struct streambuf *b = s->inbuf;
+	int is_metrics;
+
+	mutex_lock(&b->lock);
+	if (!g_strstr_len(b->buf->str, b->buf->len, "\r\n\r\n")
+			&& !g_strstr_len(b->buf->str, b->buf->len, "\n\n"))
+	{
+		unsigned int len = b->buf->len;
+		mutex_unlock(&b->lock);
+		if (len > METRICS_MAX_REQUEST) {
+			ilog(LOG_INFO, "Request too long in metrics connection from %s", s->addr);
+			streambuf_stream_close(s);
+		}
+		return;
+	}
+	is_metrics = (!strncmp(b->buf->str, "GET /metrics ", 13)
+			|| !strncmp(b->buf->str, "GET /metrics?", 13));
+	g_string_truncate(b->buf, 0);
+	mutex_unlock(&b->lock);
+
+	if (!is_metrics) {
+		static const char not_found[] = "Not found\n";
+		metrics_send(s, "404 Not Found", not_found, sizeof(not_found) - 1);
+		streambuf_stream_shutdown(s);
+		return;
+	}
+
+	mutex_lock(&metrics_lock);
+	metrics_update(&metrics_text);
+	metrics_send(s, "200 OK", metrics_text.s->str, metrics_text.s->len);
+	mutex_unlock(&metrics_lock);
+
+	streambuf_stream_shutdown(s);
+}
+
+static void metrics_incoming(struct streambuf_stream *s) {
+	ilog(LOG_DEBUG, "New metrics connection from %s", s->addr);
+}
+
+struct metrics *metrics_new(struct poller *p, endpoint_t *ep) {
+	struct metrics *m;
+
+	if (!p)
+		return NULL;
+
+	m = obj_alloc0("metrics", sizeof(*m), NULL);
+
+	if (streambuf_listener_init(&m->listeners[0], p, ep,
+				metrics_incoming, metrics_stream_readable,
+				NULL,
+				NULL,
+				&m->obj))
+	{
+		ilog(LOG_ERR, "Failed to open TCP metrics port: %s", strerror(errno));
+		goto fail;
+	}
+	if (ipv46_any_convert(ep)) {
+		if (streambuf_listener_init(&m->listeners[1], p, ep,
+					metrics_incoming, metrics_stream_readable,
+					NULL,
+					NULL,
+					&m->obj))
+		{
+			ilog(LOG_ERR, "Failed to open TCP metrics port: %s", strerror(errno));
+			goto fail;
+		}
+	}
+
+	m->poller = p;
+
+	obj_put(m);
+	return m;
+
+fail:
+	obj_put(m);
+	return NULL;
+}
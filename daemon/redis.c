@@ -2172,11 +2172,13 @@ char* redis_encode_json(struct call *c) {
 
 void redis_update_onekey(struct call *c, struct redis *r) {
 	unsigned int redis_expires_s;
+	struct timeval start, end;
 
 	if (!r)
 		return;
 
 	mutex_lock(&r->lock);
+	gettimeofday(&start, NULL);
 	// coverity[sleep : FALSE]
 	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
 		mutex_unlock(&r->lock);
@@ -2202,6 +2204,9 @@ void redis_update_onekey(struct call *c, struct redis *r) {
 
 	redis_consume(r);
 
+	gettimeofday(&end, NULL);
+	latency_histogram_add(&rtpe_redis_write_latency, timeval_diff(&end, &start));
+
 	if (result)
 		free(result);
 	mutex_unlock(&r->lock);
@@ -39,15 +39,55 @@ struct sdp_connection {
 	int parsed:1;
 };
 
+enum attr_id {
+	ATTR_OTHER = 0,
+	ATTR_RTCP,
+	ATTR_CANDIDATE,
+	ATTR_ICE,
+	ATTR_ICE_LITE,
+	ATTR_ICE_OPTIONS,
+	ATTR_ICE_UFRAG,
+	ATTR_ICE_PWD,
+	ATTR_CRYPTO,
+	ATTR_SSRC,
+	ATTR_INACTIVE,
+	ATTR_SENDRECV,
+	ATTR_SENDONLY,
+	ATTR_RECVONLY,
+	ATTR_RTCP_MUX,
+	ATTR_EXTMAP,
+	ATTR_GROUP,
+	ATTR_MID,
+	ATTR_FINGERPRINT,
+	ATTR_SETUP,
+	ATTR_RTPMAP,
+	ATTR_FMTP,
+	ATTR_IGNORE,
+	ATTR_RTPENGINE,
+	ATTR_PTIME,
+	ATTR_END_OF_CANDIDATES,
+
+	__ATTR_LAST
+};
+
 struct sdp_attributes {
 	GQueue list;
-	/* GHashTable *name_hash; */
-	/* GHashTable *name_lists_hash; */
-	GHashTable *id_lists_hash;
-	GHashTable *id_hash;
+	// indexed by attribute ID: first attribute of each type and list of all of them
+	struct sdp_attribute *id[__ATTR_LAST];
+	GQueue id_lists[__ATTR_LAST];
+};
+
+// memory for everything that belongs to a parsed session: its media sections, attributes, and
+// the list links for them. freed all at once.
+struct sdp_chunk {
+	struct sdp_chunk *next;
+	size_t used;
+	size_t size;
+	char buf[];
 };
 
 struct sdp_session {
+	struct sdp_chunk *chunks;
 	str s;
 	struct sdp_origin origin;
 	struct sdp_connection connection;
@@ -71,7 +111,7 @@ struct sdp_media {
 	struct sdp_connection connection;
 	int rr, rs;
 	struct sdp_attributes attributes;
-	GQueue format_list; /* list of slice-alloc'd str objects */
+	GQueue format_list; /* list of str objects in the session's chunks */
 };
 
 struct attribute_rtcp {
@@ -177,34 +217,7 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 	    key,	/* "rtpmap:8" */
 	    param;	/* "PCMA/8000" */
 
-	enum {
-		ATTR_OTHER = 0,
-		ATTR_RTCP,
-		ATTR_CANDIDATE,
-		ATTR_ICE,
-		ATTR_ICE_LITE,
-		ATTR_ICE_OPTIONS,
-		ATTR_ICE_UFRAG,
-		ATTR_ICE_PWD,
-		ATTR_CRYPTO,
-		ATTR_SSRC,
-		ATTR_INACTIVE,
-		ATTR_SENDRECV,
-		ATTR_SENDONLY,
-		ATTR_RECVONLY,
-		ATTR_RTCP_MUX,
-		ATTR_EXTMAP,
-		ATTR_GROUP,
-		ATTR_MID,
-		ATTR_FINGERPRINT,
-		ATTR_SETUP,
-		ATTR_RTPMAP,
-		ATTR_FMTP,
-		ATTR_IGNORE,
-		ATTR_RTPENGINE,
-		ATTR_PTIME,
-		ATTR_END_OF_CANDIDATES,
-	} attr;
+	enum attr_id attr;
 
 	union {
 		struct attribute_rtcp rtcp;
@@ -217,6 +230,9 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 		struct attribute_rtpmap rtpmap;
 		struct attribute_fmtp fmtp;
 	} u;
+
+	GList link, // in sdp_attributes.list
+	      id_link; // in sdp_attributes.id_lists
 };
 
 
@@ -227,11 +243,66 @@ static const str instance_id = STR_CONST_INIT(__id_buf);
 
 
 
+// SDP chunks are recycled per thread
+#define SDP_CHUNK_SIZE 16384
+#define SDP_CHUNK_CACHE 8
+
+static __thread struct sdp_chunk *sdp_chunk_cache;
+static __thread unsigned int sdp_chunk_cache_len;
+
+// returns NULL if a new chunk can't be allocated
+static void *sdp_alloc0(struct sdp_session *session, size_t len) {
+	struct sdp_chunk *c = session->chunks;
+
+	len = (len + 7) & ~7UL;
+
+	if (!c || c->used + len > c->size) {
+		if (len <= SDP_CHUNK_SIZE && sdp_chunk_cache) {
+			c = sdp_chunk_cache;
+			sdp_chunk_cache = c->next;
+			sdp_chunk_cache_len--;
+		}
+		else {
+			size_t size = MAX(len, SDP_CHUNK_SIZE);
+			c = malloc(sizeof(*c) + size);
+			if (!c)
+				return NULL;
+			c->size = size;
+		}
+		c->used = 0;
+		c->next = session->chunks;
+		session->chunks = c;
+	}
+
+	void *ret = c->buf + c->used;
+	c->used += len;
+	memset(ret, 0, len);
+	return ret;
+}
+
+static void sdp_chunks_free(struct sdp_chunk *c) {
+	struct sdp_chunk *next;
+
+	for (; c; c = next) {
+		next = c->next;
+		if (c->size != SDP_CHUNK_SIZE || sdp_chunk_cache_len >= SDP_CHUNK_CACHE) {
+			free(c);
+			continue;
+		}
+		c->next = sdp_chunk_cache;
+		sdp_chunk_cache = c;
+		sdp_chunk_cache_len++;
+	}
+}
+
+
 INLINE struct sdp_attribute *attr_get_by_id(struct sdp_attributes *a, int id) {
-	return g_hash_table_lookup(a->id_hash, &id);
+	return a->id[id];
 }
 INLINE GQueue *attr_list_get_by_id(struct sdp_attributes *a, int id) {
-	return g_hash_table_lookup(a->id_lists_hash, &id);
+	if (!a->id_lists[id].length)
+		return NULL;
+	return &a->id_lists[id];
 }
 
 static struct sdp_attribute *attr_get_by_id_m_s(struct sdp_media *m, int id) {
@@ -317,6 +388,7 @@ static int parse_connection(str *value_str, struct sdp_connection *output) {
 static int parse_media(str *value_str, struct sdp_media *output) {
 	char *ep;
 	str *sp;
+	GList *link;
 
 	EXTRACT_TOKEN(media_type);
 	EXTRACT_TOKEN(port);
@@ -343,24 +415,18 @@ static int parse_media(str *value_str, struct sdp_media *output) {
 	str formats = output->formats;
 	str format;
 	while (!str_token_sep(&format, &formats, ' ')) {
-		sp = g_slice_alloc(sizeof(*sp));
+		sp = sdp_alloc0(output->session, sizeof(*sp));
+		link = sdp_alloc0(output->session, sizeof(*link));
+		if (!sp || !link)
+			return -1;
 		*sp = format;
-		g_queue_push_tail(&output->format_list, sp);
+		link->data = sp;
+		g_queue_push_tail_link(&output->format_list, link);
 	}
 
 	return 0;
 }
 
-static void attrs_init(struct sdp_attributes *a) {
-	g_queue_init(&a->list);
-	/* a->name_hash = g_hash_table_new(str_hash, str_equal); */
-	a->id_hash = g_hash_table_new(g_int_hash, g_int_equal);
-	/* a->name_lists_hash = g_hash_table_new_full(str_hash, str_equal,
-			NULL, (GDestroyNotify) g_queue_free); */
-	a->id_lists_hash = g_hash_table_new_full(g_int_hash, g_int_equal,
-			NULL, (GDestroyNotify) g_queue_free);
-}
-
 static int parse_attribute_group(struct sdp_attribute *output) {
 	output->attr = ATTR_GROUP;
 
@@ -882,7 +948,6 @@ int sdp_parse(str *body, GQueue *sessions, const struct sdp_ng_flags *flags) {
 	struct sdp_attributes *attrs;
 	struct sdp_attribute *attr;
 	str *adj_s;
-	GQueue *attr_queue;
 
 	b = body->s;
 	end = str_end(body);
@@ -932,8 +997,6 @@ int sdp_parse(str *body, GQueue *sessions, const struct sdp_ng_flags *flags) {
 
 new_session:
 				session = g_slice_alloc0(sizeof(*session));
-				g_queue_init(&session->media_streams);
-				attrs_init(&session->attributes);
 				g_queue_push_tail(sessions, session);
 				media = NULL;
 				session->s.s = b;
@@ -952,9 +1015,11 @@ new_session:
 				break;
 
 			case 'm':
-				media = g_slice_alloc0(sizeof(*media));
+				errstr = "Out of memory";
+				media = sdp_alloc0(session, sizeof(*media));
+				if (!media)
+					goto error;
 				media->session = session;
-				attrs_init(&media->attributes);
 				errstr = "Error parsing m= line";
 				if (parse_media(&value_str, media))
 					goto error;
@@ -973,7 +1038,10 @@ new_session:
 				break;
 
 			case 'a':
-				attr = g_slice_alloc0(sizeof(*attr));
+				errstr = "Out of memory";
+				attr = sdp_alloc0(session, sizeof(*attr));
+				if (!attr)
+					goto error;
 
 				attr->full_line.s = b;
 				attr->full_line.len = next_line ? (next_line - b) : (line_end - b);
@@ -981,23 +1049,16 @@ new_session:
 				attr->line_value.s = value;
 				attr->line_value.len = line_end - value;
 
-				if (parse_attribute(attr)) {
-					g_slice_free1(sizeof(*attr), attr);
+				if (parse_attribute(attr))
 					break;
-				}
 
 				attrs = media ? &media->attributes : &session->attributes;
-				g_queue_push_tail(&attrs->list, attr);
-				/* g_hash_table_insert(attrs->name_hash, &attr->name, attr); */
-				if (!g_hash_table_lookup(attrs->id_hash, &attr->attr))
-					g_hash_table_insert(attrs->id_hash, &attr->attr, attr);
-				/* if (attr->key.s)
-					g_hash_table_insert(attrs->name_hash, &attr->key, attr); */
-
-				/* attr_queue = g_hash_table_lookup_queue_new(attrs->name_lists_hash, &attr->name);
-				g_queue_push_tail(attr_queue, attr); */
-				attr_queue = g_hash_table_lookup_queue_new(attrs->id_lists_hash, &attr->attr);
-				g_queue_push_tail(attr_queue, attr);
+				attr->link.data = attr;
+				g_queue_push_tail_link(&attrs->list, &attr->link);
+				if (!attrs->id[attr->attr])
+					attrs->id[attr->attr] = attr;
+				attr->id_link.data = attr;
+				g_queue_push_tail_link(&attrs->id_lists[attr->attr], &attr->id_link);
 
 				break;
 
@@ -1047,26 +1108,11 @@ error:
 	return -1;
 }
 
-static void attr_free(void *p) {
-	g_slice_free1(sizeof(struct sdp_attribute), p);
-}
-static void free_attributes(struct sdp_attributes *a) {
-	/* g_hash_table_destroy(a->name_hash); */
-	g_hash_table_destroy(a->id_hash);
-	/* g_hash_table_destroy(a->name_lists_hash); */
-	g_hash_table_destroy(a->id_lists_hash);
-	g_queue_clear_full(&a->list, attr_free);
-}
-static void media_free(void *p) {
-	struct sdp_media *media = p;
-	free_attributes(&media->attributes);
-	g_queue_clear_full(&media->format_list, str_slice_free);
-	g_slice_free1(sizeof(*media), media);
-}
 static void session_free(void *p) {
 	struct sdp_session *session = p;
-	g_queue_clear_full(&session->media_streams, media_free);
-	free_attributes(&session->attributes);
+	// media sections and attributes all live in the chunks
+	g_queue_clear(&session->media_streams);
+	sdp_chunks_free(session->chunks);
 	g_slice_free1(sizeof(*session), session);
 }
 void sdp_free(GQueue *sessions) {
@@ -1385,7 +1431,28 @@ INLINE void chopper_append_str(struct sdp_chopper *c, const str *s) {
 	chopper_append(c, s->s, s->len);
 }
 
-#define chopper_append_printf(c, f...) g_string_append_printf((c)->output, f)
+// decimal formatting without going through printf, written back to front
+INLINE void chopper_append_uint(struct sdp_chopper *c, unsigned long long u) {
+	char buf[20];
+	char *o = buf + sizeof(buf);
+	do {
+		*--o = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	chopper_append(c, o, buf + sizeof(buf) - o);
+}
+INLINE void chopper_append_char(struct sdp_chopper *c, char ch) {
+	g_string_append_c(c->output, ch);
+}
+
+// makes sure the output won't have to be reallocated while it's being written
+static void chopper_reserve(struct sdp_chopper *c, size_t len) {
+	gsize cur = c->output->len;
+	if (c->output->allocated_len > cur + len)
+		return;
+	g_string_set_size(c->output, cur + len);
+	g_string_truncate(c->output, cur);
+}
 
 static int copy_up_to_ptr(struct sdp_chopper *chop, const char *b) {
 	int offset, len;
@@ -1463,7 +1530,8 @@ static int replace_codec_list(struct sdp_chopper *chop,
 
 	for (GList *l = cm->codecs_prefs_recv.head; l; l = l->next) {
 		struct rtp_payload_type *pt = l->data;
-		chopper_append_printf(chop, " %u", pt->payload_type);
+		chopper_append_char(chop, ' ');
+		chopper_append_uint(chop, pt->payload_type);
 	}
 	if (skip_over(chop, &media->formats))
 		return -1;
@@ -1475,17 +1543,21 @@ static void insert_codec_parameters(struct sdp_chopper *chop, struct call_media
 		struct rtp_payload_type *pt = l->data;
 		if (!pt->encoding_with_params.len)
 			continue;
-		chopper_append_printf(chop, "a=rtpmap:%u " STR_FORMAT "\r\n",
-				pt->payload_type,
-				STR_FMT(&pt->encoding_with_params));
+		chopper_append_c(chop, "a=rtpmap:");
+		chopper_append_uint(chop, pt->payload_type);
+		chopper_append_char(chop, ' ');
+		chopper_append_str(chop, &pt->encoding_with_params);
+		chopper_append_c(chop, "\r\n");
 	}
 	for (GList *l = cm->codecs_prefs_recv.head; l; l = l->next) {
 		struct rtp_payload_type *pt = l->data;
 		if (!pt->format_parameters.len)
 			continue;
-		chopper_append_printf(chop, "a=fmtp:%u " STR_FORMAT "\r\n",
-				pt->payload_type,
-				STR_FMT(&pt->format_parameters));
+		chopper_append_c(chop, "a=fmtp:");
+		chopper_append_uint(chop, pt->payload_type);
+		chopper_append_char(chop, ' ');
+		chopper_append_str(chop, &pt->format_parameters);
+		chopper_append_c(chop, "\r\n");
 	}
 }
 
@@ -1500,7 +1572,7 @@ static int replace_media_port(struct sdp_chopper *chop, struct sdp_media *media,
 		return -1;
 
 	p = ps->selected_sfd ? ps->selected_sfd->socket.local.port : 0;
-	chopper_append_printf(chop, "%u", p);
+	chopper_append_uint(chop, p);
 
 	if (skip_over(chop, port))
 		return -1;
@@ -1529,7 +1601,8 @@ warn:
 		}
 	}
 
-	chopper_append_printf(chop, "/%i", cons);
+	chopper_append_char(chop, '/');
+	chopper_append_uint(chop, cons);
 
 	return 0;
 }
@@ -1538,9 +1611,10 @@ static int insert_ice_address(struct sdp_chopper *chop, struct stream_fd *sfd) {
 	char buf[64];
 	int len;
 
-	call_stream_address46(buf, sfd->stream, SAF_ICE, &len, sfd->local_intf, 0);
+	call_stream_address46(buf, sizeof(buf), sfd->stream, SAF_ICE, &len, sfd->local_intf, 0);
 	chopper_append(chop, buf, len);
-	chopper_append_printf(chop, " %u", sfd->socket.local.port);
+	chopper_append_char(chop, ' ');
+	chopper_append_uint(chop, sfd->socket.local.port);
 
 	return 0;
 }
@@ -1550,10 +1624,10 @@ static int insert_raddr_rport(struct sdp_chopper *chop, struct packet_stream *ps
         int len;
 
 	chopper_append_c(chop, " raddr ");
-	call_stream_address46(buf, ps, SAF_ICE, &len, ifa, 0);
+	call_stream_address46(buf, sizeof(buf), ps, SAF_ICE, &len, ifa, 0);
 	chopper_append(chop, buf, len);
 	chopper_append_c(chop, " rport ");
-	chopper_append_printf(chop, "%u", ps->selected_sfd->socket.local.port);
+	chopper_append_uint(chop, ps->selected_sfd->socket.local.port);
 
 	return 0;
 }
@@ -1576,13 +1650,16 @@ static int replace_network_address(struct sdp_chopper *chop, struct network_addr
 	if (flags->media_address.s && is_addr_unspecified(&flags->parsed_media_address))
 		__parse_address(&flags->parsed_media_address, NULL, NULL, &flags->media_address);
 
-	if (!is_addr_unspecified(&flags->parsed_media_address))
-		len = sprintf(buf, "%s %s",
-				flags->parsed_media_address.family->rfc_name,
-				sockaddr_print_buf(&flags->parsed_media_address));
-	else
-		call_stream_address46(buf, ps, SAF_NG, &len, NULL, keep_unspec);
-	chopper_append(chop, buf, len);
+	if (!is_addr_unspecified(&flags->parsed_media_address)) {
+		chopper_append_c(chop, flags->parsed_media_address.family->rfc_name);
+		chopper_append_char(chop, ' ');
+		sockaddr_print(&flags->parsed_media_address, buf, sizeof(buf));
+		chopper_append_c(chop, buf);
+	}
+	else {
+		call_stream_address46(buf, sizeof(buf), ps, SAF_NG, &len, NULL, keep_unspec);
+		chopper_append(chop, buf, len);
+	}
 
 	if (skip_over(chop, &address->address))
 		return -1;
@@ -1806,7 +1883,11 @@ static void insert_candidate(struct sdp_chopper *chop, struct stream_fd *sfd,
 	priority = ice_priority_pref(type_pref, local_pref, ps->component);
 	chopper_append_c(chop, "a=candidate:");
 	chopper_append_str(chop, &ifa->ice_foundation);
-	chopper_append_printf(chop, " %u UDP %lu ", ps->component, priority);
+	chopper_append_char(chop, ' ');
+	chopper_append_uint(chop, ps->component);
+	chopper_append_c(chop, " UDP ");
+	chopper_append_uint(chop, priority);
+	chopper_append_char(chop, ' ');
 	insert_ice_address(chop, sfd);
 	chopper_append_c(chop, " typ ");
 	chopper_append_c(chop, ice_candidate_type_str(type));
@@ -1870,8 +1951,11 @@ static void insert_candidates(struct sdp_chopper *chop, struct packet_stream *rt
 				if (l != rc.head)
 					chopper_append_c(chop, " ");
 				cand = l->data;
-				chopper_append_printf(chop, "%lu %s %u", cand->component_id,
-						sockaddr_print_buf(&cand->endpoint.address), cand->endpoint.port);
+				chopper_append_uint(chop, cand->component_id);
+				chopper_append_char(chop, ' ');
+				chopper_append_c(chop, sockaddr_print_buf(&cand->endpoint.address));
+				chopper_append_char(chop, ' ');
+				chopper_append_uint(chop, cand->endpoint.port);
 			}
 			chopper_append_c(chop, "\r\n");
 			g_queue_clear(&rc);
@@ -1886,6 +1970,7 @@ static void insert_candidates(struct sdp_chopper *chop, struct packet_stream *rt
 }
 
 static void insert_dtls(struct call_media *media, struct sdp_chopper *chop) {
+	static const char hex[] = "0123456789ABCDEF";
 	char hexbuf[DTLS_MAX_DIGEST_LEN * 3 + 2];
 	unsigned char *p;
 	char *o;
@@ -1903,8 +1988,11 @@ static void insert_dtls(struct call_media *media, struct sdp_chopper *chop) {
 
 	p = call->dtls_cert->fingerprint.digest;
 	o = hexbuf;
-	for (i = 0; i < hf->num_bytes; i++)
-		o += sprintf(o, "%02X:", *p++);
+	for (i = 0; i < hf->num_bytes; i++) {
+		*o++ = hex[*p >> 4];
+		*o++ = hex[*p++ & 0xf];
+		*o++ = ':';
+	}
 	*(--o) = '\0';
 
 	actpass = "holdconn";
@@ -1949,7 +2037,8 @@ static void insert_crypto1(struct call_media *media, struct sdp_chopper *chop, s
 	}
 
 	chopper_append_c(chop, "a=crypto:");
-	chopper_append_printf(chop, "%u ", cps->tag);
+	chopper_append_uint(chop, cps->tag);
+	chopper_append_char(chop, ' ');
 	chopper_append_c(chop, cps->params.crypto_suite->name);
 	chopper_append_c(chop, " inline:");
 	chopper_append(chop, b64_buf, p - b64_buf);
@@ -1957,7 +2046,10 @@ static void insert_crypto1(struct call_media *media, struct sdp_chopper *chop, s
 		ull = 0;
 		for (i = 0; i < cps->params.mki_len && i < sizeof(ull); i++)
 			ull |= (unsigned long long) cps->params.mki[cps->params.mki_len - i - 1] << (i * 8);
-		chopper_append_printf(chop, "|%llu:%u", ull, cps->params.mki_len);
+		chopper_append_char(chop, '|');
+		chopper_append_uint(chop, ull);
+		chopper_append_char(chop, ':');
+		chopper_append_uint(chop, cps->params.mki_len);
 	}
 	if (cps->params.session_params.unencrypted_srtp)
 		chopper_append_c(chop, " UNENCRYPTED_SRTP");
@@ -1976,17 +2068,42 @@ static void insert_rtcp_attr(struct sdp_chopper *chop, struct packet_stream *ps,
 {
 	if (flags->no_rtcp_attr)
 		return;
-	chopper_append_printf(chop, "a=rtcp:%u", ps->selected_sfd->socket.local.port);
+	chopper_append_c(chop, "a=rtcp:");
+	chopper_append_uint(chop, ps->selected_sfd->socket.local.port);
 	if (flags->full_rtcp_attr) {
 		char buf[64];
 		int len;
-		call_stream_address46(buf, ps, SAF_NG, &len, NULL, 0);
-		chopper_append_printf(chop, " IN %.*s", len, buf);
+		call_stream_address46(buf, sizeof(buf), ps, SAF_NG, &len, NULL, 0);
+		chopper_append_c(chop, " IN ");
+		chopper_append(chop, buf, len);
 	}
 	chopper_append_c(chop, "\r\n");
 }
 
 
+// rough upper bound of what gets added to the input SDP: codec attributes,
+// crypto lines, fingerprints and one candidate line per local socket
+static size_t sdp_output_estimate(struct sdp_chopper *chop, struct call_monologue *monologue) {
+	size_t ret = chop->input->len + 256;
+
+	for (GList *l = monologue->medias.head; l; l = l->next) {
+		struct call_media *media = l->data;
+		ret += 256;
+		ret += media->codecs_prefs_recv.length * 64;
+		ret += media->sdes_out.length * 160;
+		if (MEDIA_ISSET(media, DTLS))
+			ret += DTLS_MAX_DIGEST_LEN * 3 + 64;
+		if (!MEDIA_ISSET(media, ICE))
+			continue;
+		for (GList *k = media->streams.head; k; k = k->next) {
+			struct packet_stream *ps = k->data;
+			ret += ps->sfds.length * 128;
+		}
+	}
+
+	return ret;
+}
+
 /* called with call->master_lock held in W */
 int sdp_replace(struct sdp_chopper *chop, GQueue *sessions, struct call_monologue *monologue,
 		struct sdp_ng_flags *flags)
@@ -1998,6 +2115,8 @@ int sdp_replace(struct sdp_chopper *chop, GQueue *sessions, struct call_monologu
 	struct call_media *call_media;
 	struct packet_stream *ps, *ps_rtcp;
 
+	chopper_reserve(chop, sdp_output_estimate(chop, monologue));
+
 	m = monologue->medias.head;
 
 	for (l = sessions->head; l; l = l->next) {
@@ -2138,8 +2257,11 @@ int sdp_replace(struct sdp_chopper *chop, GQueue *sessions, struct call_monologu
 			insert_crypto(call_media, chop, flags);
 			insert_dtls(call_media, chop);
 
-			if (call_media->ptime)
-				chopper_append_printf(chop, "a=ptime:%i\r\n", call_media->ptime);
+			if (call_media->ptime) {
+				chopper_append_c(chop, "a=ptime:");
+				chopper_append_uint(chop, call_media->ptime);
+				chopper_append_c(chop, "\r\n");
+			}
 
 			if (MEDIA_ISSET(call_media, ICE) && call_media->ice_agent) {
 				chopper_append_c(chop, "a=ice-ufrag:");
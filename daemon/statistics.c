@@ -9,6 +9,40 @@ struct totalstats       rtpe_totalstats_interval;
 mutex_t		       	rtpe_totalstats_lastinterval_lock;
 struct totalstats       rtpe_totalstats_lastinterval;
 
+__thread struct stats_counters *rtpe_thread_stats;
+unsigned int stats_counters_num_intf; // set once during startup
+struct latency_histogram rtpe_redis_write_latency;
+
+// upper bounds, the last bucket is open ended
+const unsigned int latency_bucket_us[LATENCY_BUCKETS - 1] = {
+	100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 500000,
+};
+const unsigned int packet_stage_bucket_ns[LATENCY_BUCKETS - 1] = {
+	250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 1000000,
+};
+const char *packet_stage_names[__PACKET_STAGES] = {
+	[PACKET_STAGE_CALL_LOCK]	= "call_lock",
+	[PACKET_STAGE_DEMUX]		= "demux",
+	[PACKET_STAGE_DECRYPT]		= "decrypt",
+	[PACKET_STAGE_RECORDING]	= "recording",
+	[PACKET_STAGE_RTCP]		= "rtcp",
+	[PACKET_STAGE_CODEC]		= "codec",
+	[PACKET_STAGE_ENCRYPT]		= "encrypt",
+	[PACKET_STAGE_ADDRESS_CHECK]	= "address_check",
+	[PACKET_STAGE_KERNEL_CHECK]	= "kernel_check",
+	[PACKET_STAGE_SINK_LOCK]	= "sink_lock",
+	[PACKET_STAGE_SEND]		= "send",
+	[PACKET_STAGE_TOTAL]		= "total",
+};
+
+static GQueue stats_counters_list = G_QUEUE_INIT;
+static mutex_t stats_counters_lock = MUTEX_STATIC_INIT;
+static struct stats_counters *stats_counters_retired; // from threads that have exited
+static pthread_key_t stats_counters_key;
+
+// everything before num_intf is a plain list of counters
+#define STATS_COUNTERS_SCALARS (G_STRUCT_OFFSET(struct stats_counters, num_intf) / sizeof(atomic64))
+
 
 static void timeval_totalstats_average_add(struct totalstats *s, const struct timeval *add) {
 	struct timeval dp, oa;
@@ -223,7 +257,122 @@ void statistics_update_oneway(struct call* c) {
 
 }
 
+static struct stats_counters *stats_counters_alloc(void) {
+	void *p;
+	unsigned int num_intf = g_atomic_int_get(&stats_counters_num_intf);
+	size_t align = __alignof__(struct stats_counters);
+	size_t len = G_STRUCT_OFFSET(struct stats_counters, intf) + num_intf * sizeof(struct intf_counters);
+	// round up so that no other allocation shares our last cache line
+	len = (len + align - 1) & ~(align - 1);
+	if (posix_memalign(&p, align, len))
+		abort();
+	memset(p, 0, len);
+	struct stats_counters *s = p;
+	s->num_intf = num_intf;
+	return s;
+}
+
+/* lock must be held */
+static void __stats_counters_add(struct stats_counters *dst, const struct stats_counters *src) {
+	atomic64 *d = (atomic64 *) dst;
+	const atomic64 *s = (const atomic64 *) src;
+	for (unsigned int i = 0; i < STATS_COUNTERS_SCALARS; i++)
+		atomic64_add_na(&d[i], atomic64_get(&s[i]));
+	for (unsigned int i = 0; i < dst->num_intf && i < src->num_intf; i++) {
+		atomic64_add_na(&dst->intf[i].packets, atomic64_get(&src->intf[i].packets));
+		atomic64_add_na(&dst->intf[i].bytes, atomic64_get(&src->intf[i].bytes));
+	}
+}
+
+/* lock must be held. returns a copy of `s` with room for all interfaces, or `s` itself */
+static struct stats_counters *__stats_counters_grow(struct stats_counters *s) {
+	if (s->num_intf >= g_atomic_int_get(&stats_counters_num_intf))
+		return s;
+	struct stats_counters *n = stats_counters_alloc();
+	__stats_counters_add(n, s);
+	return n;
+}
+
+static void stats_counters_free(void *p) {
+	struct stats_counters *s = p;
+
+	mutex_lock(&stats_counters_lock);
+	if (!stats_counters_retired)
+		stats_counters_retired = stats_counters_alloc();
+	else {
+		struct stats_counters *r = __stats_counters_grow(stats_counters_retired);
+		if (r != stats_counters_retired) {
+			free(stats_counters_retired);
+			stats_counters_retired = r;
+		}
+	}
+	__stats_counters_add(stats_counters_retired, s);
+	g_queue_remove(&stats_counters_list, s);
+	mutex_unlock(&stats_counters_lock);
+
+	free(s);
+	rtpe_thread_stats = NULL;
+}
+
+struct stats_counters *__stats_counters_new(void) {
+	struct stats_counters *s = stats_counters_alloc();
+
+	mutex_lock(&stats_counters_lock);
+	g_queue_push_tail(&stats_counters_list, s);
+	mutex_unlock(&stats_counters_lock);
+
+	pthread_setspecific(stats_counters_key, s);
+	rtpe_thread_stats = s;
+	return s;
+}
+
+// for threads that registered before interfaces_init() set the number of interfaces
+struct stats_counters *__stats_counters_resize(void) {
+	struct stats_counters *s = rtpe_thread_stats;
+
+	mutex_lock(&stats_counters_lock);
+	struct stats_counters *n = __stats_counters_grow(s);
+	if (n != s) {
+		GList *l = g_queue_find(&stats_counters_list, s);
+		l->data = n;
+	}
+	mutex_unlock(&stats_counters_lock);
+
+	if (n == s)
+		return s;
+
+	free(s);
+	pthread_setspecific(stats_counters_key, n);
+	rtpe_thread_stats = n;
+	return n;
+}
+
+// all counters only ever increase
+struct stats_counters *stats_counters_total(void) {
+	struct stats_counters *ret = stats_counters_alloc();
+
+	mutex_lock(&stats_counters_lock);
+	if (stats_counters_retired)
+		__stats_counters_add(ret, stats_counters_retired);
+	for (GList *l = stats_counters_list.head; l; l = l->next)
+		__stats_counters_add(ret, l->data);
+	mutex_unlock(&stats_counters_lock);
+
+	return ret;
+}
+
+// fills in packets, bytes and errors
+void stats_counters_sum(struct stats *out) {
+	struct stats_counters *t = stats_counters_total();
+	atomic64_set_na(&out->packets, atomic64_get_na(&t->packets));
+	atomic64_set_na(&out->bytes, atomic64_get_na(&t->bytes));
+	atomic64_set_na(&out->errors, atomic64_get_na(&t->errors));
+	free(t);
+}
+
 void statistics_init() {
+	pthread_key_create(&stats_counters_key, stats_counters_free);
+
 	mutex_init(&rtpe_totalstats.total_average_lock);
 	mutex_init(&rtpe_totalstats_interval.total_average_lock);
 	mutex_init(&rtpe_totalstats_interval.managed_sess_lock);
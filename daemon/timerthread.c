@@ -1,5 +1,6 @@
 #include "timerthread.h"
 #include "aux.h"
+#include "statistics.h"
 
 
 static int tt_obj_cmp(const void *a, const void *b) {
@@ -33,6 +34,7 @@ void timerthread_run(void *p) {
 
 		// steal reference
 		g_tree_remove(tt->tree, tt_obj);
+		thread_stats_timer_lag(timeval_diff(&rtpe_now, &tt_obj->next_check));
 		ZERO(tt_obj->next_check);
 		tt_obj->last_run = rtpe_now;
 		mutex_unlock(&tt->lock);
@@ -326,6 +326,52 @@ INLINE int bit_array_set(volatile unsigned int *name, unsigned int bit) {
 INLINE int bit_array_clear(volatile unsigned int *name, unsigned int bit) {
 	return bf_clear(&name[bit / (sizeof(int) * 8)], 1U << (bit % (sizeof(int) * 8)));
 }
+/* Looks for a clear bit at an even position within [min, max], followed by another clear bit if
+ * `pair` is set. The search begins at `start` and wraps around to `min`, going through the array one
+ * word at a time. Returns the position found or -1. `words`, if given, is incremented by the number
+ * of words looked at. The result is only a candidate and must still be claimed with bit_array_set(). */
+INLINE int bit_array_find_clear_even(const volatile unsigned int *name, unsigned int min, unsigned int max,
+		unsigned int start, int pair, unsigned int *words)
+{
+	const unsigned int bits = sizeof(int) * 8;
+	unsigned int even = 0;
+	for (unsigned int i = 0; i < bits; i += 2)
+		even |= 1U << i;
+
+	if (pair && max > 0)
+		max--; // last possible start of a pair
+	if (min > max)
+		return -1;
+	if (start < min || start > max)
+		start = min;
+
+	unsigned int first = min / bits, last = max / bits;
+	unsigned int w = start / bits;
+
+	// the word we start at is looked at twice: first above `start` and then after wrapping around
+	for (unsigned int i = 0; i <= last - first + 1; i++) {
+		unsigned int base = w * bits;
+		unsigned int avail = ~g_atomic_int_get(&name[w]);
+		if (pair)
+			avail &= avail >> 1;
+		avail &= even;
+		if (w == first)
+			avail &= ~0U << (min - base);
+		if (w == last && max - base < bits - 1)
+			avail &= (2U << (max - base)) - 1;
+		if (i == 0)
+			avail &= ~0U << (start - base);
+
+		if (words)
+			(*words)++;
+		if (avail)
+			return base + __builtin_ctz(avail);
+
+		w = (w == last) ? first : w + 1;
+	}
+
+	return -1;
+}
 
 
 
@@ -117,7 +117,7 @@ enum call_type {
 #define PS_FLAG_RTCP				0x00020000
 #define PS_FLAG_IMPLICIT_RTCP			SHARED_FLAG_IMPLICIT_RTCP
 #define PS_FLAG_FALLBACK_RTCP			0x00040000
-#define PS_FLAG_UNUSED2				0x00080000
+#define PS_FLAG_KERNEL_RTCP			0x00080000
 #define PS_FLAG_FILLED				0x00100000
 #define PS_FLAG_CONFIRMED			0x00200000
 #define PS_FLAG_KERNELIZED			0x00400000
@@ -424,8 +424,8 @@ void call_media_state_machine(struct call_media *m);
 void call_media_unkernelize(struct call_media *media);
 void __monologue_unkernelize(struct call_monologue *monologue);
 
-int call_stream_address46(char *o, struct packet_stream *ps, enum stream_address_format format,
-		int *len, const struct local_intf *ifa, int keep_unspec);
+int call_stream_address46(char *o, size_t olen, struct packet_stream *ps,
+		enum stream_address_format format, int *len, const struct local_intf *ifa, int keep_unspec);
 
 void add_total_calls_duration_in_interval(struct timeval *interval_tv);
 
@@ -36,12 +36,49 @@ struct control_ng {
 	socket_t udp_listeners[2];
 };
 
+enum ng_command {
+	NGC_PING = 0,
+	NGC_OFFER,
+	NGC_ANSWER,
+	NGC_DELETE,
+	NGC_QUERY,
+	NGC_LIST,
+	NGC_START_RECORDING,
+	NGC_STOP_RECORDING,
+	NGC_START_FORWARDING,
+	NGC_STOP_FORWARDING,
+	NGC_BLOCK_DTMF,
+	NGC_UNBLOCK_DTMF,
+	NGC_BLOCK_MEDIA,
+	NGC_UNBLOCK_MEDIA,
+	NGC_PLAY_MEDIA,
+	NGC_STOP_MEDIA,
+
+	__NGC_MAX
+};
+
+#define NG_LATENCY_BUCKETS 12
+
+// time from receiving a request until the response was sent, including queueing
+struct ng_command_stats {
+	atomic64 count;
+	atomic64 time_us;
+	atomic64 latency[NG_LATENCY_BUCKETS];
+};
+
 struct control_ng *control_ng_new(struct poller *, endpoint_t *, unsigned char);
 void control_ng_init(void);
+void control_ng_workers_init(unsigned int, unsigned int);
+void control_ng_worker_loop(void *);
+unsigned int control_ng_queue_depth(void);
+unsigned int control_ng_in_flight(void);
 
 extern mutex_t rtpe_cngs_lock;
 extern GHashTable *rtpe_cngs_hash;
 extern struct control_ng *rtpe_control_ng;
+extern struct ng_command_stats rtpe_ng_command_stats[__NGC_MAX];
+extern const char *ng_command_names[__NGC_MAX];
+extern const unsigned int ng_latency_bucket_us[NG_LATENCY_BUCKETS - 1];
 
 enum load_limit_reasons {
 	LOAD_LIMIT_NONE = -1,
@@ -3,24 +3,33 @@
 
 #include <time.h>
 #include <glib.h>
+#include <sys/uio.h>
 #include "aux.h"
 #include "str.h"
 
+#define COOKIE_CACHE_SHARDS 16
+#define COOKIE_CACHE_TIMEOUT 30
+
 struct cookie_cache_state {
-	GHashTable *cookies;
+	GHashTable *cookies; // cookie from `chunks` -> str from str_alloc()
 	GStringChunk *chunks;
 };
 
-struct cookie_cache {
+struct cookie_cache_shard {
 	mutex_t lock;
-	cond_t cond;
 	struct cookie_cache_state current, old;
+	GHashTable *pending; // cookie -> struct cookie_wait, for commands being worked on
 	time_t swap_time;
 };
 
+struct cookie_cache {
+	struct cookie_cache_shard shards[COOKIE_CACHE_SHARDS];
+};
+
 void cookie_cache_init(struct cookie_cache *);
 str *cookie_cache_lookup(struct cookie_cache *, const str *);
 void cookie_cache_insert(struct cookie_cache *, const str *, const str *);
+void cookie_cache_insert_iov(struct cookie_cache *, const str *, const struct iovec *, unsigned int);
 void cookie_cache_remove(struct cookie_cache *, const str *);
 
 #endif
@@ -10,6 +10,10 @@ void iptables_init(void);
 extern int (*iptables_add_rule)(const socket_t *local_sock, const str *comment);
 extern int (*iptables_del_rule)(const socket_t *local_sock);
 
+// rule changes made between these are committed together at the end
+void iptables_batch_start(void);
+void iptables_batch_end(void);
+
 
 
 #endif
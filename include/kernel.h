@@ -25,6 +25,7 @@ struct kernel_interface {
 	int fd;
 	int is_open;
 	int is_wanted;
+	int no_batch;
 };
 extern struct kernel_interface kernel;
 
@@ -34,6 +35,7 @@ int kernel_setup_table(unsigned int);
 
 int kernel_add_stream(struct rtpengine_target_info *, int);
 int kernel_del_stream(const struct re_address *);
+int kernel_del_stream_last(const struct re_address *, struct rtpengine_target_info *);
 GList *kernel_list(void);
 
 unsigned int kernel_add_call(const char *id);
@@ -41,6 +43,13 @@ int kernel_del_call(unsigned int);
 
 unsigned int kernel_add_intercept_stream(unsigned int call_idx, const char *id);
 
+// accumulates add, update and delete operations until the matching (outermost)
+// kernel_batch_end(). both that and kernel_batch_sync() return -1 if any of the queued
+// operations failed
+void kernel_batch_start(void);
+int kernel_batch_end(void);
+int kernel_batch_sync(void);
+
 
 
 
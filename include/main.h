@@ -26,6 +26,10 @@ struct rtpengine_config {
 	struct rtpengine_common_config common;
 
 	int			kernel_table;
+	int			kernel_rtcp_sample;
+	unsigned int		kernel_rtcp_mark;
+	unsigned int		kernel_rtcp_mark_mask; // zero: sampling is disabled
+	int			packet_timing_sample;
 	int			max_sessions;
 	int			timeout;
 	int			silent_timeout;
@@ -47,6 +51,7 @@ struct rtpengine_config {
 	endpoint_t		udp_listen_ep;
 	endpoint_t		ng_listen_ep;
 	endpoint_t		cli_listen_ep;
+	endpoint_t		metrics_listen_ep;
 	endpoint_t		redis_ep;
 	endpoint_t		redis_write_ep;
 	endpoint_t		homer_ep;
@@ -66,10 +71,15 @@ struct rtpengine_config {
 	char			*redis_write_auth;
 	int			num_threads;
 	int			media_num_threads;
+	int			ng_num_threads;
+	int			ng_queue_size;
 	char			*spooldir;
 	char			*rec_method;
 	char			*rec_format;
 	char			*iptables_chain;
+	char			*nftables_table;
+	char			*nftables_set4;
+	char			*nftables_set6;
 	int			load_limit;
 	int			cpu_limit;
 	uint64_t		bw_limit;
@@ -83,6 +93,9 @@ struct rtpengine_config {
 	char			*mysql_user;
 	char			*mysql_pass;
 	char			*mysql_query;
+	int			mysql_threads;
+	int			media_cache_size;
+	int			port_pool_size;
 };
 
 
@@ -15,6 +15,7 @@ struct ssrc_ctx;
 struct packet_stream;
 struct codec_packet;
 struct media_player;
+struct media_cache_entry;
 
 
 #ifdef WITH_TRANSCODING
@@ -45,6 +46,17 @@ struct media_player {
 	AVIOContext *avioctx;
 	str *blob;
 	str read_pos;
+
+	// playing back pre-encoded media from the cache
+	struct media_cache_entry *cache_entry;
+	unsigned int cache_idx;
+	struct timeval cache_start;
+	unsigned long cache_ts;
+	int cache_pt;
+	// cache miss: encoded output is captured into this entry
+	struct media_cache_entry *cache_rec;
+
+	unsigned int db_gen;
 };
 
 INLINE void media_player_put(struct media_player **mp) {
@@ -61,6 +73,15 @@ INLINE void media_player_put(struct media_player **mp) {
 
 #endif
 
+struct media_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	unsigned int entries;
+	uint64_t bytes;
+	uint64_t max_bytes;
+};
+
 struct send_timer {
 	struct timerthread_obj tt_obj;
 	mutex_t lock;
@@ -78,6 +99,9 @@ void media_player_stop(struct media_player *);
 
 void media_player_init(void);
 void media_player_loop(void *);
+void media_player_db_loop(void *);
+void media_player_cache_stats(struct media_cache_stats *);
+unsigned int media_player_cache_flush(void);
 
 struct send_timer *send_timer_new(struct packet_stream *);
 void send_timer_push(struct send_timer *, struct codec_packet *);
@@ -75,8 +75,34 @@ struct port_pool {
 
 	unsigned int			min, max;
 
-	mutex_t				free_list_lock;
-	GQueue				free_list;
+	atomic64			allocs;
+	atomic64			alloc_failures;
+	atomic64			alloc_words; // bit array words looked at
+	atomic64			alloc_attempts; // ports found free but then failed to open, plus one
+};
+struct port_pool_stats {
+	uint64_t			allocs;
+	uint64_t			failures;
+	uint64_t			words;
+	uint64_t			attempts;
+	unsigned int			free_ports;
+};
+// pre-opened and bound RTP/RTCP socket pairs, ready to be handed out
+struct socket_pool {
+	mutex_t				lock;
+	GQueue				sockets; // socket_t, RTP and RTCP alternating
+
+	atomic64			hits;
+	atomic64			misses;
+	atomic64			refills;
+	atomic64			refill_time_us;
+};
+struct socket_pool_stats {
+	uint64_t			hits;
+	uint64_t			misses;
+	uint64_t			refills;
+	uint64_t			refill_time_us;
+	unsigned int			available;
 };
 struct intf_address {
 	socktype_t			*type;
@@ -93,6 +119,8 @@ struct intf_config {
 struct intf_spec {
 	struct intf_address		local_address;
 	struct port_pool		port_pool;
+	struct socket_pool		socket_pool;
+	unsigned int			stats_idx; // into stats_counters->intf
 };
 struct local_intf {
 	struct intf_spec		*spec;
@@ -153,6 +181,9 @@ int is_local_endpoint(const struct intf_address *addr, unsigned int port);
 int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
 		struct intf_spec *spec, const str *);
 int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log, const str *);
+void socket_pool_loop(void *);
+void socket_pool_stats(struct socket_pool_stats *);
+void port_pool_stats(struct port_pool_stats *);
 struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct local_intf *lif);
 
 void free_intf_list(struct intf_list *il);
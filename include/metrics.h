@@ -0,0 +1,19 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "socket.h"
+#include "obj.h"
+#include "tcp_listener.h"
+
+// serves the counters over HTTP in the Prometheus text format
+struct metrics {
+	struct obj		obj;
+
+	struct poller		*poller;
+
+	struct streambuf_listener listeners[2];
+};
+
+struct metrics *metrics_new(struct poller *p, endpoint_t *);
+
+#endif
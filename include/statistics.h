@@ -21,6 +21,58 @@ struct stats {
 };
 
 
+#define LATENCY_BUCKETS 12
+
+// buckets are bounded by latency_bucket_us (or packet_stage_bucket_ns for the packet
+// stages, and `sum` is then in nanoseconds), the last one is open ended
+struct latency_histogram {
+	atomic64			count;
+	atomic64			sum;
+	atomic64			buckets[LATENCY_BUCKETS];
+};
+
+// parts of stream_packet() that are timed for sampled packets
+enum packet_stage {
+	PACKET_STAGE_CALL_LOCK = 0, // waiting for the call's master lock
+	PACKET_STAGE_DEMUX,
+	PACKET_STAGE_DECRYPT,
+	PACKET_STAGE_RECORDING,
+	PACKET_STAGE_RTCP,
+	PACKET_STAGE_CODEC,
+	PACKET_STAGE_ENCRYPT,
+	PACKET_STAGE_ADDRESS_CHECK,
+	PACKET_STAGE_KERNEL_CHECK, // only for packets that may get the stream kernelized
+	PACKET_STAGE_SINK_LOCK, // waiting for the output lock of the destination stream
+	PACKET_STAGE_SEND,
+	PACKET_STAGE_TOTAL,
+
+	__PACKET_STAGES
+};
+
+struct intf_counters {
+	atomic64			packets;
+	atomic64			bytes;
+};
+
+// packet path counters. every thread that handles packets has its own block, so
+// that the per-packet updates don't bounce shared cache lines between CPUs.
+// stats_counters_total() adds them all up
+struct stats_counters {
+	atomic64			packets;
+	atomic64			bytes;
+	atomic64			errors;
+	atomic64			kernel_packets; // included in the above
+	atomic64			kernel_bytes;
+	atomic64			transcode_packets;
+	atomic64			transcode_cpu_ns;
+	struct latency_histogram	timer_lag;
+	struct latency_histogram	packet_stages[__PACKET_STAGES];
+
+	unsigned int			num_intf;
+	struct intf_counters		intf[0]; // indexed by intf_spec->stats_idx
+} __attribute__ ((aligned (64)));
+
+
 struct request_time {
 	mutex_t lock;
 	u_int64_t count;
@@ -85,6 +137,13 @@ struct call_stats {
 	struct stats	totals[4]; /* rtp in, rtcp in, rtp out, rtcp out */
 };
 
+extern __thread struct stats_counters *rtpe_thread_stats;
+extern unsigned int stats_counters_num_intf;
+extern const unsigned int latency_bucket_us[LATENCY_BUCKETS - 1];
+extern const unsigned int packet_stage_bucket_ns[LATENCY_BUCKETS - 1];
+extern const char *packet_stage_names[__PACKET_STAGES];
+extern struct latency_histogram rtpe_redis_write_latency;
+
 extern struct totalstats       rtpe_totalstats;
 extern struct totalstats       rtpe_totalstats_interval;
 extern mutex_t		       rtpe_totalstats_lastinterval_lock;
@@ -97,4 +156,81 @@ void statistics_update_totals(struct packet_stream *) ;
 
 void statistics_init(void);
 
+struct stats_counters *__stats_counters_new(void);
+struct stats_counters *__stats_counters_resize(void);
+struct stats_counters *stats_counters_total(void); // to be free()d
+void stats_counters_sum(struct stats *);
+
+
+INLINE struct stats_counters *thread_stats(void) {
+	struct stats_counters *s = rtpe_thread_stats;
+	if (G_LIKELY(s))
+		return s;
+	return __stats_counters_new();
+}
+
+// only ever written by the owning thread, so no locked instruction is needed
+INLINE void thread_stats_add(atomic64 *a, u_int64_t n) {
+#if GLIB_SIZEOF_VOID_P >= 8
+	atomic64_add_na(a, n);
+#else
+	atomic64_add(a, n);
+#endif
+}
+
+#define RTPE_STATS_ADD(field, n) thread_stats_add(&thread_stats()->field, n)
+#define RTPE_STATS_INC(field) RTPE_STATS_ADD(field, 1)
+
+INLINE void thread_stats_intf_add(unsigned int idx, u_int64_t packets, u_int64_t bytes) {
+	struct stats_counters *s = thread_stats();
+	if (G_UNLIKELY(idx >= s->num_intf)) {
+		s = __stats_counters_resize();
+		if (idx >= s->num_intf)
+			return;
+	}
+	thread_stats_add(&s->intf[idx].packets, packets);
+	thread_stats_add(&s->intf[idx].bytes, bytes);
+}
+
+INLINE unsigned int __latency_bucket(const unsigned int *bounds, long long val) {
+	unsigned int bucket;
+	for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++) {
+		if (val <= bounds[bucket])
+			break;
+	}
+	return bucket;
+}
+INLINE unsigned int latency_bucket(long long us) {
+	return __latency_bucket(latency_bucket_us, us);
+}
+
+INLINE void latency_histogram_add(struct latency_histogram *h, long long us) {
+	if (us < 0)
+		us = 0;
+	atomic64_inc(&h->count);
+	atomic64_add(&h->sum, us);
+	atomic64_inc(&h->buckets[latency_bucket(us)]);
+}
+
+INLINE void thread_stats_timer_lag(long long us) {
+	struct latency_histogram *h = &thread_stats()->timer_lag;
+	if (us < 0)
+		us = 0;
+	thread_stats_add(&h->count, 1);
+	thread_stats_add(&h->sum, us);
+	thread_stats_add(&h->buckets[latency_bucket(us)], 1);
+}
+
+// `mask` has a bit set for each stage that the packet went through
+INLINE void thread_stats_packet_stages(const u_int64_t *ns, unsigned int mask) {
+	struct latency_histogram *h = thread_stats()->packet_stages;
+	for (unsigned int i = 0; i < __PACKET_STAGES; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		thread_stats_add(&h[i].count, 1);
+		thread_stats_add(&h[i].sum, ns[i]);
+		thread_stats_add(&h[i].buckets[__latency_bucket(packet_stage_bucket_ns, ns[i])], 1);
+	}
+}
+
 #endif /* STATISTICS_H_ */
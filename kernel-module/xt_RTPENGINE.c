@@ -17,6 +17,7 @@
 #include <net/dst.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
+#include <linux/vmalloc.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
 #include <linux/bsearch.h>
 #endif
@@ -40,7 +41,7 @@ MODULE_LICENSE("GPL");
 
 
 #define MAX_ID 64 /* - 1 */
-#define MAX_SKB_TAIL_ROOM (sizeof(((struct rtpengine_srtp *) 0)->mki) + 20)
+#define MAX_SKB_TAIL_ROOM (sizeof(((struct rtpengine_srtp *) 0)->mki) + 20 + sizeof(u_int32_t))
 
 #define MIPF		"%i:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x:%u"
 #define MIPP(x)		(x).family,		\
@@ -149,6 +150,7 @@ MODULE_LICENSE("GPL");
 struct re_hmac;
 struct re_cipher;
 struct rtp_parsed;
+struct rtcp_parsed;
 struct re_crypto_context;
 struct re_auto_array;
 struct re_call;
@@ -178,6 +180,10 @@ static bool log_errors = 0;
 module_param(log_errors, bool, 0);
 MODULE_PARM_DESC(log_errors, "generate kernel log lines from forwarding errors");
 
+static uint hash_bits = 8;
+module_param(hash_bits, uint, 0);
+MODULE_PARM_DESC(hash_bits, "number of bits (size as power of 2) of per-table call and stream hashes");
+
 
 
 #define log_err(fmt, ...) do { if (log_errors) printk(KERN_NOTICE "rtpengine[%s:%i]: " fmt, \
@@ -231,6 +237,10 @@ static int srtp_encrypt_aes_cm(struct re_crypto_context *, struct rtpengine_srtp
 		struct rtp_parsed *, u_int64_t);
 static int srtp_encrypt_aes_f8(struct re_crypto_context *, struct rtpengine_srtp *,
 		struct rtp_parsed *, u_int64_t);
+static int srtcp_encrypt_aes_cm(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtcp_parsed *, u_int64_t);
+static int srtcp_encrypt_aes_f8(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtcp_parsed *, u_int64_t);
 
 static void call_put(struct re_call *call);
 static void del_stream(struct re_stream *stream, struct rtpengine_table *);
@@ -279,6 +289,11 @@ struct rtpengine_target {
 
 	struct re_crypto_context	decrypt;
 	struct re_crypto_context	encrypt;
+
+	/* SRTCP uses its own session keys */
+	struct re_crypto_context	rtcp_decrypt;
+	struct re_crypto_context	rtcp_encrypt;
+	atomic_t			rtcp_count;
 };
 
 struct re_bitfield {
@@ -356,7 +371,13 @@ struct re_stream {
 	int				eof; /* protected by packet_list_lock */
 };
 
-#define RE_HASH_BITS 8 /* make configurable? */
+#define RE_HASH_BITS_MIN 4
+#define RE_HASH_BITS_MAX 20
+struct re_hash_bucket {
+	spinlock_t			lock;
+	struct hlist_head		head;
+};
+
 struct rtpengine_table {
 	atomic_t			refcnt;
 	rwlock_t			target_lock;
@@ -376,10 +397,9 @@ struct rtpengine_table {
 
 	struct list_head		calls; /* protected by calls.lock */
 
-	spinlock_t			calls_hash_lock[1 << RE_HASH_BITS];
-	struct hlist_head		calls_hash[1 << RE_HASH_BITS];
-	spinlock_t			streams_hash_lock[1 << RE_HASH_BITS];
-	struct hlist_head		streams_hash[1 << RE_HASH_BITS];
+	unsigned int			hash_bits;
+	struct re_hash_bucket		*calls_hash; /* 1 << hash_bits entries */
+	struct re_hash_bucket		*streams_hash; /* 1 << hash_bits entries */
 };
 
 struct re_cipher {
@@ -390,6 +410,10 @@ struct re_cipher {
 			struct rtp_parsed *, u_int64_t);
 	int				(*encrypt)(struct re_crypto_context *, struct rtpengine_srtp *,
 			struct rtp_parsed *, u_int64_t);
+	int				(*decrypt_rtcp)(struct re_crypto_context *, struct rtpengine_srtp *,
+			struct rtcp_parsed *, u_int64_t);
+	int				(*encrypt_rtcp)(struct re_crypto_context *, struct rtpengine_srtp *,
+			struct rtcp_parsed *, u_int64_t);
 	int				(*session_key_init)(struct re_crypto_context *, struct rtpengine_srtp *);
 };
 
@@ -422,6 +446,22 @@ struct rtp_parsed {
 	int				ok;
 };
 
+/* XXX shared */
+struct rtcp_header {
+	unsigned char v_p_x;
+	unsigned char pt;
+	u_int16_t length;
+	u_int32_t ssrc;
+} __attribute__ ((packed));
+
+struct rtcp_parsed {
+	struct rtcp_header		*header;
+	unsigned int			header_len;
+	unsigned char			*payload;
+	unsigned int			payload_len;
+	int				ok;
+};
+
 
 
 
@@ -525,6 +565,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.decrypt_rtcp	= srtcp_encrypt_aes_cm,
+		.encrypt_rtcp	= srtcp_encrypt_aes_cm,
 	},
 	[REC_AES_F8] = {
 		.id		= REC_AES_F8,
@@ -532,6 +574,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_f8,
 		.encrypt	= srtp_encrypt_aes_f8,
+		.decrypt_rtcp	= srtcp_encrypt_aes_f8,
+		.encrypt_rtcp	= srtcp_encrypt_aes_f8,
 		.session_key_init = aes_f8_session_key_init,
 	},
 	[REC_AES_CM_192] = {
@@ -540,6 +584,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.decrypt_rtcp	= srtcp_encrypt_aes_cm,
+		.encrypt_rtcp	= srtcp_encrypt_aes_cm,
 	},
 	[REC_AES_CM_256] = {
 		.id		= REC_AES_CM_256,
@@ -547,6 +593,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.decrypt_rtcp	= srtcp_encrypt_aes_cm,
+		.encrypt_rtcp	= srtcp_encrypt_aes_cm,
 	},
 };
 
@@ -625,9 +673,32 @@ static void auto_array_free(struct re_auto_array *a) {
 		pop_free_list_entry(a);
 }
 
+static struct re_hash_bucket *hash_buckets_new(unsigned int bits) {
+	struct re_hash_bucket *ret;
+	unsigned int i;
+
+	/* can be large (up to several MB), so use vmalloc */
+	ret = vmalloc(sizeof(*ret) << bits);
+	if (!ret)
+		return NULL;
+
+	for (i = 0; i < (1U << bits); i++) {
+		INIT_HLIST_HEAD(&ret[i].head);
+		spin_lock_init(&ret[i].lock);
+	}
+
+	return ret;
+}
+
+static void hash_buckets_free(struct re_hash_bucket **b) {
+	if (!*b)
+		return;
+	vfree(*b);
+	*b = NULL;
+}
+
 static struct rtpengine_table *new_table(void) {
 	struct rtpengine_table *t;
-	unsigned int i;
 
 	DBG("Creating new table\n");
 
@@ -645,16 +716,21 @@ static struct rtpengine_table *new_table(void) {
 	INIT_LIST_HEAD(&t->calls);
 	t->id = -1;
 
-	for (i = 0; i < ARRAY_SIZE(t->calls_hash); i++) {
-		INIT_HLIST_HEAD(&t->calls_hash[i]);
-		spin_lock_init(&t->calls_hash_lock[i]);
-	}
-	for (i = 0; i < ARRAY_SIZE(t->streams_hash); i++) {
-		INIT_HLIST_HEAD(&t->streams_hash[i]);
-		spin_lock_init(&t->streams_hash_lock[i]);
-	}
+	t->hash_bits = hash_bits;
+	t->calls_hash = hash_buckets_new(t->hash_bits);
+	if (!t->calls_hash)
+		goto fail;
+	t->streams_hash = hash_buckets_new(t->hash_bits);
+	if (!t->streams_hash)
+		goto fail;
 
 	return t;
+
+fail:
+	hash_buckets_free(&t->calls_hash);
+	kfree(t);
+	module_put(THIS_MODULE);
+	return NULL;
 }
 
 
@@ -805,6 +881,8 @@ static void target_put(struct rtpengine_target *t) {
 
 	free_crypto_context(&t->decrypt);
 	free_crypto_context(&t->encrypt);
+	free_crypto_context(&t->rtcp_decrypt);
+	free_crypto_context(&t->rtcp_encrypt);
 
 	kfree(t);
 }
@@ -890,6 +968,8 @@ static void table_put(struct rtpengine_table *t) {
 	}
 
 	clear_table_proc_files(t);
+	hash_buckets_free(&t->calls_hash);
+	hash_buckets_free(&t->streams_hash);
 	kfree(t);
 
 	module_put(THIS_MODULE);
@@ -1061,6 +1141,7 @@ static ssize_t proc_status(struct file *f, char __user *b, size_t l, loff_t *o)
 	len += sprintf(buf + len, "Refcount:    %u\n", atomic_read(&t->refcnt) - 1);
 	len += sprintf(buf + len, "Control PID: %u\n", t->pid);
 	len += sprintf(buf + len, "Targets:     %u\n", t->num_targets);
+	len += sprintf(buf + len, "Hash size:   %u\n", 1U << t->hash_bits);
 	read_unlock_irqrestore(&t->target_lock, flags);
 
 	table_put(t);
@@ -1513,6 +1594,10 @@ static int proc_list_show(struct seq_file *f, void *v) {
 		seq_printf(f, "    option: stun\n");
 	if (g->target.transcoding)
 		seq_printf(f, "    option: transcoding\n");
+	if (g->target.rtcp)
+		seq_printf(f, "    option: rtcp\n");
+	if (g->target.rtcp_fw)
+		seq_printf(f, "    option: kernel RTCP forwarding (sample 1 in %u)\n", g->target.rtcp_sample);
 
 	target_put(g);
 
@@ -1598,7 +1683,11 @@ static struct re_dest_addr *find_dest_addr(const struct re_dest_addr_hash *h, co
 
 
 
-static int table_del_target(struct rtpengine_table *t, const struct re_address *local) {
+/* if "last" is given, the final state of the target is returned in it, which may
+ * alias "local" */
+static int table_del_target(struct rtpengine_table *t, const struct re_address *local,
+		struct rtpengine_target_info *last)
+{
 	unsigned char hi, lo;
 	struct re_dest_addr *rda;
 	struct re_bucket *b;
@@ -1643,6 +1732,13 @@ out:
 	if (b)
 		kfree(b);
 
+	if (last) {
+		/* the SRTCP index is advanced under this lock */
+		spin_lock_irqsave(&g->rtcp_encrypt.lock, flags);
+		*last = g->target;
+		spin_unlock_irqrestore(&g->rtcp_encrypt.lock, flags);
+	}
+
 	target_put(g);
 
 	return 0;
@@ -1687,6 +1783,8 @@ static int validate_srtp(struct rtpengine_srtp *s) {
 		return -1;
 	if (s->auth_tag_len > 20)
 		return -1;
+	if (s->rtcp_auth_tag_len > 20)
+		return -1;
 	if (s->mki_len > sizeof(s->mki))
 		return -1;
 	return 0;
@@ -1887,20 +1985,21 @@ error:
 	return ret;
 }
 
-static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s) {
+/* label base is 0x00 for SRTP and 0x03 for SRTCP - rfc 3711 section 4.3.2 */
+static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s, unsigned char label) {
 	int ret;
 	const char *err;
 
 	if (s->cipher == REC_NULL && s->hmac == REH_NULL)
 		return 0;
 	err = "failed to generate session key";
-	ret = gen_session_key(c->session_key, s->session_key_len, s, 0x00);
+	ret = gen_session_key(c->session_key, s->session_key_len, s, label + 0x00);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_auth_key, 20, s, 0x01);
+	ret = gen_session_key(c->session_auth_key, 20, s, label + 0x01);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_salt, 14, s, 0x02);
+	ret = gen_session_key(c->session_salt, 14, s, label + 0x02);
 	if (ret)
 		goto error;
 
@@ -2052,6 +2151,8 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 		return -EINVAL;
 	if (validate_srtp(&i->encrypt))
 		return -EINVAL;
+	if (i->rtcp && !i->rtcp_fw)
+		return -EINVAL;
 
 	DBG("Creating new target\n");
 
@@ -2066,16 +2167,28 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 	atomic_set(&g->refcnt, 1);
 	spin_lock_init(&g->decrypt.lock);
 	spin_lock_init(&g->encrypt.lock);
+	spin_lock_init(&g->rtcp_decrypt.lock);
+	spin_lock_init(&g->rtcp_encrypt.lock);
 	memcpy(&g->target, i, sizeof(*i));
 	crypto_context_init(&g->decrypt, &g->target.decrypt);
 	crypto_context_init(&g->encrypt, &g->target.encrypt);
+	crypto_context_init(&g->rtcp_decrypt, &g->target.decrypt);
+	crypto_context_init(&g->rtcp_encrypt, &g->target.encrypt);
 
-	err = gen_session_keys(&g->decrypt, &g->target.decrypt);
+	err = gen_session_keys(&g->decrypt, &g->target.decrypt, 0x00);
 	if (err)
 		goto fail2;
-	err = gen_session_keys(&g->encrypt, &g->target.encrypt);
+	err = gen_session_keys(&g->encrypt, &g->target.encrypt, 0x00);
 	if (err)
 		goto fail2;
+	if (g->target.rtcp_fw) {
+		err = gen_session_keys(&g->rtcp_decrypt, &g->target.decrypt, 0x03);
+		if (err)
+			goto fail2;
+		err = gen_session_keys(&g->rtcp_encrypt, &g->target.encrypt, 0x03);
+		if (err)
+			goto fail2;
+	}
 
 	/* find or allocate re_dest_addr */
 
@@ -2525,30 +2638,30 @@ static int table_new_call(struct rtpengine_table *table, struct rtpengine_call_i
 	/* check for name collisions */
 
 	call->hash_bucket = crc32_le(0x52342, info->call_id, strlen(info->call_id));
-	call->hash_bucket = call->hash_bucket & ((1 << RE_HASH_BITS) - 1);
+	call->hash_bucket = call->hash_bucket & ((1U << table->hash_bits) - 1);
 
-	spin_lock_irqsave(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_lock_irqsave(&table->calls_hash[call->hash_bucket].lock, flags);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry(hash_entry, hlist_entry, &table->calls_hash[call->hash_bucket],
+	hlist_for_each_entry(hash_entry, hlist_entry, &table->calls_hash[call->hash_bucket].head,
 			calls_hash_entry) {
 #else
-	hlist_for_each_entry(hash_entry, &table->calls_hash[call->hash_bucket], calls_hash_entry) {
+	hlist_for_each_entry(hash_entry, &table->calls_hash[call->hash_bucket].head, calls_hash_entry) {
 #endif
 		if (!strcmp(hash_entry->info.call_id, info->call_id))
 			goto found;
 	}
 	goto not_found;
 found:
-	spin_unlock_irqrestore(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->calls_hash[call->hash_bucket].lock, flags);
 	printk(KERN_ERR "Call name collision: %s\n", info->call_id);
 	err = -EEXIST;
 	goto fail2;
 
 not_found:
-	hlist_add_head(&call->calls_hash_entry, &table->calls_hash[call->hash_bucket]);
+	hlist_add_head(&call->calls_hash_entry, &table->calls_hash[call->hash_bucket].head);
 	ref_get(call);
-	spin_unlock_irqrestore(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->calls_hash[call->hash_bucket].lock, flags);
 
 	/* create proc */
 
@@ -2577,9 +2690,9 @@ not_found:
 fail3:
 	_w_unlock(&calls.lock, flags);
 fail4:
-	spin_lock_irqsave(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_lock_irqsave(&table->calls_hash[call->hash_bucket].lock, flags);
 	hlist_del(&call->calls_hash_entry);
-	spin_unlock_irqrestore(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->calls_hash[call->hash_bucket].lock, flags);
 	call_put(call);
 fail2:
 	call_put(call);
@@ -2641,12 +2754,12 @@ static void del_call(struct re_call *call, struct rtpengine_table *table) {
 	_w_unlock(&streams.lock, flags);
 
 	DBG("locking table's call hash\n");
-	spin_lock_irqsave(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_lock_irqsave(&table->calls_hash[call->hash_bucket].lock, flags);
 	if (!hlist_unhashed(&call->calls_hash_entry)) {
 		hlist_del_init(&call->calls_hash_entry);
 		call_put(call);
 	}
-	spin_unlock_irqrestore(&table->calls_hash_lock[call->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->calls_hash[call->hash_bucket].lock, flags);
 
 	_w_lock(&calls.lock, flags);
 
@@ -2712,15 +2825,15 @@ static int table_new_stream(struct rtpengine_table *table, struct rtpengine_stre
 	/* check for name collisions */
 
 	stream->hash_bucket = crc32_le(0x52342 ^ info->call_idx, info->stream_name, strlen(info->stream_name));
-	stream->hash_bucket = stream->hash_bucket & ((1 << RE_HASH_BITS) - 1);
+	stream->hash_bucket = stream->hash_bucket & ((1U << table->hash_bits) - 1);
 
-	spin_lock_irqsave(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_lock_irqsave(&table->streams_hash[stream->hash_bucket].lock, flags);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry(hash_entry, hlist_entry, &table->streams_hash[stream->hash_bucket],
+	hlist_for_each_entry(hash_entry, hlist_entry, &table->streams_hash[stream->hash_bucket].head,
 			streams_hash_entry) {
 #else
-	hlist_for_each_entry(hash_entry, &table->streams_hash[stream->hash_bucket], streams_hash_entry) {
+	hlist_for_each_entry(hash_entry, &table->streams_hash[stream->hash_bucket].head, streams_hash_entry) {
 #endif
 		if (hash_entry->info.call_idx == info->call_idx
 				&& !strcmp(hash_entry->info.stream_name, info->stream_name))
@@ -2728,15 +2841,15 @@ static int table_new_stream(struct rtpengine_table *table, struct rtpengine_stre
 	}
 	goto not_found;
 found:
-	spin_unlock_irqrestore(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->streams_hash[stream->hash_bucket].lock, flags);
 	printk(KERN_ERR "Stream name collision: %s\n", info->stream_name);
 	err = -EEXIST;
 	goto fail3;
 
 not_found:
-	hlist_add_head(&stream->streams_hash_entry, &table->streams_hash[stream->hash_bucket]);
+	hlist_add_head(&stream->streams_hash_entry, &table->streams_hash[stream->hash_bucket].head);
 	ref_get(stream);
-	spin_unlock_irqrestore(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->streams_hash[stream->hash_bucket].lock, flags);
 
 	/* add into array */
 
@@ -2779,9 +2892,9 @@ fail5:
 fail4:
 	_w_unlock(&streams.lock, flags);
 
-	spin_lock_irqsave(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_lock_irqsave(&table->streams_hash[stream->hash_bucket].lock, flags);
 	hlist_del(&stream->streams_hash_entry);
-	spin_unlock_irqrestore(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->streams_hash[stream->hash_bucket].lock, flags);
 	stream_put(stream);
 fail3:
 	stream_put(stream);
@@ -2818,12 +2931,12 @@ static void del_stream(struct re_stream *stream, struct rtpengine_table *table)
 	/* sleeping readers will now close files */
 
 	DBG("clearing stream from streams_hash\n");
-	spin_lock_irqsave(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_lock_irqsave(&table->streams_hash[stream->hash_bucket].lock, flags);
 	if (!hlist_unhashed(&stream->streams_hash_entry)) {
 		hlist_del_init(&stream->streams_hash_entry);
 		stream_put(stream);
 	}
-	spin_unlock_irqrestore(&table->streams_hash_lock[stream->hash_bucket], flags);
+	spin_unlock_irqrestore(&table->streams_hash[stream->hash_bucket].lock, flags);
 
 	_w_lock(&streams.lock, flags);
 	if (!list_empty(&stream->call_entry)) {
@@ -3132,6 +3245,58 @@ out:
 
 
 
+static int table_batch(struct rtpengine_table *t, const struct rtpengine_batch_info *info,
+		struct rtpengine_batch_entry *entries, size_t len)
+{
+	unsigned int i;
+	struct rtpengine_batch_entry *e;
+
+	if (!info->num_entries || info->num_entries > RTPENGINE_MAX_BATCH)
+		return -EINVAL;
+	if (len != info->num_entries * sizeof(*entries))
+		return -EINVAL;
+
+	DBG("processing batch of %u entries\n", info->num_entries);
+
+	/* entries are processed in order and independently of each other. the
+	 * individual results are reported back in each entry */
+	for (i = 0; i < info->num_entries; i++) {
+		e = &entries[i];
+
+		switch (e->cmd) {
+			case REMG_NOOP:
+				e->result = 0;
+				break;
+
+			case REMG_ADD:
+				e->result = table_new_target(t, &e->u.target, 0);
+				break;
+
+			case REMG_DEL:
+				e->result = table_del_target(t, &e->u.target.local, NULL);
+				break;
+
+			case REMG_UPDATE:
+				e->result = table_new_target(t, &e->u.target, 1);
+				break;
+
+			case REMG_DEL_CALL:
+				e->result = table_del_call(t, e->u.call.call_idx);
+				break;
+
+			case REMG_DEL_STREAM:
+				e->result = table_del_stream(t, &e->u.stream);
+				break;
+
+			default:
+				e->result = -EINVAL;
+				break;
+		}
+	}
+
+	return 0;
+}
+
 static inline ssize_t proc_control_read_write(struct file *file, char __user *ubuf, size_t buflen, loff_t *off,
 		int writeable)
 {
@@ -3175,7 +3340,8 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 			break;
 
 		case REMG_DEL:
-			err = table_del_target(t, &msg->u.target.local);
+			/* when reading, the final state of the target is returned */
+			err = table_del_target(t, &msg->u.target.local, writeable ? &msg->u.target : NULL);
 			break;
 
 		case REMG_UPDATE:
@@ -3208,6 +3374,14 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 			err = stream_packet(t, &msg->u.packet, msg->data, buflen - sizeof(*msg));
 			break;
 
+		case REMG_BATCH:
+			/* results are returned to the caller, so this must be a read() */
+			err = -EINVAL;
+			if (!writeable)
+				goto err;
+			err = table_batch(t, &msg->u.batch, (void *) (msg + 1), buflen - sizeof(*msg));
+			break;
+
 		default:
 			printk(KERN_WARNING "xt_RTPENGINE unimplemented op %u\n", msg->cmd);
 			err = -EINVAL;
@@ -3221,7 +3395,7 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 
 	if (writeable) {
 		err = -EFAULT;
-		if (copy_to_user(ubuf, msg, sizeof(*msg)))
+		if (copy_to_user(ubuf, msg, msg->cmd == REMG_BATCH ? buflen : sizeof(*msg)))
 			goto out;
 	}
 
@@ -3488,6 +3662,25 @@ error:
 	rtp->ok = 0;
 }
 
+static void parse_rtcp(struct rtcp_parsed *rtcp, struct sk_buff *skb) {
+	if (skb->len < sizeof(*rtcp->header))
+		goto error;
+	rtcp->header = (void *) skb->data;
+	if ((rtcp->header->v_p_x & 0xc0) != 0x80) /* version 2 */
+		goto error;
+	rtcp->header_len = sizeof(*rtcp->header);
+	rtcp->payload = skb->data + rtcp->header_len;
+	rtcp->payload_len = skb->len - rtcp->header_len;
+
+	DBG("rtcp header parsed, payload length is %u\n", rtcp->payload_len);
+
+	rtcp->ok = 1;
+	return;
+
+error:
+	rtcp->ok = 0;
+}
+
 /* XXX shared code */
 static u_int64_t packet_index(struct re_crypto_context *c,
 		struct rtpengine_srtp *s, struct rtp_header *rtp)
@@ -3759,6 +3952,205 @@ static inline int srtp_decrypt(struct re_crypto_context *c,
 	return c->cipher->decrypt(c, s, r, pkt_idx);
 }
 
+
+
+
+/* rfc 3711 section 3.4 */
+static inline int is_srtcp(const struct rtpengine_srtp *s) {
+	return s->cipher != REC_NULL || s->hmac != REH_NULL;
+}
+
+/* hashes everything from the header up to and including the SRTCP index */
+static int srtcp_hash(unsigned char *hmac,
+		struct re_crypto_context *c, struct rtcp_parsed *r)
+{
+	struct shash_desc *dsc;
+
+	dsc = kmalloc(sizeof(*dsc) + crypto_shash_descsize(c->shash), GFP_ATOMIC);
+	if (!dsc)
+		return -1;
+
+	dsc->tfm = c->shash;
+	dsc->flags = 0;
+
+	if (crypto_shash_init(dsc))
+		goto error;
+
+	crypto_shash_update(dsc, (void *) r->header, r->header_len + r->payload_len);
+
+	crypto_shash_final(dsc, hmac);
+
+	kfree(dsc);
+
+	return 0;
+
+error:
+	kfree(dsc);
+	return -1;
+}
+
+/* strips SRTCP trailer and returns the index word including the E flag */
+static int srtcp_auth_validate(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int64_t *idx_p)
+{
+	unsigned char *auth_tag;
+	unsigned char hmac[20];
+	u_int32_t *idx;
+	unsigned long flags;
+
+	*idx_p = 0;
+
+	if (!is_srtcp(s))
+		return 0;
+
+	if (r->payload_len < s->rtcp_auth_tag_len)
+		return -1;
+	r->payload_len -= s->rtcp_auth_tag_len;
+	auth_tag = r->payload + r->payload_len;
+
+	if (r->payload_len < s->mki_len)
+		return -1;
+	r->payload_len -= s->mki_len;
+
+	if (r->payload_len < sizeof(*idx))
+		return -1;
+
+	if (s->hmac != REH_NULL && s->rtcp_auth_tag_len) {
+		if (!c->shash)
+			return -1;
+		if (srtcp_hash(hmac, c, r))
+			return -1;
+		if (memcmp(auth_tag, hmac, s->rtcp_auth_tag_len))
+			return -1;
+	}
+
+	r->payload_len -= sizeof(*idx);
+	idx = (void *) (r->payload + r->payload_len);
+	*idx_p = ntohl(*idx);
+
+	spin_lock_irqsave(&c->lock, flags);
+	s->rtcp_index = (*idx_p & 0x7fffffffULL) + 1;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	return 0;
+}
+
+static inline int srtcp_decrypt(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int64_t idx)
+{
+	if (!(idx & 0x80000000ULL)) /* E flag */
+		return 0;
+	if (!c->cipher->decrypt_rtcp)
+		return 0;
+	return c->cipher->decrypt_rtcp(c, s, r, idx & 0x7fffffffULL);
+}
+
+/* encrypts and appends the SRTCP index. the skb must have room for it */
+static int srtcp_encrypt(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r)
+{
+	u_int64_t idx;
+	u_int32_t *idx_p;
+	unsigned long flags;
+	int encrypt;
+
+	if (!is_srtcp(s))
+		return 0;
+
+	spin_lock_irqsave(&c->lock, flags);
+	idx = s->rtcp_index++ & 0x7fffffffULL;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	encrypt = c->cipher->encrypt_rtcp ? 1 : 0;
+	if (encrypt && c->cipher->encrypt_rtcp(c, s, r, idx))
+		return -1;
+
+	idx_p = (void *) (r->payload + r->payload_len);
+	*idx_p = htonl((encrypt ? 0x80000000ULL : 0ULL) | idx);
+	r->payload_len += sizeof(*idx_p);
+
+	return 0;
+}
+
+static int srtcp_authenticate(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r)
+{
+	unsigned char hmac[20];
+	unsigned char *p;
+
+	if (!is_srtcp(s))
+		return 0;
+	if (s->hmac == REH_NULL)
+		return 0;
+	if (!c->shash)
+		return -1;
+
+	if (srtcp_hash(hmac, c, r))
+		return -1;
+
+	if (s->mki_len) {
+		p = r->payload + r->payload_len;
+		memcpy(p, s->mki, s->mki_len);
+		r->payload_len += s->mki_len;
+	}
+
+	memcpy(r->payload + r->payload_len, hmac, s->rtcp_auth_tag_len);
+	r->payload_len += s->rtcp_auth_tag_len;
+
+	return 0;
+}
+
+/* rfc 3711 section 4.1.1 */
+static int srtcp_encrypt_aes_cm(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int64_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t *ivi;
+
+	memcpy(iv, c->session_salt, 14);
+	iv[14] = iv[15] = '\0';
+	ivi = (void *) iv;
+	idx <<= 16;
+
+	ivi[1] ^= r->header->ssrc;
+	ivi[2] ^= htonl((idx & 0xffffffff00000000ULL) >> 32);
+	ivi[3] ^= htonl(idx & 0xffffffffULL);
+
+	aes_ctr(r->payload, r->payload, r->payload_len, c->tfm[0], iv);
+
+	return 0;
+}
+
+/* rfc 3711 section 4.1.2.3 */
+static int srtcp_encrypt_aes_f8(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int64_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t i;
+
+	memset(iv, 0, 4);
+	i = htonl(0x80000000ULL | idx);
+	memcpy(&iv[4], &i, sizeof(i));
+	memcpy(&iv[8], r->header, 8);
+
+	aes_f8(r->payload, r->payload_len, c->tfm[0], c->tfm[1], iv);
+
+	return 0;
+}
+
+static inline int rtcp_sample(struct rtpengine_target *g) {
+	if (!g->target.rtcp_sample)
+		return 0;
+	/* an unmarked sample couldn't be told apart from a packet we couldn't handle */
+	if (!g->target.rtcp_sample_mark_mask)
+		return 0;
+	return ((atomic_inc_return(&g->rtcp_count) - 1) % g->target.rtcp_sample) == 0;
+}
+
 static inline int is_muxed_rtcp(struct rtp_parsed *r) {
 	if (r->header->m_pt < 194)
 		return 0;
@@ -3853,7 +4245,8 @@ static struct sk_buff *intercept_skb_copy(struct sk_buff *oskb, const struct re_
 
 
 
-static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t, struct re_address *src,
+static unsigned int rtpengine46(struct sk_buff *skb, struct sk_buff *oskb,
+		struct rtpengine_table *t, struct re_address *src,
 		struct re_address *dst, u_int8_t in_tos, const struct xt_action_param *par)
 {
 	struct udphdr *uh;
@@ -3865,7 +4258,10 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	unsigned int datalen;
 	u_int32_t *u32;
 	struct rtp_parsed rtp;
+	struct rtcp_parsed rtcp;
 	u_int64_t pkt_idx;
+	int rtcp_up = 0;
+	u_int32_t rtcp_mark = 0, rtcp_mark_mask = 0;
 	struct re_stream *stream;
 	struct re_stream_packet *packet;
 	const char *errstr = NULL;
@@ -3931,6 +4327,9 @@ src_check_ok:
 		goto skip1;
 
 	rtp.ok = 0;
+	rtcp.ok = 0;
+	if (g->target.rtcp)
+		goto do_rtcp;
 	if (!g->target.rtp)
 		goto not_rtp;
 
@@ -3941,8 +4340,12 @@ src_check_ok:
 		goto not_rtp;
 	}
 
-	if (g->target.rtcp_mux && is_muxed_rtcp(&rtp))
-		goto skip1;
+	if (g->target.rtcp_mux && is_muxed_rtcp(&rtp)) {
+		if (!g->target.rtcp_fw)
+			goto skip1;
+		rtp.ok = 0;
+		goto do_rtcp;
+	}
 
 	rtp_pt_idx = rtp_payload_type(rtp.header, &g->target);
 
@@ -3972,6 +4375,30 @@ src_check_ok:
 			rtp.payload[12], rtp.payload[13], rtp.payload[14], rtp.payload[15],
 			rtp.payload[16], rtp.payload[17], rtp.payload[18], rtp.payload[19]);
 
+	goto not_rtp;
+
+do_rtcp:
+	parse_rtcp(&rtcp, skb);
+	if (!rtcp.ok)
+		goto skip1;
+
+	/* the original packet of a sampled RTCP packet also goes to userspace for
+	 * inspection, while the copy is forwarded from here as usual */
+	rtcp_up = rtcp_sample(g);
+	if (rtcp_up) {
+		rtcp_mark = g->target.rtcp_sample_mark;
+		rtcp_mark_mask = g->target.rtcp_sample_mark_mask;
+	}
+
+	errstr = "SRTCP authentication tag mismatch";
+	if (srtcp_auth_validate(&g->rtcp_decrypt, &g->target.decrypt, &rtcp, &pkt_idx))
+		goto skip_error;
+	errstr = "SRTCP decryption failed";
+	if (srtcp_decrypt(&g->rtcp_decrypt, &g->target.decrypt, &rtcp, pkt_idx))
+		goto skip_error;
+
+	skb_trim(skb, rtcp.header_len + rtcp.payload_len);
+
 not_rtp:
 	if (g->target.mirror_addr.family) {
 		DBG("sending mirror packet to dst "MIPF"\n", MIPP(g->target.mirror_addr));
@@ -4013,6 +4440,12 @@ no_intercept:
 		if (g->target.transcoding && g->target.ssrc_out)
 			rtp.header->ssrc = g->target.ssrc_out;
 	}
+	else if (rtcp.ok && is_srtcp(&g->target.encrypt)) {
+		skb_put(skb, sizeof(u_int32_t) + g->target.encrypt.mki_len
+				+ g->target.encrypt.rtcp_auth_tag_len);
+		srtcp_encrypt(&g->rtcp_encrypt, &g->target.encrypt, &rtcp);
+		srtcp_authenticate(&g->rtcp_encrypt, &g->target.encrypt, &rtcp);
+	}
 
 	err = send_proxy_packet(skb, &g->target.src_addr, &g->target.dst_addr, g->target.tos, par);
 
@@ -4063,6 +4496,12 @@ no_intercept:
 	target_put(g);
 	table_put(t);
 
+	if (rtcp_up) {
+		/* lets the daemon tell this apart from packets we couldn't handle. only
+		 * the bits that the daemon was told to use are touched */
+		oskb->mark = (oskb->mark & ~rtcp_mark_mask) | (rtcp_mark & rtcp_mark_mask);
+		return XT_CONTINUE;
+	}
 	return NF_DROP;
 
 skip_error:
@@ -4109,7 +4548,7 @@ static unsigned int rtpengine4(struct sk_buff *oskb, const struct xt_action_para
 	dst.family = AF_INET;
 	dst.u.ipv4 = ih->daddr;
 
-	return rtpengine46(skb, t, &src, &dst, (u_int8_t)ih->tos, par);
+	return rtpengine46(skb, oskb, t, &src, &dst, (u_int8_t)ih->tos, par);
 
 skip2:
 	kfree_skb(skb);
@@ -4151,7 +4590,7 @@ static unsigned int rtpengine6(struct sk_buff *oskb, const struct xt_action_para
 	dst.family = AF_INET6;
 	memcpy(&dst.u.ipv6, &ih->daddr, sizeof(dst.u.ipv6));
 
-	return rtpengine46(skb, t, &src, &dst, ipv6_get_dsfield(ih), par);
+	return rtpengine46(skb, oskb, t, &src, &dst, ipv6_get_dsfield(ih), par);
 
 skip2:
 	kfree_skb(skb);
@@ -4222,6 +4661,9 @@ static int __init init(void) {
 	ret = -EINVAL;
 	if (stream_packets_list_limit <= 0)
 		goto fail;
+	err = "hash_bits parameter out of range";
+	if (hash_bits < RE_HASH_BITS_MIN || hash_bits > RE_HASH_BITS_MAX)
+		goto fail;
 
 	printk(KERN_NOTICE "Registering xt_RTPENGINE module - version %s\n", RTPENGINE_VERSION);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
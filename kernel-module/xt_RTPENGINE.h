@@ -69,6 +69,8 @@ struct rtpengine_srtp {
 	u_int64_t			last_index;
 	unsigned int			auth_tag_len; /* in bytes */
 	unsigned int			mki_len;
+	unsigned int			rtcp_auth_tag_len; /* in bytes */
+	u_int64_t			rtcp_index; /* next SRTCP index to use for encryption */
 };
 
 
@@ -98,13 +100,18 @@ struct rtpengine_target_info {
 	unsigned int			num_payload_types;
 
 	unsigned char			tos;
+	unsigned int			rtcp_sample; /* with rtcp_fw: also pass every Nth RTCP packet up */
+	u_int32_t			rtcp_sample_mark; /* bits to set in the mark of sampled packets, */
+	u_int32_t			rtcp_sample_mark_mask; /* within this mask. the rest is left alone */
 	int				rtcp_mux:1,
 					dtls:1,
 					stun:1,
 					rtp:1,
 					rtp_only:1,
 					do_intercept:1,
-					transcoding:1; // SSRC subst and RTP PT filtering
+					transcoding:1, // SSRC subst and RTP PT filtering
+					rtcp:1, // target is a separate RTCP port, requires rtcp_fw
+					rtcp_fw:1; // forward (S)RTCP in kernel instead of passing it up
 };
 
 struct rtpengine_call_info {
@@ -124,6 +131,23 @@ struct rtpengine_packet_info {
 	unsigned int			stream_idx;
 };
 
+struct rtpengine_batch_info {
+	unsigned int			num_entries;
+};
+
+/* for REMG_BATCH, an array of these follows the rtpengine_message struct */
+struct rtpengine_batch_entry {
+	unsigned int			cmd; /* REMG_ADD, REMG_DEL, REMG_UPDATE, REMG_DEL_CALL, REMG_DEL_STREAM */
+	int				result; /* set by kernel: 0 or negative errno */
+	union {
+		struct rtpengine_target_info	target;
+		struct rtpengine_call_info	call;
+		struct rtpengine_stream_info	stream;
+	} u;
+};
+
+#define RTPENGINE_MAX_BATCH 32
+
 struct rtpengine_message {
 	enum {
 		REMG_NOOP = 1,
@@ -144,6 +168,9 @@ struct rtpengine_message {
 		/* packet_info: */
 		REMG_PACKET,
 
+		/* batch_info: */
+		REMG_BATCH,
+
 		__REMG_LAST
 	}				cmd;
 
@@ -152,6 +179,7 @@ struct rtpengine_message {
 		struct rtpengine_call_info	call;
 		struct rtpengine_stream_info	stream;
 		struct rtpengine_packet_info	packet;
+		struct rtpengine_batch_info	batch;
 	} u;
 
 	unsigned char			data[];
@@ -18,6 +18,7 @@ struct rtpengine_common_config {
 	char *log_facility;
 	volatile int log_level;
 	int log_stderr;
+	int log_async_buffer;
 	char *pidfile;
 	int foreground;
 };
@@ -795,100 +795,76 @@ void codeclib_init(int print) {
 
 
 
-static int ptr_cmp(const void *a, const void *b, void *dummy) {
-	if (a < b)
-		return -1;
-	if (a > b)
-		return 1;
-	return 0;
-}
+#define PACKET_SEQ_RING_MASK (PACKET_SEQ_RING_SIZE - 1)
+
+G_STATIC_ASSERT((PACKET_SEQ_RING_SIZE & PACKET_SEQ_RING_MASK) == 0);
+G_STATIC_ASSERT(PACKET_SEQ_RING_SIZE > PACKET_SEQ_DUPE_THRES);
+
+// All queued packets are less than PACKET_SEQ_DUPE_THRES ahead of the next expected
+// seq, so each of them has a ring slot of its own.
 
 void __packet_sequencer_init(packet_sequencer_t *ps, GDestroyNotify ffunc) {
-	ps->packets = g_tree_new_full(ptr_cmp, NULL, NULL, ffunc);
+	ps->packets = g_new0(seq_packet_t *, PACKET_SEQ_RING_SIZE);
+	ps->num_packets = 0;
+	ps->ffunc = ffunc;
 	ps->seq = -1;
 }
+static void __packet_sequencer_flush(packet_sequencer_t *ps) {
+	for (unsigned int i = 0; ps->num_packets && i < PACKET_SEQ_RING_SIZE; i++) {
+		seq_packet_t *packet = ps->packets[i];
+		if (!packet)
+			continue;
+		ps->packets[i] = NULL;
+		ps->num_packets--;
+		if (ps->ffunc)
+			ps->ffunc(packet);
+	}
+}
 void packet_sequencer_destroy(packet_sequencer_t *ps) {
-	if (ps->packets)
-		g_tree_destroy(ps->packets);
+	if (!ps->packets)
+		return;
+	__packet_sequencer_flush(ps);
+	g_free(ps->packets);
 	ps->packets = NULL;
 }
-struct tree_searcher {
-	int find_seq,
-	    found_seq;
-};
-static int packet_tree_search(const void *testseq_p, const void *ts_p) {
-	struct tree_searcher *ts = (void *) ts_p;
-	int testseq = GPOINTER_TO_INT(testseq_p);
-	// called as a binary search test function. we're looking for the lowest
-	// seq number that is higher than find_seq. if our test number is too low,
-	// we proceed with higher numbers. if it's too high, we proceed to the lower
-	// numbers, but remember the lowest we've seen along that path.
-	if (G_UNLIKELY(testseq == ts->find_seq)) {
-		// we've struck gold
-		ts->found_seq = testseq;
-		return 0;
-	}
-	if (testseq < ts->find_seq)
-		return 1;
-	// testseq > ts->find_seq
-	if (ts->found_seq == -1 || testseq < ts->found_seq)
-		ts->found_seq = testseq;
-	return -1;
-}
 // caller must take care of locking
 static void *__packet_sequencer_next_packet(packet_sequencer_t *ps, int num_wait) {
 	// see if we have a packet with the correct seq nr in the queue
-	seq_packet_t *packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ps->seq));
+	seq_packet_t *packet = ps->packets[ps->seq & PACKET_SEQ_RING_MASK];
 	if (G_LIKELY(packet != NULL)) {
 		dbg("returning in-sequence packet (seq %i)", ps->seq);
 		goto out;
 	}
 
 	// why not? do we have anything? (we should)
-	int nnodes = g_tree_nnodes(ps->packets);
-	if (G_UNLIKELY(nnodes == 0)) {
+	if (G_UNLIKELY(ps->num_packets == 0)) {
 		dbg("packet queue empty");
 		return NULL;
 	}
-	if (G_LIKELY(nnodes < num_wait)) {
-		dbg("only %i packets in queue - waiting for more", nnodes);
+	if (G_LIKELY(ps->num_packets < num_wait)) {
+		dbg("only %u packets in queue - waiting for more", ps->num_packets);
 		return NULL; // need to wait for more
 	}
 
-	// packet was probably lost. search for the next highest seq
-	struct tree_searcher ts = { .find_seq = ps->seq + 1, .found_seq = -1 };
-	packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-	if (packet) {
-		// bullseye
-		dbg("lost packet - returning packet with next seq %i", packet->seq);
-		goto out;
-	}
-	if (G_UNLIKELY(ts.found_seq == -1)) {
-		// didn't find anything. seq must have wrapped around. retry
-		// starting from zero
-		ts.find_seq = 0;
-		packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-		if (packet) {
-			dbg("lost packet - returning packet with next seq %i (after wrap)", packet->seq);
-			goto out;
-		}
-		if (G_UNLIKELY(ts.found_seq == -1))
-			abort();
+	// packet was probably lost. return the next highest seq, which is also the
+	// nearest one in the ring
+	for (unsigned int i = 1; i < PACKET_SEQ_RING_SIZE; i++) {
+		packet = ps->packets[(ps->seq + i) & PACKET_SEQ_RING_MASK];
+		if (packet)
+			break;
 	}
-
-	// pull out the packet we found
-	packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ts.found_seq));
 	if (G_UNLIKELY(packet == NULL))
 		abort();
 
-	dbg("lost multiple packets - returning packet with next highest seq %i", packet->seq);
+	dbg("lost packet(s) - returning packet with next highest seq %i", packet->seq);
 
 out:
 	;
 	u_int16_t l = packet->seq - ps->seq;
 	ps->lost_count += l;
 
-	g_tree_steal(ps->packets, GINT_TO_POINTER(packet->seq));
+	ps->packets[packet->seq & PACKET_SEQ_RING_MASK] = NULL;
+	ps->num_packets--;
 	ps->seq = (packet->seq + 1) & 0xffff;
 
 	if (packet->seq < ps->ext_seq)
@@ -928,15 +904,20 @@ int packet_sequencer_insert(packet_sequencer_t *ps, seq_packet_t *p) {
 	if (diff > (0xffff - PACKET_SEQ_DUPE_THRES))
 		return -1;
 
-	// everything else we consider a seq reset
+	// everything else we consider a seq reset. packets queued from before the
+	// reset can't be placed in sequence any more
 	ilog(LOG_DEBUG, "Seq reset detected: expected seq %i, received seq %i", ps->seq, p->seq);
+	__packet_sequencer_flush(ps);
 	ps->seq = p->seq;
 	ret = 1;
 	// seq ok - fall thru
 seq_ok:
-	if (g_tree_lookup(ps->packets, GINT_TO_POINTER(p->seq)))
+	;
+	seq_packet_t **slot = &ps->packets[p->seq & PACKET_SEQ_RING_MASK];
+	if (*slot)
 		return -1;
-	g_tree_insert(ps->packets, GINT_TO_POINTER(p->seq), p);
+	*slot = p;
+	ps->num_packets++;
 
 	return ret;
 }
@@ -177,8 +177,11 @@ struct encoder_s {
 struct seq_packet_s {
 	int seq;
 };
+#define PACKET_SEQ_RING_SIZE 128 // must be a power of two and larger than the dupe threshold
 struct packet_sequencer_s {
-	GTree *packets;
+	seq_packet_t **packets; // ring buffer indexed by seq & (PACKET_SEQ_RING_SIZE - 1)
+	unsigned int num_packets;
+	GDestroyNotify ffunc;
 	unsigned int lost_count;
 	int seq; // next expected
 	unsigned int ext_seq; // last received
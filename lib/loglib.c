@@ -7,7 +7,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <string.h>
+#include <errno.h>
 #include "auxlib.h"
 
 
@@ -16,6 +18,24 @@ struct log_limiter_entry {
 	char *msg;
 };
 
+// single producer (the owning thread), single consumer (the logger thread) ring of
+// complete log lines. `head` and `tail` count bytes and wrap around freely
+struct log_ring {
+	struct log_ring *next;
+	char *buf;
+	unsigned int size; // power of two
+	volatile unsigned int head, tail;
+	volatile unsigned int dropped;
+	volatile int exited;
+};
+
+struct log_ring_entry {
+	int prio; // -1 for padding up to the end of the buffer
+	unsigned int len;
+	struct timeval tv; // when the line was logged
+	char msg[0];
+};
+
 typedef struct _fac_code {
 	char	*c_name;
 	int	c_val;
@@ -75,6 +95,23 @@ static pthread_mutex_t __log_limiter_lock;
 static GStringChunk *__log_limiter_strings;
 static unsigned int __log_limiter_count;
 
+#define LOG_MSG_BUF_SIZE 4096
+
+static __thread char __log_msg_buf[LOG_MSG_BUF_SIZE];
+
+static volatile int log_async;
+static unsigned int log_ring_size;
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log_thread;
+static volatile int log_thread_stop;
+static pthread_key_t log_ring_key;
+static __thread struct log_ring *log_ring;
+static volatile unsigned int log_dropped;
+static GString *log_drain_out; // stderr output of one drain, protected by log_drain_lock
+
 
 
 
@@ -122,18 +159,272 @@ static void log_both(int facility_priority, const char *format, ...) {
 
 
 
+static void log_ring_destroy(void *p) {
+	struct log_ring *r = p;
+	// freed by the logger thread once drained
+	g_atomic_int_set(&r->exited, 1);
+	log_ring = NULL;
+}
+
+static struct log_ring *log_ring_get(void) {
+	struct log_ring *r = log_ring;
+	if (r)
+		return r;
+
+	r = g_slice_alloc0(sizeof(*r));
+	r->size = log_ring_size;
+	r->buf = g_malloc(r->size);
+
+	pthread_mutex_lock(&log_rings_lock);
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_rings_lock);
+
+	pthread_setspecific(log_ring_key, r);
+	log_ring = r;
+	return r;
+}
+
+#define LOG_RING_ALIGN(l) (((l) + 7) & ~7U)
+
+// copies the line into this thread's ring without blocking. returns 0 if the line
+// was queued or dropped, -1 if async logging isn't active
+static int log_ring_push(int prio, const char *prio_prefix, const char *prefix, const char *infix,
+		int len, const char *piece, const char *suffix)
+{
+	if (!g_atomic_int_get(&log_async))
+		return -1;
+
+	struct log_ring *r = log_ring_get();
+
+	unsigned int pp_len = strlen(prio_prefix), p_len = strlen(prefix), i_len = strlen(infix),
+		s_len = strlen(suffix);
+	unsigned int msg_len = pp_len + 2 + p_len + i_len + len + s_len;
+	unsigned int need = LOG_RING_ALIGN(sizeof(struct log_ring_entry) + msg_len);
+
+	unsigned int head = r->head;
+	unsigned int tail = g_atomic_int_get(&r->tail);
+	unsigned int off = head & (r->size - 1);
+	unsigned int pad = 0;
+	if (r->size - off < need)
+		pad = r->size - off;
+
+	if (need + pad > r->size - (head - tail)) {
+		g_atomic_int_inc(&r->dropped);
+		return 0;
+	}
+
+	struct log_ring_entry *e;
+	if (pad) {
+		e = (void *) (r->buf + off);
+		e->prio = -1;
+		e->len = 0;
+		off = 0;
+	}
+
+	e = (void *) (r->buf + off);
+	e->prio = prio;
+	e->len = msg_len;
+	gettimeofday(&e->tv, NULL);
+	char *o = e->msg;
+	memcpy(o, prio_prefix, pp_len);
+	o += pp_len;
+	*o++ = ':';
+	*o++ = ' ';
+	memcpy(o, prefix, p_len);
+	o += p_len;
+	memcpy(o, infix, i_len);
+	o += i_len;
+	memcpy(o, piece, len);
+	o += len;
+	memcpy(o, suffix, s_len);
+
+	g_atomic_int_set(&r->head, head + pad + need);
+	return 0;
+}
+
+static void log_line(int prio, const char *prio_prefix, const char *prefix, const char *infix,
+		int len, const char *piece, const char *suffix)
+{
+	if (!log_ring_push(prio, prio_prefix, prefix, infix, len, piece, suffix))
+		return;
+	write_log(prio, "%s: %s%s%.*s%s", prio_prefix, prefix, infix, len, piece, suffix);
+}
+
+#define LOG_DRAIN_FLUSH 65536
+
+static void log_drain_flush(void) {
+	size_t off = 0;
+
+	while (off < log_drain_out->len) {
+		ssize_t ret = write(STDERR_FILENO, log_drain_out->str + off, log_drain_out->len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+	g_string_truncate(log_drain_out, 0);
+}
+
+// does what write_log() would do, except that lines for stderr carry the time they were
+// logged at and are collected to be written together. syslog() has no way to do either
+static void log_drain_line(int prio, const struct timeval *tv, int len, const char *msg) {
+	int to_stderr;
+
+	if (write_log == log_to_stderr)
+		to_stderr = 1;
+	else if (write_log == (write_log_t *) log_both) {
+		syslog(prio, "%.*s", len, msg);
+		to_stderr = LOG_LEVEL_MASK(prio) <= LOG_WARN;
+	}
+	else {
+		write_log(prio, "%.*s", len, msg);
+		return;
+	}
+
+	if (!to_stderr)
+		return;
+	g_string_append_printf(log_drain_out, "[%lu.%06lu] %.*s\n", (unsigned long) tv->tv_sec,
+			(unsigned long) tv->tv_usec, len, msg);
+	if (log_drain_out->len >= LOG_DRAIN_FLUSH)
+		log_drain_flush();
+}
+
+static void log_ring_drain(struct log_ring *r) {
+	unsigned int head = g_atomic_int_get(&r->head);
+	unsigned int tail = r->tail;
+
+	while (tail != head) {
+		struct log_ring_entry *e = (void *) (r->buf + (tail & (r->size - 1)));
+		if (e->prio == -1)
+			tail += r->size - (tail & (r->size - 1));
+		else {
+			log_drain_line(e->prio, &e->tv, e->len, e->msg);
+			tail += LOG_RING_ALIGN(sizeof(*e) + e->len);
+		}
+		g_atomic_int_set(&r->tail, tail);
+	}
+
+	unsigned int dropped = g_atomic_int_get(&r->dropped);
+	if (dropped) {
+		char msg[80];
+		struct timeval tv;
+
+		g_atomic_int_add(&r->dropped, -dropped);
+		g_atomic_int_add(&log_dropped, dropped);
+		int len = snprintf(msg, sizeof(msg), "WARNING: Log buffer full, %u log messages dropped", dropped);
+		gettimeofday(&tv, NULL);
+		log_drain_line(LOG_WARNING, &tv, len, msg);
+	}
+}
+
+static void log_rings_drain(void) {
+	struct log_ring *r, **rp;
+
+	pthread_mutex_lock(&log_drain_lock);
+
+	if (!log_drain_out)
+		log_drain_out = g_string_sized_new(LOG_DRAIN_FLUSH);
+
+	// new rings are only ever added to the head of the list
+	pthread_mutex_lock(&log_rings_lock);
+	r = log_rings;
+	pthread_mutex_unlock(&log_rings_lock);
+
+	for (; r; r = r->next)
+		log_ring_drain(r);
+	log_drain_flush();
+
+	pthread_mutex_lock(&log_rings_lock);
+	for (rp = &log_rings; (r = *rp); ) {
+		if (!g_atomic_int_get(&r->exited) || r->head != r->tail) {
+			rp = &r->next;
+			continue;
+		}
+		*rp = r->next;
+		g_free(r->buf);
+		g_slice_free1(sizeof(*r), r);
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void *log_thread_loop(void *p) {
+	struct timespec ts;
+
+	pthread_mutex_lock(&log_rings_lock);
+	while (!log_thread_stop) {
+		pthread_mutex_unlock(&log_rings_lock);
+		log_rings_drain();
+		pthread_mutex_lock(&log_rings_lock);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 20000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
+		}
+		pthread_cond_timedwait(&log_async_cond, &log_rings_lock, &ts);
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	log_rings_drain();
+	return NULL;
+}
+
+void log_async_start(void) {
+	unsigned int kb = rtpe_common_config_ptr->log_async_buffer;
+	if (!kb)
+		return;
+	log_ring_size = 1024;
+	while (log_ring_size < kb * 1024)
+		log_ring_size <<= 1;
+	if (pthread_create(&log_thread, NULL, log_thread_loop, NULL)) {
+		write_log(LOG_ERROR, "Failed to start logging thread, logging synchronously");
+		return;
+	}
+	atexit(log_rings_drain);
+	g_atomic_int_set(&log_async, 1);
+}
+
+void log_async_stop(void) {
+	if (!g_atomic_int_get(&log_async))
+		return;
+	g_atomic_int_set(&log_async, 0);
+	pthread_mutex_lock(&log_rings_lock);
+	log_thread_stop = 1;
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_rings_lock);
+	pthread_join(log_thread, NULL);
+}
+
+unsigned int log_dropped_messages(void) {
+	return g_atomic_int_get(&log_dropped);
+}
+
+
+
 void __vpilog(int prio, const char *prefix, const char *fmt, va_list ap) {
 	char *msg, *piece;
 	const char *infix = "";
 	int ret, xprio;
 	const char *prio_prefix;
+	va_list ap2;
 
 	xprio = LOG_LEVEL_MASK(prio);
 	prio_prefix = prio_str[prio & LOG_PRIMASK];
 	if (!prefix)
 		prefix = "";
 
-	ret = vasprintf(&msg, fmt, ap);
+	// most messages fit into the thread's buffer, only the long ones need an allocation
+	msg = __log_msg_buf;
+	va_copy(ap2, ap);
+	ret = vsnprintf(msg, LOG_MSG_BUF_SIZE, fmt, ap2);
+	va_end(ap2);
+	if (ret >= LOG_MSG_BUF_SIZE)
+		ret = vasprintf(&msg, fmt, ap);
 
 	if (ret < 0) {
 		write_log(LOG_ERROR, "Failed to print syslog message - message dropped");
@@ -180,16 +471,17 @@ void __vpilog(int prio, const char *prefix, const char *fmt, va_list ap) {
 	piece = msg;
 
 	while (max_log_line_length && ret > max_log_line_length) {
-		write_log(xprio, "%s: %s%s%.*s ...", prio_prefix, prefix, infix, max_log_line_length, piece);
+		log_line(xprio, prio_prefix, prefix, infix, max_log_line_length, piece, " ...");
 		ret -= max_log_line_length;
 		piece += max_log_line_length;
 		infix = "... ";
 	}
 
-	write_log(xprio, "%s: %s%s%.*s", prio_prefix, prefix, infix, ret, piece);
+	log_line(xprio, prio_prefix, prefix, infix, ret, piece, "");
 
 out:
-	free(msg);
+	if (msg != __log_msg_buf)
+		free(msg);
 }
 
 
@@ -221,6 +513,7 @@ void log_init(const char *handle) {
 	pthread_mutex_init(&__log_limiter_lock, NULL);
 	__log_limiter = g_hash_table_new(log_limiter_entry_hash, log_limiter_entry_equal);
 	__log_limiter_strings = g_string_chunk_new(1024);
+	pthread_key_create(&log_ring_key, log_ring_destroy);
 
 	if (!rtpe_common_config_ptr->log_stderr)
 		openlog(handle, LOG_PID | LOG_NDELAY, ilog_facility);
@@ -27,6 +27,7 @@ static int __ip_connect(socket_t *s, const endpoint_t *);
 static int __ip_listen(socket_t *s, int backlog);
 static int __ip_accept(socket_t *s, socket_t *new_sock);
 static int __ip_timestamping(socket_t *s);
+static int __ip_rcvmark(socket_t *s);
 static int __ip4_sockaddr2endpoint(endpoint_t *, const void *);
 static int __ip6_sockaddr2endpoint(endpoint_t *, const void *);
 static int __ip4_endpoint2sockaddr(void *, const endpoint_t *);
@@ -34,7 +35,8 @@ static int __ip6_endpoint2sockaddr(void *, const endpoint_t *);
 static int __ip4_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static int __ip6_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static ssize_t __ip_recvfrom(socket_t *s, void *buf, size_t len, endpoint_t *ep);
-static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *);
+static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *,
+		unsigned int *);
 static ssize_t __ip_sendmsg(socket_t *s, struct msghdr *mh, const endpoint_t *ep);
 static ssize_t __ip_sendto(socket_t *s, const void *buf, size_t len, const endpoint_t *ep);
 static int __ip4_tos(socket_t *, unsigned int);
@@ -80,6 +82,7 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.listen			= __ip_listen,
 		.accept			= __ip_accept,
 		.timestamping		= __ip_timestamping,
+		.rcvmark		= __ip_rcvmark,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
 		.sendmsg		= __ip_sendmsg,
@@ -111,6 +114,7 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.listen			= __ip_listen,
 		.accept			= __ip_accept,
 		.timestamping		= __ip_timestamping,
+		.rcvmark		= __ip_rcvmark,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
 		.sendmsg		= __ip_sendmsg,
@@ -290,12 +294,14 @@ static int __ip_accept(socket_t *s, socket_t *newsock) {
 
 	return 0;
 }
-static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *tv) {
+static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *tv,
+		unsigned int *mark)
+{
 	ssize_t ret;
 	struct sockaddr_storage sin;
 	struct msghdr msg;
 	struct iovec iov;
-	char ctrl[32];
+	char ctrl[64];
 	struct cmsghdr *cm;
 
 	ZERO(msg);
@@ -314,13 +320,19 @@ static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *
 		return ret;
 	s->family->sockaddr2endpoint(ep, &sin);
 
-	if (tv) {
+	if (mark)
+		*mark = 0;
+
+	if (tv || mark) {
 		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
-			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMP) {
+			if (cm->cmsg_level != SOL_SOCKET)
+				continue;
+			if (tv && cm->cmsg_type == SO_TIMESTAMP) {
 				*tv = *((struct timeval *) CMSG_DATA(cm));
 				tv = NULL;
-				break;
 			}
+			else if (mark && cm->cmsg_type == SO_MARK)
+				memcpy(mark, CMSG_DATA(cm), sizeof(*mark));
 		}
 		if (G_UNLIKELY(tv)) {
 			ilog(LOG_WARNING, "No receive timestamp received from kernel");
@@ -335,7 +347,7 @@ static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *
 	return ret;
 }
 static ssize_t __ip_recvfrom(socket_t *s, void *buf, size_t len, endpoint_t *ep) {
-	return __ip_recvfrom_ts(s, buf, len, ep, NULL);
+	return __ip_recvfrom_ts(s, buf, len, ep, NULL, NULL);
 }
 static ssize_t __ip_sendmsg(socket_t *s, struct msghdr *mh, const endpoint_t *ep) {
 	struct sockaddr_storage sin;
@@ -377,6 +389,17 @@ static int __ip_timestamping(socket_t *s) {
 		return -1;
 	return 0;
 }
+static int __ip_rcvmark(socket_t *s) {
+#ifdef SO_RCVMARK
+	int one = 1;
+	if (setsockopt(s->fd, SOL_SOCKET, SO_RCVMARK, &one, sizeof(one)))
+		return -1;
+	return 0;
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
 static void __ip4_endpoint2kernel(struct re_address *ra, const endpoint_t *ep) {
 	ZERO(*ra);
 	ra->family = AF_INET;
@@ -779,6 +802,21 @@ socktype_t *get_socket_type_c(const char *s) {
 
 
 
+// whether socket_rcvmark() can work on this system
+int socket_rcvmark_supported(void) {
+	int ret = 0;
+#ifdef SO_RCVMARK
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return 0;
+	if (!setsockopt(fd, SOL_SOCKET, SO_RCVMARK, &one, sizeof(one)))
+		ret = 1;
+	close(fd);
+#endif
+	return ret;
+}
+
 void socket_init(void) {
 	int i;
 
@@ -69,8 +69,11 @@ struct socket_family {
 	int				(*listen)(socket_t *, int);
 	int				(*accept)(socket_t *, socket_t *);
 	int				(*timestamping)(socket_t *);
+	int				(*rcvmark)(socket_t *);
 	ssize_t				(*recvfrom)(socket_t *, void *, size_t, endpoint_t *);
-	ssize_t				(*recvfrom_ts)(socket_t *, void *, size_t, endpoint_t *, struct timeval *);
+	// the packet mark is only returned with rcvmark enabled, otherwise it's zero
+	ssize_t				(*recvfrom_ts)(socket_t *, void *, size_t, endpoint_t *, struct timeval *,
+						unsigned int *mark);
 	ssize_t				(*sendmsg)(socket_t *, struct msghdr *, const endpoint_t *);
 	ssize_t				(*sendto)(socket_t *, const void *, size_t, const endpoint_t *);
 	int				(*tos)(socket_t *, unsigned int);
@@ -168,6 +171,7 @@ INLINE int is_addr_unspecified(const sockaddr_t *a) {
 #define socket_sendto(s,a...) (s)->family->sendto((s), a)
 #define socket_error(s) (s)->family->error((s))
 #define socket_timestamping(s) (s)->family->timestamping((s))
+#define socket_rcvmark(s) (s)->family->rcvmark((s))
 INLINE ssize_t socket_sendiov(socket_t *s, const struct iovec *v, unsigned int len, const endpoint_t *dst) {
 	struct msghdr mh;
 	ZERO(mh);
@@ -196,6 +200,7 @@ INLINE void ipv6only(int fd, int yn) {
 
 
 void socket_init(void);
+int socket_rcvmark_supported(void);
 
 int open_socket(socket_t *r, int type, unsigned int port, const sockaddr_t *);
 int connect_socket(socket_t *r, int type, const endpoint_t *ep);
@@ -1,8 +1,15 @@
 #include "db.h"
 #include <mysql.h>
+#include <errmsg.h>
 #include <glib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
 #include "types.h"
 #include "main.h"
 #include "log.h"
@@ -51,6 +58,75 @@ CREATE TABLE `recording_metakeys` (
 
 
 
+#define DB_BATCH_SIZE 64 // max operations per transaction
+#define DB_MAX_META_ROWS 32 // max rows per metadata insert statement
+#define DB_RETRY_INTERVAL 5 // seconds between reconnect attempts while the journal is in use
+#define DB_STATS_INTERVAL 60 // seconds
+
+
+enum db_op_type {
+	DB_OP_INSERT_CALL = 0,
+	DB_OP_INSERT_METADATA,
+	DB_OP_INSERT_STREAM,
+	DB_OP_CLOSE_CALL,
+	DB_OP_CLOSE_STREAM,
+	DB_OP_CONFIG_STREAM,
+
+	__DB_OP_LAST
+};
+
+// Database row ID of a call or a stream. Shared between the metafile or output and all
+// queued operations referring to it. The ID itself is only ever touched by the writer thread.
+struct db_id {
+	volatile gint refcnt;
+	unsigned long long serial; // to refer to it from the journal
+	unsigned long long id;
+};
+
+typedef struct {
+	enum db_op_type type;
+	struct db_id *call,
+		     *stream;
+	double ts;
+	unsigned long i[2];
+	char *s[5];
+	gint64 enqueued; // monotonic, zero for operations read back from the journal
+	str blob; // file contents for OUTPUT_STORAGE_DB
+} db_op_t;
+
+
+int db_queue_size = 4096;
+const char *db_journal;
+
+static int db_enabled;
+static pthread_t db_thread;
+
+// everything below protected by db_lock
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_cond = PTHREAD_COND_INITIALIZER;
+static GQueue db_queue = G_QUEUE_INIT;
+static int db_overflow; // queue went over db_queue_size with a journal configured
+static int db_shutdown;
+static unsigned long long db_serial;
+static struct {
+	unsigned int queue_max;
+	unsigned long long queued,
+			   executed,
+			   journaled,
+			   dropped;
+	// reset after each report
+	unsigned long long latency_total,
+			   latency_max,
+			   latency_count;
+} db_stats;
+
+// only used by the writer thread
+static FILE *journal_fp;
+static int journal_pending;
+static time_t journal_last_retry;
+static GHashTable *journal_ids; // serial -> struct db_id, for objects referenced from the journal
+
+
 static MYSQL __thread *mysql_conn;
 static MYSQL_STMT __thread
 	*stm_insert_call,
@@ -58,7 +134,7 @@ static MYSQL_STMT __thread
 	*stm_insert_stream,
 	*stm_close_stream,
 	*stm_config_stream,
-	*stm_insert_metadata;
+	*stm_insert_metadata[DB_MAX_META_ROWS]; // by number of rows - 1, prepared on demand
 
 
 static void my_stmt_close(MYSQL_STMT **st) {
@@ -75,7 +151,8 @@ static void reset_conn(void) {
 	my_stmt_close(&stm_insert_stream);
 	my_stmt_close(&stm_close_stream);
 	my_stmt_close(&stm_config_stream);
-	my_stmt_close(&stm_insert_metadata);
+	for (int i = 0; i < DB_MAX_META_ROWS; i++)
+		my_stmt_close(&stm_insert_metadata[i]);
 	mysql_close(mysql_conn);
 	mysql_conn = NULL;
 }
@@ -140,9 +217,6 @@ static int check_conn(void) {
 	}
 	if (prep(&stm_config_stream, "update recording_streams set channels = ?, sample_rate = ? where id = ?"))
 		goto err;
-	if (prep(&stm_insert_metadata, "insert into recording_metakeys (`call`, `key`, `value`) values " \
-				"(?,?,?)"))
-		goto err;
 
 	dbg("Connection to MySQL established");
 
@@ -182,12 +256,12 @@ INLINE void my_ull(MYSQL_BIND *b, const unsigned long long *ull) {
 		.is_unsigned = 1,
 	};
 }
-INLINE void my_i(MYSQL_BIND *b, const int *i) {
+INLINE void my_ul(MYSQL_BIND *b, const unsigned long *ul) {
 	*b = (MYSQL_BIND) {
 		.buffer_type = MYSQL_TYPE_LONG,
-		.buffer = (void *) i,
-		.buffer_length = sizeof(*i),
-		.is_unsigned = 0,
+		.buffer = (void *) ul,
+		.buffer_length = sizeof(*ul),
+		.is_unsigned = 1,
 	};
 }
 INLINE void my_d(MYSQL_BIND *b, const double *d) {
@@ -200,39 +274,22 @@ INLINE void my_d(MYSQL_BIND *b, const double *d) {
 }
 
 
-static void execute_wrap(MYSQL_STMT **stmt, MYSQL_BIND *binds, unsigned long long *auto_id) {
-	int retr = 0;
-	while (1) {
-		if (mysql_stmt_bind_param(*stmt, binds))
-			goto err;
-		if (mysql_stmt_execute(*stmt))
-			goto err;
-		if (auto_id) {
-			*auto_id = mysql_insert_id(mysql_conn);
-			if (*auto_id == 0)
-				goto err;
-		}
-		if (mysql_commit(mysql_conn))
+// returns 0 or a MySQL error code
+static unsigned int execute(MYSQL_STMT *stmt, MYSQL_BIND *binds, unsigned long long *auto_id) {
+	if (mysql_stmt_bind_param(stmt, binds))
+		goto err;
+	if (mysql_stmt_execute(stmt))
+		goto err;
+	if (auto_id) {
+		*auto_id = mysql_insert_id(mysql_conn);
+		if (*auto_id == 0)
 			goto err;
-
-		return;
+	}
+	return 0;
 
 err:
-		if (retr > 5) {
-			// fatal
-			ilog(LOG_ERR, "Failed to bind or execute prepared statement: %s",
-					mysql_stmt_error(*stmt));
-			reset_conn();
-			return;
-		}
-		if (retr > 2) {
-			reset_conn();
-			if (check_conn())
-				return;
-		}
-
-		retr++;
-	}
+	ilog(LOG_WARN, "Failed to bind or execute prepared statement: %s", mysql_stmt_error(stmt));
+	return mysql_stmt_errno(stmt) ? : CR_UNKNOWN_ERROR;
 }
 
 
@@ -242,29 +299,104 @@ static double now_double(void) {
 	return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
+
+static struct db_id *db_id_new(unsigned long long serial, unsigned long long id) {
+	struct db_id *d = g_slice_alloc0(sizeof(*d));
+	d->refcnt = 1;
+	d->id = id;
+	if (serial)
+		d->serial = serial;
+	else {
+		pthread_mutex_lock(&db_lock);
+		d->serial = ++db_serial;
+		pthread_mutex_unlock(&db_lock);
+	}
+	return d;
+}
+static struct db_id *db_id_get(struct db_id *d) {
+	if (d)
+		g_atomic_int_inc(&d->refcnt);
+	return d;
+}
+static void db_id_put(struct db_id **d) {
+	if (!*d)
+		return;
+	if (g_atomic_int_dec_and_test(&(*d)->refcnt))
+		g_slice_free1(sizeof(**d), *d);
+	*d = NULL;
+}
+static void db_id_hash_put(void *p) {
+	struct db_id *d = p;
+	db_id_put(&d);
+}
+
+
+static db_op_t *db_op_new(enum db_op_type type, struct db_id *call, struct db_id *stream) {
+	db_op_t *op = g_slice_alloc0(sizeof(*op));
+	op->type = type;
+	op->call = db_id_get(call);
+	op->stream = db_id_get(stream);
+	op->ts = now_double();
+	return op;
+}
+static void db_op_free(db_op_t *op) {
+	db_id_put(&op->call);
+	db_id_put(&op->stream);
+	for (int i = 0; i < G_N_ELEMENTS(op->s); i++)
+		g_free(op->s[i]);
+	free(op->blob.s);
+	g_slice_free1(sizeof(*op), op);
+}
+
+
+static void db_enqueue(db_op_t *op) {
+	pthread_mutex_lock(&db_lock);
+
+	if (db_queue.length >= db_queue_size) {
+		// with a journal, the writer thread moves the whole backlog there once it's done
+		// with its current batch. the call row is needed by everything that follows it
+		if (db_journal)
+			db_overflow = 1;
+		else if (op->type != DB_OP_INSERT_CALL) {
+			db_stats.dropped++;
+			pthread_mutex_unlock(&db_lock);
+			ilog(LOG_ERR, "Database write queue is full, discarding operation");
+			db_op_free(op);
+			return;
+		}
+	}
+
+	op->enqueued = g_get_monotonic_time();
+	g_queue_push_tail(&db_queue, op);
+	db_stats.queued++;
+	if (db_queue.length > db_stats.queue_max)
+		db_stats.queue_max = db_queue.length;
+	pthread_cond_signal(&db_cond);
+
+	pthread_mutex_unlock(&db_lock);
+}
+
+
+// mf is locked
 static void db_do_call_id(metafile_t *mf) {
-	if (mf->db_id > 0)
+	if (mf->db_id)
 		return;
 	if (!mf->call_id)
 		return;
 
-	double now = now_double();
+	mf->db_id = db_id_new(0, 0);
 
-	MYSQL_BIND b[2];
-	my_cstr(&b[0], mf->call_id);
-	my_d(&b[1], &now);
-
-	execute_wrap(&stm_insert_call, b, &mf->db_id);
+	db_op_t *op = db_op_new(DB_OP_INSERT_CALL, mf->db_id, NULL);
+	op->s[0] = g_strdup(mf->call_id);
+	db_enqueue(op);
 }
+// mf is locked
 static void db_do_call_metadata(metafile_t *mf) {
 	if (!mf->metadata_db)
 		return;
-	if (mf->db_id == 0)
+	if (!mf->db_id)
 		return;
 
-	MYSQL_BIND b[3];
-	my_ull(&b[0], &mf->db_id); // stays persistent
-
 	// XXX offload this parsing to proxy module -> bencode list/dictionary
 	str all_meta;
 	str_init(&all_meta, mf->metadata_db);
@@ -279,17 +411,18 @@ static void db_do_call_metadata(metafile_t *mf) {
 			continue;
 		}
 
-		my_str(&b[1], &key);
-		my_str(&b[2], &token);
-
-		execute_wrap(&stm_insert_metadata, b, NULL);
+		db_op_t *op = db_op_new(DB_OP_INSERT_METADATA, mf->db_id, NULL);
+		op->s[0] = g_strndup(key.s, key.len);
+		op->s[1] = g_strndup(token.s, token.len);
+		db_enqueue(op);
 	}
 
 	mf->metadata_db = NULL;
 }
 
+// mf is locked
 void db_do_call(metafile_t *mf) {
-	if (check_conn())
+	if (!db_enabled)
 		return;
 
 	db_do_call_id(mf);
@@ -299,139 +432,764 @@ void db_do_call(metafile_t *mf) {
 
 // mf is locked
 void db_do_stream(metafile_t *mf, output_t *op, const char *type, stream_t *stream, unsigned long ssrc) {
-	if (check_conn())
+	if (!db_enabled)
 		return;
-	if (mf->db_id == 0)
+	if (!mf->db_id)
 		return;
-	if (op->db_id > 0)
+	if (op->db_id)
 		return;
 
-	unsigned long id = stream ? stream->id : 0;
-	double now = now_double();
+	op->db_id = db_id_new(0, 0);
 
-	MYSQL_BIND b[11];
-	my_ull(&b[0], &mf->db_id);
-	my_cstr(&b[1], op->file_name);
-	my_cstr(&b[2], op->file_format);
-	my_cstr(&b[3], op->full_filename);
-	my_cstr(&b[4], op->file_format);
-	my_cstr(&b[5], op->file_format);
-	my_cstr(&b[6], type);
-	b[7] = (MYSQL_BIND) {
-		.buffer_type = MYSQL_TYPE_LONG,
-		.buffer = &id,
-		.buffer_length = sizeof(id),
-		.is_unsigned = 1,
-	};
-	b[8] = (MYSQL_BIND) {
-		.buffer_type = MYSQL_TYPE_LONG,
-		.buffer = &ssrc,
-		.buffer_length = sizeof(ssrc),
-		.is_unsigned = 1,
-	};
+	db_op_t *dop = db_op_new(DB_OP_INSERT_STREAM, mf->db_id, op->db_id);
+	dop->i[0] = stream ? stream->id : 0;
+	dop->i[1] = ssrc;
+	dop->s[0] = g_strdup(op->file_name);
+	dop->s[1] = g_strdup(op->file_format);
+	dop->s[2] = g_strdup(op->full_filename);
+	dop->s[3] = g_strdup(type);
 	if (stream) {
 		tag_t *tag = tag_get(mf, stream->tag);
-		my_cstr(&b[9], tag->label ? : "");
+		dop->s[4] = g_strdup(tag->label ? : "");
 	}
 	else
-		my_cstr(&b[9], "");
-	my_d(&b[10], &now);
-
-	execute_wrap(&stm_insert_stream, b, &op->db_id);
+		dop->s[4] = g_strdup("");
+	db_enqueue(dop);
 }
 
+// mf is locked
 void db_close_call(metafile_t *mf) {
-	if (check_conn())
+	if (!mf->db_id)
 		return;
-	if (mf->db_id == 0)
+
+	db_enqueue(db_op_new(DB_OP_CLOSE_CALL, mf->db_id, NULL));
+	db_id_put(&mf->db_id);
+}
+
+void db_close_stream(output_t *op) {
+	if (!op->db_id)
 		return;
 
-	double now = now_double();
+	db_op_t *dop = db_op_new(DB_OP_CLOSE_STREAM, NULL, op->db_id);
+	dop->s[0] = g_strdup_printf("%s.%s", op->full_filename, op->file_format);
+	db_enqueue(dop);
+	db_id_put(&op->db_id);
+}
 
-	MYSQL_BIND b[2];
-	my_d(&b[0], &now);
-	my_ull(&b[1], &mf->db_id);
+void db_config_stream(output_t *op) {
+	if (!op->db_id)
+		return;
 
-	execute_wrap(&stm_close_call, b, NULL);
+	db_op_t *dop = db_op_new(DB_OP_CONFIG_STREAM, NULL, op->db_id);
+	dop->i[0] = op->encoder->actual_format.channels;
+	dop->i[1] = op->encoder->actual_format.clockrate;
+	db_enqueue(dop);
 }
 
-void db_close_stream(output_t *op) {
-	if (check_conn())
+
+
+// ---- writer thread ----
+
+
+// returns 0 if the file contents are available or not needed
+static int db_read_stream_file(db_op_t *op) {
+	if (!(output_storage & OUTPUT_STORAGE_DB))
+		return 0;
+	if (op->blob.s)
+		return 0;
+
+	FILE *f = fopen(op->s[0], "rb");
+	if (!f) {
+		ilog(LOG_ERR, "Failed to open file: %s", op->s[0]);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	op->blob.len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	op->blob.s = malloc(op->blob.len);
+	if (!op->blob.s) {
+		ilog(LOG_ERR, "Failed to allocate memory for file contents");
+		goto err;
+	}
+	size_t count = fread(op->blob.s, 1, op->blob.len, f);
+	if (count != op->blob.len) {
+		ilog(LOG_ERR, "Failed to read from stream");
+		goto err;
+	}
+	fclose(f);
+	return 0;
+
+err:
+	free(op->blob.s);
+	op->blob.s = NULL;
+	op->blob.len = 0;
+	fclose(f);
+	return -1;
+}
+
+
+// executes a single non-metadata operation. returns 0 or a MySQL error code.
+// IDs set by this are added to `assigned`.
+static unsigned int db_op_exec(db_op_t *op, GQueue *assigned) {
+	MYSQL_BIND b[11];
+	unsigned int ret;
+	int par_idx = 0;
+
+	switch (op->type) {
+		case DB_OP_INSERT_CALL:
+			if (op->call->id)
+				return 0;
+
+			my_cstr(&b[0], op->s[0]);
+			my_d(&b[1], &op->ts);
+
+			ret = execute(stm_insert_call, b, &op->call->id);
+			if (!ret)
+				g_queue_push_tail(assigned, op->call);
+			return ret;
+
+		case DB_OP_INSERT_STREAM:
+			if (!op->call->id)
+				return 0;
+			if (op->stream->id)
+				return 0;
+
+			my_ull(&b[0], &op->call->id);
+			my_cstr(&b[1], op->s[0]);
+			my_cstr(&b[2], op->s[1]);
+			my_cstr(&b[3], op->s[2]);
+			my_cstr(&b[4], op->s[1]);
+			my_cstr(&b[5], op->s[1]);
+			my_cstr(&b[6], op->s[3]);
+			my_ul(&b[7], &op->i[0]);
+			my_ul(&b[8], &op->i[1]);
+			my_cstr(&b[9], op->s[4]);
+			my_d(&b[10], &op->ts);
+
+			ret = execute(stm_insert_stream, b, &op->stream->id);
+			if (!ret)
+				g_queue_push_tail(assigned, op->stream);
+			return ret;
+
+		case DB_OP_CLOSE_CALL:
+			if (!op->call->id)
+				return 0;
+
+			my_d(&b[0], &op->ts);
+			my_ull(&b[1], &op->call->id);
+
+			return execute(stm_close_call, b, NULL);
+
+		case DB_OP_CLOSE_STREAM:
+			if (!op->stream->id)
+				return 0;
+			if (db_read_stream_file(op) && !(output_storage & OUTPUT_STORAGE_FILE))
+				return 0;
+
+			my_d(&b[par_idx++], &op->ts);
+			if ((output_storage & OUTPUT_STORAGE_DB))
+				my_str(&b[par_idx++], &op->blob);
+			my_ull(&b[par_idx++], &op->stream->id);
+
+			return execute(stm_close_stream, b, NULL);
+
+		case DB_OP_CONFIG_STREAM:
+			if (!op->stream->id)
+				return 0;
+
+			my_ul(&b[0], &op->i[0]);
+			my_ul(&b[1], &op->i[1]);
+			my_ull(&b[2], &op->stream->id);
+
+			return execute(stm_config_stream, b, NULL);
+
+		default:
+			return 0;
+	}
+}
+
+
+// inserts metadata rows with a single statement. returns 0 or a MySQL error code
+static unsigned int db_meta_exec(db_op_t **ops, unsigned int num) {
+	MYSQL_STMT **stmt = &stm_insert_metadata[num - 1];
+
+	if (!*stmt) {
+		GString *q = g_string_new("insert into recording_metakeys (`call`, `key`, `value`) values (?,?,?)");
+		for (unsigned int i = 1; i < num; i++)
+			g_string_append(q, ",(?,?,?)");
+		int err = prep(stmt, q->str);
+		g_string_free(q, TRUE);
+		if (err)
+			return CR_UNKNOWN_ERROR;
+	}
+
+	MYSQL_BIND b[DB_MAX_META_ROWS * 3];
+	for (unsigned int i = 0; i < num; i++) {
+		my_ull(&b[i * 3], &ops[i]->call->id);
+		my_cstr(&b[i * 3 + 1], ops[i]->s[0]);
+		my_cstr(&b[i * 3 + 2], ops[i]->s[1]);
+	}
+
+	return execute(*stmt, b, NULL);
+}
+
+
+// executes operations within the current transaction, coalescing consecutive metadata
+// inserts. returns 0 or a MySQL error code.
+static unsigned int db_batch_exec_ops(GQueue *ops, GQueue *assigned) {
+	db_op_t *meta[DB_MAX_META_ROWS];
+	unsigned int num_meta = 0;
+	unsigned int ret;
+
+	for (GList *l = ops->head; l; l = l->next) {
+		db_op_t *op = l->data;
+
+		if (op->type == DB_OP_INSERT_METADATA) {
+			if (!op->call->id)
+				continue;
+			meta[num_meta++] = op;
+			if (num_meta < DB_MAX_META_ROWS)
+				continue;
+		}
+
+		if (num_meta) {
+			ret = db_meta_exec(meta, num_meta);
+			num_meta = 0;
+			if (ret)
+				return ret;
+		}
+
+		if (op->type == DB_OP_INSERT_METADATA)
+			continue;
+
+		ret = db_op_exec(op, assigned);
+		if (ret)
+			return ret;
+	}
+
+	if (num_meta) {
+		ret = db_meta_exec(meta, num_meta);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static unsigned int db_query(const char *q) {
+	if (mysql_query(mysql_conn, q))
+		return mysql_errno(mysql_conn) ? : CR_UNKNOWN_ERROR;
+	return 0;
+}
+
+
+// executes all operations within a single transaction. returns 0 or a MySQL error code.
+static unsigned int db_batch_exec(GQueue *ops, GQueue *assigned) {
+	unsigned int ret = db_batch_exec_ops(ops, assigned);
+	if (ret)
+		return ret;
+	if (mysql_commit(mysql_conn))
+		return mysql_errno(mysql_conn) ? : CR_UNKNOWN_ERROR;
+	return 0;
+}
+
+
+// same as above, but operations rejected by the server are rolled back individually
+// and discarded. the rest is still only committed as a whole, so that nothing gets
+// executed twice if the batch has to be kept for later.
+static unsigned int db_batch_exec_single(GQueue *ops, GQueue *assigned) {
+	unsigned int ret;
+
+	for (GList *l = ops->head; l; l = l->next) {
+		GQueue single = G_QUEUE_INIT;
+		GQueue op_assigned = G_QUEUE_INIT;
+		struct db_id *d;
+
+		ret = db_query("savepoint op");
+		if (ret)
+			return ret;
+
+		g_queue_push_tail(&single, l->data);
+		ret = db_batch_exec_ops(&single, &op_assigned);
+		g_queue_clear(&single);
+
+		if (!ret) {
+			while ((d = g_queue_pop_head(&op_assigned)))
+				g_queue_push_tail(assigned, d);
+			continue;
+		}
+
+		while ((d = g_queue_pop_head(&op_assigned)))
+			d->id = 0;
+		if (ret >= CR_MIN_ERROR)
+			return ret;
+
+		ilog(LOG_ERR, "Discarding failed database operation");
+		ret = db_query("rollback to savepoint op");
+		if (ret)
+			return ret;
+	}
+
+	if (mysql_commit(mysql_conn))
+		return mysql_errno(mysql_conn) ? : CR_UNKNOWN_ERROR;
+	return 0;
+}
+
+
+static void db_batch_rollback(GQueue *assigned) {
+	struct db_id *d;
+	while ((d = g_queue_pop_head(assigned)))
+		d->id = 0;
+	reset_conn(); // discards the transaction
+}
+
+
+// returns 0 if all operations were dealt with, or -1 if the database is unreachable
+// and the operations are to be kept
+static int db_batch_run(GQueue *ops) {
+	GQueue assigned = G_QUEUE_INIT;
+
+	for (int retr = 0; retr < 3; retr++) {
+		if (check_conn())
+			return -1;
+
+		unsigned int err = db_batch_exec(ops, &assigned);
+		if (!err) {
+			g_queue_clear(&assigned);
+			return 0;
+		}
+
+		db_batch_rollback(&assigned);
+
+		if (err >= CR_MIN_ERROR)
+			continue; // connection trouble: retry
+
+		// rejected by the server. try again, skipping what fails
+		if (check_conn())
+			return -1;
+		err = db_batch_exec_single(ops, &assigned);
+		if (!err) {
+			g_queue_clear(&assigned);
+			return 0;
+		}
+
+		db_batch_rollback(&assigned);
+
+		if (err >= CR_MIN_ERROR)
+			continue;
+
+		ilog(LOG_ERR, "Discarding %u database operations after error: %u", ops->length, err);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+static void db_ops_done(GQueue *ops) {
+	db_op_t *op;
+	gint64 now = g_get_monotonic_time();
+	unsigned long long num = 0, lat_total = 0, lat_max = 0, lat_count = 0;
+
+	while ((op = g_queue_pop_head(ops))) {
+		if (op->type == DB_OP_CLOSE_STREAM && !(output_storage & OUTPUT_STORAGE_FILE))
+			remove(op->s[0]);
+		if (op->enqueued) {
+			unsigned long long lat = now - op->enqueued;
+			lat_total += lat;
+			if (lat > lat_max)
+				lat_max = lat;
+			lat_count++;
+		}
+		num++;
+		db_op_free(op);
+	}
+
+	pthread_mutex_lock(&db_lock);
+	db_stats.executed += num;
+	db_stats.latency_total += lat_total;
+	db_stats.latency_count += lat_count;
+	if (lat_max > db_stats.latency_max)
+		db_stats.latency_max = lat_max;
+	pthread_mutex_unlock(&db_lock);
+}
+
+
+static void db_ops_drop(GQueue *ops) {
+	db_op_t *op;
+	unsigned int num = ops->length;
+
+	while ((op = g_queue_pop_head(ops)))
+		db_op_free(op);
+
+	ilog(LOG_ERR, "Database unavailable, discarding %u operations", num);
+
+	pthread_mutex_lock(&db_lock);
+	db_stats.dropped += num;
+	pthread_mutex_unlock(&db_lock);
+}
+
+
+static void db_journal_ref(GString *s, struct db_id *d) {
+	if (!d) {
+		g_string_append(s, "\t0\t0");
 		return;
-	if (op->db_id == 0)
+	}
+	g_string_append_printf(s, "\t%llu\t%llu", d->serial, d->id);
+	// remember objects without ID, so they get one when the journal is replayed
+	if (!d->id && !g_hash_table_lookup(journal_ids, &d->serial))
+		g_hash_table_insert(journal_ids, &d->serial, db_id_get(d));
+}
+
+
+// appends operations to the journal, in order. returns 0 if they were all written.
+static int db_journal_write(GQueue *ops) {
+	if (!db_journal)
+		return -1;
+
+	if (!journal_fp) {
+		journal_fp = fopen(db_journal, "a");
+		if (!journal_fp) {
+			ilog(LOG_ERR, "Failed to open database journal '%s': %s", db_journal, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (!journal_pending)
+		ilog(LOG_WARN, "Database unavailable, writing to journal '%s'", db_journal);
+
+	GString *s = g_string_new(NULL);
+	for (GList *l = ops->head; l; l = l->next) {
+		db_op_t *op = l->data;
+
+		g_string_printf(s, "%u", op->type);
+		db_journal_ref(s, op->call);
+		db_journal_ref(s, op->stream);
+		g_string_append_printf(s, "\t%.6f\t%lu\t%lu", op->ts, op->i[0], op->i[1]);
+		for (int i = 0; i < G_N_ELEMENTS(op->s); i++) {
+			char *esc = g_strescape(op->s[i] ? : "", NULL);
+			g_string_append_printf(s, "\t%s", esc);
+			g_free(esc);
+		}
+		g_string_append_c(s, '\n');
+
+		fputs(s->str, journal_fp);
+	}
+	g_string_free(s, TRUE);
+
+	journal_pending = 1;
+
+	if (fflush(journal_fp) || fsync(fileno(journal_fp)))
+		ilog(LOG_ERR, "Failed to write to database journal '%s': %s", db_journal, strerror(errno));
+
+	unsigned int num = ops->length;
+	db_op_t *op;
+	while ((op = g_queue_pop_head(ops)))
+		db_op_free(op);
+
+	pthread_mutex_lock(&db_lock);
+	db_stats.journaled += num;
+	pthread_mutex_unlock(&db_lock);
+
+	return 0;
+}
+
+
+static struct db_id *db_journal_id(const char *serial_s, const char *id_s) {
+	unsigned long long serial = strtoull(serial_s, NULL, 10);
+	if (!serial)
+		return NULL;
+
+	struct db_id *d = g_hash_table_lookup(journal_ids, &serial);
+	if (d)
+		return db_id_get(d);
+
+	d = db_id_new(serial, strtoull(id_s, NULL, 10));
+	g_hash_table_insert(journal_ids, &d->serial, db_id_get(d));
+	return d;
+}
+
+
+static db_op_t *db_journal_parse(const char *line) {
+	db_op_t *op = NULL;
+	gchar **f = g_strsplit(line, "\t", 0);
+
+	if (g_strv_length(f) != 8 + G_N_ELEMENTS(op->s))
+		goto out;
+	unsigned int type = strtoul(f[0], NULL, 10);
+	if (type >= __DB_OP_LAST)
+		goto out;
+
+	op = g_slice_alloc0(sizeof(*op));
+	op->type = type;
+	op->call = db_journal_id(f[1], f[2]);
+	op->stream = db_journal_id(f[3], f[4]);
+	op->ts = g_ascii_strtod(f[5], NULL);
+	op->i[0] = strtoul(f[6], NULL, 10);
+	op->i[1] = strtoul(f[7], NULL, 10);
+	for (int i = 0; i < G_N_ELEMENTS(op->s); i++)
+		op->s[i] = g_strcompress(f[8 + i]);
+
+	// make sure the references the operation needs are there
+	switch (op->type) {
+		case DB_OP_INSERT_CALL:
+		case DB_OP_INSERT_METADATA:
+		case DB_OP_CLOSE_CALL:
+			if (!op->call)
+				goto err;
+			break;
+		case DB_OP_INSERT_STREAM:
+			if (!op->call || !op->stream)
+				goto err;
+			break;
+		default:
+			if (!op->stream)
+				goto err;
+			break;
+	}
+
+out:
+	g_strfreev(f);
+	return op;
+
+err:
+	db_op_free(op);
+	op = NULL;
+	goto out;
+}
+
+
+// replaces the journal with what hasn't been replayed yet
+static void db_journal_rewrite(const char *start, size_t len) {
+	GError *err = NULL;
+	if (!g_file_set_contents(db_journal, start, len, &err)) {
+		ilog(LOG_ERR, "Failed to rewrite database journal '%s': %s", db_journal, err->message);
+		g_error_free(err);
+	}
+}
+
+
+static void db_journal_replay(void) {
+	gchar *contents;
+	gsize len;
+	GError *err = NULL;
+
+	if (journal_fp) {
+		fclose(journal_fp);
+		journal_fp = NULL;
+	}
+
+	if (!g_file_get_contents(db_journal, &contents, &len, &err)) {
+		if (g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			goto done;
+		ilog(LOG_ERR, "Failed to read database journal '%s': %s", db_journal, err->message);
+		g_error_free(err);
 		return;
+	}
 
-	double now = now_double();
+	ilog(LOG_INFO, "Replaying database journal '%s'", db_journal);
 
-	str stream;
-        char *filename = 0;
-        MYSQL_BIND b[3];
-        stream.s = 0;
-        stream.len = 0;
+	char *pos = contents, *end = contents + len, *batch_start = contents;
+	GQueue batch = G_QUEUE_INIT;
 
-	if ((output_storage & OUTPUT_STORAGE_DB)) {
-		filename = malloc(strlen(op->full_filename) +
-				  strlen(op->file_format) + 2);
-		if (!filename) {
-			ilog(LOG_ERR, "Failed to allocate memory for filename");
-			if ((output_storage & OUTPUT_STORAGE_FILE))
-				goto file;
+	while (pos < end) {
+		char *nl = memchr(pos, '\n', end - pos);
+		if (!nl)
+			break; // incomplete last line
+
+		*nl = '\0';
+		db_op_t *op = db_journal_parse(pos);
+		*nl = '\n';
+		pos = nl + 1;
+
+		if (!op)
+			ilog(LOG_WARN, "Discarding invalid entry in database journal");
+		else
+			g_queue_push_tail(&batch, op);
+
+		if (batch.length < DB_BATCH_SIZE && pos < end)
+			continue;
+
+		if (db_batch_run(&batch)) {
+			// still unavailable, keep what's left for later
+			db_op_t *op;
+			while ((op = g_queue_pop_head(&batch)))
+				db_op_free(op);
+			db_journal_rewrite(batch_start, end - batch_start);
+			g_free(contents);
 			return;
 		}
-		strcpy(filename, op->full_filename);
-		strcat(filename, ".");
-		strcat(filename, op->file_format);
-		FILE *f = fopen(filename, "rb");
-		if (!f) {
-			ilog(LOG_ERR, "Failed to open file: %s", filename);
-			if ((output_storage & OUTPUT_STORAGE_FILE))
-				goto file;
-			free(filename);
-			return;
+
+		db_ops_done(&batch);
+		batch_start = pos;
+	}
+
+	g_free(contents);
+
+	if (unlink(db_journal))
+		ilog(LOG_ERR, "Failed to remove database journal '%s': %s", db_journal, strerror(errno));
+	ilog(LOG_INFO, "Database journal replayed");
+
+done:
+	if (err)
+		g_error_free(err);
+	journal_pending = 0;
+	g_hash_table_remove_all(journal_ids);
+}
+
+
+static void db_journal_retry(void) {
+	if (!journal_pending)
+		return;
+
+	time_t now = time(NULL);
+	if (now - journal_last_retry < DB_RETRY_INTERVAL)
+		return;
+	journal_last_retry = now;
+
+	if (check_conn())
+		return;
+
+	db_journal_replay();
+}
+
+
+static void db_batch_process(GQueue *batch) {
+	// while there's a journal, everything must go through it to keep things in order
+	if (!journal_pending && !db_batch_run(batch)) {
+		db_ops_done(batch);
+		return;
+	}
+	if (db_journal_write(batch))
+		db_ops_drop(batch);
+}
+
+
+static void db_stats_report(time_t *last, int force) {
+	time_t now = time(NULL);
+	if (!force && now - *last < DB_STATS_INTERVAL)
+		return;
+	*last = now;
+
+	pthread_mutex_lock(&db_lock);
+	unsigned int depth = db_queue.length;
+	unsigned int depth_max = db_stats.queue_max;
+	unsigned long long queued = db_stats.queued,
+			   executed = db_stats.executed,
+			   journaled = db_stats.journaled,
+			   dropped = db_stats.dropped,
+			   lat_avg = db_stats.latency_count ? db_stats.latency_total / db_stats.latency_count : 0,
+			   lat_max = db_stats.latency_max,
+			   lat_count = db_stats.latency_count;
+	db_stats.queue_max = depth;
+	db_stats.latency_total = db_stats.latency_max = db_stats.latency_count = 0;
+	pthread_mutex_unlock(&db_lock);
+
+	if (!force && !lat_count && !depth)
+		return;
+
+	ilog(LOG_INFO, "Database writer: queue depth %u (max %u), %llu queued, %llu written, "
+			"%llu journaled, %llu discarded, latency avg %llu us, max %llu us",
+			depth, depth_max, queued, executed, journaled, dropped, lat_avg, lat_max);
+}
+
+
+static void *db_thread_run(void *p) {
+	GQueue batch = G_QUEUE_INIT;
+	time_t last_stats = time(NULL);
+	db_op_t *op;
+
+	mysql_thread_init();
+
+	pthread_mutex_lock(&db_lock);
+
+	while (1) {
+		if (!db_queue.length) {
+			if (db_shutdown)
+				break;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&db_cond, &db_lock, &ts);
 		}
-		fseek(f, 0, SEEK_END);
-		stream.len = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		stream.s = malloc(stream.len);
-		if (stream.s) {
-			size_t count = fread(stream.s, 1, stream.len, f);
-			if (count != stream.len) {
-				ilog(LOG_ERR, "Failed to read from stream");
-				if ((output_storage & OUTPUT_STORAGE_FILE))
-					goto file;
-				free(filename);
-				return;
-			}
+
+		int overflow = db_overflow;
+		db_overflow = 0;
+		while ((overflow || batch.length < DB_BATCH_SIZE) && (op = g_queue_pop_head(&db_queue)))
+			g_queue_push_tail(&batch, op);
+
+		pthread_mutex_unlock(&db_lock);
+
+		db_journal_retry();
+		if (overflow) {
+			// keeps the order, as everything after this goes through the journal too
+			ilog(LOG_WARN, "Database write queue is full, moving %u operations to the journal",
+					batch.length);
+			if (db_journal_write(&batch))
+				db_ops_drop(&batch);
 		}
-		fclose(f);
-        }
+		else if (batch.length)
+			db_batch_process(&batch);
+		db_stats_report(&last_stats, 0);
 
-file:;
-	int par_idx = 0;
-	my_d(&b[par_idx++], &now);
-	if ((output_storage & OUTPUT_STORAGE_DB))
-		my_str(&b[par_idx++], &stream);
-	my_ull(&b[par_idx++], &op->db_id);
+		pthread_mutex_lock(&db_lock);
+	}
+
+	pthread_mutex_unlock(&db_lock);
 
-	execute_wrap(&stm_close_stream, b, NULL);
+	db_stats_report(&last_stats, 1);
+
+	if (journal_fp) {
+		fclose(journal_fp);
+		journal_fp = NULL;
+	}
+	reset_conn();
+	mysql_thread_end();
 
-        if (stream.s)
-		free(stream.s);
-	if (!(output_storage & OUTPUT_STORAGE_FILE))
-		remove(filename);
-        free(filename);
+	return NULL;
 }
 
-void db_config_stream(output_t *op) {
-	if (check_conn())
+
+void db_setup(void) {
+	if (!c_mysql_host || !c_mysql_db)
+		return;
+
+	// unique across restarts, as the journal may outlive us
+	db_serial = (unsigned long long) time(NULL) << 20;
+	journal_ids = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, db_id_hash_put);
+	if (db_journal && g_file_test(db_journal, G_FILE_TEST_EXISTS))
+		journal_pending = 1;
+	if (db_queue_size <= 0)
+		db_queue_size = 1;
+}
+
+
+// to be called after daemonizing, as threads don't survive the fork
+void db_start(void) {
+	if (!journal_ids)
 		return;
-	if (op->db_id == 0)
+
+	if (pthread_create(&db_thread, NULL, db_thread_run, NULL))
+		die_errno("pthread_create failed");
+
+	db_enabled = 1;
+}
+
+
+// writes out everything still queued
+void db_cleanup(void) {
+	if (!db_enabled)
 		return;
 
-	MYSQL_BIND b[3];
-	my_i(&b[0], &op->encoder->actual_format.channels);
-	my_i(&b[1], &op->encoder->actual_format.clockrate);
-	my_ull(&b[2], &op->db_id);
+	pthread_mutex_lock(&db_lock);
+	db_shutdown = 1;
+	pthread_cond_signal(&db_cond);
+	pthread_mutex_unlock(&db_lock);
+
+	pthread_join(db_thread, NULL);
 
-	execute_wrap(&stm_config_stream, b, NULL);
+	g_hash_table_destroy(journal_ids);
+	journal_ids = NULL;
+	db_enabled = 0;
 }
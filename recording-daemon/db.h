@@ -4,6 +4,15 @@
 #include "types.h"
 
 
+extern int db_queue_size;
+extern const char *db_journal;
+
+
+void db_setup(void);
+void db_start(void);
+void db_cleanup(void);
+
+
 void db_do_call(metafile_t *);
 void db_close_call(metafile_t *);
 void db_do_stream(metafile_t *mf, output_t *op, const char *type, stream_t *, unsigned long ssrc);
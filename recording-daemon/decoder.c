@@ -24,7 +24,9 @@ int resample_audio;
 
 
 
-decode_t *decoder_new(const char *payload_str, output_t *outp) {
+// `raw_outp`: single output that may receive the RTP payloads as they are. if that's
+// the same as `outp`, nothing else is decoded into it
+decode_t *decoder_new(const char *payload_str, output_t *outp, output_t *raw_outp) {
 	str name;
 	char *slash = strchr(payload_str, '/');
 	if (!slash) {
@@ -65,6 +67,18 @@ decode_t *decoder_new(const char *payload_str, output_t *outp) {
 		.format = -1,
 	};
 
+	int passthrough = 0;
+	if (raw_outp && output_passthrough_ok(def)) {
+		format_t raw_format = out_format;
+		if (!output_config_raw(raw_outp, def, &raw_format)) {
+			// still need a decoder for mixing or TLS forwarding, but not for this output
+			dbg("using passthrough output for %s", payload_str);
+			passthrough = 1;
+			if (outp == raw_outp)
+				outp = NULL;
+		}
+	}
+
 	if (resample_audio)
 		out_format.clockrate = resample_audio;
 	// mono/stereo mixing goes here: out_format.channels = ...
@@ -83,6 +97,7 @@ decode_t *decoder_new(const char *payload_str, output_t *outp) {
 	decode_t *deco = g_slice_alloc0(sizeof(decode_t));
 	deco->dec = dec;
 	deco->mixer_idx = (unsigned int) -1;
+	deco->passthrough = passthrough ? 1 : 0;
 	return deco;
 }
 
@@ -103,29 +118,23 @@ static int decoder_got_frame(decoder_t *dec, AVFrame *frame, void *sp, void *dp)
 	if (!metafile->recording_on)
 		goto no_recording;
 
-	// handle mix output
+	// handle mix output. the mixer has its own locking, and it stays around as
+	// long as the metafile does
 	pthread_mutex_lock(&metafile->mix_lock);
-	if (metafile->mix_out) {
+	mix_t *mix = metafile->mix;
+	pthread_mutex_unlock(&metafile->mix_lock);
+	if (mix) {
 		dbg("adding packet from stream #%lu to mix output", stream->id);
 		if (G_UNLIKELY(deco->mixer_idx == (unsigned int) -1))
-			deco->mixer_idx = mix_get_index(metafile->mix);
-		format_t actual_format;
-		if (output_config(metafile->mix_out, &dec->out_format, &actual_format))
+			deco->mixer_idx = mix_get_index(mix);
+		if (mix_config(mix, &dec->out_format))
 			goto no_mix_out;
-		mix_config(metafile->mix, &actual_format);
-		// XXX might be a second resampling to same format
-		AVFrame *dec_frame = resample_frame(&deco->mix_resampler, frame, &actual_format);
-		if (!dec_frame) {
-			pthread_mutex_unlock(&metafile->mix_lock);
-			goto err;
-		}
-		if (mix_add(metafile->mix, dec_frame, deco->mixer_idx, metafile->mix_out))
+		if (mix_add(mix, frame, deco->mixer_idx))
 			ilog(LOG_ERR, "Failed to add decoded packet to mixed output");
 	}
 no_mix_out:
-	pthread_mutex_unlock(&metafile->mix_lock);
 
-	if (output) {
+	if (output && !deco->passthrough) {
 		dbg("SSRC %lx of stream #%lu has single output", ssrc->ssrc, stream->id);
 		if (output_config(output, &dec->out_format, NULL))
 			goto err;
@@ -170,6 +179,17 @@ err:
 
 
 int decoder_input(decode_t *deco, const str *data, unsigned long ts, ssrc_t *ssrc) {
+	if (deco->passthrough) {
+		metafile_t *metafile = ssrc->metafile;
+		if (metafile->recording_on)
+			output_add_raw(ssrc->output, data, ts);
+		// decoding is only needed for mixing and TLS forwarding
+		pthread_mutex_lock(&metafile->mix_lock);
+		int mixing = metafile->recording_on && metafile->mix;
+		pthread_mutex_unlock(&metafile->mix_lock);
+		if (!mixing && !ssrc->tls_fwd_stream)
+			return 0;
+	}
 	return decoder_input_data(deco->dec, data, ts, decoder_got_frame, ssrc, deco);
 }
 
@@ -177,6 +197,5 @@ void decoder_free(decode_t *deco) {
 	if (!deco)
 		return;
 	decoder_close(deco->dec);
-	resample_shutdown(&deco->mix_resampler);
 	g_slice_free1(sizeof(*deco), deco);
 }
@@ -8,7 +8,7 @@
 extern int resample_audio;
 
 
-decode_t *decoder_new(const char *payload_str, output_t *);
+decode_t *decoder_new(const char *payload_str, output_t *, output_t *raw_outp);
 int decoder_input(decode_t *, const str *, unsigned long ts, ssrc_t *);
 void decoder_free(decode_t *);
 
@@ -9,26 +9,42 @@
 #include "garbage.h"
 
 
-static int epoll_fd = -1;
+#define EPOLL_MAX_EVENTS 64
+
+
+// one epoll instance per poller thread
+static int *epoll_fds;
+static unsigned int num_epoll_fds;
+static volatile gint epoll_next;
 
 
 void epoll_setup(void) {
-	epoll_fd = epoll_create1(0);
-	if (epoll_fd == -1)
-		die_errno("epoll_create1 failed");
+	num_epoll_fds = num_threads > 0 ? num_threads : 1;
+	epoll_fds = g_new(int, num_epoll_fds);
+
+	for (unsigned int i = 0; i < num_epoll_fds; i++) {
+		epoll_fds[i] = epoll_create1(0);
+		if (epoll_fds[i] == -1)
+			die_errno("epoll_create1 failed");
+	}
+}
+
 
+// picks a poller thread for a new set of fds, round-robin
+unsigned int epoll_poller_new(void) {
+	return ((unsigned int) g_atomic_int_add(&epoll_next, 1)) % num_epoll_fds;
 }
 
 
-int epoll_add(int fd, uint32_t events, handler_t *handler) {
+int epoll_add(int fd, uint32_t events, handler_t *handler, unsigned int poller) {
 	struct epoll_event epev = { .events = events | EPOLLET, .data = { .ptr = handler } };
-	int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &epev);
+	int ret = epoll_ctl(epoll_fds[poller % num_epoll_fds], EPOLL_CTL_ADD, fd, &epev);
 	return ret;
 }
 
 
-void epoll_del(int fd) {
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+void epoll_del(int fd, unsigned int poller) {
+	epoll_ctl(epoll_fds[poller % num_epoll_fds], EPOLL_CTL_DEL, fd, NULL);
 }
 
 
@@ -38,8 +54,9 @@ static void poller_thread_end(void *ptr) {
 
 
 void *poller_thread(void *ptr) {
-	struct epoll_event epev;
+	struct epoll_event epev[EPOLL_MAX_EVENTS];
 	unsigned int me_num = GPOINTER_TO_UINT(ptr);
+	int epoll_fd = epoll_fds[me_num % num_epoll_fds];
 
 	dbg("poller thread %u running", me_num);
 
@@ -49,7 +66,7 @@ void *poller_thread(void *ptr) {
 
 	while (!shutdown_flag) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		int ret = epoll_wait(epoll_fd, &epev, 1, 10000);
+		int ret = epoll_wait(epoll_fd, epev, G_N_ELEMENTS(epev), 10000);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 		if (ret == -1) {
@@ -58,13 +75,15 @@ void *poller_thread(void *ptr) {
 			die_errno("epoll_wait failed");
 		}
 
-		if (ret > 0) {
-			dbg("thread %u handling event", me_num);
+		dbg("thread %u handling %i events", me_num, ret);
 
-			handler_t *handler = epev.data.ptr;
+		for (int i = 0; i < ret; i++) {
+			handler_t *handler = epev[i].data.ptr;
 			handler->func(handler);
 		}
 
+		// once per batch: handlers from this batch may still have referenced
+		// objects that were released while it was being processed
 		garbage_collect(me_num);
 	}
 
@@ -75,5 +94,9 @@ void *poller_thread(void *ptr) {
 
 
 void epoll_cleanup(void) {
-	close(epoll_fd);
+	for (unsigned int i = 0; i < num_epoll_fds; i++)
+		close(epoll_fds[i]);
+	g_free(epoll_fds);
+	epoll_fds = NULL;
+	num_epoll_fds = 0;
 }
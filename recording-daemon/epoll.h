@@ -10,8 +10,9 @@
 void epoll_setup(void);
 void epoll_cleanup(void);
 
-int epoll_add(int fd, uint32_t events, handler_t *handler);
-void epoll_del(int fd);
+unsigned int epoll_poller_new(void);
+int epoll_add(int fd, uint32_t events, handler_t *handler, unsigned int poller);
+void epoll_del(int fd, unsigned int poller);
 
 
 void *poller_thread(void *ptr);
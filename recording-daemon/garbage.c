@@ -16,6 +16,7 @@ typedef struct {
 static pthread_mutex_t garbage_lock = PTHREAD_MUTEX_INITIALIZER;
 static GQueue garbage = G_QUEUE_INIT;
 static volatile int garbage_thread_num;
+static volatile gint garbage_entries;
 
 
 unsigned int garbage_new_thread_num(void) {
@@ -47,6 +48,7 @@ void garbage_add(void *ptr, free_func_t *free_func) {
 	memset(garb->wait_threads, 0, sizeof(int) * garb->array_len);
 
 	g_queue_push_tail(&garbage, garb);
+	g_atomic_int_inc(&garbage_entries);
 
 	pthread_mutex_unlock(&garbage_lock);
 }
@@ -61,6 +63,10 @@ static void garbage_collect1(garbage_t *garb) {
 
 
 void garbage_collect(unsigned int num) {
+	// nothing to do most of the time
+	if (!g_atomic_int_get(&garbage_entries))
+		return;
+
 	dbg("running garbage collection thread %u", num);
 
 restart:
@@ -82,6 +88,7 @@ restart:
 		if (!garb->threads_left) {
 			// remove from list and process
 			g_queue_delete_link(&garbage, l);
+			g_atomic_int_add(&garbage_entries, -1);
 			pthread_mutex_unlock(&garbage_lock);
 			garbage_collect1(garb);
 
@@ -97,4 +104,5 @@ void garbage_collect_all(void) {
 	garbage_t *garb;
 	while ((garb = g_queue_pop_head(&garbage)))
 		garbage_collect1(garb);
+	g_atomic_int_set(&garbage_entries, 0);
 }
@@ -69,7 +69,7 @@ void inotify_setup(void) {
 	if (ret == -1)
 		die_errno("inotify_add_watch failed");
 
-	if (epoll_add(inotify_fd, EPOLLIN, &inotify_handler))
+	if (epoll_add(inotify_fd, EPOLLIN, &inotify_handler, 0))
 		die_errno("failed to add inotify_fd to epoll");
 }
 
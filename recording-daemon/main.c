@@ -23,6 +23,9 @@
 #include "decoder.h"
 #include "output.h"
 #include "forward.h"
+#include "mix.h"
+#include "db.h"
+#include "packet.h"
 #include "codeclib.h"
 #include "socket.h"
 #include "ssllib.h"
@@ -33,6 +36,7 @@ int ktable = 0;
 int num_threads = 8;
 enum output_storage_enum output_storage = OUTPUT_STORAGE_FILE;
 const char *spool_dir = "/var/spool/rtpengine";
+const char *proc_dir = "/proc/rtpengine";
 const char *output_dir = "/var/lib/rtpengine-recording";
 static const char *output_format = "wav";
 int output_mixed;
@@ -88,6 +92,7 @@ static void setup(void) {
 	metafile_setup();
 	epoll_setup();
 	inotify_setup();
+	db_setup();
 
 }
 
@@ -137,6 +142,10 @@ static void wait_for_signal(void) {
 static void cleanup(void) {
 	garbage_collect_all();
 	metafile_cleanup();
+	mix_cleanup();
+	output_cleanup();
+	db_cleanup();
+	packet_buffer_cleanup();
 	inotify_cleanup();
 	epoll_cleanup();
 	mysql_library_end();
@@ -155,13 +164,20 @@ static void options(int *argc, char ***argv) {
 		{ "output-format",	0,   0, G_OPTION_ARG_STRING,	&output_format,	"Write audio files of this type",	"wav|mp3|none"	},
 		{ "resample-to",	0,   0, G_OPTION_ARG_INT,	&resample_audio,"Resample all output audio",		"INT"		},
 		{ "mp3-bitrate",	0,   0, G_OPTION_ARG_INT,	&mp3_bitrate,	"Bits per second for MP3 encoding",	"INT"		},
+		{ "output-buffer-size",	0,   0, G_OPTION_ARG_INT,	&output_buffer_size,"Size of output file write buffers in kB","INT"	},
+		{ "output-queue-depth",	0,   0, G_OPTION_ARG_INT,	&output_queue_depth,"Max number of pending write buffers per output file","INT"},
+		{ "output-flush-interval",0, 0, G_OPTION_ARG_INT,	&output_flush_interval,"Max seconds to hold back written data","INT"},
 		{ "output-mixed",	0,   0, G_OPTION_ARG_NONE,	&output_mixed,	"Mix participating sources into a single output",NULL	},
+		{ "mix-num-threads",	0,   0, G_OPTION_ARG_INT,	&mix_num_threads,"Number of threads for mixed output",	"INT"		},
 		{ "output-single",	0,   0, G_OPTION_ARG_NONE,	&output_single,	"Create one output file for each source",NULL		},
+		{ "output-passthrough",	0,   0, G_OPTION_ARG_NONE,	&output_passthrough,"Write received audio into single outputs without transcoding if possible",NULL},
 		{ "mysql-host",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_host,	"MySQL host for storage of call metadata","HOST|IP"	},
 		{ "mysql-port",		0,   0,	G_OPTION_ARG_INT,	&c_mysql_port,	"MySQL port"				,"INT"		},
 		{ "mysql-user",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_user,	"MySQL connection credentials",		"USERNAME"	},
 		{ "mysql-pass",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_pass,	"MySQL connection credentials",		"PASSWORD"	},
 		{ "mysql-db",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_db,	"MySQL database name",			"STRING"	},
+		{ "db-queue-size",	0,   0,	G_OPTION_ARG_INT,	&db_queue_size,	"Max number of pending database writes","INT"		},
+		{ "db-journal",		0,   0,	G_OPTION_ARG_STRING,	&db_journal,	"File to hold database writes while the database is unavailable","FILE"	},
 		{ "forward-to", 	0,   0, G_OPTION_ARG_STRING,	&forward_to,	"Where to forward to (unix socket)",	"PATH"		},
 		{ "tls-send-to", 	0,   0, G_OPTION_ARG_STRING,	&tls_send_to,	"Where to send to (TLS destination)",	"IP:PORT"	},
 		{ "tls-resample", 	0,   0, G_OPTION_ARG_INT,	&tls_resample,	"Sampling rate for TLS PCM output",	"INT"		},
@@ -207,6 +223,11 @@ int main(int argc, char **argv) {
 	setup();
 	daemonize();
 	wpidfile();
+	log_async_start();
+	if (output_enabled)
+		output_start();
+	mix_start();
+	db_start();
 
 	service_notify("READY=1\n");
 
@@ -221,4 +242,6 @@ int main(int argc, char **argv) {
 	wait_threads_finish();
 
 	cleanup();
+
+	log_async_stop();
 }
@@ -16,6 +16,7 @@ extern int ktable;
 extern int num_threads;
 extern enum output_storage_enum output_storage;
 extern const char *spool_dir;
+extern const char *proc_dir;
 extern const char *output_dir;
 extern int output_mixed;
 extern int output_single;
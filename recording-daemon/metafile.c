@@ -8,6 +8,7 @@
 #include <limits.h>
 #include "log.h"
 #include "stream.h"
+#include "epoll.h"
 #include "garbage.h"
 #include "main.h"
 #include "recaux.h"
@@ -26,8 +27,8 @@ static void meta_free(void *ptr) {
 	metafile_t *mf = ptr;
 
 	dbg("freeing metafile info for %s", mf->name);
+	mix_destroy(mf->mix); // flushes remaining mixed output
 	output_close(mf->mix_out);
-	mix_destroy(mf->mix);
 	g_string_chunk_free(mf->gsc);
 	for (int i = 0; i < mf->streams->len; i++) {
 		stream_t *stream = g_ptr_array_index(mf->streams, i);
@@ -76,7 +77,7 @@ static void meta_stream_interface(metafile_t *mf, unsigned long snum, char *cont
 			char buf[256];
 			snprintf(buf, sizeof(buf), "%s-mix", mf->parent);
 			mf->mix_out = output_new(output_dir, buf);
-			mf->mix = mix_new();
+			mf->mix = mix_new(mf->mix_out);
 			db_do_stream(mf, mf->mix_out, "mixed", NULL, 0);
 		}
 		pthread_mutex_unlock(&mf->mix_lock);
@@ -175,6 +176,7 @@ static metafile_t *metafile_get(char *name) {
 	mf->forward_count = 0;
 	mf->forward_failed = 0;
 	mf->recording_on = 1;
+	mf->poller = epoll_poller_new();
 
 	if (decoding_enabled) {
 		pthread_mutex_init(&mf->payloads_lock, NULL);
@@ -1,290 +1,575 @@
 #include "mix.h"
 #include <glib.h>
-#include <libavfilter/avfilter.h>
-#include <libavfilter/buffersrc.h>
-#include <libavfilter/buffersink.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdint.h>
 #include <libavutil/channel_layout.h>
-#include <libavutil/mathematics.h>
+#include <libavutil/samplefmt.h>
 #include <inttypes.h>
-#include <libavutil/opt.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "types.h"
 #include "log.h"
 #include "output.h"
 #include "resample.h"
+#include "main.h"
+#include "fix_frame_channel_layout.h"
 
 
 #define NUM_INPUTS 4
+#define MIX_BUFFER_SECS 5 // size of the mixing ring buffer
+#define MIX_MAX_DELAY_SECS 1 // inputs lagging behind more than this are treated as silent
+#define MIX_FRAME_MS 20 // size of frames handed to the output
+#define MIX_INPUT_SCALE (65536 / NUM_INPUTS) // Q16 weight of each input, like amix with NUM_INPUTS
 
+G_STATIC_ASSERT(MIX_INPUT_SCALE <= INT16_MAX); // for _mm_mulhi_epi16
+
+
+struct mix_input {
+	uint64_t pts_offs; // initialized at first input seen
+	uint64_t in_pts; // running counter of next expected adjusted pts
+	resample_t resample; // to S16, if the decoder produces something else
+	unsigned int active:1;
+};
+
+struct mix_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // new work or shutdown
+	pthread_cond_t idle_cond; // finished servicing a mixer
+	GQueue queue; // mix_t objects with output pending
+	mix_t *busy; // currently being serviced
+	int shutdown;
+};
 
 struct mix_s {
-	format_t format;
-
-	AVFilterGraph *graph;
-	AVFilterContext *src_ctxs[NUM_INPUTS];
-	uint64_t pts_offs[NUM_INPUTS]; // initialized at first input seen
-	uint64_t in_pts[NUM_INPUTS]; // running counter of next expected adjusted pts
-	AVFilterContext *amix_ctx;
-	AVFilterContext *sink_ctx;
+	// lock order: out_lock, then lock
+	pthread_mutex_t lock; // protects the input side and the ring buffer
+	pthread_mutex_t out_lock; // protects the output side
+
+	format_t in_format; // as requested by the first decoder, determines the output format
+	format_t format; // what is being mixed: always S16 interleaved
+	uint64_t channel_layout;
+
+	int16_t *buf; // ring buffer of mixed samples, zero where nothing was mixed in yet
+	unsigned int buf_samples; // per channel
+	uint64_t out_pts; // starting at zero, everything before this was handed to the output
+	uint64_t head_pts; // highest pts any input has reached
 	unsigned int next_idx;
-	AVFrame *sink_frame;
-
-	resample_t resample;
+	struct mix_input inputs[NUM_INPUTS];
 
-	uint64_t out_pts; // starting at zero
+	// output side
+	output_t *output;
+	format_t out_format;
+	AVFrame *out_frame; // reused for every output frame
+	resample_t out_resample;
 
-	AVFrame *silence_frame;
+	// worker side, protected by the worker lock
+	struct mix_worker *worker;
+	unsigned int queued:1;
 };
 
 
-static void mix_shutdown(mix_t *mix) {
-	if (mix->amix_ctx)
-		avfilter_free(mix->amix_ctx);
-	mix->amix_ctx = NULL;
+int mix_num_threads = -1;
 
-	if (mix->sink_ctx)
-		avfilter_free(mix->sink_ctx);
-	mix->sink_ctx = NULL;
+static struct mix_worker *mix_workers;
+static unsigned int num_mix_workers;
+static volatile int mix_worker_rr;
 
-	for (int i = 0; i < NUM_INPUTS; i++) {
-		if (mix->src_ctxs[i])
-			avfilter_free(mix->src_ctxs[i]);
-		mix->src_ctxs[i] = NULL;
+
+// adds `num` samples from `src` into `dst`, weighted by 1/NUM_INPUTS so that the mix keeps
+// the loudness of the amix filter and can't clip. saturates at the S16 limits regardless
+static void mix_s16_sat(int16_t *dst, const int16_t *src, unsigned int num) {
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i scale = _mm_set1_epi16(MIX_INPUT_SCALE);
+	for (; i + 8 <= num; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+		b = _mm_mulhi_epi16(b, scale);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epi16(a, b));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 <= num; i += 8) {
+		// doubling multiply, so half the scale gives the same result as above
+		int16x8_t b = vqdmulhq_n_s16(vld1q_s16(src + i), MIX_INPUT_SCALE / 2);
+		vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), b));
+	}
+#endif
+
+	for (; i < num; i++) {
+		int32_t s = (int32_t) dst[i] + (((int32_t) src[i] * MIX_INPUT_SCALE) >> 16);
+		if (s > INT16_MAX)
+			s = INT16_MAX;
+		else if (s < INT16_MIN)
+			s = INT16_MIN;
+		dst[i] = s;
 	}
+}
+
 
-	resample_shutdown(&mix->resample);
-	avfilter_graph_free(&mix->graph);
+// mix->lock must be held
+static void mix_reset(mix_t *mix) {
+	g_free(mix->buf);
+	mix->buf = NULL;
+	mix->buf_samples = 0;
+	mix->out_pts = 0;
+	mix->head_pts = 0;
+
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		struct mix_input *inp = &mix->inputs[i];
+		resample_shutdown(&inp->resample);
+		inp->pts_offs = (uint64_t) -1LL;
+		inp->in_pts = 0;
+		inp->active = 0;
+	}
 
 	format_init(&mix->format);
 }
 
 
-void mix_destroy(mix_t *mix) {
-	if (!mix)
-		return;
-	mix_shutdown(mix);
-	av_frame_free(&mix->sink_frame);
-	av_frame_free(&mix->silence_frame);
-	g_slice_free1(sizeof(*mix), mix);
+// both locks must be held
+static void mix_shutdown(mix_t *mix) {
+	mix_reset(mix);
+	av_frame_free(&mix->out_frame);
+	resample_shutdown(&mix->out_resample);
+	format_init(&mix->in_format);
+	format_init(&mix->out_format);
 }
 
 
 unsigned int mix_get_index(mix_t *mix) {
-	return mix->next_idx++;
+	pthread_mutex_lock(&mix->lock);
+	unsigned int ret = mix->next_idx++;
+	pthread_mutex_unlock(&mix->lock);
+	return ret;
 }
 
 
+// the output is configured from the first decoder's format. inputs in other formats are
+// resampled by mix_add(), so they don't cause the output to be reopened
 int mix_config(mix_t *mix, const format_t *format) {
 	const char *err;
-	char args[512];
+	format_t actual_format;
 
-	if (format_eq(format, &mix->format))
+	pthread_mutex_lock(&mix->lock);
+	int configured = mix->buf != NULL;
+	pthread_mutex_unlock(&mix->lock);
+	if (G_LIKELY(configured))
 		return 0;
 
-	mix_shutdown(mix);
-
-	mix->format = *format;
+	pthread_mutex_lock(&mix->out_lock);
 
-	// filter graph
-	err = "failed to alloc filter graph";
-	mix->graph = avfilter_graph_alloc();
-	if (!mix->graph)
-		goto err;
+	// lost the race against another decoder?
+	pthread_mutex_lock(&mix->lock);
+	configured = mix->buf != NULL;
+	pthread_mutex_unlock(&mix->lock);
+	if (configured) {
+		pthread_mutex_unlock(&mix->out_lock);
+		return 0;
+	}
 
-	// amix
-	err = "no amix filter available";
-	const AVFilter *flt = avfilter_get_by_name("amix");
-	if (!flt)
-		goto err;
+	err = "failed to configure output";
+	if (output_config(mix->output, format, &actual_format))
+		goto err_out;
 
-	snprintf(args, sizeof(args), "inputs=%lu", (unsigned long) NUM_INPUTS);
-	err = "failed to create amix filter context";
-	if (avfilter_graph_create_filter(&mix->amix_ctx, flt, NULL, args, NULL, mix->graph))
-		goto err;
+	pthread_mutex_lock(&mix->lock);
 
-	// inputs
-	err = "no abuffer filter available";
-	flt = avfilter_get_by_name("abuffer");
-	if (!flt)
-		goto err;
+	format_t mix_format = {
+		.clockrate = actual_format.clockrate,
+		.channels = actual_format.channels,
+		.format = AV_SAMPLE_FMT_S16,
+	};
 
-	for (int i = 0; i < NUM_INPUTS; i++) {
-		dbg("init input ctx %i", i);
+	if (!format_eq(&mix_format, &mix->format)) {
+		mix_shutdown(mix);
 
-		snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:"
-				"channel_layout=0x%" PRIx64,
-				1, mix->format.clockrate, mix->format.clockrate,
-				av_get_sample_fmt_name(mix->format.format),
-				av_get_default_channel_layout(mix->format.channels));
+		mix->format = mix_format;
+		mix->channel_layout = av_get_default_channel_layout(mix_format.channels);
+		mix->buf_samples = mix_format.clockrate * MIX_BUFFER_SECS;
+		mix->buf = g_malloc0(sizeof(*mix->buf) * mix->buf_samples * mix_format.channels);
 
-		err = "failed to create abuffer filter context";
-		if (avfilter_graph_create_filter(&mix->src_ctxs[i], flt, NULL, args, NULL, mix->graph))
+		err = "failed to alloc output frame";
+		mix->out_frame = av_frame_alloc();
+		if (!mix->out_frame)
 			goto err;
-
-		err = "failed to link abuffer to amix";
-		if (avfilter_link(mix->src_ctxs[i], 0, mix->amix_ctx, i))
+		mix->out_frame->format = mix_format.format;
+		mix->out_frame->channel_layout = mix->channel_layout;
+		mix->out_frame->sample_rate = mix_format.clockrate;
+		mix->out_frame->nb_samples = mix_format.clockrate * MIX_FRAME_MS / 1000;
+		err = "failed to get output frame buffers";
+		if (av_frame_get_buffer(mix->out_frame, 0) < 0)
 			goto err;
 	}
 
-	// sink
-	err = "no abuffersink filter available";
-	flt = avfilter_get_by_name("abuffersink");
-	if (!flt)
-		goto err;
-
-	err = "failed to create abuffersink filter context";
-	if (avfilter_graph_create_filter(&mix->sink_ctx, flt, NULL, NULL, NULL, mix->graph))
-		goto err;
-
-	err = "failed to link amix to abuffersink";
-	if (avfilter_link(mix->amix_ctx, 0, mix->sink_ctx, 0))
-		goto err;
+	if (!format_eq(&actual_format, &mix->out_format))
+		resample_shutdown(&mix->out_resample);
+	mix->in_format = *format;
+	mix->out_format = actual_format;
 
-	// finish up
-	err = "failed to configure filter chain";
-	if (avfilter_graph_config(mix->graph, NULL))
-		goto err;
+	pthread_mutex_unlock(&mix->lock);
+	pthread_mutex_unlock(&mix->out_lock);
 
 	return 0;
 
 err:
 	mix_shutdown(mix);
+	pthread_mutex_unlock(&mix->lock);
+err_out:
+	pthread_mutex_unlock(&mix->out_lock);
 	ilog(LOG_ERR, "Failed to initialize mixer: %s", err);
 	return -1;
 }
 
 
-mix_t *mix_new() {
-	mix_t *mix = g_slice_alloc0(sizeof(*mix));
-	format_init(&mix->format);
-	mix->sink_frame = av_frame_alloc();
+// mix->lock must be held. returns up to which pts output can be produced.
+static uint64_t mix_ready_pts(mix_t *mix) {
+	uint64_t ret = mix->head_pts;
 
-	for (int i = 0; i < NUM_INPUTS; i++)
-		mix->pts_offs[i] = (uint64_t) -1LL;
+	// wait for all inputs we have seen to catch up ...
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		struct mix_input *inp = &mix->inputs[i];
+		if (inp->active && inp->in_pts < ret)
+			ret = inp->in_pts;
+	}
 
-	return mix;
+	// ... but give them max 1 second of delay. if they fall behind too much,
+	// treat them as silent. otherwise output stalls and won't produce media
+	uint64_t max_delay = (uint64_t) mix->format.clockrate * MIX_MAX_DELAY_SECS;
+	if (mix->head_pts - ret > max_delay)
+		ret = mix->head_pts - max_delay;
+
+	if (ret < mix->out_pts)
+		ret = mix->out_pts;
+	return ret;
 }
 
 
-static void mix_silence_fill_idx_upto(mix_t *mix, unsigned int idx, uint64_t upto) {
-	unsigned int silence_samples = mix->format.clockrate / 100;
+// hands all mixed data that is ready over to the output. with `final` set, also
+// flushes out incomplete frames and data still waiting for other inputs.
+static int mix_flush(mix_t *mix, int final) {
+	int ret = 0;
+
+	pthread_mutex_lock(&mix->out_lock);
+
+	while (1) {
+		pthread_mutex_lock(&mix->lock);
+
+		if (!mix->buf || !mix->out_frame) {
+			pthread_mutex_unlock(&mix->lock);
+			break;
+		}
 
-	while (mix->in_pts[idx] < upto) {
-		if (G_UNLIKELY(upto - mix->in_pts[idx] > mix->format.clockrate * 30)) {
-			ilog(LOG_WARN, "More than 30 seconds of silence needed to fill mix buffer, resetting");
-			mix->in_pts[idx] = upto;
+		unsigned int frame_samples = mix->format.clockrate * MIX_FRAME_MS / 1000;
+		uint64_t ready = final ? mix->head_pts : mix_ready_pts(mix);
+		uint64_t avail = ready - mix->out_pts;
+		if (avail == 0 || (avail < frame_samples && !final)) {
+			pthread_mutex_unlock(&mix->lock);
 			break;
 		}
+		unsigned int num = MIN(avail, frame_samples);
 
-		if (G_UNLIKELY(!mix->silence_frame)) {
-			mix->silence_frame = av_frame_alloc();
-			mix->silence_frame->format = mix->format.format;
-			mix->silence_frame->channel_layout =
-				av_get_default_channel_layout(mix->format.channels);
-			mix->silence_frame->nb_samples = silence_samples;
-			mix->silence_frame->sample_rate = mix->format.clockrate;
-			if (av_frame_get_buffer(mix->silence_frame, 0) < 0) {
-				ilog(LOG_ERR, "Failed to get silence frame buffers");
-				return;
-			}
-			int planes = av_sample_fmt_is_planar(mix->silence_frame->format) ? mix->format.channels : 1;
-			for (int i = 0; i < planes; i++)
-				memset(mix->silence_frame->extended_data[i], 0, mix->silence_frame->linesize[0]);
+		mix->out_frame->nb_samples = frame_samples;
+		if (av_frame_make_writable(mix->out_frame) < 0) {
+			pthread_mutex_unlock(&mix->lock);
+			ret = -1;
+			break;
+		}
+
+		// copy out of the ring buffer and clear the space for new input
+		unsigned int channels = mix->format.channels;
+		int16_t *dst = (int16_t *) mix->out_frame->extended_data[0];
+		unsigned int pos = mix->out_pts % mix->buf_samples;
+		unsigned int first = MIN(num, mix->buf_samples - pos);
+		memcpy(dst, mix->buf + pos * channels, sizeof(*dst) * first * channels);
+		memset(mix->buf + pos * channels, 0, sizeof(*dst) * first * channels);
+		if (first < num) {
+			memcpy(dst + first * channels, mix->buf, sizeof(*dst) * (num - first) * channels);
+			memset(mix->buf, 0, sizeof(*dst) * (num - first) * channels);
 		}
 
-		dbg("pushing silence frame into stream %i (%lli < %llu)", idx,
-				(long long unsigned) mix->in_pts[idx],
-				(long long unsigned) upto);
+		mix->out_frame->nb_samples = num;
+		mix->out_frame->pts = mix->out_pts;
+		mix->out_pts += num;
 
-		mix->silence_frame->pts = mix->in_pts[idx];
-		mix->silence_frame->nb_samples = MIN(silence_samples, upto - mix->in_pts[idx]);
-		mix->in_pts[idx] += mix->silence_frame->nb_samples;
+		pthread_mutex_unlock(&mix->lock);
 
-		if (av_buffersrc_write_frame(mix->src_ctxs[idx], mix->silence_frame))
-			ilog(LOG_WARN, "Failed to write silence frame to buffer");
+		// out_lock is still held: output and out_frame are ours
+		if (format_eq(&mix->format, &mix->out_format)) {
+			if (output_add(mix->output, mix->out_frame))
+				ret = -1;
+		}
+		else {
+			AVFrame *frame = resample_frame(&mix->out_resample, mix->out_frame, &mix->out_format);
+			if (!frame)
+				ret = -1;
+			else {
+				if (output_add(mix->output, frame))
+					ret = -1;
+				av_frame_free(&frame);
+			}
+		}
 	}
+
+	pthread_mutex_unlock(&mix->out_lock);
+
+	return ret;
 }
 
 
-static void mix_silence_fill(mix_t *mix) {
-	if (mix->out_pts < mix->format.clockrate)
+static void mix_schedule(mix_t *mix) {
+	struct mix_worker *w = mix->worker;
+
+	if (!w) {
+		if (mix_flush(mix, 0))
+			ilog(LOG_ERR, "Failed to write mixed output");
 		return;
+	}
 
-	for (int i = 0; i < NUM_INPUTS; i++) {
-		// check the pts of each input and give them max 1 second of delay.
-		// if they fall behind too much, fill input with silence. otherwise
-		// output stalls and won't produce media
-		mix_silence_fill_idx_upto(mix, i, mix->out_pts - mix->format.clockrate);
+	pthread_mutex_lock(&w->lock);
+	if (!mix->queued) {
+		mix->queued = 1;
+		g_queue_push_tail(&w->queue, mix);
+		pthread_cond_signal(&w->cond);
 	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+// mix->lock must be held
+static void mix_buf_add(mix_t *mix, uint64_t pts, const int16_t *src, unsigned int num) {
+	unsigned int channels = mix->format.channels;
+	unsigned int pos = pts % mix->buf_samples;
+	unsigned int first = MIN(num, mix->buf_samples - pos);
+
+	mix_s16_sat(mix->buf + pos * channels, src, first * channels);
+	if (first < num)
+		mix_s16_sat(mix->buf, src + first * channels, (num - first) * channels);
 }
 
 
-int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
+int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx) {
 	const char *err;
+	AVFrame *s16_frame = NULL;
+
+	pthread_mutex_lock(&mix->lock);
 
 	err = "index out of range";
 	if (idx >= NUM_INPUTS)
 		goto err;
 
 	err = "mixer not initialized";
-	if (!mix->src_ctxs[idx])
+	if (!mix->buf)
 		goto err;
 
-	dbg("stream %i pts_off %llu in pts %llu in frame pts %llu samples %u mix out pts %llu", 
+	struct mix_input *inp = &mix->inputs[idx];
+
+	// decoders normally already produce what we need. they may leave the layout unset
+	fix_frame_channel_layout(frame);
+	if (frame->format != mix->format.format || frame->sample_rate != mix->format.clockrate
+			|| frame->channel_layout != mix->channel_layout)
+	{
+		err = "failed to resample frame for mixer";
+		s16_frame = resample_frame(&inp->resample, frame, &mix->format);
+		if (!s16_frame)
+			goto err;
+		frame = s16_frame;
+	}
+
+	dbg("stream %i pts_off %llu in pts %llu in frame pts %llu samples %u mix out pts %llu",
 			idx,
-			(unsigned long long) mix->pts_offs[idx],
-			(unsigned long long) mix->in_pts[idx],
+			(unsigned long long) inp->pts_offs,
+			(unsigned long long) inp->in_pts,
 			(unsigned long long) frame->pts,
 			frame->nb_samples,
 			(unsigned long long) mix->out_pts);
 
 	// adjust for media started late
-	if (G_UNLIKELY(mix->pts_offs[idx] == (uint64_t) -1LL))
-		mix->pts_offs[idx] = mix->out_pts - frame->pts;
-	frame->pts += mix->pts_offs[idx];
-
-	// fill missing time
-	mix_silence_fill_idx_upto(mix, idx, frame->pts);
+	if (G_UNLIKELY(inp->pts_offs == (uint64_t) -1LL))
+		inp->pts_offs = mix->head_pts - frame->pts;
+	inp->active = 1;
+
+	uint64_t pts = frame->pts + inp->pts_offs;
+	unsigned int num = frame->nb_samples;
+	const int16_t *src = (const int16_t *) frame->extended_data[0];
+
+	// jumped further ahead than the buffer can hold?
+	if (G_UNLIKELY(pts + num > mix->out_pts + mix->buf_samples)) {
+		ilog(LOG_WARN, "Timestamp jump on mixer input %u, resyncing", idx);
+		uint64_t resync = MAX(inp->in_pts, mix->out_pts);
+		inp->pts_offs += resync - pts;
+		pts = resync;
+		if (pts + num > mix->out_pts + mix->buf_samples) {
+			err = "mix buffer overflow";
+			goto err;
+		}
+	}
 
-	uint64_t next_pts = frame->pts + frame->nb_samples;
+	// discard what's too late to be mixed in
+	if (G_UNLIKELY(pts < mix->out_pts)) {
+		uint64_t skip = mix->out_pts - pts;
+		if (skip >= num)
+			num = 0;
+		else {
+			num -= skip;
+			src += skip * mix->format.channels;
+			pts += skip;
+		}
+	}
 
-	err = "failed to add frame to mixer";
-	if (av_buffersrc_add_frame(mix->src_ctxs[idx], frame))
-		goto err;
+	if (num)
+		mix_buf_add(mix, pts, src, num);
 
 	// update running counters
-	if (next_pts > mix->out_pts)
-		mix->out_pts = next_pts;
-	if (next_pts > mix->in_pts[idx])
-		mix->in_pts[idx] = next_pts;
-
-	av_frame_free(&frame);
+	uint64_t next_pts = pts + num;
+	if (next_pts > mix->head_pts)
+		mix->head_pts = next_pts;
+	if (next_pts > inp->in_pts)
+		inp->in_pts = next_pts;
 
-	mix_silence_fill(mix);
+	int ready = mix_ready_pts(mix) - mix->out_pts >= mix->format.clockrate * MIX_FRAME_MS / 1000;
 
-	while (1) {
-		int ret = av_buffersink_get_frame(mix->sink_ctx, mix->sink_frame);
-		err = "failed to get frame from mixer";
-		if (ret < 0) {
-			if (ret == AVERROR(EAGAIN))
-				break;
-			else
-				goto err;
-		}
-		frame = resample_frame(&mix->resample, mix->sink_frame, &mix->format);
+	pthread_mutex_unlock(&mix->lock);
 
-		ret = output_add(output, frame);
+	av_frame_free(&s16_frame);
 
-		av_frame_unref(mix->sink_frame);
-		av_frame_free(&frame);
-
-		if (ret)
-			return -1;
-	}
+	if (ready)
+		mix_schedule(mix);
 
 	return 0;
 
 err:
+	pthread_mutex_unlock(&mix->lock);
 	ilog(LOG_ERR, "Failed to add frame to mixer: %s", err);
-	av_frame_free(&frame);
+	av_frame_free(&s16_frame);
 	return -1;
 }
+
+
+mix_t *mix_new(output_t *output) {
+	mix_t *mix = g_slice_alloc0(sizeof(*mix));
+	pthread_mutex_init(&mix->lock, NULL);
+	pthread_mutex_init(&mix->out_lock, NULL);
+	mix->output = output;
+	format_init(&mix->in_format);
+	format_init(&mix->out_format);
+	mix_reset(mix);
+
+	// pin to one worker, so that output for this mixer is produced in order
+	if (num_mix_workers) {
+		unsigned int w = g_atomic_int_add(&mix_worker_rr, 1);
+		mix->worker = &mix_workers[w % num_mix_workers];
+	}
+
+	return mix;
+}
+
+
+void mix_destroy(mix_t *mix) {
+	if (!mix)
+		return;
+
+	struct mix_worker *w = mix->worker;
+	if (w) {
+		pthread_mutex_lock(&w->lock);
+		if (mix->queued) {
+			g_queue_remove(&w->queue, mix);
+			mix->queued = 0;
+		}
+		while (w->busy == mix)
+			pthread_cond_wait(&w->idle_cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (mix_flush(mix, 1))
+		ilog(LOG_ERR, "Failed to write mixed output");
+
+	pthread_mutex_lock(&mix->out_lock);
+	pthread_mutex_lock(&mix->lock);
+	mix_shutdown(mix);
+	pthread_mutex_unlock(&mix->lock);
+	pthread_mutex_unlock(&mix->out_lock);
+
+	pthread_mutex_destroy(&mix->lock);
+	pthread_mutex_destroy(&mix->out_lock);
+	g_slice_free1(sizeof(*mix), mix);
+}
+
+
+static void *mix_worker_thread(void *p) {
+	struct mix_worker *w = p;
+
+	pthread_mutex_lock(&w->lock);
+
+	while (!w->shutdown) {
+		mix_t *mix = g_queue_pop_head(&w->queue);
+		if (!mix) {
+			pthread_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+
+		mix->queued = 0;
+		w->busy = mix;
+		pthread_mutex_unlock(&w->lock);
+
+		if (mix_flush(mix, 0))
+			ilog(LOG_ERR, "Failed to write mixed output");
+
+		pthread_mutex_lock(&w->lock);
+		w->busy = NULL;
+		pthread_cond_broadcast(&w->idle_cond);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+
+// to be called after daemonizing, as threads don't survive the fork
+void mix_start(void) {
+	if (!output_enabled || !output_mixed)
+		return;
+	if (mix_num_threads < 0)
+		mix_num_threads = num_threads;
+	if (mix_num_threads <= 0)
+		return; // mix in the receiving threads
+
+	mix_workers = g_new0(struct mix_worker, mix_num_threads);
+
+	for (int i = 0; i < mix_num_threads; i++) {
+		struct mix_worker *w = &mix_workers[i];
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		pthread_cond_init(&w->idle_cond, NULL);
+		g_queue_init(&w->queue);
+		if (pthread_create(&w->thread, NULL, mix_worker_thread, w))
+			die_errno("pthread_create failed");
+	}
+
+	num_mix_workers = mix_num_threads;
+}
+
+
+// to be called after all mixers have been destroyed
+void mix_cleanup(void) {
+	for (unsigned int i = 0; i < num_mix_workers; i++) {
+		struct mix_worker *w = &mix_workers[i];
+		pthread_mutex_lock(&w->lock);
+		w->shutdown = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		pthread_cond_destroy(&w->idle_cond);
+	}
+
+	g_free(mix_workers);
+	mix_workers = NULL;
+	num_mix_workers = 0;
+}
@@ -5,13 +5,18 @@
 #include <libavutil/frame.h>
 
 
-mix_t *mix_new(void);
+extern int mix_num_threads;
+
+
+void mix_start(void);
+void mix_cleanup(void);
+
+mix_t *mix_new(output_t *);
 void mix_destroy(mix_t *mix);
 
 int mix_config(mix_t *, const format_t *format);
-int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output);
+int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx);
 unsigned int mix_get_index(mix_t *);
 
 
 #endif
-
@@ -1,11 +1,65 @@
 #include "output.h"
 #include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
 #include <limits.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glib.h>
 #include "log.h"
 #include "db.h"
+#include "main.h"
+#include "decoder.h"
+
+
+#define AVIO_BUFFER_SIZE 32768
+#define IO_ALIGN 4096
+#define RAW_MAX_GAP 10 // seconds of silence to fill in passthrough mode
+
+
+// Muxers write into a custom AVIO context, which collects the data into large
+// buffers. Full buffers are written out by a dedicated I/O thread using pwrite(),
+// so that seeks (e.g. to rewrite a WAV header) become plain writes at an offset.
+// The file itself is opened synchronously so that errors are seen by the caller.
+// If the I/O thread falls behind, the writing thread waits for it: dropping a
+// muxer buffer would leave a hole in the middle of a compressed frame.
+
+struct output_io {
+	char *filename;
+	int fd; // owned by the I/O thread
+
+	// accessed by the owner of the output only
+	int64_t pos;
+	int64_t size;
+	unsigned char *buf;
+	int64_t buf_offset;
+	unsigned int buf_len;
+	time_t buf_started;
+
+	// protected by io_lock
+	unsigned int queued;
+	unsigned int max_queued;
+	unsigned long long written;
+	unsigned long long stalls;
+};
+
+enum io_op_type {
+	IO_OP_WRITE,
+	IO_OP_CLOSE,
+};
+
+struct io_op {
+	enum io_op_type type;
+	struct output_io *io;
+	unsigned char *buf;
+	unsigned int len;
+	int64_t offset;
+	output_t *output; // for IO_OP_CLOSE: release this once the file is complete
+};
 
 
 //static int output_codec_id;
@@ -13,10 +67,291 @@ static const codec_def_t *output_codec;
 static const char *output_file_format;
 
 int mp3_bitrate;
+int output_passthrough;
+int output_buffer_size = 32; // kB
+int output_queue_depth = 64; // buffers per output
+int output_flush_interval = 5; // seconds
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER; // a write has completed
+static GQueue io_queue = G_QUEUE_INIT;
+static pthread_t io_thread;
+static int io_running;
+static int io_shutdown;
+
+static struct {
+	unsigned long long buffers;
+	unsigned long long bytes;
+	unsigned long long stalls;
+	unsigned int max_queued;
+} io_stats;
 
 
 
 static void output_shutdown(output_t *output);
+static void output_free(output_t *output);
+
+
+
+static void io_op_run(struct io_op *op) {
+	struct output_io *io = op->io;
+
+	switch (op->type) {
+		case IO_OP_WRITE:;
+			unsigned int done = 0;
+			while (io->fd != -1 && done < op->len) {
+				ssize_t ret = pwrite(io->fd, op->buf + done, op->len - done, op->offset + done);
+				if (ret < 0) {
+					if (errno == EINTR)
+						continue;
+					ilog(LOG_ERR, "Failed to write to output file '%s': %s", io->filename,
+							strerror(errno));
+					break;
+				}
+				done += ret;
+			}
+			free(op->buf);
+
+			pthread_mutex_lock(&io_lock);
+			io->queued--;
+			io->written++;
+			io_stats.buffers++;
+			io_stats.bytes += done;
+			pthread_cond_broadcast(&io_done_cond);
+			pthread_mutex_unlock(&io_lock);
+			break;
+
+		case IO_OP_CLOSE:
+			if (io->fd != -1)
+				close(io->fd);
+			if (io->stalls)
+				ilog(LOG_WARN, "Output file '%s' complete: %llu buffers, writing had "
+						"to wait for disk I/O %llu times, max queue depth %u",
+						io->filename, io->written, io->stalls, io->max_queued);
+			else
+				dbg("Output file '%s' complete: %llu buffers, max queue depth %u",
+						io->filename, io->written, io->max_queued);
+			if (op->output)
+				output_free(op->output);
+			g_free(io->filename);
+			g_slice_free1(sizeof(*io), io);
+			break;
+	}
+
+	g_slice_free1(sizeof(*op), op);
+}
+
+
+static void *io_thread_func(void *p) {
+	pthread_mutex_lock(&io_lock);
+
+	while (1) {
+		struct io_op *op = g_queue_pop_head(&io_queue);
+		if (!op) {
+			if (io_shutdown)
+				break;
+			pthread_cond_wait(&io_cond, &io_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&io_lock);
+		io_op_run(op);
+		pthread_mutex_lock(&io_lock);
+	}
+
+	pthread_mutex_unlock(&io_lock);
+	return NULL;
+}
+
+
+// `wait`: block until the I/O thread has caught up if too many buffers are pending
+// for this output
+static void io_op_queue(struct io_op *op, int wait) {
+	struct output_io *io = op->io;
+
+	pthread_mutex_lock(&io_lock);
+
+	if (!io_running) {
+		// no I/O thread: write synchronously
+		if (op->type == IO_OP_WRITE)
+			io->queued++;
+		pthread_mutex_unlock(&io_lock);
+		io_op_run(op);
+		return;
+	}
+
+	if (op->type == IO_OP_WRITE) {
+		if (wait && io->queued >= output_queue_depth) {
+			io->stalls++;
+			io_stats.stalls++;
+			if (io->stalls == 1)
+				ilog(LOG_WARN, "Disk I/O for '%s' is falling behind", io->filename);
+			while (io->queued >= output_queue_depth)
+				pthread_cond_wait(&io_done_cond, &io_lock);
+		}
+		io->queued++;
+		if (io->queued > io->max_queued)
+			io->max_queued = io->queued;
+		if (io->queued > io_stats.max_queued)
+			io_stats.max_queued = io->queued;
+	}
+
+	g_queue_push_tail(&io_queue, op);
+	pthread_cond_signal(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+}
+
+
+static struct io_op *io_op_new(enum io_op_type type, struct output_io *io) {
+	struct io_op *op = g_slice_alloc0(sizeof(*op));
+	op->type = type;
+	op->io = io;
+	return op;
+}
+
+
+// `wait`: see io_op_queue()
+static void io_buf_flush(struct output_io *io, int wait) {
+	if (!io->buf)
+		return;
+
+	struct io_op *op = io_op_new(IO_OP_WRITE, io);
+	op->buf = io->buf;
+	op->len = io->buf_len;
+	op->offset = io->buf_offset;
+	io->buf = NULL;
+	io->buf_len = 0;
+
+	io_op_queue(op, wait);
+}
+
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int io_avio_write(void *opaque, const uint8_t *data, int len) {
+#else
+static int io_avio_write(void *opaque, uint8_t *data, int len) {
+#endif
+	struct output_io *io = opaque;
+	unsigned int buf_size = output_buffer_size * 1024;
+	int ret = len;
+
+	// not contiguous after a seek?
+	if (io->buf && io->pos != io->buf_offset + io->buf_len)
+		io_buf_flush(io, 0);
+
+	while (len > 0) {
+		if (!io->buf) {
+			if (posix_memalign((void **) &io->buf, IO_ALIGN, buf_size)) {
+				io->buf = NULL;
+				return AVERROR(ENOMEM);
+			}
+			io->buf_offset = io->pos;
+			io->buf_len = 0;
+			io->buf_started = time(NULL);
+		}
+
+		unsigned int chunk = buf_size - io->buf_len;
+		if (chunk > len)
+			chunk = len;
+		memcpy(io->buf + io->buf_len, data, chunk);
+		io->buf_len += chunk;
+		io->pos += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (io->buf_len == buf_size)
+			io_buf_flush(io, 1);
+	}
+
+	if (io->pos > io->size)
+		io->size = io->pos;
+
+	// low bitrate streams take a long time to fill a buffer, don't keep their data back
+	if (io->buf && time(NULL) - io->buf_started >= output_flush_interval)
+		io_buf_flush(io, 1);
+
+	return ret;
+}
+
+
+static int64_t io_avio_seek(void *opaque, int64_t offset, int whence) {
+	struct output_io *io = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return io->size;
+		case SEEK_SET:
+			io->pos = offset;
+			break;
+		case SEEK_CUR:
+			io->pos += offset;
+			break;
+		case SEEK_END:
+			io->pos = io->size + offset;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	return io->pos;
+}
+
+
+static AVIOContext *io_open(output_t *output, const char *filename) {
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		ilog(LOG_ERR, "Failed to open output file '%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	unsigned char *avio_buf = av_malloc(AVIO_BUFFER_SIZE);
+	if (!avio_buf) {
+		close(fd);
+		return NULL;
+	}
+
+	struct output_io *io = g_slice_alloc0(sizeof(*io));
+	io->filename = g_strdup(filename);
+	io->fd = fd;
+
+	AVIOContext *avio = avio_alloc_context(avio_buf, AVIO_BUFFER_SIZE, 1, io, NULL,
+			io_avio_write, io_avio_seek);
+	if (!avio) {
+		av_free(avio_buf);
+		close(fd);
+		g_free(io->filename);
+		g_slice_free1(sizeof(*io), io);
+		return NULL;
+	}
+
+	output->io = io;
+
+	return avio;
+}
+
+
+static void io_avio_free(AVIOContext **avio) {
+	avio_flush(*avio);
+	av_freep(&(*avio)->buffer);
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 81, 100)
+	avio_context_free(avio);
+#else
+	av_freep(avio);
+#endif
+}
+
+
+// `free_output`: release `output` once all of its data has been written
+static void io_close(output_t *output, output_t *free_output) {
+	struct output_io *io = output->io;
+	output->io = NULL;
+
+	io_buf_flush(io, 0);
+	struct io_op *op = io_op_new(IO_OP_CLOSE, io);
+	op->output = free_output;
+	io_op_queue(op, 0);
+}
 
 
 
@@ -50,10 +385,37 @@ output_t *output_new(const char *path, const char *filename) {
 	snprintf(ret->full_filename, sizeof(ret->full_filename), "%s/%s", path, filename);
 	ret->file_format = output_file_format;
 	ret->encoder = encoder_new();
+	format_init(&ret->raw_format);
 	return ret;
 }
 
 
+// picks an unused file name, opens the file and writes the container header.
+// returns NULL on success, or an error description
+static const char *output_open_file(output_t *output, int *av_ret) {
+	char full_fn[PATH_MAX*2];
+	char suff[16] = "";
+	for (int i = 1; i < 20; i++) {
+		snprintf(full_fn, sizeof(full_fn), "%s%s.%s", output->full_filename, suff, output->file_format);
+		if (!g_file_test(full_fn, G_FILE_TEST_EXISTS))
+			goto got_fn;
+		snprintf(suff, sizeof(suff), "-%i", i);
+	}
+
+	return "failed to find unused output file number";
+
+got_fn:
+	output->fmtctx->pb = io_open(output, full_fn);
+	if (!output->fmtctx->pb)
+		return "failed to open output file";
+	*av_ret = avformat_write_header(output->fmtctx, NULL);
+	if (*av_ret)
+		return "failed to write header";
+
+	return NULL;
+}
+
+
 int output_config(output_t *output, const format_t *requested_format, format_t *actual_format) {
 	const char *err;
 	int av_ret = 0;
@@ -98,50 +460,210 @@ int output_config(output_t *output, const format_t *requested_format, format_t *
 	avcodec_parameters_from_context(output->avst->codecpar, output->encoder->u.avc.avcctx);
 #endif
 
-	char full_fn[PATH_MAX*2];
-	char suff[16] = "";
-	for (int i = 1; i < 20; i++) {
-		snprintf(full_fn, sizeof(full_fn), "%s%s.%s", output->full_filename, suff, output->file_format);
-		if (!g_file_test(full_fn, G_FILE_TEST_EXISTS))
-			goto got_fn;
-		snprintf(suff, sizeof(suff), "-%i", i);
+	err = output_open_file(output, &av_ret);
+	if (err)
+		goto err;
+
+	db_config_stream(output);
+done:
+	return 0;
+
+err:
+	output_shutdown(output);
+	ilog(LOG_ERR, "Error configuring media output: %s", err);
+	if (av_ret)
+		ilog(LOG_ERR, "Error returned from libav: %s", av_error(av_ret));
+	return -1;
+}
+
+
+// Passthrough: RTP payloads are written into the container as they are, without
+// decoding and re-encoding. Only done for codecs that the container can hold natively.
+int output_passthrough_ok(const codec_def_t *def) {
+	if (!output_passthrough || resample_audio)
+		return 0;
+	if (!output_file_format || strcmp(output_file_format, "wav"))
+		return 0;
+	switch (def->avcodec_id) {
+		case AV_CODEC_ID_PCM_ALAW:
+		case AV_CODEC_ID_PCM_MULAW:
+			return 1;
+		default:
+			return 0;
 	}
+}
 
-	err = "failed to find unused output file number";
-	goto err;
 
-got_fn:
-	err = "failed to open avio";
-	av_ret = avio_open(&output->fmtctx->pb, full_fn, AVIO_FLAG_WRITE);
-	if (av_ret < 0)
+int output_config_raw(output_t *output, const codec_def_t *def, const format_t *format) {
+	const char *err;
+	int av_ret = 0;
+
+	// anything to do?
+	if (G_LIKELY(output->raw_def == def && format_eq(format, &output->raw_format)))
+		return 0;
+
+	output_shutdown(output);
+
+	err = "failed to alloc format context";
+	output->fmtctx = avformat_alloc_context();
+	if (!output->fmtctx)
 		goto err;
-	err = "failed to write header";
-	av_ret = avformat_write_header(output->fmtctx, NULL);
-	if (av_ret)
+	output->fmtctx->oformat = av_guess_format(output->file_format, NULL, NULL);
+	err = "failed to determine output format";
+	if (!output->fmtctx->oformat)
 		goto err;
 
+	err = "failed to alloc output stream";
+	output->avst = avformat_new_stream(output->fmtctx, NULL);
+	if (!output->avst)
+		goto err;
+	output->avst->time_base = (AVRational) {1, format->clockrate};
+
+	// G.711: one byte per sample and channel
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 26, 0)
+	AVCodecParameters *par = output->avst->codecpar;
+#else
+	AVCodecContext *par = output->avst->codec;
+#endif
+	par->codec_type = AVMEDIA_TYPE_AUDIO;
+	par->codec_id = def->avcodec_id;
+	par->sample_rate = format->clockrate;
+	par->channels = format->channels;
+	par->channel_layout = av_get_default_channel_layout(format->channels);
+	par->bits_per_coded_sample = 8;
+	par->block_align = format->channels;
+	par->bit_rate = format->clockrate * format->channels * 8;
+
+	err = "failed to alloc packet";
+	output->raw_pkt = av_packet_alloc();
+	if (!output->raw_pkt)
+		goto err;
+
+	err = output_open_file(output, &av_ret);
+	if (err)
+		goto err;
+
+	output->raw_def = def;
+	output->raw_format = *format;
+	output->raw_ts_valid = 0;
+	output->raw_pts = 0;
+	// for the database
+	output->encoder->actual_format = *format;
+
 	db_config_stream(output);
-done:
 	return 0;
 
 err:
 	output_shutdown(output);
-	ilog(LOG_ERR, "Error configuring media output: %s", err);
+	ilog(LOG_ERR, "Error configuring media passthrough output: %s", err);
 	if (av_ret)
 		ilog(LOG_ERR, "Error returned from libav: %s", av_error(av_ret));
 	return -1;
 }
 
 
-static void output_shutdown(output_t *output) {
+// shuts down the output on failure
+static int output_write_raw(output_t *output, const unsigned char *data, unsigned int len,
+		unsigned int samples)
+{
+	AVPacket *pkt = output->raw_pkt;
+	AVRational tb = {1, output->raw_format.clockrate};
+
+	pkt->data = (unsigned char *) data;
+	pkt->size = len;
+	pkt->stream_index = output->avst->index;
+	pkt->pts = pkt->dts = av_rescale_q(output->raw_pts, tb, output->avst->time_base);
+	pkt->duration = av_rescale_q(samples, tb, output->avst->time_base);
+
+	int ret = av_write_frame(output->fmtctx, pkt);
+
+	pkt->data = NULL;
+	pkt->size = 0;
+
+	if (ret < 0) {
+		ilog(LOG_ERR, "Failed to write to passthrough output '%s': %s", output->file_name,
+				av_error(ret));
+		output_shutdown(output);
+		return -1;
+	}
+
+	output->raw_pts += samples;
+	return 0;
+}
+
+
+// fills a gap left by lost packets with codec-native silence
+static int output_fill_raw(output_t *output, unsigned int samples) {
+	unsigned char silence[1024];
+	unsigned int channels = output->raw_format.channels;
+
+	memset(silence, output->raw_def->avcodec_id == AV_CODEC_ID_PCM_ALAW ? 0xd5 : 0xff,
+			sizeof(silence));
+
+	while (samples) {
+		unsigned int num = sizeof(silence) / channels;
+		if (num > samples)
+			num = samples;
+		if (output_write_raw(output, silence, num * channels, num))
+			return -1;
+		samples -= num;
+	}
+	return 0;
+}
+
+
+int output_add_raw(output_t *output, const str *data, unsigned long ts) {
+	if (!output)
+		return -1;
+	if (!output->raw_def) // not configured for passthrough
+		return -1;
+
+	unsigned int channels = output->raw_format.channels;
+	const unsigned char *buf = (unsigned char *) data->s;
+	unsigned int samples = data->len / channels;
+	uint32_t ts32 = ts;
+
+	if (!output->raw_ts_valid) {
+		output->raw_ts = ts32;
+		output->raw_ts_valid = 1;
+	}
+
+	int32_t diff = ts32 - output->raw_ts;
+	if (diff < 0) {
+		// overlaps with what's been written already
+		if (-diff >= samples)
+			return 0;
+		buf += -diff * channels;
+		samples -= -diff;
+		ts32 += -diff;
+	}
+	else if (diff > 0) {
+		if (diff <= output->raw_format.clockrate * RAW_MAX_GAP) {
+			if (output_fill_raw(output, diff))
+				return -1;
+		}
+		else
+			dbg("RTP timestamp jump of %i in passthrough output, not filling gap", diff);
+	}
+
+	if (output_write_raw(output, buf, samples * channels, samples))
+		return -1;
+	output->raw_ts = ts32 + samples;
+
+	return 0;
+}
+
+
+// `free_output`: passed on to io_close()
+static void __output_shutdown(output_t *output, output_t *free_output) {
 	if (!output)
 		return;
 	if (!output->fmtctx)
-		return;
+		goto out;
 
 	if (output->fmtctx->pb) {
 		av_write_trailer(output->fmtctx);
-		avio_closep(&output->fmtctx->pb);
+		io_avio_free(&output->fmtctx->pb);
 	}
 	avformat_free_context(output->fmtctx);
 
@@ -154,19 +676,39 @@ static void output_shutdown(output_t *output) {
 
 	output->fmtctx = NULL;
 	output->avst = NULL;
+	av_packet_free(&output->raw_pkt);
+	output->raw_def = NULL;
+	format_init(&output->raw_format);
+
+out:
+	if (output->io)
+		io_close(output, free_output);
+	else if (free_output)
+		output_free(free_output);
 }
 
 
-void output_close(output_t *output) {
-	if (!output)
-		return;
-	output_shutdown(output);
+static void output_shutdown(output_t *output) {
+	__output_shutdown(output, NULL);
+}
+
+
+static void output_free(output_t *output) {
 	db_close_stream(output);
 	encoder_free(output->encoder);
 	g_slice_free1(sizeof(*output), output);
 }
 
 
+void output_close(output_t *output) {
+	if (!output)
+		return;
+	// the output is released once the file is complete, so that the database
+	// sees the final file
+	__output_shutdown(output, output);
+}
+
+
 void output_init(const char *format) {
 	str codec;
 
@@ -183,4 +725,41 @@ void output_init(const char *format) {
 
 	output_codec = codec_find(&codec, MT_AUDIO);
 	assert(output_codec != NULL);
+
+	if (output_buffer_size <= 0)
+		output_buffer_size = 32;
+	if (output_flush_interval <= 0)
+		output_flush_interval = 5;
+	if (output_queue_depth <= 0)
+		output_queue_depth = 64;
+}
+
+
+// to be called after daemonizing, as threads don't survive the fork
+void output_start(void) {
+	io_shutdown = 0;
+	if (pthread_create(&io_thread, NULL, io_thread_func, NULL))
+		die_errno("Failed to start output I/O thread");
+	io_running = 1;
+}
+
+
+void output_cleanup(void) {
+	if (!io_running)
+		return;
+
+	// write out everything that's still pending
+	pthread_mutex_lock(&io_lock);
+	io_shutdown = 1;
+	pthread_cond_signal(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+	pthread_join(io_thread, NULL);
+
+	pthread_mutex_lock(&io_lock);
+	io_running = 0;
+	pthread_mutex_unlock(&io_lock);
+
+	ilog(LOG_INFO, "Output I/O: %llu buffers (%llu bytes) written, waited for disk I/O "
+			"%llu times, max queue depth %u",
+			io_stats.buffers, io_stats.bytes, io_stats.stalls, io_stats.max_queued);
 }
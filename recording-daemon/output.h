@@ -6,9 +6,15 @@
 
 
 extern int mp3_bitrate;
+extern int output_passthrough;
+extern int output_buffer_size;
+extern int output_queue_depth;
+extern int output_flush_interval;
 
 
 void output_init(const char *format);
+void output_start(void);
+void output_cleanup(void);
 
 output_t *output_new(const char *path, const char *filename);
 void output_close(output_t *);
@@ -16,5 +22,9 @@ void output_close(output_t *);
 int output_config(output_t *output, const format_t *requested_format, format_t *actual_format);
 int output_add(output_t *output, AVFrame *frame);
 
+int output_passthrough_ok(const codec_def_t *def);
+int output_config_raw(output_t *output, const codec_def_t *def, const format_t *format);
+int output_add_raw(output_t *output, const str *data, unsigned long ts);
+
 
 #endif
@@ -5,6 +5,9 @@
 #include <glib.h>
 #include <unistd.h>
 #include <openssl/err.h>
+#include <pthread.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
 #include "types.h"
 #include "log.h"
 #include "rtplib.h"
@@ -18,6 +21,119 @@
 #include "resample.h"
 
 
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE 0
+#endif
+#ifndef FF_INPUT_BUFFER_PADDING_SIZE
+#define FF_INPUT_BUFFER_PADDING_SIZE 0
+#endif
+#define PACKET_BUF_PADDING (AV_INPUT_BUFFER_PADDING_SIZE + FF_INPUT_BUFFER_PADDING_SIZE)
+#define PACKET_BUF_CACHE 256 // max number of unused buffers kept per size class and thread
+
+
+// Packet buffers come in a few size classes, and unused ones are kept around for
+// re-use by the thread that released them, up to a limit. The header sits in front
+// of the buffer handed out.
+struct packet_buf {
+	struct packet_buf *next;
+	unsigned int cls;
+	unsigned int _pad; // keep buffer 16-byte aligned
+};
+
+static const unsigned int packet_buf_sizes[] = {
+	512,
+	2048,
+	8192,
+	65536 + PACKET_BUF_PADDING,
+};
+
+struct packet_buf_cache {
+	struct packet_buf *free[G_N_ELEMENTS(packet_buf_sizes)];
+	unsigned int num_free[G_N_ELEMENTS(packet_buf_sizes)];
+};
+
+static __thread struct packet_buf_cache packet_buf_cache;
+static __thread int packet_buf_cache_used;
+// only used to release a thread's cache when it exits
+static pthread_key_t packet_buf_cache_key;
+static pthread_once_t packet_buf_cache_once = PTHREAD_ONCE_INIT;
+
+
+static void packet_buf_cache_free(void *p) {
+	struct packet_buf_cache *c = p;
+	for (int i = 0; i < G_N_ELEMENTS(c->free); i++) {
+		struct packet_buf *pb;
+		while ((pb = c->free[i])) {
+			c->free[i] = pb->next;
+			free(pb);
+		}
+		c->num_free[i] = 0;
+	}
+}
+
+static void packet_buf_cache_key_init(void) {
+	pthread_key_create(&packet_buf_cache_key, packet_buf_cache_free);
+}
+
+
+// copies `len` bytes from `data` into a new buffer, followed by zeroed padding for decoders
+unsigned char *packet_buffer_new(const unsigned char *data, unsigned int len) {
+	unsigned int cls;
+	for (cls = 0; cls < G_N_ELEMENTS(packet_buf_sizes); cls++) {
+		if (len + PACKET_BUF_PADDING <= packet_buf_sizes[cls])
+			break;
+	}
+	if (cls == G_N_ELEMENTS(packet_buf_sizes))
+		return NULL;
+
+	struct packet_buf_cache *c = &packet_buf_cache;
+	struct packet_buf *pb = c->free[cls];
+	if (pb) {
+		c->free[cls] = pb->next;
+		c->num_free[cls]--;
+	}
+	else {
+		pb = malloc(sizeof(*pb) + packet_buf_sizes[cls]);
+		if (!pb)
+			return NULL;
+		pb->cls = cls;
+	}
+
+	unsigned char *buf = (unsigned char *) (pb + 1);
+	memcpy(buf, data, len);
+	memset(buf + len, 0, PACKET_BUF_PADDING);
+	return buf;
+}
+
+void packet_buffer_free(unsigned char *buf) {
+	if (!buf)
+		return;
+
+	struct packet_buf *pb = ((struct packet_buf *) buf) - 1;
+	struct packet_buf_cache *c = &packet_buf_cache;
+
+	if (c->num_free[pb->cls] >= PACKET_BUF_CACHE) {
+		free(pb);
+		return;
+	}
+
+	if (G_UNLIKELY(!packet_buf_cache_used)) {
+		pthread_once(&packet_buf_cache_once, packet_buf_cache_key_init);
+		pthread_setspecific(packet_buf_cache_key, c);
+		packet_buf_cache_used = 1;
+	}
+
+	pb->next = c->free[pb->cls];
+	c->free[pb->cls] = pb;
+	c->num_free[pb->cls]++;
+}
+
+// releases the calling thread's cache. other threads release theirs when they exit
+void packet_buffer_cleanup(void) {
+	packet_buf_cache_free(&packet_buf_cache);
+}
+
+
 static ssize_t ssrc_tls_write(void *, const void *, size_t);
 static ssize_t ssrc_tls_read(void *, void *, size_t);
 
@@ -77,7 +193,7 @@ static void packet_free(void *p) {
 	packet_t *packet = p;
 	if (!packet)
 		return;
-	free(packet->buffer);
+	packet_buffer_free(packet->buffer);
 	g_slice_free1(sizeof(*packet), packet);
 }
 
@@ -264,7 +380,7 @@ static void packet_decode(ssrc_t *ssrc, packet_t *packet) {
 			outp = mf->mix_out;
 		else if (ssrc->output)
 			outp = ssrc->output;
-		ssrc->decoders[payload_type] = decoder_new(payload_str, outp);
+		ssrc->decoders[payload_type] = decoder_new(payload_str, outp, ssrc->output);
 		pthread_mutex_unlock(&mf->mix_lock);
 		if (!ssrc->decoders[payload_type]) {
 			ilog(LOG_WARN, "Cannot decode RTP payload type %u (%s)",
@@ -292,14 +408,14 @@ static void ssrc_run(ssrc_t *ssrc) {
 		packet_decode(ssrc, packet);
 
 		packet_free(packet);
-		dbg("packets left in queue: %i", g_tree_nnodes(ssrc->sequencer.packets));
+		dbg("packets left in queue: %u", ssrc->sequencer.num_packets);
 	}
 
 	pthread_mutex_unlock(&ssrc->lock);
 }
 
 
-// stream is unlocked, buf is malloc'd
+// stream is unlocked, buf is from packet_buffer_new()
 void packet_process(stream_t *stream, unsigned char *buf, unsigned len) {
 	packet_t *packet = g_slice_alloc0(sizeof(*packet));
 	packet->buffer = buf; // handing it over
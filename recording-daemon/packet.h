@@ -5,6 +5,10 @@
 
 void ssrc_free(void *p);
 
+unsigned char *packet_buffer_new(const unsigned char *data, unsigned int len);
+void packet_buffer_free(unsigned char *);
+void packet_buffer_cleanup(void);
+
 void packet_process(stream_t *, unsigned char *, unsigned len);
 
 void ssrc_tls_state(ssrc_t *ssrc);
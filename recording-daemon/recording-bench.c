@@ -0,0 +1,533 @@
+// Throughput benchmark for the recording daemon.
+//
+// Builds against all daemon objects except main.o and epoll.o. The spool directory
+// is a temporary directory with synthetic metafiles fed to metafile_change(), and
+// the kernel's per-stream proc files are replaced by FIFOs. This file provides the
+// epoll API: streams registered by stream_open() are picked up by the benchmark's
+// worker threads, which write one RTP packet into the FIFO and then invoke the
+// stream's handler directly, timing the full read -> packet_process() ->
+// decoder_input() -> mix_add()/output_add() path per packet.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <mysql.h>
+#include "main.h"
+#include "log.h"
+#include "epoll.h"
+#include "metafile.h"
+#include "garbage.h"
+#include "decoder.h"
+#include "output.h"
+#include "mix.h"
+#include "packet.h"
+#include "codeclib.h"
+#include "socket.h"
+
+
+
+// stand-ins for the globals from main.c
+int ktable = 0;
+int num_threads = 4;
+enum output_storage_enum output_storage = OUTPUT_STORAGE_FILE;
+const char *spool_dir;
+const char *proc_dir;
+const char *output_dir;
+int output_mixed;
+int output_single;
+int output_enabled = 1;
+int decoding_enabled = 1;
+const char *c_mysql_host,
+      *c_mysql_user,
+      *c_mysql_pass,
+      *c_mysql_db;
+int c_mysql_port;
+const char *forward_to = NULL;
+endpoint_t tls_send_to_ep;
+int tls_resample = 8000;
+volatile int shutdown_flag;
+struct rtpengine_common_config rtpe_common_config;
+
+
+#define LAT_BUCKETS 100000 // 1 us resolution up to 100 ms
+
+
+struct bench_stream {
+	char *fifo;
+	ino_t ino;
+	int wfd;
+	handler_t *handler;
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t ts;
+};
+
+struct bench_poller {
+	pthread_mutex_t lock;
+	GPtrArray *streams; // bench_stream
+	pthread_t thread;
+	unsigned int idx;
+
+	// results
+	uint64_t packets;
+	uint64_t overruns;
+	uint64_t lat_max;
+	uint32_t *lat_hist;
+};
+
+
+static int opt_calls = 100;
+static int opt_seconds = 10;
+static int opt_ptime = 20;
+static int opt_payload_type = 8;
+static const char *opt_codec = "PCMA/8000";
+static int opt_payload_len = 160;
+static int opt_samples = 160;
+static int opt_flat_out;
+static const char *opt_format = "wav";
+static int opt_keep;
+
+static struct bench_poller *pollers;
+static unsigned int num_pollers;
+static volatile gint next_poller;
+static GHashTable *streams_by_ino; // ino -> bench_stream
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int bench_stop;
+
+
+
+// epoll API used by stream.c and inotify.c
+
+void epoll_setup(void) {
+	num_pollers = num_threads > 0 ? num_threads : 1;
+	pollers = g_new0(struct bench_poller, num_pollers);
+	// recursive: a handler may remove its own stream
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+	for (unsigned int i = 0; i < num_pollers; i++) {
+		pthread_mutex_init(&pollers[i].lock, &attr);
+		pollers[i].streams = g_ptr_array_new();
+		pollers[i].idx = i;
+		pollers[i].lat_hist = g_new0(uint32_t, LAT_BUCKETS);
+	}
+
+	pthread_mutexattr_destroy(&attr);
+}
+
+void epoll_cleanup(void) {
+	for (unsigned int i = 0; i < num_pollers; i++) {
+		pthread_mutex_destroy(&pollers[i].lock);
+		g_ptr_array_free(pollers[i].streams, TRUE);
+		g_free(pollers[i].lat_hist);
+	}
+	g_free(pollers);
+	pollers = NULL;
+}
+
+unsigned int epoll_poller_new(void) {
+	return ((unsigned int) g_atomic_int_add(&next_poller, 1)) % num_pollers;
+}
+
+int epoll_add(int fd, uint32_t events, handler_t *handler, unsigned int poller) {
+	struct stat st;
+	if (fstat(fd, &st))
+		return -1;
+
+	pthread_mutex_lock(&streams_lock);
+	struct bench_stream *bs = g_hash_table_lookup(streams_by_ino, GSIZE_TO_POINTER(st.st_ino));
+	pthread_mutex_unlock(&streams_lock);
+	if (!bs)
+		return -1;
+
+	struct bench_poller *bp = &pollers[poller % num_pollers];
+	pthread_mutex_lock(&bp->lock);
+	bs->handler = handler;
+	g_ptr_array_add(bp->streams, bs);
+	pthread_mutex_unlock(&bp->lock);
+	return 0;
+}
+
+void epoll_del(int fd, unsigned int poller) {
+	struct stat st;
+	if (fstat(fd, &st))
+		return;
+
+	pthread_mutex_lock(&streams_lock);
+	struct bench_stream *bs = g_hash_table_lookup(streams_by_ino, GSIZE_TO_POINTER(st.st_ino));
+	pthread_mutex_unlock(&streams_lock);
+	if (!bs)
+		return;
+
+	struct bench_poller *bp = &pollers[poller % num_pollers];
+	pthread_mutex_lock(&bp->lock);
+	g_ptr_array_remove_fast(bp->streams, bs);
+	bs->handler = NULL;
+	pthread_mutex_unlock(&bp->lock);
+}
+
+
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double cpu_seconds(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+// writes one packet as the kernel module would present it: IPv4 + UDP + RTP
+static void bench_packet(struct bench_poller *bp, struct bench_stream *bs) {
+	unsigned char buf[20 + 8 + 12 + 1500];
+	unsigned int rtp_len = 12 + opt_payload_len;
+	unsigned int len = 20 + 8 + rtp_len;
+
+	memset(buf, 0, 28);
+	buf[0] = 0x45;
+	*(uint16_t *) (buf + 2) = htons(len);
+	buf[8] = 64;
+	buf[9] = 17;
+	*(uint32_t *) (buf + 12) = htonl(0x7f000001);
+	*(uint32_t *) (buf + 16) = htonl(0x7f000001);
+	*(uint16_t *) (buf + 20) = htons(30000);
+	*(uint16_t *) (buf + 22) = htons(40000);
+	*(uint16_t *) (buf + 24) = htons(8 + rtp_len);
+
+	unsigned char *rtp = buf + 28;
+	rtp[0] = 0x80;
+	rtp[1] = opt_payload_type & 0x7f;
+	*(uint16_t *) (rtp + 2) = htons(bs->seq++);
+	*(uint32_t *) (rtp + 4) = htonl(bs->ts);
+	*(uint32_t *) (rtp + 8) = htonl(bs->ssrc);
+	bs->ts += opt_samples;
+	// some audio-ish content that is valid for any G.711 decoder
+	for (unsigned int i = 0; i < opt_payload_len; i++)
+		rtp[12 + i] = (bs->seq + i) * 7;
+
+	if (write(bs->wfd, buf, len) != len)
+		return;
+
+	uint64_t start = now_us();
+	bs->handler->func(bs->handler);
+	uint64_t lat = now_us() - start;
+
+	bp->packets++;
+	if (lat > bp->lat_max)
+		bp->lat_max = lat;
+	bp->lat_hist[lat < LAT_BUCKETS ? lat : LAT_BUCKETS - 1]++;
+}
+
+static void *bench_thread(void *p) {
+	struct bench_poller *bp = p;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	mysql_thread_init();
+
+	while (!bench_stop) {
+		pthread_mutex_lock(&bp->lock);
+		for (unsigned int i = 0; i < bp->streams->len; i++)
+			bench_packet(bp, g_ptr_array_index(bp->streams, i));
+		pthread_mutex_unlock(&bp->lock);
+
+		if (opt_flat_out)
+			continue;
+
+		next.tv_nsec += opt_ptime * 1000000L;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+			// couldn't keep up with real time
+			bp->overruns++;
+			next = now;
+			continue;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	mysql_thread_end();
+	return NULL;
+}
+
+
+
+static void bench_stream_free(void *p) {
+	struct bench_stream *bs = p;
+	close(bs->wfd);
+	g_free(bs->fifo);
+	g_free(bs);
+}
+
+
+static void meta_chunk(GString *s, const char *section, const char *content) {
+	g_string_append_printf(s, "%s\n%zu:\n%s\n\n", section, strlen(content), content);
+}
+
+static void bench_call(unsigned int num) {
+	char name[64], parent[64], path[PATH_MAX];
+	snprintf(parent, sizeof(parent), "bench-call-%u", num);
+	snprintf(name, sizeof(name), "%s.meta", parent);
+
+	snprintf(path, sizeof(path), "%s/%u/calls/%s", proc_dir, ktable, parent);
+	if (g_mkdir_with_parents(path, 0700))
+		die_errno("Failed to create '%s'", path);
+
+	GString *s = g_string_new(NULL);
+	meta_chunk(s, "CALL-ID", parent);
+	meta_chunk(s, "PARENT", parent);
+
+	char section[64], content[128];
+	for (unsigned int leg = 0; leg < 2; leg++) {
+		snprintf(section, sizeof(section), "TAG %u", leg);
+		snprintf(content, sizeof(content), "tag-%u-%u", num, leg);
+		meta_chunk(s, section, content);
+		snprintf(section, sizeof(section), "MEDIA %u PAYLOAD TYPE %u", leg, opt_payload_type);
+		meta_chunk(s, section, opt_codec);
+	}
+
+	for (unsigned int leg = 0; leg < 2; leg++) {
+		struct bench_stream *bs = g_new0(struct bench_stream, 1);
+		bs->ssrc = num * 2 + leg + 0x1000;
+		bs->seq = random();
+		bs->ts = random();
+
+		snprintf(content, sizeof(content), "stream-%u-%u", num, leg);
+		bs->fifo = g_strdup_printf("%s/%s", path, content);
+		if (mkfifo(bs->fifo, 0600))
+			die_errno("Failed to create FIFO '%s'", bs->fifo);
+		// read-write open: doesn't block, and keeps a writer around so that the
+		// reader never sees EOF
+		bs->wfd = open(bs->fifo, O_RDWR | O_NONBLOCK);
+		if (bs->wfd == -1)
+			die_errno("Failed to open FIFO '%s'", bs->fifo);
+		struct stat st;
+		if (fstat(bs->wfd, &st))
+			die_errno("fstat failed");
+		bs->ino = st.st_ino;
+		pthread_mutex_lock(&streams_lock);
+		g_hash_table_insert(streams_by_ino, GSIZE_TO_POINTER(bs->ino), bs);
+		pthread_mutex_unlock(&streams_lock);
+
+		snprintf(section, sizeof(section), "STREAM %u details", leg);
+		char details[128];
+		snprintf(details, sizeof(details), "TAG %u MEDIA %u TAG-MEDIA %u COMPONENT 0 FLAGS 0",
+				leg, leg, leg);
+		meta_chunk(s, section, details);
+		snprintf(section, sizeof(section), "STREAM %u interface", leg);
+		meta_chunk(s, section, content);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", spool_dir, name);
+	if (!g_file_set_contents(path, s->str, s->len, NULL))
+		die("Failed to write metafile '%s'", path);
+	g_string_free(s, TRUE);
+
+	metafile_change(name);
+}
+
+static void bench_call_end(unsigned int num) {
+	char name[64];
+	snprintf(name, sizeof(name), "bench-call-%u.meta", num);
+	metafile_delete(name);
+}
+
+
+static uint64_t dir_size(const char *path) {
+	uint64_t ret = 0;
+	DIR *dp = opendir(path);
+	if (!dp)
+		return 0;
+	struct dirent *de;
+	while ((de = readdir(dp))) {
+		if (de->d_name[0] == '.')
+			continue;
+		char fn[PATH_MAX];
+		snprintf(fn, sizeof(fn), "%s/%s", path, de->d_name);
+		struct stat st;
+		if (lstat(fn, &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			ret += dir_size(fn);
+		else if (S_ISREG(st.st_mode))
+			ret += st.st_size;
+	}
+	closedir(dp);
+	return ret;
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total, double pct) {
+	uint64_t want = total * pct / 100.0;
+	uint64_t sum = 0;
+	for (unsigned int i = 0; i < LAT_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum > want)
+			return i;
+	}
+	return LAT_BUCKETS;
+}
+
+
+static void options(int *argc, char ***argv) {
+	GOptionEntry e[] = {
+		{ "calls",		'c', 0, G_OPTION_ARG_INT,	&opt_calls,	"Number of concurrent calls (two streams each)","INT"	},
+		{ "seconds",		's', 0, G_OPTION_ARG_INT,	&opt_seconds,	"Duration of the run",			"INT"		},
+		{ "num-threads",	't', 0, G_OPTION_ARG_INT,	&num_threads,	"Number of worker threads",		"INT"		},
+		{ "mix-num-threads",	0,   0, G_OPTION_ARG_INT,	&mix_num_threads,"Number of threads for mixed output",	"INT"		},
+		{ "output-mixed",	0,   0, G_OPTION_ARG_NONE,	&output_mixed,	"Mix participating sources into a single output",NULL	},
+		{ "output-single",	0,   0, G_OPTION_ARG_NONE,	&output_single,	"Create one output file for each source",NULL		},
+		{ "output-passthrough",	0,   0, G_OPTION_ARG_NONE,	&output_passthrough,"Write G.711 into single outputs without transcoding",NULL},
+		{ "output-format",	0,   0, G_OPTION_ARG_STRING,	&opt_format,	"Write audio files of this type",	"wav|mp3"	},
+		{ "codec",		0,   0, G_OPTION_ARG_STRING,	&opt_codec,	"Payload type encoding (G.711 only)",	"STRING"	},
+		{ "payload-type",	0,   0, G_OPTION_ARG_INT,	&opt_payload_type,"RTP payload type number",		"INT"		},
+		{ "ptime",		0,   0, G_OPTION_ARG_INT,	&opt_ptime,	"Packetisation interval in ms",		"INT"		},
+		{ "flat-out",		0,   0, G_OPTION_ARG_NONE,	&opt_flat_out,	"Don't pace packets in real time",	NULL		},
+		{ "keep",		0,   0, G_OPTION_ARG_NONE,	&opt_keep,	"Don't delete output files",		NULL		},
+		{ NULL, }
+	};
+
+	GError *er = NULL;
+	GOptionContext *c = g_option_context_new(" - rtpengine recording daemon benchmark");
+	g_option_context_add_main_entries(c, e, NULL);
+	if (!g_option_context_parse(c, argc, argv, &er))
+		die("Failed to parse options: %s", er->message);
+	g_option_context_free(c);
+
+	if (opt_calls <= 0 || opt_seconds <= 0 || opt_ptime <= 0)
+		die("Invalid options");
+	if (!output_mixed && !output_single)
+		output_mixed = output_single = 1;
+	opt_samples = opt_payload_len = 8 * opt_ptime; // G.711 at 8 kHz
+}
+
+
+int main(int argc, char **argv) {
+	options(&argc, &argv);
+
+	rtpe_common_config.log_level = LOG_WARN;
+	rtpe_common_config.log_stderr = 1;
+	rtpe_common_config_ptr = &rtpe_common_config;
+	log_init("rtpengine-recording-bench");
+	socket_init();
+	codeclib_init(0);
+	output_init(opt_format);
+	output_start();
+	mysql_library_init(0, NULL, NULL);
+
+	char tmpl[] = "/tmp/rtpengine-recording-bench-XXXXXX";
+	char *base = mkdtemp(tmpl);
+	if (!base)
+		die_errno("mkdtemp failed");
+	char *spool = g_strdup_printf("%s/spool", base);
+	char *proc = g_strdup_printf("%s/proc", base);
+	char *out = g_strdup_printf("%s/output", base);
+	if (mkdir(spool, 0700) || mkdir(proc, 0700) || mkdir(out, 0700))
+		die_errno("mkdir failed");
+	spool_dir = spool;
+	proc_dir = proc;
+	output_dir = out;
+
+	streams_by_ino = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, bench_stream_free);
+	metafile_setup();
+	epoll_setup();
+	mix_start();
+
+	for (unsigned int i = 0; i < opt_calls; i++)
+		bench_call(i);
+
+	double cpu_start = cpu_seconds();
+	uint64_t start = now_us();
+
+	for (unsigned int i = 0; i < num_pollers; i++) {
+		if (pthread_create(&pollers[i].thread, NULL, bench_thread, &pollers[i]))
+			die_errno("pthread_create failed");
+	}
+
+	sleep(opt_seconds);
+	bench_stop = 1;
+	for (unsigned int i = 0; i < num_pollers; i++)
+		pthread_join(pollers[i].thread, NULL);
+
+	// close all calls, which flushes mixed output and closes all output files
+	for (unsigned int i = 0; i < opt_calls; i++)
+		bench_call_end(i);
+	garbage_collect_all();
+	output_cleanup(); // waits for all pending writes
+
+	uint64_t wall_us = now_us() - start;
+	double cpu = cpu_seconds() - cpu_start;
+	double wall = wall_us / 1e6;
+
+	uint64_t packets = 0, overruns = 0, lat_max = 0;
+	uint64_t *hist = g_new0(uint64_t, LAT_BUCKETS);
+	for (unsigned int i = 0; i < num_pollers; i++) {
+		struct bench_poller *bp = &pollers[i];
+		packets += bp->packets;
+		overruns += bp->overruns;
+		if (bp->lat_max > lat_max)
+			lat_max = bp->lat_max;
+		for (unsigned int j = 0; j < LAT_BUCKETS; j++)
+			hist[j] += bp->lat_hist[j];
+	}
+
+	uint64_t out_bytes = dir_size(out);
+	double pps = packets / wall;
+	// a call carries two streams at 1000/ptime packets per second each
+	double rt_calls = pps / (2.0 * 1000.0 / opt_ptime);
+	double cores = cpu / wall;
+
+	printf("calls:                  %i (%u threads, %s)\n", opt_calls, num_pollers,
+			opt_flat_out ? "flat out" : "real time");
+	printf("packets:                %" PRIu64 " in %.2f s (%.0f/s)\n", packets, wall, pps);
+	printf("real-time calls:        %.1f\n", rt_calls);
+	printf("CPU:                    %.2f s (%.2f cores)\n", cpu, cores);
+	printf("CPU per call:           %.3f%% of a core\n", rt_calls > 0 ? cores / rt_calls * 100.0 : 0);
+	printf("calls per core:         %.1f\n", cores > 0 ? rt_calls / cores : 0);
+	printf("packet latency (us):    p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 "\n",
+			lat_percentile(hist, packets, 50), lat_percentile(hist, packets, 90),
+			lat_percentile(hist, packets, 99), lat_max);
+	printf("pacing overruns:        %" PRIu64 "\n", overruns);
+	printf("output written:         %" PRIu64 " bytes (%.1f kB/s)\n", out_bytes, out_bytes / wall / 1024.0);
+	g_free(hist);
+
+	metafile_cleanup();
+	mix_cleanup();
+	packet_buffer_cleanup();
+	epoll_cleanup();
+	g_hash_table_destroy(streams_by_ino);
+	mysql_library_end();
+
+	if (!opt_keep) {
+		char *cmd = g_strdup_printf("rm -rf '%s'", base);
+		if (system(cmd))
+			ilog(LOG_WARN, "Failed to remove '%s'", base);
+		g_free(cmd);
+	}
+	else
+		printf("output kept in:         %s\n", out);
+
+	return 0;
+}
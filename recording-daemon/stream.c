@@ -4,7 +4,6 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
-#include <libavcodec/avcodec.h>
 #include "metafile.h"
 #include "epoll.h"
 #include "log.h"
@@ -14,20 +13,14 @@
 
 
 #define MAXBUFLEN 65535
-#ifndef AV_INPUT_BUFFER_PADDING_SIZE
-#define AV_INPUT_BUFFER_PADDING_SIZE 0
-#endif
-#ifndef FF_INPUT_BUFFER_PADDING_SIZE
-#define FF_INPUT_BUFFER_PADDING_SIZE 0
-#endif
-#define ALLOCLEN (MAXBUFLEN + AV_INPUT_BUFFER_PADDING_SIZE + FF_INPUT_BUFFER_PADDING_SIZE)
+#define READ_BATCH 16 // packets read per stream lock
 
 
 // stream is locked
 void stream_close(stream_t *stream) {
 	if (stream->fd == -1)
 		return;
-	epoll_del(stream->fd);
+	epoll_del(stream->fd, stream->metafile->poller);
 	close(stream->fd);
 	stream->fd = -1;
 }
@@ -37,58 +30,82 @@ void stream_free(stream_t *stream) {
 }
 
 
+// stream is locked. returns number of packets read, or -1 if there's nothing more to read
+static int stream_read_batch(stream_t *stream, unsigned char **bufs, unsigned int *lens) {
+	static __thread unsigned char buf[MAXBUFLEN];
+	int num = 0;
+
+	while (num < READ_BATCH) {
+		if (stream->fd == -1)
+			goto done;
+
+		int ret = read(stream->fd, buf, sizeof(buf));
+		if (ret == 0) {
+			ilog(LOG_INFO, "EOF on stream %s", stream->name);
+			stream_close(stream);
+			goto done;
+		}
+		else if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto done;
+			ilog(LOG_INFO, "Read error on stream %s: %s", stream->name, strerror(errno));
+			stream_close(stream);
+			goto done;
+		}
+
+		// got a packet: copy it into a right-sized buffer
+		bufs[num] = packet_buffer_new(buf, ret);
+		if (!bufs[num]) {
+			ilog(LOG_ERR, "Failed to allocate packet buffer");
+			continue;
+		}
+		lens[num++] = ret;
+	}
+
+	return num;
+
+done:
+	return num ? num : -1;
+}
+
+
 static void stream_handler(handler_t *handler) {
 	stream_t *stream = handler->ptr;
-	unsigned char *buf = NULL;
+	unsigned char *bufs[READ_BATCH];
+	unsigned int lens[READ_BATCH];
 
 	log_info_call = stream->metafile->name;
 	log_info_stream = stream->name;
 
 	//dbg("poll event for %s", stream->name);
 
-	pthread_mutex_lock(&stream->lock);
-
-	if (stream->fd == -1)
-		goto out;
-
-	buf = malloc(ALLOCLEN);
-	int ret = read(stream->fd, buf, MAXBUFLEN);
-	if (ret == 0) {
-		ilog(LOG_INFO, "EOF on stream %s", stream->name);
-		stream_close(stream);
-		goto out;
-	}
-	else if (ret < 0) {
-		if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
-			goto out;
-		ilog(LOG_INFO, "Read error on stream %s: %s", stream->name, strerror(errno));
-		stream_close(stream);
-		goto out;
-	}
-
-	// got a packet
-	pthread_mutex_unlock(&stream->lock);
-
-	if (forward_to){
-		if (forward_packet(stream->metafile,buf,ret)) // leaves buf intact
-			g_atomic_int_inc(&stream->metafile->forward_failed);
-		else
-			g_atomic_int_inc(&stream->metafile->forward_count);
+	// edge triggered: drain the stream until there's nothing left
+	while (1) {
+		pthread_mutex_lock(&stream->lock);
+		int num = stream_read_batch(stream, bufs, lens);
+		pthread_mutex_unlock(&stream->lock);
+
+		if (num < 0)
+			break;
+
+		for (int i = 0; i < num; i++) {
+			if (forward_to){
+				if (forward_packet(stream->metafile, bufs[i], lens[i])) // leaves buf intact
+					g_atomic_int_inc(&stream->metafile->forward_failed);
+				else
+					g_atomic_int_inc(&stream->metafile->forward_count);
+			}
+			if (decoding_enabled)
+				packet_process(stream, bufs[i], lens[i]); // consumes buf
+			else
+				packet_buffer_free(bufs[i]);
+		}
 	}
-	if (decoding_enabled)
-		packet_process(stream, buf, ret); // consumes buf
-	else
-		free(buf);
 
 	log_info_call = NULL;
 	log_info_stream = NULL;
-	return;
-
-out:
-	pthread_mutex_unlock(&stream->lock);
-	free(buf);
-	log_info_call = NULL;
-	log_info_stream = NULL;
 }
 
 
@@ -122,7 +139,7 @@ void stream_open(metafile_t *mf, unsigned long id, char *name) {
 	stream->name = g_string_chunk_insert(mf->gsc, name);
 
 	char fnbuf[PATH_MAX];
-	snprintf(fnbuf, sizeof(fnbuf), "/proc/rtpengine/%u/calls/%s/%s", ktable, mf->parent, name);
+	snprintf(fnbuf, sizeof(fnbuf), "%s/%u/calls/%s/%s", proc_dir, ktable, mf->parent, name);
 
 	stream->fd = open(fnbuf, O_RDONLY | O_NONBLOCK);
 	if (stream->fd == -1) {
@@ -133,7 +150,7 @@ void stream_open(metafile_t *mf, unsigned long id, char *name) {
 	// add to epoll
 	stream->handler.ptr = stream;
 	stream->handler.func = stream_handler;
-	epoll_add(stream->fd, EPOLLIN, &stream->handler);
+	epoll_add(stream->fd, EPOLLIN, &stream->handler, mf->poller);
 }
 
 void stream_details(metafile_t *mf, unsigned long id, unsigned int tag) {
@@ -23,6 +23,8 @@ struct ip6_hdr;
 struct udphdr;
 struct rtp_header;
 struct streambuf;
+struct db_id;
+struct output_io;
 
 
 struct handler_s;
@@ -112,7 +114,8 @@ struct metafile_s {
 	char *metadata;
 	char *metadata_db;
 	off_t pos;
-	unsigned long long db_id;
+	struct db_id *db_id;
+	unsigned int poller; // all streams are handled by the same poller thread
 
 	GStringChunk *gsc; // XXX limit max size
 
@@ -141,7 +144,7 @@ struct output_s {
 		file_path[PATH_MAX],
 		file_name[PATH_MAX];
 	const char *file_format;
-	unsigned long long db_id;
+	struct db_id *db_id;
 
 //	format_t requested_format,
 //		 actual_format;
@@ -155,13 +158,22 @@ struct output_s {
 //	int64_t mux_dts; // last dts passed to muxer
 //	AVFrame *frame;
 	encoder_t *encoder;
+	struct output_io *io; // write-behind buffer for the current file
+
+	// passthrough mode, see output_config_raw()
+	const codec_def_t *raw_def;
+	format_t raw_format;
+	AVPacket *raw_pkt;
+	int64_t raw_pts;
+	uint32_t raw_ts; // next expected RTP timestamp
+	unsigned int raw_ts_valid:1;
 };
 
 
 struct decode_s {
 	decoder_t *dec;
-	resample_t mix_resampler;
 	unsigned int mixer_idx;
+	unsigned int passthrough:1; // payloads go to the single output as they are
 };
 
 
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "bencode.h"
+#include "test-bench.h"
+
+
+static void enc_cmp(bencode_item_t *item, const char *exp, const char *file, int line) {
+	str out;
+
+	if (!item) {
+		printf("test nok: %s:%i\n", file, line);
+		printf("no item\n");
+		abort();
+	}
+
+	bencode_collapse_str(item, &out);
+	if (out.len != strlen(exp) || memcmp(out.s, exp, out.len)) {
+		printf("test nok: %s:%i\n", file, line);
+		printf("expected: %s\n", exp);
+		printf("got: %.*s\n", out.len, out.s);
+		abort();
+	}
+
+	printf("test ok: %s:%i\n", file, line);
+}
+
+#define enc(i, s) enc_cmp(i, s, __FILE__, __LINE__)
+// for helpers that report the line of their caller
+#define check_at(cond) __check(file, line, cond, #cond)
+
+// checks the length prefix of a string of the given size
+static void long_string(bencode_buffer_t *buf, int len, const char *prefix, const char *file, int line) {
+	char *tmp = malloc(len);
+	str out;
+
+	memset(tmp, 'x', len);
+	bencode_item_t *item = bencode_string_len(buf, tmp, len);
+	check_at(item != NULL);
+	bencode_collapse_str(item, &out);
+	check_at(out.len == len + strlen(prefix));
+	check_at(!memcmp(out.s, prefix, strlen(prefix)));
+	check_at(out.s[strlen(prefix)] == 'x' && out.s[out.len - 1] == 'x');
+	free(tmp);
+}
+
+#define long_str(l, p) long_string(&buf, l, p, __FILE__, __LINE__)
+
+
+static const char *sdp =
+	"v=0\r\n"
+	"o=- 1545997027 1 IN IP4 198.51.100.1\r\n"
+	"s=tester\r\n"
+	"c=IN IP4 198.51.100.1\r\n"
+	"t=0 0\r\n"
+	"m=audio 2000 RTP/AVP 0 8 9 18 101\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:9 G722/8000\r\n"
+	"a=rtpmap:18 G729/8000\r\n"
+	"a=fmtp:18 annexb=no\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n"
+	"a=fmtp:101 0-16\r\n"
+	"a=ptime:20\r\n"
+	"a=sendrecv\r\n"
+	"a=rtcp:2001\r\n";
+
+// what a SIP proxy typically sends with an offer
+static str make_offer(bencode_buffer_t *buf) {
+	bencode_item_t *d = bencode_dictionary(buf);
+	bencode_dictionary_add_string(d, "sdp", sdp);
+	bencode_dictionary_add_string(d, "call-id", "a84b4c76e66710@pc33.example.com");
+	bencode_dictionary_add_string(d, "via-branch", "z9hG4bK776asdhds.0");
+	bencode_dictionary_add_string(d, "from-tag", "1928301774");
+	bencode_item_t *l = bencode_dictionary_add_list(d, "flags");
+	bencode_list_add_string(l, "trust-address");
+	bencode_list_add_string(l, "symmetric");
+	l = bencode_dictionary_add_list(d, "replace");
+	bencode_list_add_string(l, "origin");
+	bencode_list_add_string(l, "session-connection");
+	l = bencode_dictionary_add_list(d, "received-from");
+	bencode_list_add_string(l, "IP4");
+	bencode_list_add_string(l, "198.51.100.1");
+	l = bencode_dictionary_add_list(d, "rtcp-mux");
+	bencode_list_add_string(l, "demux");
+	bencode_dictionary_add_string(d, "ICE", "remove");
+	bencode_dictionary_add_string(d, "transport-protocol", "RTP/AVP");
+	bencode_dictionary_add_string(d, "record-call", "no");
+	bencode_dictionary_add_string(d, "command", "offer");
+	str ret;
+	bencode_collapse_str(d, &ret);
+	return ret;
+}
+
+// decode the request the way control_ng does and build a reply of similar size
+static int request(const str *req) {
+	bencode_buffer_t buf;
+	str s, out;
+	int n = 0;
+
+	if (bencode_buffer_init(&buf))
+		abort();
+	bencode_item_t *resp = bencode_dictionary(&buf);
+	bencode_item_t *d = bencode_decode_expect_str(&buf, req, BENCODE_DICTIONARY);
+	if (!d)
+		abort();
+
+	bencode_dictionary_get_str(d, "command", &s);
+	bencode_dictionary_get_str(d, "call-id", &s);
+	bencode_dictionary_get_str(d, "from-tag", &s);
+	bencode_dictionary_get_str(d, "to-tag", &s);
+	bencode_dictionary_get_str(d, "via-branch", &s);
+	bencode_dictionary_get_str(d, "ICE", &s);
+	bencode_dictionary_get_str(d, "transport-protocol", &s);
+	bencode_dictionary_get_str(d, "record-call", &s);
+	bencode_dictionary_get_str(d, "address family", &s);
+	bencode_dictionary_get_str(d, "direction", &s);
+	static const char *lists[] = { "flags", "replace", "received-from", "rtcp-mux", "SDES", NULL };
+	for (const char **k = lists; *k; k++) {
+		bencode_item_t *l = bencode_dictionary_get_expect(d, *k, BENCODE_LIST);
+		if (!l)
+			continue;
+		for (bencode_item_t *it = l->child; it; it = it->sibling)
+			n += bencode_get_str(it, &s) ? 1 : 0;
+	}
+	bencode_dictionary_get_str(d, "sdp", &s);
+
+	bencode_dictionary_add_str(resp, "sdp", &s);
+	bencode_dictionary_add_string(resp, "result", "ok");
+	bencode_collapse_str(resp, &out);
+	n += out.len;
+
+	bencode_buffer_free(&buf);
+	return n;
+}
+
+
+// not part of the unit tests, run with "./bencode-test bench" or "make bench"
+#define BENCH_REQUESTS 1000000
+
+static void bench(void) {
+	bencode_buffer_t buf;
+	bencode_buffer_init(&buf);
+	str req = make_offer(&buf);
+
+	unsigned long sum = 0;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_REQUESTS; i++)
+		sum += request(&req);
+	double secs = bench_now() - start;
+
+	printf("offer decode+encode (%i bytes): %i requests in %.3f s, %.0f requests/s (%lu)\n",
+			req.len, BENCH_REQUESTS, secs, BENCH_REQUESTS / secs, sum);
+
+	bencode_buffer_free(&buf);
+}
+
+
+
+int main(int argc, char **argv) {
+	bencode_buffer_t buf;
+	bencode_item_t *d, *l;
+	str s;
+
+	if (bench_requested(argc, argv)) {
+		bench();
+		return 0;
+	}
+
+	if (bencode_buffer_init(&buf))
+		abort();
+
+	enc(bencode_integer(&buf, 0), "i0e");
+	enc(bencode_integer(&buf, 7), "i7e");
+	enc(bencode_integer(&buf, -1), "i-1e");
+	enc(bencode_integer(&buf, 1234567890), "i1234567890e");
+	enc(bencode_integer(&buf, LLONG_MAX), "i9223372036854775807e");
+	enc(bencode_integer(&buf, LLONG_MIN), "i-9223372036854775808e");
+
+	enc(bencode_string(&buf, ""), "0:");
+	enc(bencode_string(&buf, "123456789"), "9:123456789");
+	enc(bencode_string(&buf, "1234567890"), "10:1234567890");
+	long_str(99999, "99999:");
+	long_str(1000000, "1000000:");
+	long_str(12345678, "12345678:");
+
+	d = bencode_dictionary(&buf);
+	bencode_dictionary_add_string(d, "foo", "bar");
+	bencode_dictionary_add_integer(d, "num", -42);
+	l = bencode_dictionary_add_list(d, "list");
+	bencode_list_add_string(l, "a");
+	bencode_list_add_dictionary(l);
+	enc(d, "d3:foo3:bar3:numi-42e4:listl1:adeee");
+
+	// decoded strings point into the input
+	const char *in = "d7:command5:offer3:numi-42e5:flagsl3:one3:twoe3:sdp5:v=0\r\ne";
+	d = bencode_decode_expect(&buf, in, strlen(in), BENCODE_DICTIONARY);
+	check(d != NULL);
+	check(bencode_dictionary_get_str(d, "command", &s) != NULL);
+	check(!str_cmp(&s, "offer"));
+	check(s.s > in && s.s < in + strlen(in));
+	check(bencode_dictionary_get_integer(d, "num", 0) == -42);
+	l = bencode_dictionary_get_expect(d, "flags", BENCODE_LIST);
+	check(l != NULL);
+	check(!bencode_strcmp(l->child, "one"));
+	check(!bencode_strcmp(l->child->sibling, "two"));
+	check(bencode_dictionary_get(d, "missing") == NULL);
+	enc(d, in);
+
+	check(bencode_decode(&buf, "d3:fooe", 7) == NULL);
+	check(bencode_decode(&buf, "5:abc", 5) == NULL);
+	check(bencode_decode(&buf, "ixe", 3) == NULL);
+
+	bencode_buffer_free(&buf);
+
+	// large allocations bypass the piece cache
+	for (int i = 0; i < 100; i++) {
+		if (bencode_buffer_init(&buf))
+			abort();
+		if (!bencode_buffer_alloc(&buf, 100) || !bencode_buffer_alloc(&buf, 100000)
+				|| !bencode_buffer_alloc(&buf, 5000))
+			abort();
+		bencode_buffer_free(&buf);
+	}
+	printf("test ok: %s:%i\n", __FILE__, __LINE__);
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "test-bench.h"
+#include "cookie_cache.h"
+
+static struct cookie_cache cache;
+
+// pending entries reference the cookie until the reply is inserted, as they do in control_ng
+static str cookies[16];
+static unsigned int num_cookies;
+
+static const str *cookie_get(const char *cookie) {
+	for (unsigned int i = 0; i < num_cookies; i++) {
+		if (!str_cmp(&cookies[i], cookie))
+			return &cookies[i];
+	}
+	if (num_cookies >= G_N_ELEMENTS(cookies))
+		abort();
+	str_init(&cookies[num_cookies], (char *) cookie);
+	return &cookies[num_cookies++];
+}
+
+static void lookup_cmp(const char *cookie, const char *exp, const char *file, int line) {
+	str *r;
+
+	r = cookie_cache_lookup(&cache, cookie_get(cookie));
+
+	if (exp ? (!r || str_cmp(r, exp)) : r != NULL) {
+		printf("test nok: %s:%i\n", file, line);
+		printf("expected: %s\n", exp ? exp : "NULL");
+		printf("got: %.*s\n", r ? r->len : 4, r ? r->s : "NULL");
+		abort();
+	}
+	free(r);
+
+	printf("test ok: %s:%i\n", file, line);
+}
+
+static void insert(const char *cookie, const char *reply) {
+	str r;
+	str_init(&r, (char *) reply);
+	cookie_cache_insert(&cache, cookie_get(cookie), &r);
+}
+
+#define cmp(c, e) lookup_cmp(c, e, __FILE__, __LINE__)
+
+static volatile int dupe_done;
+
+static void *dupe_thread(void *p) {
+	gettimeofday(&rtpe_now, NULL);
+	cmp("dupe", "reply");
+	dupe_done = 1;
+	return NULL;
+}
+
+static void tests(void) {
+	gettimeofday(&rtpe_now, NULL);
+	cookie_cache_init(&cache);
+
+	// first lookup marks the cookie as in progress, the reply is cached
+	cmp("one", NULL);
+	insert("one", "first");
+	cmp("one", "first");
+	cmp("two", NULL);
+	insert("two", "second");
+	cmp("two", "second");
+	cmp("one", "first");
+
+	// replies given as an iovec are stored in one piece
+	struct iovec iov[3] = {
+		{ .iov_base = "d6:result", .iov_len = 9 },
+		{ .iov_base = "2:ok", .iov_len = 4 },
+		{ .iov_base = "e", .iov_len = 1 },
+	};
+	cmp("iov", NULL);
+	cookie_cache_insert_iov(&cache, cookie_get("iov"), iov, 3);
+	cmp("iov", "d6:result2:oke");
+
+	// removed cookies are treated as new
+	cookie_cache_remove(&cache, cookie_get("one"));
+	cmp("one", NULL);
+	cookie_cache_remove(&cache, cookie_get("one"));
+
+	// a duplicate arriving while the first is still being worked on waits for the reply
+	pthread_t thr;
+	cmp("dupe", NULL);
+	pthread_create(&thr, NULL, dupe_thread, NULL);
+	usleep(100000);
+	if (dupe_done)
+		abort();
+	insert("dupe", "reply");
+	pthread_join(thr, NULL);
+	if (!dupe_done)
+		abort();
+
+	// entries survive one swap and are gone after the second
+	rtpe_now.tv_sec += COOKIE_CACHE_TIMEOUT;
+	cmp("two", "second");
+	rtpe_now.tv_sec += COOKIE_CACHE_TIMEOUT;
+	cmp("two", NULL);
+	insert("two", "again");
+}
+
+// run with "./cookie-cache-test bench"
+#define BENCH_COMMANDS 500000
+
+// each thread runs lookup+insert on its own cookies, like a set of busy signalling
+// threads. every tenth command is a retransmission of the previous one. the clock
+// runs fast so that the shards age out entries while under load
+static void *bench_thread(void *p) {
+	int id = GPOINTER_TO_INT(p);
+	char buf[64];
+	str cookie, reply, *r;
+
+	gettimeofday(&rtpe_now, NULL);
+	str_init(&reply, (char *) "d6:result2:oke");
+
+	for (int i = 0; i < BENCH_COMMANDS; i++) {
+		if ((i % 5000) == 0)
+			rtpe_now.tv_sec++;
+		int n = (i % 10) == 9 ? i - 1 : i;
+		cookie.s = buf;
+		cookie.len = sprintf(buf, "%i_%i", id, n);
+		r = cookie_cache_lookup(&cache, &cookie);
+		if (r) {
+			free(r);
+			continue;
+		}
+		cookie_cache_insert(&cache, &cookie, &reply);
+	}
+	return NULL;
+}
+
+static void bench(int threads) {
+	pthread_t thr[threads];
+
+	cookie_cache_init(&cache);
+
+	double start = bench_now();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&thr[i], NULL, bench_thread, GINT_TO_POINTER(i));
+	for (int i = 0; i < threads; i++)
+		pthread_join(thr[i], NULL);
+	double secs = bench_now() - start;
+
+	printf("%2i threads: %.0f commands/s\n", threads, threads * BENCH_COMMANDS / secs);
+}
+
+
+int main(int argc, char **argv) {
+	if (bench_requested(argc, argv)) {
+		bench(1);
+		bench(2);
+		bench(4);
+		bench(8);
+		return 0;
+	}
+
+	tests();
+
+	return 0;
+}
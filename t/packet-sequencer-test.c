@@ -0,0 +1,191 @@
+#include "codeclib.h"
+#include "str.h"
+#include "test-bench.h"
+
+struct test_packet {
+	seq_packet_t p;
+	int freed;
+};
+
+static int freed;
+static packet_sequencer_t ps;
+
+static void packet_free(void *p) {
+	freed++;
+	g_slice_free1(sizeof(struct test_packet), p);
+}
+
+static seq_packet_t *packet_new(int seq) {
+	struct test_packet *tp = g_slice_alloc0(sizeof(*tp));
+	tp->p.seq = seq & 0xffff;
+	return &tp->p;
+}
+
+#define insert(seq, exp_ret) __insert(__FILE__, __LINE__, seq, exp_ret)
+#define next(seq) __next(__FILE__, __LINE__, seq, 0)
+#define force_next(seq) __next(__FILE__, __LINE__, seq, 1)
+
+static void __insert(const char *file, int line, int seq, int exp_ret) {
+	seq_packet_t *p = packet_new(seq);
+	int ret = packet_sequencer_insert(&ps, p);
+	if (ret != exp_ret) {
+		printf("test failed: %s:%i\n", file, line);
+		printf("expected: %i\n", exp_ret);
+		printf("received: %i\n", ret);
+		abort();
+	}
+	if (ret < 0)
+		packet_free(p);
+	printf("test ok: %s:%i\n", file, line);
+}
+
+// seq -1: no packet
+static void __next(const char *file, int line, int seq, int force) {
+	seq_packet_t *p = force ? packet_sequencer_force_next_packet(&ps) : packet_sequencer_next_packet(&ps);
+	int got = p ? p->seq : -1;
+	if (seq != -1)
+		seq &= 0xffff;
+	if (got != seq) {
+		printf("test failed: %s:%i\n", file, line);
+		printf("expected: %i\n", seq);
+		printf("received: %i\n", got);
+		abort();
+	}
+	if (p)
+		g_slice_free1(sizeof(struct test_packet), p);
+	printf("test ok: %s:%i\n", file, line);
+}
+
+static void tests(void) {
+	// in order
+	packet_sequencer_init(&ps, packet_free);
+	insert(1000, 0);
+	next(1000);
+	insert(1001, 0);
+	next(1001);
+	next(-1);
+
+	// dupe
+	insert(1001, -1);
+	insert(950, -1);
+
+	// reordered
+	insert(1003, 0);
+	next(-1);
+	insert(1002, 0);
+	next(1002);
+	next(1003);
+	next(-1);
+	check(ps.lost_count == 0);
+
+	// lost: waits for 10 packets before skipping ahead
+	for (int i = 1005; i < 1014; i++)
+		insert(i, 0);
+	next(-1);
+	insert(1014, 0);
+	next(1005);
+	check(ps.lost_count == 1);
+	for (int i = 1006; i < 1015; i++)
+		next(i);
+	next(-1);
+
+	// forced
+	insert(1020, 0);
+	next(-1);
+	force_next(1020);
+	check(ps.lost_count == 6);
+	packet_sequencer_destroy(&ps);
+
+	// wrap around
+	ps = (packet_sequencer_t) {0,};
+	packet_sequencer_init(&ps, packet_free);
+	insert(65534, 0);
+	next(65534);
+	insert(0, 0);
+	insert(65535, 0);
+	next(65535);
+	next(0);
+	check(ps.roc == 1);
+	check(ps.ext_seq == 0x10000);
+	insert(65530, -1);
+
+	// seq reset drops queued packets
+	freed = 0;
+	insert(5, 0);
+	insert(20000, 1);
+	check(freed == 1);
+	next(20000);
+	next(-1);
+
+	// leftover packets are freed on destroy
+	freed = 0;
+	insert(20002, 0);
+	insert(20003, 0);
+	packet_sequencer_destroy(&ps);
+	check(freed == 2);
+}
+
+
+// run with "./packet-sequencer-test bench"
+#define BENCH_PACKETS 10000000
+
+// `reorder`: swap every nth pair of packets. `loss`: drop every nth packet
+static void bench(const char *name, int reorder, int loss) {
+	packet_sequencer_t bps = {0,};
+	packet_sequencer_init(&bps, packet_free);
+
+	struct test_packet *pool = g_new0(struct test_packet, 2);
+	unsigned long out = 0;
+
+	double start = bench_now();
+
+	for (unsigned int i = 0; i < BENCH_PACKETS; i++) {
+		unsigned int seq = i;
+		if (reorder && (i % reorder) == 0)
+			seq = i + 1;
+		else if (reorder && (i % reorder) == 1)
+			seq = i - 1;
+		if (loss && (i % loss) == loss - 1)
+			continue;
+
+		seq_packet_t *p = &pool[i & 1].p;
+		p->seq = seq & 0xffff;
+		if (packet_sequencer_insert(&bps, p) < 0)
+			continue;
+		while (1) {
+			// a real receiver would fall back to forcing the next packet on a timeout
+			seq_packet_t *o = packet_sequencer_next_packet(&bps);
+			if (!o && loss)
+				o = packet_sequencer_force_next_packet(&bps);
+			if (!o)
+				break;
+			out++;
+		}
+	}
+
+	double secs = bench_now() - start;
+
+	// no free function for the stack packets
+	bps.ffunc = NULL;
+	packet_sequencer_destroy(&bps);
+	g_free(pool);
+
+	printf("%-12s %lu packets out in %.3f s, %.1f ns/packet\n", name, out, secs,
+			secs * 1e9 / BENCH_PACKETS);
+}
+
+
+int main(int argc, char **argv) {
+	codeclib_init(0);
+
+	if (bench_requested(argc, argv)) {
+		bench("in order", 0, 0);
+		bench("reordered", 10, 0);
+		bench("lossy", 0, 50);
+		return 0;
+	}
+
+	tests();
+
+	return 0;
+}
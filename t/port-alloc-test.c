@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "test-bench.h"
+#include "aux.h"
+
+#define err(fmt...) do { \
+		fprintf(stderr, fmt); \
+		exit(1); \
+	} while (0)
+
+static BIT_ARRAY_DECLARE(ports, 0x10000);
+
+static void reset(void) {
+	memset((void *) ports, 0, sizeof(ports));
+}
+
+// marks the whole range as used
+static void fill(unsigned int min, unsigned int max) {
+	for (unsigned int i = min; i <= max; i++)
+		bit_array_set(ports, i);
+}
+
+#define expect(args...) do_test(__FILE__, __LINE__, args)
+
+static void do_test(const char *file, int line,
+		unsigned int min, unsigned int max, unsigned int start, int pair, int exp)
+{
+	int ret = bit_array_find_clear_even(ports, min, max, start, pair, NULL);
+	if (ret != exp)
+		err("%s:%i: range %u-%u start %u pair %i: expected %i, got %i\n", file, line,
+				min, max, start, pair, exp, ret);
+}
+
+// simple linear reference implementation
+static int find_linear(unsigned int min, unsigned int max, unsigned int start, int pair) {
+	if (start < min || start > max)
+		start = min;
+	unsigned int num = max - min + 1;
+	for (unsigned int i = 0; i < num; i++) {
+		unsigned int p = min + (start - min + i) % num;
+		if ((p & 1))
+			continue;
+		if (pair && p + 1 > max)
+			continue;
+		if (bit_array_isset(ports, p))
+			continue;
+		if (pair && bit_array_isset(ports, p + 1))
+			continue;
+		return p;
+	}
+	return -1;
+}
+
+static void tests(void) {
+	// empty range
+	reset();
+	expect(30000, 40000, 30000, 1, 30000);
+	expect(30000, 40000, 35001, 1, 35002);
+	expect(30000, 40000, 50000, 1, 30000);
+	expect(30001, 40000, 0, 0, 30002);
+
+	// full range
+	fill(30000, 40000);
+	expect(30000, 40000, 30000, 1, -1);
+	expect(30000, 40000, 30000, 0, -1);
+
+	// one free pair, found from anywhere
+	bit_array_clear(ports, 31000);
+	bit_array_clear(ports, 31001);
+	expect(30000, 40000, 30000, 1, 31000);
+	expect(30000, 40000, 31000, 1, 31000);
+	expect(30000, 40000, 31002, 1, 31000);
+	expect(30000, 40000, 39998, 1, 31000);
+
+	// odd free port doesn't make a pair start
+	bit_array_clear(ports, 32001);
+	bit_array_clear(ports, 32002);
+	expect(30000, 40000, 31002, 1, 31000);
+	expect(30000, 40000, 31002, 0, 32002);
+
+	// pairs don't cross the top of the range
+	reset();
+	fill(30000, 40000);
+	bit_array_clear(ports, 40000);
+	expect(30000, 40000, 30000, 1, -1);
+	expect(30000, 40000, 30000, 0, 40000);
+	bit_array_clear(ports, 40001);
+	expect(30000, 40000, 30000, 1, -1);
+	expect(30000, 40001, 30000, 1, 40000);
+
+	// bits outside of the range are ignored
+	reset();
+	fill(30000, 40000);
+	expect(30000, 40000, 30000, 1, -1);
+	expect(29990, 40000, 30000, 1, 29990);
+	expect(30000, 40010, 30000, 1, 40002);
+
+	// range within a single word
+	reset();
+	fill(100, 110);
+	bit_array_clear(ports, 104);
+	bit_array_clear(ports, 105);
+	expect(100, 110, 106, 1, 104);
+	expect(102, 103, 102, 1, -1);
+	expect(104, 105, 100, 1, 104);
+
+	// compare against the linear search on near-full ranges
+	srandom(1234);
+	for (int round = 0; round < 200; round++) {
+		unsigned int min = 1000 + random() % 100;
+		unsigned int max = min + 100 + random() % 5000;
+		unsigned int pct = 90 + random() % 10;
+		reset();
+		for (unsigned int p = min; p <= max; p++)
+			if (random() % 100 < pct)
+				bit_array_set(ports, p);
+		for (int i = 0; i < 50; i++) {
+			unsigned int start = min + random() % (max - min + 1);
+			int pair = random() % 2;
+			int exp = find_linear(min, max, start, pair);
+			expect(min, max, start, pair, exp);
+		}
+	}
+}
+
+
+// run with "./port-alloc-test bench"
+#define BENCH_ALLOCS 1000000
+#define PORT_MIN 30000
+#define PORT_MAX 40000
+
+// keep the given share of pairs in use, releasing a random one for each new one taken
+static void bench(unsigned int pct) {
+	unsigned int num_pairs = (PORT_MAX - PORT_MIN + 1) / 2;
+	unsigned int in_use = num_pairs * pct / 100;
+	unsigned int *used = g_new(unsigned int, in_use);
+	unsigned int words = 0, start = PORT_MIN;
+
+	reset();
+	srandom(4321);
+	for (unsigned int i = 0; i < in_use; i++) {
+		int p = bit_array_find_clear_even(ports, PORT_MIN, PORT_MAX, start + random() % 100, 1, NULL);
+		if (p < 0)
+			err("ran out of ports\n");
+		bit_array_set(ports, p);
+		bit_array_set(ports, p + 1);
+		used[i] = p;
+		start = p + 2;
+	}
+
+	double t = bench_now();
+
+	for (unsigned int i = 0; i < BENCH_ALLOCS; i++) {
+		unsigned int idx = random() % in_use;
+		bit_array_clear(ports, used[idx]);
+		bit_array_clear(ports, used[idx] + 1);
+		int p = bit_array_find_clear_even(ports, PORT_MIN, PORT_MAX, start + random() % 100, 1, &words);
+		if (p < 0)
+			err("ran out of ports\n");
+		bit_array_set(ports, p);
+		bit_array_set(ports, p + 1);
+		used[idx] = p;
+		start = p + 2;
+	}
+
+	double secs = bench_now() - t;
+
+	printf("%u%% in use: %.1f ns/allocation, %.1f words scanned on average\n", pct,
+			secs * 1e9 / BENCH_ALLOCS, (double) words / BENCH_ALLOCS);
+
+	g_free(used);
+}
+
+
+int main(int argc, char **argv) {
+	if (bench_requested(argc, argv)) {
+		bench(50);
+		bench(90);
+		bench(99);
+		return 0;
+	}
+
+	tests();
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include "sdp.h"
+#include "call.h"
+#include "call_interfaces.h"
+#include "ice.h"
+#include "crypto.h"
+#include "log.h"
+#include "main.h"
+#include "test-bench.h"
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+GString *dtmf_logs;
+
+static const char *sip_sdp =
+	"v=0\r\n"
+	"o=- 1545997027 1 IN IP4 198.51.100.1\r\n"
+	"s=tester\r\n"
+	"c=IN IP4 198.51.100.1\r\n"
+	"t=0 0\r\n"
+	"m=audio 2000 RTP/AVP 0 8 9 18 101\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:9 G722/8000\r\n"
+	"a=rtpmap:18 G729/8000\r\n"
+	"a=fmtp:18 annexb=no\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n"
+	"a=fmtp:101 0-16\r\n"
+	"a=ptime:20\r\n"
+	"a=sendrecv\r\n"
+	"a=rtcp:2001\r\n";
+
+static const char *webrtc_sdp =
+	"v=0\r\n"
+	"o=- 4611731400430051336 2 IN IP4 127.0.0.1\r\n"
+	"s=-\r\n"
+	"t=0 0\r\n"
+	"a=group:BUNDLE 0 1\r\n"
+	"a=msid-semantic: WMS lgsCFqt9kN2fVKw5wg3NKqGdATQoltEwOdMS\r\n"
+	"m=audio 9 UDP/TLS/RTP/SAVPF 111 103 104 9 0 8 106 105 13 110 112 113 126\r\n"
+	"c=IN IP4 0.0.0.0\r\n"
+	"a=rtcp:9 IN IP4 0.0.0.0\r\n"
+	"a=candidate:842163049 1 udp 1677729535 198.51.100.1 50264 typ srflx raddr 192.168.1.100 rport 50264 generation 0 network-cost 999\r\n"
+	"a=candidate:3225203539 1 udp 2122260223 192.168.1.100 50264 typ host generation 0 network-id 1 network-cost 10\r\n"
+	"a=candidate:2999745851 1 udp 2122194687 192.168.56.1 51353 typ host generation 0 network-id 2\r\n"
+	"a=candidate:1624193723 1 udp 2122129151 10.0.0.2 55128 typ host generation 0 network-id 3\r\n"
+	"a=candidate:4233069003 1 tcp 1518280447 192.168.1.100 9 typ host tcptype active generation 0 network-id 1 network-cost 10\r\n"
+	"a=candidate:4019380659 1 tcp 1518214911 192.168.56.1 9 typ host tcptype active generation 0 network-id 2\r\n"
+	"a=candidate:508263659 1 tcp 1518149375 10.0.0.2 9 typ host tcptype active generation 0 network-id 3\r\n"
+	"a=candidate:1061233893 1 udp 1686052607 198.51.100.1 50265 typ srflx raddr 192.168.56.1 rport 51353 generation 0 network-id 2\r\n"
+	"a=ice-ufrag:ZcCn\r\n"
+	"a=ice-pwd:rUdQl+b9Sw3HzeHWqAvPiGqS\r\n"
+	"a=ice-options:trickle\r\n"
+	"a=fingerprint:sha-256 4E:1C:F8:4E:D0:F7:0F:53:AB:2F:98:9C:16:74:5A:2B:20:F8:BB:1A:0E:79:CE:A7:4C:45:E0:3E:1E:4C:22:C2\r\n"
+	"a=setup:actpass\r\n"
+	"a=mid:0\r\n"
+	"a=extmap:1 urn:ietf:params:rtp-hdrext:ssrc-audio-level\r\n"
+	"a=extmap:2 http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time\r\n"
+	"a=extmap:3 http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01\r\n"
+	"a=extmap:4 urn:ietf:params:rtp-hdrext:sdes:mid\r\n"
+	"a=sendrecv\r\n"
+	"a=msid:lgsCFqt9kN2fVKw5wg3NKqGdATQoltEwOdMS 3bd3ea40-6b3b-4b54-9fa5-2a2dc1b7bd3d\r\n"
+	"a=rtcp-mux\r\n"
+	"a=rtpmap:111 opus/48000/2\r\n"
+	"a=rtcp-fb:111 transport-cc\r\n"
+	"a=fmtp:111 minptime=10;useinbandfec=1\r\n"
+	"a=rtpmap:103 ISAC/16000\r\n"
+	"a=rtpmap:104 ISAC/32000\r\n"
+	"a=rtpmap:9 G722/8000\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:106 CN/32000\r\n"
+	"a=rtpmap:105 CN/16000\r\n"
+	"a=rtpmap:13 CN/8000\r\n"
+	"a=rtpmap:110 telephone-event/48000\r\n"
+	"a=rtpmap:112 telephone-event/32000\r\n"
+	"a=rtpmap:113 telephone-event/16000\r\n"
+	"a=rtpmap:126 telephone-event/8000\r\n"
+	"a=ssrc:1570403486 cname:Ff2qJMbIGqKNxbNw\r\n"
+	"a=ssrc:1570403486 msid:lgsCFqt9kN2fVKw5wg3NKqGdATQoltEwOdMS 3bd3ea40-6b3b-4b54-9fa5-2a2dc1b7bd3d\r\n"
+	"a=ssrc:1570403486 mslabel:lgsCFqt9kN2fVKw5wg3NKqGdATQoltEwOdMS\r\n"
+	"a=ssrc:1570403486 label:3bd3ea40-6b3b-4b54-9fa5-2a2dc1b7bd3d\r\n"
+	"m=video 9 UDP/TLS/RTP/SAVPF 96 97 98 99 100\r\n"
+	"c=IN IP4 0.0.0.0\r\n"
+	"a=rtcp:9 IN IP4 0.0.0.0\r\n"
+	"a=candidate:842163049 1 udp 1677729535 198.51.100.1 50266 typ srflx raddr 192.168.1.100 rport 50266 generation 0 network-cost 999\r\n"
+	"a=candidate:3225203539 1 udp 2122260223 192.168.1.100 50266 typ host generation 0 network-id 1 network-cost 10\r\n"
+	"a=candidate:2999745851 1 udp 2122194687 192.168.56.1 51355 typ host generation 0 network-id 2\r\n"
+	"a=candidate:1624193723 1 udp 2122129151 10.0.0.2 55130 typ host generation 0 network-id 3\r\n"
+	"a=ice-ufrag:ZcCn\r\n"
+	"a=ice-pwd:rUdQl+b9Sw3HzeHWqAvPiGqS\r\n"
+	"a=ice-options:trickle\r\n"
+	"a=fingerprint:sha-256 4E:1C:F8:4E:D0:F7:0F:53:AB:2F:98:9C:16:74:5A:2B:20:F8:BB:1A:0E:79:CE:A7:4C:45:E0:3E:1E:4C:22:C2\r\n"
+	"a=setup:actpass\r\n"
+	"a=mid:1\r\n"
+	"a=extmap:2 http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time\r\n"
+	"a=extmap:3 http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01\r\n"
+	"a=sendrecv\r\n"
+	"a=rtcp-mux\r\n"
+	"a=rtcp-rsize\r\n"
+	"a=rtpmap:96 VP8/90000\r\n"
+	"a=rtcp-fb:96 goog-remb\r\n"
+	"a=rtcp-fb:96 transport-cc\r\n"
+	"a=rtcp-fb:96 ccm fir\r\n"
+	"a=rtcp-fb:96 nack\r\n"
+	"a=rtcp-fb:96 nack pli\r\n"
+	"a=rtpmap:97 rtx/90000\r\n"
+	"a=fmtp:97 apt=96\r\n"
+	"a=rtpmap:98 VP9/90000\r\n"
+	"a=rtcp-fb:98 goog-remb\r\n"
+	"a=rtcp-fb:98 nack\r\n"
+	"a=fmtp:98 profile-id=0\r\n"
+	"a=rtpmap:99 rtx/90000\r\n"
+	"a=fmtp:99 apt=98\r\n"
+	"a=rtpmap:100 H264/90000\r\n"
+	"a=fmtp:100 level-asymmetry-allowed=1;packetization-mode=1;profile-level-id=42001f\r\n"
+	"a=ssrc-group:FID 2231627014 632943048\r\n"
+	"a=ssrc:2231627014 cname:Ff2qJMbIGqKNxbNw\r\n"
+	"a=ssrc:632943048 cname:Ff2qJMbIGqKNxbNw\r\n";
+
+static void rtp_pt_free(void *p) {
+	g_slice_free1(sizeof(struct rtp_payload_type), p);
+}
+static void sp_free(void *p) {
+	struct stream_params *sp = p;
+	g_queue_clear_full(&sp->rtp_payload_types, rtp_pt_free);
+	ice_candidates_free(&sp->ice_candidates);
+	crypto_params_sdes_queue_clear(&sp->sdes_params);
+	g_slice_free1(sizeof(*sp), sp);
+}
+
+#define parse(args...) __parse(__FILE__, __LINE__, args)
+
+// parses the SDP and checks some of the results, the way an offer would
+static void __parse(const char *file, int line, const char *sdp,
+		unsigned int exp_streams, unsigned int exp_pts, unsigned int exp_cands)
+{
+	GQueue sessions = G_QUEUE_INIT;
+	GQueue streams = G_QUEUE_INIT;
+	struct sdp_ng_flags flags = { .trust_address = 1 };
+	str s;
+
+	printf("running test %s:%i\n", file, line);
+
+	str_init(&s, (char *) sdp);
+	int ret = sdp_parse(&s, &sessions, &flags);
+	__check(file, line, ret == 0, "sdp_parse");
+	__check(file, line, sessions.length == 1, "sessions.length");
+	ret = sdp_streams(&sessions, &streams, &flags);
+	__check(file, line, ret == 0, "sdp_streams");
+	__check(file, line, streams.length == exp_streams, "streams.length");
+
+	struct stream_params *sp = streams.head->data;
+	__check(file, line, sp->rtp_payload_types.length == exp_pts, "rtp_payload_types.length");
+	__check(file, line, sp->ice_candidates.length == exp_cands, "ice_candidates.length");
+
+	g_queue_clear_full(&streams, sp_free);
+	sdp_free(&sessions);
+
+	printf("test ok: %s:%i\n", file, line);
+}
+
+static void tests(void) {
+	GQueue sessions = G_QUEUE_INIT;
+	GQueue streams = G_QUEUE_INIT;
+	struct sdp_ng_flags flags = { .trust_address = 1 };
+	str s;
+	int ret;
+
+	parse(sip_sdp, 1, 5, 0);
+	// TCP candidates are ignored
+	parse(webrtc_sdp, 2, 13, 5);
+
+	printf("running test %s:%i\n", __FILE__, __LINE__);
+	str_init(&s, (char *) webrtc_sdp);
+	ret = sdp_parse(&s, &sessions, &flags);
+	check(ret == 0);
+	ret = sdp_streams(&sessions, &streams, &flags);
+	check(ret == 0);
+	struct stream_params *sp = streams.head->data;
+	struct rtp_payload_type *pt = sp->rtp_payload_types.head->data;
+	check(pt->payload_type == 111);
+	check(!str_cmp(&pt->encoding, "opus"));
+	check(pt->clock_rate == 48000);
+	check(!str_cmp(&pt->format_parameters, "minptime=10;useinbandfec=1"));
+	check(!str_cmp(&sp->ice_ufrag, "ZcCn"));
+	check(!str_cmp(&sp->media_id, "0"));
+	sp = streams.tail->data;
+	check(!str_cmp(&sp->media_id, "1"));
+	g_queue_clear_full(&streams, sp_free);
+	sdp_free(&sessions);
+	printf("test ok: %s:%i\n", __FILE__, __LINE__);
+
+	printf("running test %s:%i\n", __FILE__, __LINE__);
+	str_init(&s, (char *) "v=0\r\nfoo\r\n");
+	ret = sdp_parse(&s, &sessions, &flags);
+	check(ret == -1);
+	check(sessions.length == 0);
+	printf("test ok: %s:%i\n", __FILE__, __LINE__);
+}
+
+// run with "./sdp-parse-test bench"
+#define BENCH_SDPS 100000
+
+static void bench(const char *name, const char *sdp) {
+	struct sdp_ng_flags flags = {0,};
+	GQueue sessions = G_QUEUE_INIT;
+	str s;
+	str_init(&s, (char *) sdp);
+
+	double start = bench_now();
+	for (int i = 0; i < BENCH_SDPS; i++) {
+		if (sdp_parse(&s, &sessions, &flags))
+			abort();
+		sdp_free(&sessions);
+	}
+	double secs = bench_now() - start;
+
+	printf("%-8s (%i bytes): %i SDPs parsed in %.3f s, %.0f SDPs/s\n", name, s.len, BENCH_SDPS, secs,
+			BENCH_SDPS / secs);
+}
+
+
+int main(int argc, char **argv) {
+	codeclib_init(0);
+	socket_init();
+
+	if (bench_requested(argc, argv)) {
+		bench("SIP", sip_sdp);
+		bench("WebRTC", webrtc_sdp);
+		return 0;
+	}
+
+	tests();
+
+	return 0;
+}
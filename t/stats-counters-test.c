@@ -0,0 +1,161 @@
+#include "statistics.h"
+#include "call.h"
+#include "log.h"
+#include "main.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include "test-bench.h"
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+GString *dtmf_logs;
+
+#define expect(args...) __expect(__FILE__, __LINE__, args)
+
+static void __expect(const char *file, int line, u_int64_t packets, u_int64_t bytes, u_int64_t errors) {
+	struct stats s;
+	stats_counters_sum(&s);
+	if (atomic64_get_na(&s.packets) != packets || atomic64_get_na(&s.bytes) != bytes
+			|| atomic64_get_na(&s.errors) != errors)
+	{
+		printf("test failed: %s:%i\n", file, line);
+		printf("expected: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n", packets, bytes, errors);
+		printf("received: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n",
+				atomic64_get_na(&s.packets), atomic64_get_na(&s.bytes), atomic64_get_na(&s.errors));
+		abort();
+	}
+	printf("test ok: %s:%i\n", file, line);
+}
+
+static void *count_thread(void *p) {
+	for (int i = 0; i < 1000; i++) {
+		RTPE_STATS_INC(packets);
+		RTPE_STATS_ADD(bytes, 160);
+	}
+	RTPE_STATS_INC(errors);
+	thread_stats_intf_add(1, 1000, 160000);
+	thread_stats_timer_lag(1500);
+	return NULL;
+}
+
+static void tests(void) {
+	expect(0, 0, 0);
+
+	RTPE_STATS_INC(packets);
+	RTPE_STATS_INC(packets);
+	RTPE_STATS_ADD(bytes, 100);
+
+	// this thread registered before the interfaces were known, as the main thread can
+	stats_counters_num_intf = 2;
+	expect(2, 100, 0);
+
+	// counts from threads that have exited are kept
+	pthread_t thr[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&thr[i], NULL, count_thread, NULL);
+	for (int i = 0; i < 4; i++)
+		pthread_join(thr[i], NULL);
+	expect(4002, 640100, 4);
+
+	RTPE_STATS_INC(errors);
+	expect(4002, 640100, 5);
+
+	// grows the counters of this thread. out of range interfaces are ignored
+	thread_stats_intf_add(0, 2, 100);
+	thread_stats_intf_add(2, 1, 1);
+	thread_stats_timer_lag(-5);
+	thread_stats_timer_lag(100);
+	thread_stats_timer_lag(1000000);
+
+	// only the stages in the mask are recorded
+	u_int64_t ns[__PACKET_STAGES] = {0,};
+	ns[PACKET_STAGE_DECRYPT] = 300;
+	ns[PACKET_STAGE_CODEC] = 999;
+	ns[PACKET_STAGE_TOTAL] = 2000000;
+	thread_stats_packet_stages(ns, (1 << PACKET_STAGE_DECRYPT) | (1 << PACKET_STAGE_TOTAL));
+
+	struct stats_counters *t = stats_counters_total();
+	check(t->num_intf == 2);
+	check(atomic64_get_na(&t->intf[0].packets) == 2);
+	check(atomic64_get_na(&t->intf[0].bytes) == 100);
+	check(atomic64_get_na(&t->intf[1].packets) == 4000);
+	check(atomic64_get_na(&t->intf[1].bytes) == 640000);
+	check(atomic64_get_na(&t->timer_lag.count) == 7);
+	check(atomic64_get_na(&t->timer_lag.sum) == 4 * 1500 + 100 + 1000000);
+	check(atomic64_get_na(&t->timer_lag.buckets[0]) == 2);
+	check(atomic64_get_na(&t->timer_lag.buckets[4]) == 4);
+	check(atomic64_get_na(&t->timer_lag.buckets[LATENCY_BUCKETS - 1]) == 1);
+	check(atomic64_get_na(&t->packet_stages[PACKET_STAGE_DECRYPT].count) == 1);
+	check(atomic64_get_na(&t->packet_stages[PACKET_STAGE_DECRYPT].sum) == 300);
+	check(atomic64_get_na(&t->packet_stages[PACKET_STAGE_DECRYPT].buckets[1]) == 1);
+	check(atomic64_get_na(&t->packet_stages[PACKET_STAGE_CODEC].count) == 0);
+	check(atomic64_get_na(&t->packet_stages[PACKET_STAGE_TOTAL].buckets[LATENCY_BUCKETS - 1]) == 1);
+	free(t);
+
+	check(latency_bucket(100) == 0);
+	check(latency_bucket(101) == 1);
+	check(latency_bucket(500000) == LATENCY_BUCKETS - 2);
+	check(latency_bucket(500001) == LATENCY_BUCKETS - 1);
+}
+
+
+// run with "./stats-counters-test bench"
+#define BENCH_PACKETS 20000000
+
+static struct stats shared;
+
+// what the packet path did before: atomic adds on one global struct
+static void *shared_thread(void *p) {
+	for (unsigned int i = 0; i < BENCH_PACKETS; i++) {
+		atomic64_inc(&shared.packets);
+		atomic64_add(&shared.bytes, 172);
+	}
+	return NULL;
+}
+
+static void *per_thread_thread(void *p) {
+	for (unsigned int i = 0; i < BENCH_PACKETS; i++) {
+		RTPE_STATS_INC(packets);
+		RTPE_STATS_ADD(bytes, 172);
+	}
+	return NULL;
+}
+
+static double bench_run(void *(*func)(void *), int threads) {
+	pthread_t thr[threads];
+
+	double start = bench_now();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&thr[i], NULL, func, NULL);
+	for (int i = 0; i < threads; i++)
+		pthread_join(thr[i], NULL);
+	return (bench_now() - start) * 1e9 / BENCH_PACKETS;
+}
+
+static void bench(int threads) {
+	double sh = bench_run(shared_thread, threads);
+	double pt = bench_run(per_thread_thread, threads);
+	printf("%2i threads: shared counters %6.2f ns/packet, per-thread counters %6.2f ns/packet\n",
+			threads, sh, pt);
+}
+
+
+int main(int argc, char **argv) {
+	statistics_init();
+
+	if (bench_requested(argc, argv)) {
+		stats_counters_num_intf = 2;
+		bench(1);
+		bench(2);
+		bench(4);
+		bench(8);
+		return 0;
+	}
+
+	tests();
+
+	return 0;
+}
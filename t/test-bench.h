@@ -0,0 +1,34 @@
+#ifndef __TEST_BENCH_H__
+#define __TEST_BENCH_H__
+
+// helpers shared by the tests that also run a benchmark, see "make bench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compat.h"
+
+#define check(cond) __check(__FILE__, __LINE__, cond, #cond)
+
+INLINE void __check(const char *file, int line, int cond, const char *s) {
+	if (!cond) {
+		printf("test failed: %s:%i\n", file, line);
+		printf("not true: %s\n", s);
+		abort();
+	}
+	printf("test ok: %s:%i\n", file, line);
+}
+
+INLINE double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// true if the test was run as "./xxx-test bench" instead of as a unit test
+INLINE int bench_requested(int argc, char **argv) {
+	return argc > 1 && !strcmp(argv[1], "bench");
+}
+
+#endif